@@ -0,0 +1,237 @@
+/*
+Host microbenchmarks for the per-frame hot paths in can_common.
+Build with the top level CMakeLists.txt and run ./can_bench [scale]. scale multiplies the
+iteration counts (default 1). Each line is: name, ns per operation, operations (frames) per second.
+Numbers are only comparable between runs on the same machine and build type.
+*/
+
+#include <loopback_can.h>
+#include <can_signal.h>
+#include <can_packed.h>
+#include <can_router.h>
+#include <can_capture.h>
+#include <can_frame_pool.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+//Keep the optimizer from deleting work whose result is never used
+template <typename T>
+static inline void keep(T const &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static inline void clobber()
+{
+	asm volatile("" : : : "memory");
+}
+
+static uint64_t scale = 1;
+
+template <typename F>
+static void bench(const char *name, uint64_t iterations, F body)
+{
+	iterations *= scale;
+	for (uint64_t i = 0; i < iterations / 10 + 1; i++) body(i); //warm up
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < iterations; i++) body(i);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	double perOp = ns / (double)iterations;
+	printf("%-36s %10.2f ns/op %14.0f ops/s\n", name, perOp, perOp > 0 ? 1e9 / perOp : 0.0);
+}
+
+static volatile uint32_t callbackCount;
+static void countFrame(CAN_FRAME *) { callbackCount++; }
+static void countFrameFD(CAN_FRAME_FD *) { callbackCount++; }
+
+class CountingListener : public CANListener
+{
+public:
+	void gotFrame(CAN_FRAME *, int) { callbackCount++; }
+};
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) scale = strtoull(argv[1], NULL, 10);
+	if (scale == 0) scale = 1;
+
+	LoopbackCAN bus(32, true, 1024);
+	bus.begin(CAN_BPS_1000K);
+
+	printf("-- frame construction / conversion\n");
+	bench("CAN_FRAME()", 20000000, [](uint64_t) { CAN_FRAME f; keep(f); });
+	bench("CAN_FRAME_FD()", 20000000, [](uint64_t) { CAN_FRAME_FD f; keep(f); });
+
+	CAN_FRAME classic;
+	CAN_FRAME_FD fd;
+	classic.id = 0x123;
+	classic.length = 8;
+	classic.data.uint64 = 0x0123456789ABCDEFull;
+	bench("canToFD", 20000000, [&](uint64_t) { bus.canToFD(classic, fd); keep(fd); });
+	bench("fdToCan", 20000000, [&](uint64_t) { bus.fdToCan(fd, classic); keep(classic); });
+
+	printf("-- BytesUnion bit access\n");
+	bench("BytesUnion bit[] read x64", 2000000, [&](uint64_t) {
+		uint32_t ones = 0;
+		for (int b = 0; b < 64; b++) ones += classic.data.bit[b] ? 1 : 0;
+		keep(ones);
+		clobber();
+	});
+	bench("BytesUnion bit[] write x64", 2000000, [&](uint64_t i) {
+		for (int b = 0; b < 64; b++) classic.data.bit[b] = ((i + b) & 1);
+		clobber();
+	});
+	bench("BytesUnion_FD bit[] read x512", 200000, [&](uint64_t) {
+		uint32_t ones = 0;
+		for (int b = 0; b < 512; b++) ones += fd.data.bit[b] ? 1 : 0;
+		keep(ones);
+		clobber();
+	});
+
+	typedef CANSignal<0, 16, CAN_INTEL, false, 1, 4> Rpm;
+	typedef CANSignal<16, 12, CAN_INTEL, true, 1, 10, -40> Temp;
+	typedef CANSignal<39, 10, CAN_MOTOROLA> Pedal;
+	typedef CANSignal<61, 3, CAN_INTEL> Gear;
+	bench("CANSignal get x4", 20000000, [&](uint64_t) {
+		float sum = Rpm::get(classic.data) + Temp::get(classic.data) + Pedal::get(classic.data) + Gear::get(classic.data);
+		keep(sum);
+		clobber();
+	});
+	bench("CANSignal set x4", 20000000, [&](uint64_t i) {
+		Rpm::set(classic.data, (float)(i & 0x3FFF));
+		Temp::set(classic.data, -12.5f);
+		Pedal::setRaw(classic.data, i);
+		Gear::setRaw(classic.data, i >> 3);
+		clobber();
+	});
+
+	printf("-- dispatch\n");
+	CAN_FRAME rx = classic;
+	bus.setCallback(3, countFrame);
+	bench("dispatchFrame mailbox callback", 20000000, [&](uint64_t) { bus.dispatchFrame(rx, 3); });
+	bus.removeCallback(3);
+
+	CountingListener listeners[CAN_LISTENER_TABLE_START];
+	for (int i = 0; i < CAN_LISTENER_TABLE_START; i++)
+	{
+		bus.attachObj(&listeners[i]);
+		listeners[i].setCallback(5);
+	}
+	bench("dispatchFrame listeners", 20000000, [&](uint64_t) { bus.dispatchFrame(rx, 5); });
+	for (int i = 0; i < CAN_LISTENER_TABLE_START; i++) bus.detachObj(&listeners[i]);
+
+	for (uint32_t id = 0; id < 0x800; id += 4) bus.onId(id, false, countFrame);
+	for (uint32_t id = 0; id < 96; id++) bus.onId(0x18FEF000 + id * 0x100, true, countFrame);
+	bench("dispatchFrame ID table (11 bit)", 20000000, [&](uint64_t i) { rx.id = (i * 4) & 0x7FF; bus.dispatchFrame(rx, -1); });
+	rx.extended = true;
+	bench("dispatchFrame ID table (29 bit)", 20000000, [&](uint64_t i) { rx.id = 0x18FEF000 + (i % 96) * 0x100; bus.dispatchFrame(rx, -1); });
+	rx.extended = false;
+	bus.onIdFD(0x123, false, countFrameFD);
+	fd.id = 0x123;
+	bench("dispatchFrameFD ID table", 20000000, [&](uint64_t) { bus.dispatchFrameFD(fd, -1); });
+
+	printf("-- receive path\n");
+	CAN_FRAME drain[64];
+	bench("loopback send+receive+read", 5000000, [&](uint64_t i) {
+		classic.id = 0x700 + (i & 0x3F);
+		bus.sendFrame(classic);
+		if ((i & 63) == 63) bus.readBatch(drain, 64);
+	});
+
+	static uint8_t packedStorage[4096];
+	CANPackedQueue packed(packedStorage, sizeof(packedStorage));
+	CANFrameView view;
+	bench("CANPackedQueue push+peek+drop", 20000000, [&](uint64_t i) {
+		classic.length = i & 7;
+		packed.push(classic);
+		if (packed.peek(view)) keep(view.data()[0]);
+		packed.drop();
+	});
+
+	static CANFramePool<CAN_FRAME_FD, 32> fdPool;
+	bench("CANFramePool alloc + 3 refs + release", 20000000, [&](uint64_t i) {
+		CANFrameRef<CAN_FRAME_FD> ref = fdPool.alloc();
+		ref->id = (uint32_t)i;
+		CANFrameRef<CAN_FRAME_FD> logger = ref, router = ref, listener = ref;
+		keep(listener->id);
+	});
+	bench("CAN_FRAME_FD copy x3", 20000000, [&](uint64_t i) {
+		fd.id = (uint32_t)i;
+		CAN_FRAME_FD a = fd, b = fd, c = fd;
+		keep(a);
+		keep(b);
+		keep(c);
+	});
+
+	static size_t captured;
+	CANCaptureWriter capture([](const uint8_t *, size_t length, void *) { captured += length; });
+	bench("CANCaptureWriter write+service", 20000000, [&](uint64_t i) {
+		classic.id = 0x100 + (i & 0xFF);
+		classic.timestamp = (uint32_t)i * 130;
+		capture.write(classic);
+		if ((i & 31) == 0) capture.service();
+	});
+	keep(captured);
+
+	//src is fed by feeder, the router forwards into dst which delivers to sink
+	LoopbackCAN feeder(8, false, 64), src(8, false, 64), dst(8, false, 64), sink(8, false, 64);
+	feeder.connect(&src);
+	dst.connect(&sink);
+	LoopbackCAN *routed[] = { &feeder, &src, &dst, &sink };
+	for (LoopbackCAN *b : routed)
+	{
+		b->begin(CAN_BPS_500K);
+		b->watchFor();
+	}
+	CANRouter router;
+	int srcBus = router.addBus(src), dstBus = router.addBus(dst);
+	router.addRoute(srcBus, 0x100, 0x700, false, 1 << dstBus);
+	router.setRemap(router.addRoute(srcBus, 0x200, 0x700, false, 1 << dstBus), 0xFF, 0x600);
+	bench("CANRouter forward x8 (half remapped)", 1000000, [&](uint64_t i) {
+		for (int n = 0; n < 8; n++)
+		{
+			classic.id = 0x100 + ((n & 1) << 8) + (i & 0x3F);
+			feeder.sendFrame(classic);
+		}
+		router.service();
+		sink.readBatch(drain, 64);
+	});
+
+	printf("-- filters\n");
+	uint32_t span = 0;
+	bench("watchForRange 11 bit", 1000000, [&](uint64_t i) { span = (uint32_t)(i & 0x3FF); keep(bus.watchForRange(0x100, 0x100 + span)); });
+	bench("watchForRange 29 bit, 16M span", 1000000, [&](uint64_t) { keep(bus.watchForRange(0x10000000, 0x10FFFFFF)); });
+	bench("CANFilterPlanner 8 ranges -> 4", 100000, [&](uint64_t i) {
+		CANFilterPlanner planner;
+		CANFilter out[4];
+		for (uint32_t r = 0; r < 8; r++) planner.addRange(0x100 + r * 0x40 + (i & 7), 0x110 + r * 0x40, false);
+		keep(planner.plan(out, 4));
+	});
+	//64 filters on single IDs of a J1939-ish mix, frames mostly miss like on a busy bus
+	CANSoftFilter soft;
+	for (uint32_t n = 0; n < 64; n++) soft.add(0x18FE0000 + n * 0x100, 0x1FFFFF00, true);
+	uint32_t batchIds[32];
+	uint8_t batchExt[32];
+	uint64_t batchOut[32];
+	for (int n = 0; n < 32; n++)
+	{
+		batchIds[n] = 0x18FE0000 + n * 0x380 + 0x17;
+		batchExt[n] = 1;
+	}
+	printf("   (soft filter kernel: %s)\n", CANSoftFilter::getKernelName());
+	bench("CANSoftFilter match, 64 filters", 20000000, [&](uint64_t i) { keep(soft.match(0x18FE0000 + (i & 0x7FFF), true)); });
+	bench("CANSoftFilter batch x32, 64 filters", 1000000, [&](uint64_t i) {
+		batchIds[i & 31] ^= 0x100;
+		clobber();
+		soft.matchBatch(batchIds, batchExt, 32, batchOut);
+		keep(batchOut[i & 31]);
+	});
+
+	keep(callbackCount);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _ARDUINO_HOST_SHIM_
+#define _ARDUINO_HOST_SHIM_
+
+/*
+Just enough of Arduino.h to build can_common (and drivers built on it) on a desktop machine.
+Time comes from the host's monotonic clock, or from a fake one tests move by hand with
+hostUseFakeClock() / hostAdvanceClock() so timing code runs the same however loaded the machine is.
+Pin calls do nothing. noInterrupts() / interrupts() lock
+and unlock one process wide recursive mutex: code standing in for the receive context on another
+thread (CANDispatchWorker) holds it while it dispatches, so the library's critical sections keep
+that thread out just like masking the ISR does on a board.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+//host only: freeze time where it is, after that it only moves with hostAdvanceClock() and delay()
+void hostUseFakeClock(bool state);
+void hostAdvanceClock(unsigned long us);
+
+inline void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) {}
+inline void digitalWrite(uint8_t /*pin*/, uint8_t /*val*/) {}
+inline int digitalRead(uint8_t /*pin*/) { return LOW; }
+void interrupts();
+void noInterrupts();
+
+#endif
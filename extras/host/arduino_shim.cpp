@@ -0,0 +1,67 @@
+#include "Arduino.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+static std::atomic<bool> fakeClock(false);
+static std::atomic<uint64_t> fakeMicros(0);
+
+static uint64_t hostMicros()
+{
+	if (fakeClock.load()) return fakeMicros.load();
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long millis()
+{
+	return (unsigned long)(hostMicros() / 1000);
+}
+
+unsigned long micros()
+{
+	return (unsigned long)hostMicros();
+}
+
+void delay(unsigned long ms)
+{
+	if (fakeClock.load()) hostAdvanceClock(ms * 1000);
+	else std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	if (fakeClock.load()) hostAdvanceClock(us);
+	else std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+//The fake clock starts where the real one is so time never goes backwards when switching
+void hostUseFakeClock(bool state)
+{
+	if (state == fakeClock.load()) return;
+	if (state) fakeMicros.store(hostMicros());
+	fakeClock.store(state);
+}
+
+void hostAdvanceClock(unsigned long us)
+{
+	fakeMicros.fetch_add(us);
+}
+
+static std::recursive_mutex &interruptLock()
+{
+	static std::recursive_mutex lock;
+	return lock;
+}
+
+void noInterrupts()
+{
+	interruptLock().lock();
+}
+
+void interrupts()
+{
+	interruptLock().unlock();
+}
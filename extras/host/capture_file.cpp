@@ -0,0 +1,54 @@
+#include "capture_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CANCaptureFile::CANCaptureFile()
+{
+	map = NULL;
+	mapSize = 0;
+}
+
+CANCaptureFile::~CANCaptureFile()
+{
+	close();
+}
+
+/**
+ * \brief Map a capture file
+ *
+ * \ret  false if the file can't be opened or mapped. An empty file fails too, there's nothing to map.
+ */
+bool CANCaptureFile::open(const char *path)
+{
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); //the mapping keeps the file alive
+	if (addr == MAP_FAILED) return false;
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+	map = (const uint8_t *)addr;
+	mapSize = st.st_size;
+	return true;
+}
+
+void CANCaptureFile::close()
+{
+	if (map) munmap((void *)map, mapSize);
+	map = NULL;
+	mapSize = 0;
+}
+
+void captureFileSink(const uint8_t *data, size_t length, void *file)
+{
+	fwrite(data, 1, length, (FILE *)file);
+}
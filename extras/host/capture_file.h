@@ -0,0 +1,36 @@
+#ifndef _CAN_CAPTURE_FILE_
+#define _CAN_CAPTURE_FILE_
+
+#include <can_capture.h>
+#include <stdio.h>
+
+/*
+Host side helpers for captures on disk (POSIX). CANCaptureFile maps a capture read only so the
+reader decodes straight out of the page cache with no read() calls or copies. captureFileSink
+appends writer buffers to a FILE opened for binary writing.
+*/
+class CANCaptureFile
+{
+public:
+    CANCaptureFile();
+    ~CANCaptureFile();
+
+    bool open(const char *path);
+    void close();
+    bool isOpen() const { return map != NULL; }
+    const uint8_t *data() const { return map; }
+    size_t size() const { return mapSize; }
+    CANCaptureReader reader() const { return CANCaptureReader(map, mapSize); }
+
+private:
+    CANCaptureFile(const CANCaptureFile &);
+    CANCaptureFile &operator=(const CANCaptureFile &);
+
+    const uint8_t *map;
+    size_t mapSize;
+};
+
+//CANCaptureSink writing to the FILE * passed as context
+void captureFileSink(const uint8_t *data, size_t length, void *file);
+
+#endif
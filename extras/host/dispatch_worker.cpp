@@ -0,0 +1,39 @@
+#include "dispatch_worker.h"
+
+#include <chrono>
+
+CANDispatchWorker::CANDispatchWorker(CAN_COMMON &canBus, uint16_t batch, uint32_t batchBudgetMicros, uint32_t idleSleepMicros)
+	: bus(canBus), batchSize(batch), batchBudget(batchBudgetMicros), idleSleep(idleSleepMicros), running(false), handled(0)
+{
+}
+
+CANDispatchWorker::~CANDispatchWorker()
+{
+	stop();
+}
+
+void CANDispatchWorker::start()
+{
+	if (running.exchange(true)) return;
+	thread = std::thread(&CANDispatchWorker::run, this);
+}
+
+//Returns once the thread has exited. Frames still pending stay queued for the next start() or poll().
+void CANDispatchWorker::stop()
+{
+	if (!running.exchange(false)) return;
+	if (thread.joinable()) thread.join();
+}
+
+void CANDispatchWorker::run()
+{
+	while (running.load())
+	{
+		//the receive context on a board, so registration changes on other threads wait for the batch to finish
+		noInterrupts();
+		uint16_t done = bus.poll(batchSize, batchBudget);
+		interrupts();
+		handled += done;
+		if (done == 0) std::this_thread::sleep_for(std::chrono::microseconds(idleSleep));
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef _CAN_DISPATCH_WORKER_
+#define _CAN_DISPATCH_WORKER_
+
+#include <can_common.h>
+
+#include <atomic>
+#include <thread>
+
+/*
+Host side worker thread for deferred dispatch. It calls poll() on one interface in bounded
+batches and sleeps briefly when there is nothing to do. This plays the part an RTOS task would
+on a microcontroller. The interface must already be in CAN_DISPATCH_DEFERRED mode, and nothing
+else may call poll() on it while the worker runs. Each batch runs with noInterrupts() held, so
+attaching and detaching listeners or changing their registrations from other threads is safe.
+*/
+class CANDispatchWorker
+{
+public:
+    CANDispatchWorker(CAN_COMMON &bus, uint16_t batchSize = 32, uint32_t batchBudgetMicros = 1000, uint32_t idleSleepMicros = 100);
+    ~CANDispatchWorker();
+
+    void start();
+    void stop();
+    bool isRunning() const { return running.load(); }
+    uint64_t framesHandled() const { return handled.load(); }
+
+private:
+    void run();
+
+    CAN_COMMON &bus;
+    uint16_t batchSize;
+    uint32_t batchBudget;
+    uint32_t idleSleep;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> handled;
+    std::thread thread;
+};
+
+#endif
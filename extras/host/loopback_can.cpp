@@ -0,0 +1,195 @@
+#include "loopback_can.h"
+
+LoopbackCAN::LoopbackCAN(int numFilt, bool supportFD, uint16_t rxDepth) : CAN_COMMON(numFilt)
+{
+	filters = new Filter[numFilt];
+	for (int i = 0; i < numFilt; i++) filters[i].active = false;
+	rxStorage = new CAN_FRAME[rxDepth];
+	rxStorageFD = new CAN_FRAME_FD[rxDepth];
+	setRXBuffer(rxStorage, rxDepth);
+	setRXBufferFD(rxStorageFD, rxDepth);
+	fdSupported = supportFD;
+	peer = this;
+	enabled = false;
+	listenOnly = false;
+	busTimeNs = 0;
+	busBusyNs = 0;
+	dropped = 0;
+}
+
+LoopbackCAN::~LoopbackCAN()
+{
+	delete[] filters;
+	delete[] rxStorage;
+	delete[] rxStorageFD;
+}
+
+int LoopbackCAN::_setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
+{
+	if (mailbox >= numFilters) return -1;
+	filters[mailbox].id = id & mask;
+	filters[mailbox].mask = mask;
+	filters[mailbox].extended = extended;
+	filters[mailbox].active = true;
+	return mailbox;
+}
+
+int LoopbackCAN::_setFilter(uint32_t id, uint32_t mask, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (!filters[i].active) return _setFilterSpecific(i, id, mask, extended);
+	}
+	return -1;
+}
+
+uint32_t LoopbackCAN::init(uint32_t ul_baudrate)
+{
+	set_baudrate(ul_baudrate);
+	enable();
+	return busSpeed;
+}
+
+//nothing to detect on a simulated bus, just use the default rate
+uint32_t LoopbackCAN::beginAutoSpeed()
+{
+	return init(CAN_DEFAULT_BAUD);
+}
+
+uint32_t LoopbackCAN::set_baudrate(uint32_t ul_baudrate)
+{
+	busSpeed = ul_baudrate;
+	return busSpeed;
+}
+
+void LoopbackCAN::setListenOnlyMode(bool state)
+{
+	listenOnly = state;
+}
+
+void LoopbackCAN::enable()
+{
+	enabled = true;
+}
+
+void LoopbackCAN::disable()
+{
+	enabled = false;
+}
+
+uint32_t LoopbackCAN::set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed)
+{
+	if (!fdSupported) return 0;
+	busSpeed = nominalSpeed;
+	fd_DataSpeed = dataSpeed;
+	return busSpeed;
+}
+
+uint32_t LoopbackCAN::initFD(uint32_t nominalRate, uint32_t dataRate)
+{
+	if (!set_baudrateFD(nominalRate, dataRate)) return 0;
+	enable();
+	return busSpeed;
+}
+
+void LoopbackCAN::connect(LoopbackCAN *other)
+{
+	peer = other ? other : this;
+}
+
+/**
+ * \brief Find the first filter that accepts this ID
+ *
+ * \ret  Mailbox number or -1 if no filter matches
+ */
+int LoopbackCAN::findMailbox(uint32_t id, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (filters[i].active && filters[i].extended == extended && ((id & filters[i].mask) == filters[i].id)) return i;
+	}
+	return -1;
+}
+
+uint64_t LoopbackCAN::getBusTimeNs()
+{
+	return busTimeNs;
+}
+
+uint64_t LoopbackCAN::getBusBusyNs()
+{
+	return busBusyNs;
+}
+
+uint32_t LoopbackCAN::getDroppedFrames()
+{
+	return dropped;
+}
+
+uint32_t LoopbackCAN::stampFrame(uint32_t nominalBits, uint32_t dataBits)
+{
+	uint64_t nowNs = (uint64_t)micros() * 1000ull;
+	uint64_t durationNs = 0;
+	if (busSpeed) durationNs += (uint64_t)nominalBits * 1000000000ull / busSpeed;
+	if (dataBits) durationNs += (uint64_t)dataBits * 1000000000ull / (fd_DataSpeed ? fd_DataSpeed : busSpeed ? busSpeed : 1);
+
+	if (busTimeNs < nowNs) busTimeNs = nowNs; //bus was idle until now
+	busTimeNs += durationNs;
+	busBusyNs += durationNs;
+	return (uint32_t)(busTimeNs / 1000ull);
+}
+
+void LoopbackCAN::deliver(CAN_FRAME &frame)
+{
+	if (!enabled) return;
+	int mailbox = findMailbox(frame.id, frame.extended);
+	if (mailbox < 0)
+	{
+		stats.countFilterReject();
+		return;
+	}
+	if (!receiveFrame(frame, mailbox)) dropped++;
+}
+
+void LoopbackCAN::deliverFD(CAN_FRAME_FD &frame)
+{
+	if (!enabled) return;
+	int mailbox = findMailbox(frame.id, frame.extended);
+	if (mailbox < 0)
+	{
+		stats.countFilterReject();
+		return;
+	}
+	if (!fdSupported)
+	{
+		//a classic controller sees an FD frame as an error, not a frame
+		CAN_FRAME classic;
+		if (!fdToCan(frame, classic)) return;
+		if (!receiveFrame(classic, mailbox)) dropped++;
+		return;
+	}
+	if (!receiveFrameFD(frame, mailbox)) dropped++;
+}
+
+bool LoopbackCAN::sendFrame(CAN_FRAME &txFrame)
+{
+	if (!enabled || listenOnly) return false;
+	CAN_FRAME frame = txFrame;
+	frame.timestamp = stampFrame(CANStatistics::frameBits(frame), 0);
+	stats.countTX(frame);
+	peer->deliver(frame);
+	return true;
+}
+
+bool LoopbackCAN::sendFrameFD(CAN_FRAME_FD &txFrame)
+{
+	if (!fdSupported || !enabled || listenOnly) return false;
+	if (txFrame.length > 64 || (!txFrame.fdMode && txFrame.length > 8)) return false;
+	CAN_FRAME_FD frame = txFrame;
+	uint32_t nominalBits, dataBits;
+	CANStatistics::frameBitsFD(frame, nominalBits, dataBits);
+	frame.timestamp = stampFrame(nominalBits, dataBits);
+	stats.countTXFD(frame);
+	peer->deliverFD(frame);
+	return true;
+}
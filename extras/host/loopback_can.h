@@ -0,0 +1,66 @@
+#ifndef _LOOPBACK_CAN_
+#define _LOOPBACK_CAN_
+
+#include <can_common.h>
+
+/*
+In memory CAN_COMMON driver for the host build. Sent frames are run through this object's filters
+(or a connected peer's) and handed to receiveFrame just like a real driver would from its ISR.
+Nothing ever touches hardware so results are repeatable which is what tests, fuzzing and
+benchmarks want.
+
+Bus timing is simulated: every frame advances a virtual bus clock by its length on the wire at
+the configured bitrate(s) and gets stamped with that time in microseconds.
+*/
+class LoopbackCAN : public CAN_COMMON
+{
+public:
+    LoopbackCAN(int numFilt = 16, bool supportFD = true, uint16_t rxDepth = 256);
+    ~LoopbackCAN();
+
+    int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
+    int _setFilter(uint32_t id, uint32_t mask, bool extended);
+    uint32_t init(uint32_t ul_baudrate);
+    uint32_t beginAutoSpeed();
+    uint32_t set_baudrate(uint32_t ul_baudrate);
+    void setListenOnlyMode(bool state);
+    void enable();
+    void disable();
+    bool sendFrame(CAN_FRAME &txFrame);
+
+    uint32_t set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed);
+    bool sendFrameFD(CAN_FRAME_FD &txFrame);
+    uint32_t initFD(uint32_t nominalRate, uint32_t dataRate);
+
+    //Deliver sent frames to another LoopbackCAN instead of back to ourselves
+    void connect(LoopbackCAN *other);
+    int findMailbox(uint32_t id, bool extended);
+    uint64_t getBusTimeNs();
+    uint64_t getBusBusyNs();
+    uint32_t getDroppedFrames();
+
+private:
+    struct Filter
+    {
+        uint32_t id;
+        uint32_t mask;
+        bool extended;
+        bool active;
+    };
+
+    uint32_t stampFrame(uint32_t nominalBits, uint32_t dataBits);
+    void deliver(CAN_FRAME &frame);
+    void deliverFD(CAN_FRAME_FD &frame);
+
+    Filter *filters;
+    CAN_FRAME *rxStorage;
+    CAN_FRAME_FD *rxStorageFD;
+    LoopbackCAN *peer;
+    bool enabled;
+    bool listenOnly;
+    uint64_t busTimeNs;
+    uint64_t busBusyNs;
+    uint32_t dropped;
+};
+
+#endif
@@ -0,0 +1,452 @@
+#include "socket_can.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/can/raw.h>
+#include <linux/can/error.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+SocketCAN::SocketCAN(const char *interfaceName, int numFilt, uint16_t rxDepth) : CAN_COMMON(numFilt)
+{
+	strncpy(ifName, interfaceName ? interfaceName : "", IFNAMSIZ - 1);
+	ifName[IFNAMSIZ - 1] = 0;
+	sock = -1;
+	filters = new Filter[numFilters];
+	for (int i = 0; i < numFilters; i++) filters[i].active = false;
+	rxStorage = new CAN_FRAME[rxDepth];
+	rxStorageFD = new CAN_FRAME_FD[rxDepth];
+	setRXBuffer(rxStorage, rxDepth);
+	setRXBufferFD(rxStorageFD, rxDepth);
+	listenOnly = false;
+	kernelDrops = 0;
+
+	for (int i = 0; i < SOCKET_CAN_BATCH; i++)
+	{
+		rxIov[i].iov_base = &rxFrames[i];
+		rxIov[i].iov_len = sizeof(rxFrames[i]);
+	}
+}
+
+SocketCAN::~SocketCAN()
+{
+	closeSocket();
+	delete[] filters;
+	delete[] rxStorage;
+	delete[] rxStorageFD;
+}
+
+bool SocketCAN::openSocket()
+{
+	if (sock >= 0) return true;
+	int s = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+	if (s < 0) return false; //no CAN support in this kernel (modprobe can_raw / vcan)
+
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, ifName, IFNAMSIZ); //ifName is always terminated
+	if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+	{
+		::close(s);
+		return false;
+	}
+	int ifIndex = ifr.ifr_ifindex;
+
+	//FD frames only if the interface can carry them, the socket option alone succeeds either way
+	int on = 1;
+	fdSupported = false;
+	if (ioctl(s, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU)
+	{
+		fdSupported = (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on)) == 0);
+	}
+
+	can_err_mask_t errMask = CAN_ERR_BUSOFF | CAN_ERR_CRTL | CAN_ERR_PROT | CAN_ERR_RESTARTED;
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errMask, sizeof(errMask));
+
+	//timestamps and the kernel's drop counter are optional, receive falls back to micros() without them
+	int stampFlags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+	                 SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &stampFlags, sizeof(stampFlags));
+	setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+
+	struct sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifIndex;
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		::close(s);
+		return false;
+	}
+	sock = s;
+	kernelDrops = 0;
+	applyFilters();
+	return true;
+}
+
+void SocketCAN::closeSocket()
+{
+	if (sock < 0) return;
+	::close(sock);
+	sock = -1;
+}
+
+//Hand the active mailbox filters to the kernel. No active filters means nothing gets through, like a controller.
+bool SocketCAN::applyFilters()
+{
+	if (sock < 0) return true;
+	struct can_filter kernelFilters[CAN_MAX_MAILBOXES];
+	int count = 0;
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (!filters[i].active) continue;
+		if (filters[i].extended)
+		{
+			kernelFilters[count].can_id = (filters[i].id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+			kernelFilters[count].can_mask = (filters[i].mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+		}
+		else
+		{
+			kernelFilters[count].can_id = filters[i].id & CAN_SFF_MASK;
+			kernelFilters[count].can_mask = (filters[i].mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+		}
+		count++;
+	}
+	return setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, count ? kernelFilters : NULL, count * sizeof(struct can_filter)) == 0;
+}
+
+int SocketCAN::_setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
+{
+	if (mailbox >= numFilters) return -1;
+	filters[mailbox].id = id & mask;
+	filters[mailbox].mask = mask;
+	filters[mailbox].extended = extended;
+	filters[mailbox].active = true;
+	if (!applyFilters()) return -1;
+	return mailbox;
+}
+
+int SocketCAN::_setFilter(uint32_t id, uint32_t mask, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (!filters[i].active) return _setFilterSpecific(i, id, mask, extended);
+	}
+	return -1;
+}
+
+/**
+ * \brief Find the first filter that accepts this ID
+ *
+ * \ret  Mailbox number or -1 if no filter matches
+ */
+int SocketCAN::findMailbox(uint32_t id, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (filters[i].active && filters[i].extended == extended && ((id & filters[i].mask) == filters[i].id)) return i;
+	}
+	return -1;
+}
+
+uint32_t SocketCAN::init(uint32_t ul_baudrate)
+{
+	set_baudrate(ul_baudrate);
+	if (!openSocket()) return 0;
+	return busSpeed;
+}
+
+//the kernel driver does any detecting there is, just take the default rate
+uint32_t SocketCAN::beginAutoSpeed()
+{
+	return init(CAN_DEFAULT_BAUD);
+}
+
+uint32_t SocketCAN::set_baudrate(uint32_t ul_baudrate)
+{
+	busSpeed = ul_baudrate;
+	return busSpeed;
+}
+
+uint32_t SocketCAN::set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed)
+{
+	busSpeed = nominalSpeed;
+	fd_DataSpeed = dataSpeed;
+	return busSpeed;
+}
+
+uint32_t SocketCAN::initFD(uint32_t nominalRate, uint32_t dataRate)
+{
+	set_baudrateFD(nominalRate, dataRate);
+	if (!openSocket() || !fdSupported) return 0;
+	return busSpeed;
+}
+
+void SocketCAN::setListenOnlyMode(bool state)
+{
+	listenOnly = state;
+}
+
+void SocketCAN::enable()
+{
+	openSocket();
+}
+
+void SocketCAN::disable()
+{
+	closeSocket();
+}
+
+void SocketCAN::toSocket(const CAN_FRAME &frame, struct canfd_frame &out)
+{
+	memset(&out, 0, sizeof(out));
+	out.can_id = frame.extended ? ((frame.id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (frame.id & CAN_SFF_MASK);
+	if (frame.rtr) out.can_id |= CAN_RTR_FLAG;
+	out.len = (frame.length > 8) ? 8 : frame.length;
+	memcpy(out.data, frame.data.uint8, 8);
+}
+
+/**
+ * \brief Fill a kernel frame from a CAN_FRAME_FD
+ *
+ * \ret  false if the length is impossible for the frame type. FD frames are always sent with bitrate switch.
+ */
+bool SocketCAN::toSocketFD(const CAN_FRAME_FD &frame, struct canfd_frame &out)
+{
+	if (frame.length > 64 || (!frame.fdMode && frame.length > 8)) return false;
+	memset(&out, 0, sizeof(out));
+	out.can_id = frame.extended ? ((frame.id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (frame.id & CAN_SFF_MASK);
+	out.len = frame.length;
+	if (frame.fdMode)
+	{
+		out.len = fdLengthDecoding[fdLengthEncoding[frame.length]]; //round up to a length the bus can carry
+		out.flags = CANFD_BRS;
+	}
+	memcpy(out.data, frame.data.uint8, frame.length);
+	return true;
+}
+
+bool SocketCAN::sendFrame(CAN_FRAME &txFrame)
+{
+	if (sock < 0 || listenOnly) return false;
+	struct canfd_frame out;
+	toSocket(txFrame, out);
+	if (write(sock, &out, CAN_MTU) != CAN_MTU) return false;
+	stats.countTX(txFrame);
+	return true;
+}
+
+bool SocketCAN::sendFrameFD(CAN_FRAME_FD &txFrame)
+{
+	if (sock < 0 || listenOnly) return false;
+	struct canfd_frame out;
+	if (!toSocketFD(txFrame, out)) return false;
+	if (txFrame.fdMode && !fdSupported) return false;
+	size_t mtu = txFrame.fdMode ? CANFD_MTU : CAN_MTU;
+	if (write(sock, &out, mtu) != (ssize_t)mtu) return false;
+	stats.countTXFD(txFrame);
+	return true;
+}
+
+//sendmmsg the frames in one go. Returns how many the kernel took, a full queue stops it early.
+size_t SocketCAN::sendMany(struct canfd_frame *frames, const size_t *lengths, size_t n)
+{
+	struct iovec iov[SOCKET_CAN_BATCH];
+	struct mmsghdr msgs[SOCKET_CAN_BATCH];
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (size_t i = 0; i < n; i++)
+	{
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = lengths[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int sent = sendmmsg(sock, msgs, n, MSG_DONTWAIT);
+	return (sent < 0) ? 0 : (size_t)sent;
+}
+
+/**
+ * \brief Send up to n frames with as few system calls as possible
+ *
+ * \ret  Number of frames the kernel accepted, in order. The rest can be retried later.
+ */
+size_t SocketCAN::sendBatch(const CAN_FRAME *in, size_t n)
+{
+	if (sock < 0 || listenOnly) return 0;
+	struct canfd_frame out[SOCKET_CAN_BATCH];
+	size_t lengths[SOCKET_CAN_BATCH];
+	size_t done = 0;
+	while (done < n)
+	{
+		size_t chunk = (n - done > SOCKET_CAN_BATCH) ? SOCKET_CAN_BATCH : n - done;
+		for (size_t i = 0; i < chunk; i++)
+		{
+			toSocket(in[done + i], out[i]);
+			lengths[i] = CAN_MTU;
+		}
+		size_t sent = sendMany(out, lengths, chunk);
+		for (size_t i = 0; i < sent; i++) stats.countTX(in[done + i]);
+		done += sent;
+		if (sent < chunk) break;
+	}
+	return done;
+}
+
+size_t SocketCAN::sendBatchFD(const CAN_FRAME_FD *in, size_t n)
+{
+	if (sock < 0 || listenOnly) return 0;
+	struct canfd_frame out[SOCKET_CAN_BATCH];
+	size_t lengths[SOCKET_CAN_BATCH];
+	size_t done = 0;
+	while (done < n)
+	{
+		size_t chunk = 0;
+		//a frame that can't be sent ends the batch just like a refusal from sendFrameFD would
+		while (chunk < SOCKET_CAN_BATCH && done + chunk < n)
+		{
+			const CAN_FRAME_FD &frame = in[done + chunk];
+			if ((frame.fdMode && !fdSupported) || !toSocketFD(frame, out[chunk])) break;
+			lengths[chunk] = frame.fdMode ? CANFD_MTU : CAN_MTU;
+			chunk++;
+		}
+		if (chunk == 0) break;
+		size_t sent = sendMany(out, lengths, chunk);
+		for (size_t i = 0; i < sent; i++) stats.countTXFD(in[done + i]);
+		done += sent;
+		if (sent < chunk) break;
+	}
+	return done;
+}
+
+/**
+ * \brief Read everything waiting on the socket and pass it on like a receive interrupt would
+ *
+ * \param timeoutMillis How long to wait for the first frame. 0 returns straight away, -1 waits forever.
+ *
+ * \ret  Number of frames handed to receiveFrame / receiveFrameFD, -1 if the socket isn't open
+ */
+int SocketCAN::service(int timeoutMillis)
+{
+	if (sock < 0) return -1;
+	if (timeoutMillis != 0)
+	{
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (::poll(&pfd, 1, timeoutMillis) <= 0) return 0;
+	}
+
+	int total = 0;
+	while (true)
+	{
+		for (int i = 0; i < SOCKET_CAN_BATCH; i++)
+		{
+			memset(&rxMsgs[i].msg_hdr, 0, sizeof(rxMsgs[i].msg_hdr));
+			rxMsgs[i].msg_hdr.msg_iov = &rxIov[i];
+			rxMsgs[i].msg_hdr.msg_iovlen = 1;
+			rxMsgs[i].msg_hdr.msg_control = rxControl[i];
+			rxMsgs[i].msg_hdr.msg_controllen = sizeof(rxControl[i]);
+		}
+		int got = recvmmsg(sock, rxMsgs, SOCKET_CAN_BATCH, MSG_DONTWAIT, NULL);
+		if (got <= 0) break;
+		for (int i = 0; i < got; i++)
+		{
+			handleMessage(rxMsgs[i].msg_hdr, rxFrames[i], rxMsgs[i].msg_len);
+			if (!(rxFrames[i].can_id & CAN_ERR_FLAG)) total++;
+		}
+		if (got < SOCKET_CAN_BATCH) break;
+	}
+	return total;
+}
+
+void SocketCAN::handleMessage(struct msghdr &msg, struct canfd_frame &frame, size_t length)
+{
+	uint32_t stamp = 0;
+	bool stamped = false;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+	{
+		if (c->cmsg_level != SOL_SOCKET) continue;
+		if (c->cmsg_type == SO_TIMESTAMPING)
+		{
+			struct scm_timestamping ts;
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			//[2] is the raw hardware time, [0] the software one
+			const struct timespec &t = (ts.ts[2].tv_sec || ts.ts[2].tv_nsec) ? ts.ts[2] : ts.ts[0];
+			stamp = (uint32_t)((uint64_t)t.tv_sec * 1000000ull + t.tv_nsec / 1000);
+			stamped = true;
+		}
+		else if (c->cmsg_type == SO_RXQ_OVFL)
+		{
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+			if (drops != kernelDrops) stats.countOverrun(drops - kernelDrops);
+			kernelDrops = drops;
+		}
+	}
+
+	if (frame.can_id & CAN_ERR_FLAG)
+	{
+		handleError(frame);
+		return;
+	}
+
+	bool extended = (frame.can_id & CAN_EFF_FLAG) != 0;
+	uint32_t id = frame.can_id & (extended ? CAN_EFF_MASK : CAN_SFF_MASK);
+	int mailbox = findMailbox(id, extended);
+	if (mailbox < 0)
+	{
+		stats.countFilterReject();
+		return;
+	}
+
+	if (length == CANFD_MTU)
+	{
+		CAN_FRAME_FD rx;
+		rx.id = id;
+		rx.extended = extended;
+		rx.fdMode = 1;
+		rx.rrs = 0;
+		rx.length = (frame.len > 64) ? 64 : frame.len;
+		rx.timestamp = stamped ? stamp : micros();
+		memcpy(rx.data.uint8, frame.data, rx.length);
+		receiveFrameFD(rx, mailbox);
+	}
+	else if (length == CAN_MTU)
+	{
+		CAN_FRAME rx;
+		rx.id = id;
+		rx.extended = extended;
+		rx.rtr = (frame.can_id & CAN_RTR_FLAG) ? 1 : 0;
+		rx.length = (frame.len > 8) ? 8 : frame.len;
+		rx.timestamp = stamped ? stamp : micros();
+		memcpy(rx.data.uint8, frame.data, 8);
+		receiveFrame(rx, mailbox);
+	}
+}
+
+//Error frames from the kernel driver. vcan never produces any, real controllers do.
+void SocketCAN::handleError(const struct canfd_frame &frame)
+{
+	stats.countErrorFrame();
+	if (frame.can_id & CAN_ERR_BUSOFF)
+	{
+		stats.countBusOff();
+		faulted = true;
+	}
+	if (frame.can_id & CAN_ERR_RESTARTED) faulted = false;
+	if (frame.can_id & CAN_ERR_CRTL)
+	{
+		if (frame.data[1] & (CAN_ERR_CRTL_RX_OVERFLOW | CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_RX_WARNING)) rxFault = true;
+		if (frame.data[1] & (CAN_ERR_CRTL_TX_OVERFLOW | CAN_ERR_CRTL_TX_PASSIVE | CAN_ERR_CRTL_TX_WARNING)) txFault = true;
+		if (frame.data[1] & CAN_ERR_CRTL_RX_OVERFLOW) stats.countOverrun();
+		if (frame.data[1] & CAN_ERR_CRTL_ACTIVE)
+		{
+			rxFault = false;
+			txFault = false;
+		}
+	}
+	if (frame.can_id & CAN_ERR_CNT) stats.setErrorCounters(frame.data[6], frame.data[7]);
+}
@@ -0,0 +1,90 @@
+#ifndef _SOCKET_CAN_
+#define _SOCKET_CAN_
+
+#include <can_common.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+//Frames moved per recvmmsg / sendmmsg call
+#ifndef SOCKET_CAN_BATCH
+#define SOCKET_CAN_BATCH 32
+#endif
+
+/*
+CAN_COMMON driver for a Linux SocketCAN interface (vcan0, can0, ...) on the host build. Linux only.
+
+The mailbox filters set with setRXFilter / watchFor become the socket's CAN_RAW_FILTER list so the
+kernel throws away what nobody asked for, and each frame that does arrive is handed to receiveFrame
+with the number of the first filter matching it, same as a controller would report. FD frames are
+used whenever the interface's MTU allows them.
+
+There is no interrupt: call service() from loop() (or a thread) and it drains the socket in
+recvmmsg batches. sendBatch / sendBatchFD go out in sendmmsg batches. Received frames are stamped
+with the kernel's receive time in microseconds, the hardware time if the interface gives one and
+the software time otherwise.
+
+The bitrate of a real interface is set with "ip link" before the program runs. init() and friends
+only record the rate for the statistics. Listen only mode just refuses to send.
+*/
+class SocketCAN : public CAN_COMMON
+{
+public:
+    SocketCAN(const char *interfaceName, int numFilt = 16, uint16_t rxDepth = 256);
+    ~SocketCAN();
+
+    int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
+    int _setFilter(uint32_t id, uint32_t mask, bool extended);
+    uint32_t init(uint32_t ul_baudrate);
+    uint32_t beginAutoSpeed();
+    uint32_t set_baudrate(uint32_t ul_baudrate);
+    void setListenOnlyMode(bool state);
+    void enable();
+    void disable();
+    bool sendFrame(CAN_FRAME &txFrame);
+    size_t sendBatch(const CAN_FRAME *in, size_t n);
+
+    uint32_t set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed);
+    bool sendFrameFD(CAN_FRAME_FD &txFrame);
+    size_t sendBatchFD(const CAN_FRAME_FD *in, size_t n);
+    uint32_t initFD(uint32_t nominalRate, uint32_t dataRate);
+
+    int service(int timeoutMillis = 0);
+    int findMailbox(uint32_t id, bool extended);
+    int getSocket() const { return sock; }
+    bool isOpen() const { return sock >= 0; }
+
+    static void toSocket(const CAN_FRAME &frame, struct canfd_frame &out);
+    static bool toSocketFD(const CAN_FRAME_FD &frame, struct canfd_frame &out);
+
+private:
+    struct Filter
+    {
+        uint32_t id;
+        uint32_t mask;
+        bool extended;
+        bool active;
+    };
+
+    bool openSocket();
+    void closeSocket();
+    bool applyFilters();
+    void handleMessage(struct msghdr &msg, struct canfd_frame &frame, size_t length);
+    void handleError(const struct canfd_frame &frame);
+    size_t sendMany(struct canfd_frame *frames, const size_t *lengths, size_t n);
+
+    char ifName[IFNAMSIZ];
+    int sock;
+    Filter *filters;
+    CAN_FRAME *rxStorage;
+    CAN_FRAME_FD *rxStorageFD;
+    bool listenOnly;
+    uint32_t kernelDrops;   //last SO_RXQ_OVFL value
+
+    struct canfd_frame rxFrames[SOCKET_CAN_BATCH];
+    struct iovec rxIov[SOCKET_CAN_BATCH];
+    struct mmsghdr rxMsgs[SOCKET_CAN_BATCH];
+    uint8_t rxControl[SOCKET_CAN_BATCH][128];
+};
+
+#endif
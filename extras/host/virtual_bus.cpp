@@ -0,0 +1,386 @@
+#include "virtual_bus.h"
+#include <string.h>
+
+CANVirtualBus::CANVirtualBus(uint32_t nominalRate, uint32_t dataRate)
+{
+	this->nominalRate = nominalRate ? nominalRate : CAN_DEFAULT_BAUD;
+	this->dataRate = dataRate ? dataRate : this->nominalRate;
+	nowNs = 0;
+	resetStats();
+}
+
+void CANVirtualBus::setRates(uint32_t nominal, uint32_t data)
+{
+	if (nominal) nominalRate = nominal;
+	dataRate = data ? data : nominalRate;
+}
+
+void CANVirtualBus::attach(CANVirtualNode *node)
+{
+	nodes.push_back(node);
+}
+
+void CANVirtualBus::detach(CANVirtualNode *node)
+{
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i] == node)
+		{
+			nodes.erase(nodes.begin() + i);
+			return;
+		}
+	}
+}
+
+void CANVirtualBus::resetStats()
+{
+	idStats.clear();
+	busyNs = 0;
+	frames = 0;
+	statsStartNs = nowNs;
+}
+
+//Exact time the frame holds the bus, interframe space included
+uint64_t CANVirtualBus::frameTimeNs(const CAN_FRAME_FD &frame, bool rtr) const
+{
+	if (!frame.fdMode)
+	{
+		CAN_FRAME classic;
+		classic.id = frame.id;
+		classic.extended = frame.extended;
+		classic.rtr = rtr ? 1 : 0;
+		classic.length = (frame.length > 8) ? 8 : frame.length;
+		memcpy(classic.data.bytes, frame.data.uint8, 8);
+		return (uint64_t)CANStatistics::stuffedFrameBits(classic) * 1000000000ull / nominalRate;
+	}
+	uint32_t nominalBits, dataBits;
+	CANStatistics::stuffedFrameBitsFD(frame, nominalBits, dataBits);
+	return (uint64_t)nominalBits * 1000000000ull / nominalRate + (uint64_t)dataBits * 1000000000ull / dataRate;
+}
+
+/**
+ * \brief Put the next frame on the wire
+ *
+ * \param limitNs Don't start a frame after this time. The bus waits for releases up to it when idle.
+ *
+ * \ret  true if a frame was sent, now() is then the end of its interframe space
+ */
+bool CANVirtualBus::step(uint64_t limitNs)
+{
+	while (true)
+	{
+		CANVirtualNode *winner = NULL;
+		int winnerIdx = -1;
+		uint64_t nextRelease = UINT64_MAX;
+		for (size_t n = 0; n < nodes.size(); n++)
+		{
+			CANVirtualNode *node = nodes[n];
+			if (!node->enabled || node->listenOnly) continue;
+			int idx = node->nextPending(nowNs);
+			//same key from two nodes is a collision on a real bus, here the first attached goes
+			if (idx >= 0 && (winner == NULL || node->txQueue[idx].key < winner->txQueue[winnerIdx].key))
+			{
+				winner = node;
+				winnerIdx = idx;
+			}
+			for (size_t i = 0; i < node->txQueue.size(); i++)
+			{
+				if (node->txQueue[i].releaseNs > nowNs && node->txQueue[i].releaseNs < nextRelease) nextRelease = node->txQueue[i].releaseNs;
+			}
+		}
+
+		if (winner == NULL)
+		{
+			//idle until the next release
+			if (nextRelease == UINT64_MAX || nextRelease > limitNs) return false;
+			nowNs = nextRelease;
+			continue;
+		}
+		if (nowNs > limitNs) return false;
+
+		CANVirtualNode::Pending entry = winner->txQueue[winnerIdx];
+		winner->txQueue.erase(winner->txQueue.begin() + winnerIdx);
+
+		uint64_t start = nowNs;
+		uint64_t duration = frameTimeNs(entry.frame, entry.rtr);
+		nowNs += duration;
+		busyNs += duration;
+		frames++;
+
+		CANVirtualIdStats &s = idStats[entry.frame.id | (entry.frame.extended ? 0x80000000ul : 0)];
+		uint64_t queued = start - entry.releaseNs;
+		uint64_t response = nowNs - entry.releaseNs;
+		s.frames++;
+		s.busyNs += duration;
+		s.totalQueueNs += queued;
+		s.totalResponseNs += response;
+		if (queued > s.worstQueueNs) s.worstQueueNs = queued;
+		if (response > s.worstResponseNs) s.worstResponseNs = response;
+
+		//receivers have the frame at the end of EOF, before the interframe space
+		uint64_t received = nowNs - 3ull * 1000000000ull / nominalRate;
+		for (size_t n = 0; n < nodes.size(); n++)
+		{
+			if (nodes[n] != winner) nodes[n]->deliver(entry, received);
+		}
+		return true;
+	}
+}
+
+//Send everything that starts before timeNs, then leave the clock at timeNs (or the end of the last frame if later)
+uint32_t CANVirtualBus::runUntil(uint64_t timeNs)
+{
+	uint32_t count = 0;
+	while (step(timeNs)) count++;
+	if (nowNs < timeNs) nowNs = timeNs;
+	return count;
+}
+
+uint32_t CANVirtualBus::runUntilIdle()
+{
+	uint32_t count = 0;
+	while (step()) count++;
+	return count;
+}
+
+//Share of the time since the last resetStats() the wire was busy
+uint8_t CANVirtualBus::getLoadPercent() const
+{
+	uint64_t elapsed = nowNs - statsStartNs;
+	if (elapsed == 0) return 0;
+	uint64_t load = busyNs * 100 / elapsed;
+	return (uint8_t)(load > 100 ? 100 : load);
+}
+
+const CANVirtualIdStats *CANVirtualBus::getIdStats(uint32_t id, bool extended) const
+{
+	std::map<uint32_t, CANVirtualIdStats>::const_iterator it = idStats.find(id | (extended ? 0x80000000ul : 0));
+	return (it == idStats.end()) ? NULL : &it->second;
+}
+
+//Every ID seen since the last resetStats(), standard IDs first then extended, each in ascending order
+void CANVirtualBus::forEachId(CANVirtualIdCallback callback, void *context) const
+{
+	for (std::map<uint32_t, CANVirtualIdStats>::const_iterator it = idStats.begin(); it != idStats.end(); ++it)
+	{
+		callback(it->first & 0x7FFFFFFF, (it->first & 0x80000000ul) != 0, it->second, context);
+	}
+}
+
+CANVirtualNode::CANVirtualNode(CANVirtualBus &bus, int numFilt, uint16_t txDepth, uint16_t rxDepth) : CAN_COMMON(numFilt), bus(bus)
+{
+	filters = new Filter[numFilters];
+	for (int i = 0; i < numFilters; i++) filters[i].active = false;
+	rxStorage = new CAN_FRAME[rxDepth];
+	rxStorageFD = new CAN_FRAME_FD[rxDepth];
+	setRXBuffer(rxStorage, rxDepth);
+	setRXBufferFD(rxStorageFD, rxDepth);
+	fdSupported = true;
+	this->txDepth = txDepth ? txDepth : 1;
+	txQueue.reserve(this->txDepth);
+	sequence = 0;
+	fifo = false;
+	enabled = false;
+	listenOnly = false;
+	bus.attach(this);
+}
+
+CANVirtualNode::~CANVirtualNode()
+{
+	bus.detach(this);
+	delete[] filters;
+	delete[] rxStorage;
+	delete[] rxStorageFD;
+}
+
+int CANVirtualNode::_setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
+{
+	if (mailbox >= numFilters) return -1;
+	filters[mailbox].id = id & mask;
+	filters[mailbox].mask = mask;
+	filters[mailbox].extended = extended;
+	filters[mailbox].active = true;
+	return mailbox;
+}
+
+int CANVirtualNode::_setFilter(uint32_t id, uint32_t mask, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (!filters[i].active) return _setFilterSpecific(i, id, mask, extended);
+	}
+	return -1;
+}
+
+int CANVirtualNode::findMailbox(uint32_t id, bool extended)
+{
+	for (int i = 0; i < numFilters; i++)
+	{
+		if (filters[i].active && filters[i].extended == extended && ((id & filters[i].mask) == filters[i].id)) return i;
+	}
+	return -1;
+}
+
+//The rate belongs to the bus, nodes only remember what they were asked for. One set to another rate only sees errors.
+uint32_t CANVirtualNode::init(uint32_t ul_baudrate)
+{
+	set_baudrate(ul_baudrate);
+	enable();
+	return busSpeed;
+}
+
+uint32_t CANVirtualNode::beginAutoSpeed()
+{
+	return init(bus.getNominalRate());
+}
+
+uint32_t CANVirtualNode::set_baudrate(uint32_t ul_baudrate)
+{
+	busSpeed = ul_baudrate;
+	return busSpeed;
+}
+
+uint32_t CANVirtualNode::set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed)
+{
+	busSpeed = nominalSpeed;
+	fd_DataSpeed = dataSpeed;
+	return busSpeed;
+}
+
+uint32_t CANVirtualNode::initFD(uint32_t nominalRate, uint32_t dataRate)
+{
+	set_baudrateFD(nominalRate, dataRate);
+	enable();
+	return busSpeed;
+}
+
+void CANVirtualNode::setListenOnlyMode(bool state)
+{
+	listenOnly = state;
+}
+
+void CANVirtualNode::enable()
+{
+	enabled = true;
+}
+
+void CANVirtualNode::disable()
+{
+	enabled = false;
+}
+
+void CANVirtualNode::setTxFifo(bool state)
+{
+	fifo = state;
+}
+
+/**
+ * \brief The bits a frame sends during arbitration as one number, lower wins
+ *
+ * Base ID, then RTR (SRR for extended, always recessive), IDE, the 18 extension bits and the
+ * extended RTR. Standard frames stop after IDE which is dominant so the rest stays 0.
+ */
+uint32_t CANVirtualNode::arbitrationKey(uint32_t id, bool extended, bool rtr)
+{
+	if (!extended) return ((id & 0x7FF) << 21) | (rtr ? (1ul << 20) : 0);
+	return (((id >> 18) & 0x7FF) << 21) | (1ul << 20) | (1ul << 19) | ((id & 0x3FFFF) << 1) | (rtr ? 1 : 0);
+}
+
+bool CANVirtualNode::queue(const CAN_FRAME_FD &frame, bool rtr, uint64_t releaseNs)
+{
+	if (!enabled || listenOnly || txQueue.size() >= txDepth) return false;
+	Pending entry;
+	entry.frame = frame;
+	entry.rtr = rtr;
+	entry.key = arbitrationKey(frame.id, frame.extended, rtr);
+	entry.sequence = sequence++;
+	entry.releaseNs = (releaseNs > bus.now()) ? releaseNs : bus.now();
+	txQueue.push_back(entry);
+	return true;
+}
+
+//Index of the frame this node would try to send at timeNs, -1 if none is released yet
+int CANVirtualNode::nextPending(uint64_t timeNs) const
+{
+	int best = -1;
+	for (size_t i = 0; i < txQueue.size(); i++)
+	{
+		const Pending &p = txQueue[i];
+		if (fifo)
+		{
+			//strict order: nothing goes before the oldest queued frame
+			if (best == -1 || p.sequence < txQueue[best].sequence) best = i;
+			continue;
+		}
+		if (p.releaseNs > timeNs) continue;
+		if (best == -1 || p.key < txQueue[best].key) best = i;
+	}
+	if (best >= 0 && txQueue[best].releaseNs > timeNs) return -1;
+	return best;
+}
+
+bool CANVirtualNode::sendFrame(CAN_FRAME &txFrame)
+{
+	return sendFrameAt(txFrame, 0);
+}
+
+bool CANVirtualNode::sendFrameFD(CAN_FRAME_FD &txFrame)
+{
+	return sendFrameFDAt(txFrame, 0);
+}
+
+bool CANVirtualNode::sendFrameAt(const CAN_FRAME &txFrame, uint64_t releaseNs)
+{
+	CAN_FRAME_FD frame;
+	CAN_FRAME copy = txFrame;
+	canToFD(copy, frame);
+	if (frame.length > 8) frame.length = 8;
+	if (!queue(frame, txFrame.rtr != 0, releaseNs)) return false;
+	stats.countTX(txFrame);
+	return true;
+}
+
+bool CANVirtualNode::sendFrameFDAt(const CAN_FRAME_FD &txFrame, uint64_t releaseNs)
+{
+	if (txFrame.length > 64 || (!txFrame.fdMode && txFrame.length > 8)) return false;
+	if (!queue(txFrame, false, releaseNs)) return false;
+	stats.countTXFD(txFrame);
+	return true;
+}
+
+void CANVirtualNode::deliver(const Pending &entry, uint64_t endNs)
+{
+	if (!enabled) return;
+	const CAN_FRAME_FD &sent = entry.frame;
+	//a controller sampling at another rate than the bus runs at sees stuff and form errors, not frames
+	if (busSpeed && busSpeed != bus.getNominalRate())
+	{
+		stats.countErrorFrame();
+		return;
+	}
+	int mailbox = findMailbox(sent.id, sent.extended);
+	if (mailbox < 0)
+	{
+		stats.countFilterReject();
+		return;
+	}
+	uint32_t stamp = (uint32_t)(endNs / 1000ull);
+	if (!sent.fdMode)
+	{
+		CAN_FRAME frame;
+		CAN_FRAME_FD copy = sent;
+		fdToCan(copy, frame);
+		frame.rtr = entry.rtr ? 1 : 0;
+		frame.timestamp = stamp;
+		receiveFrame(frame, mailbox);
+		return;
+	}
+	if (!fdSupported)
+	{
+		stats.countErrorFrame(); //a classic controller can't take FD frames
+		return;
+	}
+	CAN_FRAME_FD frame = sent;
+	frame.timestamp = stamp;
+	receiveFrameFD(frame, mailbox);
+}
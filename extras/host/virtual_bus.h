@@ -0,0 +1,148 @@
+#ifndef _VIRTUAL_BUS_
+#define _VIRTUAL_BUS_
+
+#include <can_common.h>
+#include <map>
+#include <vector>
+
+class CANVirtualNode;
+
+//What the bus saw of one identifier. Times are simulated nanoseconds.
+struct CANVirtualIdStats
+{
+    uint32_t frames;
+    uint64_t busyNs;            //wire time used by this ID
+    uint64_t totalQueueNs;      //from release (sendFrame) to winning arbitration
+    uint64_t worstQueueNs;
+    uint64_t totalResponseNs;   //from release to the end of the frame
+    uint64_t worstResponseNs;
+};
+
+typedef void (*CANVirtualIdCallback)(uint32_t id, bool extended, const CANVirtualIdStats &stats, void *context);
+
+/*
+Simulated CAN bus for capacity planning on the host. Any number of CANVirtualNode drivers attach
+to it, each with its own transmit queue. Time is simulated and only moves when runUntil() or
+step() is called, so a minute of bus traffic takes as long as the CPU needs to work it out.
+
+Whenever the bus goes idle every node offers its best pending frame and the lowest arbitration
+field wins, bit for bit like the real thing (standard beats extended with the same base ID, data
+beats remote). The winner occupies the wire for its exact length - stuff bits worked out from the
+frame's contents, FD data phase at the data rate, interframe space included - and is then handed
+to every other enabled node as if their controller had received it.
+
+Per ID the bus records how long frames waited for the wire and the response time from release to
+delivery, the quantities schedulability analysis is about.
+
+Not thread safe: nodes and bus have to be driven from one thread.
+*/
+class CANVirtualBus
+{
+public:
+    CANVirtualBus(uint32_t nominalRate = CAN_DEFAULT_BAUD, uint32_t dataRate = CAN_DEFAULT_FD_RATE);
+
+    void setRates(uint32_t nominalRate, uint32_t dataRate);
+    uint32_t getNominalRate() const { return nominalRate; }
+    uint32_t getDataRate() const { return dataRate; }
+
+    uint64_t now() const { return nowNs; }
+    bool step(uint64_t limitNs = UINT64_MAX);
+    uint32_t runUntil(uint64_t timeNs);
+    uint32_t runUntilIdle();
+
+    uint64_t getBusyNs() const { return busyNs; }
+    uint32_t getFrames() const { return frames; }
+    uint8_t getLoadPercent() const;
+    const CANVirtualIdStats *getIdStats(uint32_t id, bool extended) const;
+    void forEachId(CANVirtualIdCallback callback, void *context) const;
+    void resetStats();
+
+    uint64_t frameTimeNs(const CAN_FRAME_FD &frame, bool rtr) const;
+
+private:
+    friend class CANVirtualNode;
+    void attach(CANVirtualNode *node);
+    void detach(CANVirtualNode *node);
+
+    std::vector<CANVirtualNode *> nodes;
+    std::map<uint32_t, CANVirtualIdStats> idStats; //key is the ID with bit 31 set for extended
+    uint32_t nominalRate;
+    uint32_t dataRate;
+    uint64_t nowNs;
+    uint64_t busyNs;
+    uint64_t statsStartNs;
+    uint32_t frames;
+};
+
+/*
+CAN_COMMON driver for a node on a CANVirtualBus. Filters behave like LoopbackCAN's. A node set to a
+nominal rate other than the bus's counts an error frame for every frame instead of receiving it, as
+a real controller at the wrong rate would, so bitrate detection can be tried out. Sent frames go
+into a transmit queue of txDepth entries (sendFrame fails when it is full, like a controller with
+that many TX mailboxes) and leave it in priority order by default or strictly in order with
+setTxFifo(true), which shows what priority inversion in a FIFO driver costs.
+*/
+class CANVirtualNode : public CAN_COMMON
+{
+public:
+    CANVirtualNode(CANVirtualBus &bus, int numFilt = 16, uint16_t txDepth = 32, uint16_t rxDepth = 256);
+    ~CANVirtualNode();
+
+    int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
+    int _setFilter(uint32_t id, uint32_t mask, bool extended);
+    uint32_t init(uint32_t ul_baudrate);
+    uint32_t beginAutoSpeed();
+    uint32_t set_baudrate(uint32_t ul_baudrate);
+    void setListenOnlyMode(bool state);
+    void enable();
+    void disable();
+    bool sendFrame(CAN_FRAME &txFrame);
+
+    uint32_t set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed);
+    bool sendFrameFD(CAN_FRAME_FD &txFrame);
+    uint32_t initFD(uint32_t nominalRate, uint32_t dataRate);
+
+    //queue a frame that is released (ready to send) at a future bus time
+    bool sendFrameAt(const CAN_FRAME &txFrame, uint64_t releaseNs);
+    bool sendFrameFDAt(const CAN_FRAME_FD &txFrame, uint64_t releaseNs);
+    void setTxFifo(bool fifo);
+    uint16_t getTxPending() const { return (uint16_t)txQueue.size(); }
+    int findMailbox(uint32_t id, bool extended);
+
+    static uint32_t arbitrationKey(uint32_t id, bool extended, bool rtr);
+
+private:
+    friend class CANVirtualBus;
+    struct Filter
+    {
+        uint32_t id;
+        uint32_t mask;
+        bool extended;
+        bool active;
+    };
+    struct Pending
+    {
+        CAN_FRAME_FD frame;
+        bool rtr;
+        uint32_t key;
+        uint32_t sequence;
+        uint64_t releaseNs;
+    };
+
+    bool queue(const CAN_FRAME_FD &frame, bool rtr, uint64_t releaseNs);
+    int nextPending(uint64_t timeNs) const;
+    void deliver(const Pending &entry, uint64_t endNs);
+
+    CANVirtualBus &bus;
+    Filter *filters;
+    CAN_FRAME *rxStorage;
+    CAN_FRAME_FD *rxStorageFD;
+    std::vector<Pending> txQueue;
+    uint16_t txDepth;
+    uint32_t sequence;
+    bool fifo;
+    bool enabled;
+    bool listenOnly;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _CAN_TEST_
+#define _CAN_TEST_
+
+/*
+Minimal unit test support for the host build, no outside framework. Each test_<suite>.cpp file in
+this directory defines TESTs for one suite and CMake registers the suite with CTest, so
+ctest -R <suite> runs just that file's tests. ./can_tests without arguments runs everything.
+A test that can't run here (no vcan0 for instance) calls SKIP. When everything that ran was skipped
+the runner exits with 77, which CTest reports as skipped rather than passed.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef void (*CANTestFunction)();
+
+struct CANTestCase
+{
+    const char *suite;
+    const char *name;
+    CANTestFunction function;
+    CANTestCase *next;
+};
+
+class CANTestRegistrar
+{
+public:
+    CANTestRegistrar(CANTestCase &test);
+};
+
+void canTestFail(const char *file, int line, const char *expression);
+void canTestFailValues(const char *file, int line, const char *expression, long long actual, long long expected);
+void canTestSkip(const char *reason);
+
+#define CAN_TEST_SKIPPED 77
+
+#define TEST(suite, name) \
+    static void suite##_##name(); \
+    static CANTestCase suite##_##name##_case = {#suite, #name, suite##_##name, NULL}; \
+    static CANTestRegistrar suite##_##name##_registrar(suite##_##name##_case); \
+    static void suite##_##name()
+
+#define CHECK(cond) \
+    do { if (!(cond)) canTestFail(__FILE__, __LINE__, #cond); } while (0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        long long checkActual = (long long)(actual), checkExpected = (long long)(expected); \
+        if (checkActual != checkExpected) canTestFailValues(__FILE__, __LINE__, #actual " == " #expected, checkActual, checkExpected); \
+    } while (0)
+
+#define SKIP(reason) \
+    do { canTestSkip(reason); return; } while (0)
+
+#endif
@@ -0,0 +1,64 @@
+/*
+Test runner: ./can_tests [suite]. Runs every registered test (or those of one suite), prints the
+failed checks and exits non zero if there were any, or CAN_TEST_SKIPPED if every test skipped.
+*/
+
+#include "can_test.h"
+#include <string.h>
+
+static CANTestCase *firstTest = NULL;
+static CANTestCase *lastTest = NULL;
+static int failedChecks = 0;
+static const char *skipReason = NULL;
+
+CANTestRegistrar::CANTestRegistrar(CANTestCase &test)
+{
+	//keep file order so output reads top to bottom
+	if (lastTest) lastTest->next = &test;
+	else firstTest = &test;
+	lastTest = &test;
+}
+
+void canTestFail(const char *file, int line, const char *expression)
+{
+	printf("  %s:%d: CHECK(%s) failed\n", file, line, expression);
+	failedChecks++;
+}
+
+void canTestFailValues(const char *file, int line, const char *expression, long long actual, long long expected)
+{
+	printf("  %s:%d: CHECK_EQ(%s) failed: got %lld, expected %lld\n", file, line, expression, actual, expected);
+	failedChecks++;
+}
+
+void canTestSkip(const char *reason)
+{
+	skipReason = reason;
+}
+
+int main(int argc, char **argv)
+{
+	const char *suite = (argc > 1) ? argv[1] : NULL;
+	int run = 0, failed = 0, skipped = 0;
+	for (CANTestCase *test = firstTest; test; test = test->next)
+	{
+		if (suite && strcmp(suite, test->suite) != 0) continue;
+		int before = failedChecks;
+		skipReason = NULL;
+		test->function();
+		run++;
+		if (failedChecks != before)
+		{
+			failed++;
+			printf("FAIL %s.%s\n", test->suite, test->name);
+		}
+		else if (skipReason)
+		{
+			skipped++;
+			printf("SKIP %s.%s: %s\n", test->suite, test->name, skipReason);
+		}
+	}
+	printf("%d tests, %d failed, %d skipped\n", run, failed, skipped);
+	if (failed || run == 0) return 1;
+	return (skipped == run) ? CAN_TEST_SKIPPED : 0;
+}
@@ -0,0 +1,67 @@
+#include "can_test.h"
+#include <can_autobaud.h>
+#include <virtual_bus.h>
+
+static void sendSome(CANVirtualBus &bus, CANVirtualNode &node, int count)
+{
+	CAN_FRAME frame;
+	frame.id = 0x123;
+	frame.length = 2;
+	for (int i = 0; i < count; i++) CHECK(node.sendFrame(frame));
+	bus.runUntilIdle();
+}
+
+TEST(autobaud, rejectsTheWrongRateAndSettlesOnTheRightOne)
+{
+	CANVirtualBus bus(250000);
+	CANVirtualNode talker(bus), probe(bus);
+	talker.begin(250000);
+	probe.begin(500000);
+	probe.watchFor();
+	CANAutoBaud autobaud(probe);
+	static const uint32_t rates[] = { 500000, 250000, 125000 };
+	CHECK(autobaud.setCandidates(rates, 3));
+	autobaud.setRounds(1);
+	autobaud.start();
+	CHECK_EQ(autobaud.getCurrentRate(), 500000);
+
+	sendSome(bus, talker, 1); //only error frames at 500k
+	CHECK_EQ(autobaud.service(), AUTOBAUD_LISTENING);
+	CHECK_EQ(autobaud.getCurrentRate(), 250000);
+
+	sendSome(bus, talker, 1);
+	CHECK_EQ(autobaud.service(), AUTOBAUD_LISTENING); //one frame isn't enough
+	sendSome(bus, talker, 1);
+	CHECK_EQ(autobaud.service(), AUTOBAUD_FOUND);
+	CHECK_EQ(autobaud.getDetected(), 250000);
+	CHECK_EQ(probe.getBusSpeed(), 250000);
+	CHECK_EQ(probe.available(), 2);
+}
+
+TEST(autobaud, silentBusFailsAfterTheRounds)
+{
+	hostUseFakeClock(true);
+	CANVirtualBus bus(250000);
+	CANVirtualNode probe(bus);
+	probe.begin(500000);
+	probe.watchFor();
+	CANAutoBaud autobaud(probe);
+	static const uint32_t rates[] = { 500000, 250000 };
+	autobaud.setCandidates(rates, 2);
+	autobaud.setRounds(2);
+	autobaud.setDwell(10);
+	autobaud.start(125000); //the hint goes first
+	CHECK_EQ(autobaud.getCurrentRate(), 125000);
+	int rateChanges = 0;
+	uint32_t last = autobaud.getCurrentRate();
+	for (int i = 0; i < 100 && autobaud.service() == AUTOBAUD_LISTENING; i++)
+	{
+		if (autobaud.getCurrentRate() != last) rateChanges++;
+		last = autobaud.getCurrentRate();
+		hostAdvanceClock(1000);
+	}
+	hostUseFakeClock(false);
+	CHECK_EQ(autobaud.getState(), AUTOBAUD_FAILED);
+	CHECK_EQ(rateChanges, 5); //three rates, twice over
+	CHECK_EQ(autobaud.getDetected(), 0);
+}
@@ -0,0 +1,103 @@
+#include "can_test.h"
+#include <loopback_can.h>
+
+//Accepts a fixed number of frames then refuses the rest, like a driver whose mailboxes are all full
+class LimitedCAN : public LoopbackCAN
+{
+public:
+	LimitedCAN() : budget(0) {}
+
+	bool sendFrame(CAN_FRAME &txFrame)
+	{
+		if (budget == 0) return false;
+		budget--;
+		return LoopbackCAN::sendFrame(txFrame);
+	}
+
+	bool sendFrameFD(CAN_FRAME_FD &txFrame)
+	{
+		if (budget == 0) return false;
+		budget--;
+		return LoopbackCAN::sendFrameFD(txFrame);
+	}
+
+	int budget;
+};
+
+TEST(batch, sendStopsAtTheFirstRefusal)
+{
+	LimitedCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CAN_FRAME frames[6];
+	for (int i = 0; i < 6; i++)
+	{
+		frames[i].id = 0x100 + i;
+		frames[i].length = 1;
+		frames[i].data.bytes[0] = (uint8_t)i;
+	}
+	bus.budget = 4;
+	CHECK_EQ(bus.sendBatch(frames, 6), 4);
+	CHECK_EQ(bus.sendBatch(frames + 4, 2), 0);
+	bus.budget = 10;
+	CHECK_EQ(bus.sendBatch(frames + 4, 2), 2); //retry from where it stopped
+	CHECK_EQ(bus.budget, 8);
+	CHECK_EQ(bus.sendBatch(frames, 0), 0);
+
+	CAN_FRAME got[8];
+	CHECK_EQ(bus.readBatch(got, 8), 6); //fewer waiting than asked for
+	for (int i = 0; i < 6; i++) CHECK_EQ(got[i].id, 0x100 + i);
+	CHECK_EQ(bus.readBatch(got, 8), 0);
+}
+
+TEST(batch, readStopsAtMax)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CAN_FRAME frame;
+	frame.length = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		frame.id = 0x200 + i;
+		bus.sendFrame(frame);
+	}
+	CAN_FRAME got[3];
+	CHECK_EQ(bus.readBatch(got, 3), 3);
+	CHECK_EQ(got[2].id, 0x202);
+	CHECK_EQ(bus.available(), 2);
+	CHECK_EQ(bus.readBatch(got, 3), 2);
+	CHECK_EQ(got[0].id, 0x203);
+}
+
+TEST(batch, fdBatchesStopTheSameWay)
+{
+	LimitedCAN bus;
+	bus.beginFD(500000, 2000000);
+	bus.watchFor();
+	CAN_FRAME_FD frames[4];
+	for (int i = 0; i < 4; i++)
+	{
+		frames[i].id = 0x300 + i;
+		frames[i].extended = 0;
+		frames[i].fdMode = 1;
+		frames[i].length = 16;
+		frames[i].data.uint8[15] = (uint8_t)i;
+	}
+	frames[1].length = 65; //refused by the driver whatever the budget
+	bus.budget = 10;
+	CHECK_EQ(bus.sendBatchFD(frames, 4), 1);
+	CHECK_EQ(bus.budget, 8); //the budget check passed, the loopback refused the length
+	frames[1].length = 16;
+	bus.budget = 2;
+	CHECK_EQ(bus.sendBatchFD(frames + 1, 3), 2);
+
+	CAN_FRAME_FD got[4];
+	CHECK_EQ(bus.readBatchFD(got, 2), 2);
+	CHECK_EQ(bus.readBatchFD(got + 2, 4), 1);
+	for (int i = 0; i < 3; i++)
+	{
+		CHECK_EQ(got[i].id, 0x300 + i);
+		CHECK_EQ(got[i].data.uint8[15], i);
+	}
+}
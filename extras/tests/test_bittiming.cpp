@@ -0,0 +1,56 @@
+#include "can_test.h"
+#include <can_bittiming.h>
+
+//Classic controller with a 80 MHz clock and SJA1000 sized segments
+static const CANBitTimingLimits classic80 = { 80000000, 1, 64, 2, 16, 1, 8, 4, 0 };
+//Bosch M_CAN nominal and data phase registers on the same clock
+static const CANBitTimingLimits mcanNominal = { 80000000, 1, 512, 2, 256, 2, 128, 128, 0 };
+static const CANBitTimingLimits mcanData = { 80000000, 1, 32, 1, 32, 1, 16, 16, 127 };
+
+TEST(bittiming, classic500kAt80MHz)
+{
+	CANBitTiming t;
+	CHECK(CANBitTimingSolver::solve(classic80, 500000, t));
+	CHECK_EQ(t.brp, 10);
+	CHECK_EQ(1 + t.tseg1 + t.tseg2, 16);
+	CHECK_EQ(t.tseg1, 13);
+	CHECK_EQ(t.tseg2, 2);
+	CHECK_EQ(t.samplePoint, 875);
+	CHECK_EQ(t.bitrate, 500000);
+	CHECK_EQ(t.errorPpm, 0);
+	CHECK_EQ(t.sjw, 2);
+	CHECK(!t.tdc);
+}
+
+TEST(bittiming, samplePointAndLimits)
+{
+	CANBitTiming t;
+	CHECK(CANBitTimingSolver::solve(classic80, 1000000, t));
+	CHECK_EQ(t.samplePoint, 750);
+	CHECK_EQ(t.bitrate, 1000000);
+	CHECK(CANBitTimingSolver::solve(classic80, 250000, 800, t));
+	CHECK_EQ(t.samplePoint, 800);
+	CHECK_EQ(t.bitrate, 250000);
+	CHECK(!CANBitTimingSolver::solve(classic80, 0, t));
+	CHECK(!CANBitTimingSolver::solve(classic80, 500000, 1000, t));
+	//80 MHz / 64 / 25 quanta is the slowest this controller goes
+	CHECK(!CANBitTimingSolver::solve(classic80, 10000, t));
+}
+
+TEST(bittiming, fdDataPhaseWithTdc)
+{
+	CANBitTiming nominal, data;
+	CHECK(CANBitTimingSolver::solveFD(mcanNominal, mcanData, 500000, 2000000, nominal, data));
+	CHECK_EQ(nominal.bitrate, 500000);
+	CHECK_EQ(nominal.samplePoint, 875);
+	CHECK_EQ(data.bitrate, 2000000);
+	CHECK_EQ(data.errorPpm, 0);
+	CHECK_EQ(data.brp, 1);
+	CHECK_EQ(1 + data.tseg1 + data.tseg2, 40);
+	CHECK_EQ(data.samplePoint, 800);
+	CHECK(data.tdc);
+	CHECK_EQ(data.tdco, data.brp * (1 + data.tseg1)); //secondary sample point on the data sample point
+
+	CHECK(CANBitTimingSolver::solveFD(mcanNominal, mcanData, 500000, 1000000, nominal, data));
+	CHECK(!data.tdc); //not needed at 1 Mbit
+}
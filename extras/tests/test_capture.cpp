@@ -0,0 +1,210 @@
+#include "can_test.h"
+#include <can_capture.h>
+#include <can_replay.h>
+#include <loopback_can.h>
+#include <vector>
+
+static void collect(const uint8_t *data, size_t length, void *context)
+{
+	std::vector<uint8_t> *out = (std::vector<uint8_t> *)context;
+	out->insert(out->end(), data, data + length);
+}
+
+static CAN_FRAME makeFrame(uint32_t id, uint32_t timestamp)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.length = 8;
+	frame.timestamp = timestamp;
+	frame.data.uint64 = 0x0102030405060708ull + id;
+	return frame;
+}
+
+TEST(capture, roundTrip)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(0x123, 1000);
+	CHECK(writer.write(frame));
+	frame = makeFrame(0x18FEF100, 1250);
+	frame.extended = true;
+	CHECK(writer.write(frame));
+	CAN_FRAME_FD fd;
+	fd.id = 0x456;
+	fd.fdMode = 1;
+	fd.length = 20; //padded to 20 anyway, stored as a 20 byte code
+	fd.timestamp = 1300;
+	for (int i = 0; i < 64; i++) fd.data.uint8[i] = i;
+	CHECK(writer.writeFD(fd));
+	writer.flush();
+
+	CANCaptureReader reader(&out[0], out.size());
+	CHECK(reader.isValid());
+	CANCaptureRecord record;
+	CHECK(reader.next(record));
+	CHECK_EQ(record.timestamp, 1000);
+	CHECK_EQ(record.id, 0x123);
+	CAN_FRAME got;
+	CHECK(record.toFrame(got));
+	CHECK(got.data.uint64 == 0x0102030405060708ull + 0x123);
+	CHECK(reader.next(record));
+	CHECK_EQ(record.timestamp, 1250);
+	CHECK(record.extended());
+	CHECK(reader.next(record));
+	CHECK_EQ(record.timestamp, 1300);
+	CHECK(record.fdMode());
+	CHECK_EQ(record.length(), 20);
+	CHECK_EQ(record.data[19], 19);
+	CHECK(!reader.next(record));
+}
+
+TEST(capture, outOfOrderStampsKeepTheirTime)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(1, 5000);
+	writer.write(frame);
+	frame = makeFrame(2, 4990);
+	writer.write(frame);
+	frame = makeFrame(3, 5020);
+	writer.write(frame);
+	writer.flush();
+
+	CANCaptureReader reader(&out[0], out.size());
+	uint64_t expected[3] = { 5000, 4990, 5020 };
+	int n = 0;
+	for (CANCaptureReader::iterator it = reader.begin(); it != reader.end(); ++it)
+	{
+		CHECK(n < 3);
+		if (n < 3) CHECK(it->timestamp == expected[n]);
+		n++;
+	}
+	CHECK_EQ(n, 3);
+	//the backward step costs no more than a forward one
+	CHECK(out.size() <= CAN_CAPTURE_HEADER_SIZE + 3 * 14);
+}
+
+TEST(capture, counterWrapKeepsCounting)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(1, 0xFFFFFFF0);
+	writer.write(frame);
+	frame = makeFrame(2, 0x10);
+	writer.write(frame);
+	writer.flush();
+
+	CANCaptureReader reader(&out[0], out.size());
+	CANCaptureRecord record;
+	CHECK(reader.next(record));
+	CHECK(reader.next(record));
+	CHECK(record.timestamp == 0x100000010ull);
+}
+
+TEST(capture, otherVersionsAreRefused)
+{
+	const uint8_t v1[] = { 'C', 'A', 'N', 'C', 'A', 'P', 1, 0,
+		0x64, 0x00, 0x10,               //t = 100, ID 0x10, no data
+		0x14, 0x01, 0x11, 0xAA };       //t + 10 zigzag encoded, ID 0x11, one byte
+	CANCaptureReader reader(v1, sizeof(v1));
+	CHECK(reader.isValid());
+	CANCaptureRecord record;
+	CHECK(reader.next(record));
+	CHECK_EQ(record.timestamp, 100);
+	CHECK(reader.next(record));
+	CHECK_EQ(record.timestamp, 110);
+	CHECK_EQ(record.data[0], 0xAA);
+	const uint8_t v2[] = { 'C', 'A', 'N', 'C', 'A', 'P', 2, 0 };
+	CHECK(!reader.attach(v2, sizeof(v2)));
+	const uint8_t v0[] = { 'C', 'A', 'N', 'C', 'A', 'P', 0, 0 };
+	CHECK(!reader.attach(v0, sizeof(v0)));
+}
+
+TEST(capture, truncatedRecordEndsTheCapture)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(1, 10);
+	writer.write(frame);
+	writer.write(frame);
+	writer.flush();
+	CANCaptureReader reader(&out[0], out.size() - 1);
+	CANCaptureRecord record;
+	CHECK(reader.next(record));
+	CHECK(!reader.next(record));
+}
+
+TEST(capture, replayDoesNotStallOnAStepBack)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(1, 5000);
+	writer.write(frame);
+	frame = makeFrame(2, 4000);
+	writer.write(frame);
+	frame = makeFrame(3, 5000);
+	writer.write(frame);
+	writer.flush();
+
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANCaptureReader reader(&out[0], out.size());
+	CANReplay replay(bus, reader);
+	replay.start();
+	CHECK_EQ(replay.service(), 3);
+	CHECK(replay.isFinished());
+	CHECK_EQ(bus.available(), 3);
+}
+
+static int mailboxFrames;
+static void countMailbox(CAN_FRAME *frame)
+{
+	mailboxFrames++;
+}
+
+class MailboxListener : public CANListener
+{
+public:
+	MailboxListener() : frames(0), lastMailbox(-2) {}
+	void gotFrame(CAN_FRAME *frame, int mailbox)
+	{
+		frames++;
+		lastMailbox = mailbox;
+	}
+	int frames;
+	int lastMailbox;
+};
+
+TEST(capture, replayUsesTheMailboxTheFiltersPick)
+{
+	std::vector<uint8_t> out;
+	CANCaptureWriter writer(collect, &out);
+	CAN_FRAME frame = makeFrame(0x100, 10);
+	writer.write(frame);
+	frame = makeFrame(0x200, 20);
+	writer.write(frame);
+	frame = makeFrame(0x300, 30);
+	writer.write(frame);
+	writer.flush();
+
+	LoopbackCAN bus;
+	bus.begin(500000);
+	int first = bus.watchFor(0x100);
+	int second = bus.watchFor(0x200);
+	CHECK(first >= 0 && second >= 0 && first != second);
+	mailboxFrames = 0;
+	bus.setCallback(first, countMailbox);
+	MailboxListener listener;
+	bus.attachObj(&listener);
+	listener.setCallback(second);
+	CANCaptureReader reader(&out[0], out.size());
+	CANReplay replay(bus, reader);
+	replay.start(0);
+	CHECK_EQ(replay.service(), 3);
+	CHECK_EQ(mailboxFrames, 1);
+	CHECK_EQ(listener.frames, 1);
+	CHECK_EQ(listener.lastMailbox, second);
+	CHECK_EQ(bus.available(), 1); //0x300 matches no filter, nobody took it
+	bus.detachObj(&listener);
+}
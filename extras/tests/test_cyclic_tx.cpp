@@ -0,0 +1,180 @@
+#include "can_test.h"
+#include <can_cyclic_tx.h>
+#include <loopback_can.h>
+
+static CAN_FRAME makeFrame(uint32_t id)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.length = 2;
+	frame.data.value = 0;
+	return frame;
+}
+
+//Time only moves when a test says so, for as long as it is in scope
+struct FakeClock
+{
+	FakeClock() { hostUseFakeClock(true); }
+	~FakeClock() { hostUseFakeClock(false); }
+};
+
+//One service() call per tick. Returns the most messages that came due in a single call.
+static int runTicks(CANCyclicTx &cyclic, int ticks)
+{
+	int worst = 0;
+	for (int i = 0; i < ticks; i++)
+	{
+		hostAdvanceClock(CAN_CYCLIC_TICK_MICROS);
+		int fired = cyclic.service();
+		if (fired > worst) worst = fired;
+	}
+	return worst;
+}
+
+TEST(cyclic_tx, phasesAreSpreadOverThePeriod)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CANCyclicTx cyclic(bus);
+	int handles[10];
+	for (int i = 0; i < 10; i++) handles[i] = cyclic.add(makeFrame(0x100 + i), 10);
+	CHECK_EQ(runTicks(cyclic, 50), 1);
+	for (int i = 0; i < 10; i++)
+	{
+		CHECK(handles[i] >= 0);
+		CHECK_EQ(cyclic.getSent(handles[i]), 5);
+	}
+	//all on the same phase they go out together
+	for (int i = 0; i < 10; i++) cyclic.setPhase(handles[i], 0);
+	CHECK_EQ(runTicks(cyclic, 30), 10);
+}
+
+TEST(cyclic_tx, lateServiceDoesNotDrift)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CANCyclicTx cyclic(bus);
+	int handle = cyclic.add(makeFrame(0x200), 10);
+	uint32_t start = micros();
+	for (int round = 0; round < 100; round++)
+	{
+		hostAdvanceClock(1000 + (round % 5) * 900); //up to 3.6ms late, never a whole period
+		cyclic.service();
+	}
+	CHECK_EQ(cyclic.getSent(handle), (micros() - start) / 10000);
+	CHECK_EQ(cyclic.getMissed(handle), 0);
+}
+
+TEST(cyclic_tx, stalledServiceSendsOnce)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANCyclicTx cyclic(bus);
+	int handle = cyclic.add(makeFrame(0x210), 10); //due at 10, 20, 30 ...
+	hostAdvanceClock(55000); //five periods without a service() call
+	CHECK_EQ(cyclic.service(), 1);
+	CHECK_EQ(cyclic.getSent(handle), 1);
+	CHECK_EQ(cyclic.getMissed(handle), 4);
+	CHECK_EQ(bus.available(), 1);
+	CHECK_EQ(runTicks(cyclic, 4), 0); //the schedule carries on at 60, not from the stall
+	CHECK_EQ(runTicks(cyclic, 1), 1);
+	CHECK_EQ(cyclic.getSent(handle), 2);
+	CHECK_EQ(cyclic.getMissed(handle), 4);
+}
+
+static bool countUp(CAN_FRAME &frame, void *context)
+{
+	int *calls = (int *)context;
+	(*calls)++;
+	frame.data.bytes[0] = (uint8_t)*calls;
+	return (*calls % 2) == 1; //every other cycle is skipped
+}
+
+TEST(cyclic_tx, updateCallbackPacksInPlace)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANCyclicTx cyclic(bus);
+	int calls = 0;
+	int handle = cyclic.add(makeFrame(0x300), 5, countUp, &calls);
+	CHECK(cyclic.getFrame(handle) != NULL);
+	runTicks(cyclic, 20);
+	CHECK_EQ(calls, 4);
+	CHECK_EQ(cyclic.getSent(handle), 2);
+	CAN_FRAME got;
+	for (int i = 1; i <= calls; i += 2)
+	{
+		CHECK(bus.read(got));
+		CHECK_EQ(got.data.bytes[0], i);
+	}
+	CHECK(!bus.read(got));
+	CHECK_EQ(cyclic.getFrame(handle)->data.bytes[0], calls);
+}
+
+TEST(cyclic_tx, refusedFramesAreRetriedThenMissed)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CANCyclicTx cyclic(bus);
+	int handle = cyclic.add(makeFrame(0x400), 5);
+	bus.setListenOnlyMode(true); //the driver refuses everything
+	runTicks(cyclic, 15);
+	CHECK_EQ(cyclic.getMissed(handle), 2);
+	CHECK_EQ(cyclic.getSent(handle), 0);
+	bus.setListenOnlyMode(false);
+	cyclic.service(); //the pending one goes out on the next call
+	CHECK_EQ(cyclic.getSent(handle), 1);
+}
+
+TEST(cyclic_tx, enableSendNowAndRemove)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CANCyclicTx cyclic(bus);
+	CHECK_EQ(cyclic.add(makeFrame(0x500), 0), -1); //under a tick
+	int handle = cyclic.add(makeFrame(0x500), 5);
+	CHECK(cyclic.setEnabled(handle, false));
+	runTicks(cyclic, 20);
+	CHECK_EQ(cyclic.getSent(handle), 0);
+	CHECK(cyclic.sendNow(handle));
+	CHECK_EQ(cyclic.getSent(handle), 1);
+	CHECK(cyclic.setEnabled(handle, true));
+	runTicks(cyclic, 20);
+	CHECK_EQ(cyclic.getSent(handle), 5); //sendNow plus four periods
+	cyclic.remove(handle);
+	CHECK(!cyclic.sendNow(handle));
+	CHECK(cyclic.getFrame(handle) == NULL);
+	CHECK(!cyclic.setPeriod(handle, 10));
+}
+
+TEST(cyclic_tx, fdMessagesSendTheCallersFrame)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.beginFD(500000, 2000000);
+	bus.watchFor();
+	CANCyclicTx cyclic(bus);
+	CAN_FRAME_FD frame;
+	frame.id = 0x600;
+	frame.extended = 0;
+	frame.fdMode = 1;
+	frame.length = 16;
+	for (int i = 0; i < 16; i++) frame.data.uint8[i] = i;
+	int handle = cyclic.addFD(&frame, 5);
+	CHECK(cyclic.getFrame(handle) == NULL);
+	frame.data.uint8[15] = 0x5A; //changed after adding, still what goes out
+	runTicks(cyclic, 5);
+	CHECK_EQ(cyclic.getSent(handle), 1);
+	CAN_FRAME_FD got;
+	CHECK(bus.readFD(got));
+	CHECK_EQ(got.length, 16);
+	CHECK_EQ(got.data.uint8[15], 0x5A);
+}
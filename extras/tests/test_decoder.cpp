@@ -0,0 +1,169 @@
+#include "can_test.h"
+#include <can_decoder.h>
+#include <can_signal.h>
+#include <loopback_can.h>
+
+static const char *dbc =
+	"VERSION \"\"\n"
+	"\n"
+	"BO_ 256 Engine: 8 ECU\n"
+	" SG_ RPM : 8|16@1+ (0.25,0) [0|16383.75] \"rpm\" Dash\n"
+	" SG_ Coolant : 0|8@1+ (0.5,-40) [-40|87.5] \"C\" Dash\n"
+	" SG_ Torque : 24|12@1- (1,0) [-2048|2047] \"Nm\" Dash\n"
+	" SG_ Status : 47|12@0+ (1,0) [0|4095] \"\" Dash\n"
+	"\n"
+	"BO_ 2566844673 J1939Msg: 8 ECU\n"
+	" SG_ Mode M : 0|8@1+ (1,0) [0|255] \"\" Dash\n"
+	" SG_ Muxed m1 : 8|8@1+ (1,0) [0|255] \"\" Dash\n"
+	" SG_ Speed : 16|16@1+ (0.00390625,0) [0|250] \"km/h\" Dash\n"
+	"\n"
+	"CM_ \"comments and everything else are ignored\";\n";
+
+typedef CANSignal<8, 16, CAN_INTEL, false, 1, 4> RPM;
+typedef CANSignal<0, 8, CAN_INTEL, false, 1, 2, -40> Coolant;
+typedef CANSignal<24, 12, CAN_INTEL, true> Torque;
+typedef CANSignal<47, 12, CAN_MOTOROLA> Status;
+
+static CAN_FRAME engineFrame()
+{
+	CAN_FRAME frame;
+	frame.id = 256;
+	frame.length = 8;
+	frame.data.value = 0;
+	RPM::set(frame.data, 3000.0f);
+	Coolant::set(frame.data, 80.0f);
+	Torque::set(frame.data, -100.0f);
+	Status::set(frame.data, 0xABC);
+	return frame;
+}
+
+TEST(decoder, dbcSignalsMatchTheTemplates)
+{
+	static CANDecoder decoder;
+	decoder.clear();
+	CHECK_EQ(decoder.loadDBC(dbc), 6);
+	CHECK_EQ(decoder.signalCount(256, false), 4);
+	CHECK_EQ(decoder.signalCount(0x18FEF101, true), 2); //the multiplexed signal is skipped
+	float values[CAN_DECODER_MAX_MSG_SIGNALS];
+	CHECK_EQ(decoder.decode(engineFrame(), values), 4);
+	CHECK(values[0] == 3000.0f);
+	CHECK(values[1] == 80.0f);
+	CHECK(values[2] == -100.0f);
+	CHECK(values[3] == (float)0xABC);
+	CHECK_EQ(decoder.findSignal(256, false, "Torque"), 2);
+	CHECK_EQ(decoder.findSignal(256, false, "Nothing"), -1);
+}
+
+TEST(decoder, extendedIdsAndUnknownIds)
+{
+	static CANDecoder decoder;
+	decoder.clear();
+	decoder.loadDBC(dbc);
+	CAN_FRAME frame;
+	frame.id = 0x18FEF101;
+	frame.extended = true;
+	frame.length = 8;
+	frame.data.value = 0;
+	frame.data.bytes[0] = 5;
+	frame.data.bytes[2] = 0x00;
+	frame.data.bytes[3] = 0x19; //100 km/h
+	float values[CAN_DECODER_MAX_MSG_SIGNALS];
+	CHECK_EQ(decoder.decode(frame, values), 2);
+	CHECK(values[0] == 5.0f);
+	CHECK(values[1] == 25.0f);
+	frame.extended = false;
+	frame.id = 0x101;
+	CHECK_EQ(decoder.decode(frame, values), -1);
+}
+
+TEST(decoder, shortFrameGivesNaN)
+{
+	static CANDecoder decoder;
+	decoder.clear();
+	decoder.loadDBC(dbc);
+	CAN_FRAME frame = engineFrame();
+	frame.length = 3;
+	float values[CAN_DECODER_MAX_MSG_SIGNALS];
+	CHECK_EQ(decoder.decode(frame, values), 4);
+	CHECK(values[0] == 3000.0f);
+	CHECK(values[2] != values[2]);
+	CHECK(values[3] != values[3]);
+}
+
+TEST(decoder, badDBCIsRejected)
+{
+	static CANDecoder decoder;
+	decoder.clear();
+	CHECK_EQ(decoder.loadDBC(" SG_ Orphan : 0|8@1+ (1,0) [0|255] \"\" X\n"), -1);
+	decoder.clear();
+	CHECK_EQ(decoder.loadDBC("BO_ 100 M: 8 X\n SG_ Bad : 0-8@1+ (1,0) [0|255] \"\" X\n"), -1);
+}
+
+TEST(decoder, binaryTable)
+{
+	uint8_t table[6 + 12];
+	uint32_t id = 0x80000000ul | 0x18FEF100;
+	memcpy(table, &id, 4);
+	table[4] = 8;
+	table[5] = 1;
+	table[6] = 8;           //start bit
+	table[7] = 0;
+	table[8] = 16;          //length
+	table[9] = 0x02;        //signed Intel
+	float scale = 0.5f, offset = 1.0f;
+	memcpy(table + 10, &scale, 4);
+	memcpy(table + 14, &offset, 4);
+
+	static CANDecoder decoder;
+	decoder.clear();
+	CHECK_EQ(decoder.loadTable(table, sizeof(table)), 1);
+	CHECK_EQ(decoder.loadTable(table, sizeof(table) - 1), -1);
+
+	CAN_FRAME_FD frame;
+	frame.id = 0x18FEF100;
+	frame.extended = true;
+	frame.length = 8;
+	memset(frame.data.uint8, 0, 64);
+	frame.data.uint8[1] = 0xF6; //-10
+	frame.data.uint8[2] = 0xFF;
+	float values[CAN_DECODER_MAX_MSG_SIGNALS];
+	CHECK_EQ(decoder.decodeFD(frame, values), 1);
+	CHECK(values[0] == -4.0f);
+}
+
+class DecodedCounter : public CANDecodeListener
+{
+public:
+	DecodedCounter() : calls(0), last(0) {}
+
+	void gotDecoded(uint32_t id, bool extended, const float *values, uint8_t count)
+	{
+		calls++;
+		last = values[0];
+	}
+
+	int calls;
+	float last;
+};
+
+TEST(decoder, forwardsFramesFromTheBus)
+{
+	static CANDecoder decoder;
+	decoder.clear();
+	decoder.loadDBC(dbc);
+	DecodedCounter output;
+	CHECK(decoder.attachOutput(&output));
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	bus.attachObj(&decoder);
+	decoder.setGeneralHandler();
+	CAN_FRAME frame = engineFrame();
+	bus.sendFrame(frame);
+	frame.id = 0x555;
+	bus.sendFrame(frame);
+	CHECK_EQ(output.calls, 1);
+	CHECK(output.last == 3000.0f);
+	CHECK(decoder.detachOutput(&output));
+	bus.detachObj(&decoder);
+}
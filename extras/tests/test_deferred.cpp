@@ -0,0 +1,114 @@
+#include "can_test.h"
+#include <loopback_can.h>
+
+static int classicFrames;
+static int fdFrames;
+
+static void gotClassic(CAN_FRAME *frame)
+{
+	classicFrames++;
+}
+
+static void gotFD(CAN_FRAME_FD *frame)
+{
+	fdFrames++;
+}
+
+static void setUp(LoopbackCAN &bus)
+{
+	classicFrames = 0;
+	fdFrames = 0;
+	bus.begin(500000);
+	bus.watchFor();
+	bus.setGeneralCallback(gotClassic);
+	bus.setGeneralCallbackFD(gotFD);
+}
+
+static void sendClassic(LoopbackCAN &bus)
+{
+	CAN_FRAME frame;
+	frame.id = 0x100;
+	frame.length = 8;
+	bus.sendFrame(frame);
+}
+
+static void sendFD(LoopbackCAN &bus)
+{
+	CAN_FRAME_FD frame;
+	frame.id = 0x100;
+	frame.fdMode = 1;
+	frame.length = 64;
+	bus.sendFrameFD(frame);
+}
+
+TEST(deferred, needsABuffer)
+{
+	LoopbackCAN bus;
+	setUp(bus);
+	CHECK(!bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	CHECK(bus.getDispatchMode() == CAN_DISPATCH_IMMEDIATE);
+}
+
+TEST(deferred, callbacksWaitForPoll)
+{
+	static CANDeferredFrame ring[8];
+	LoopbackCAN bus;
+	setUp(bus);
+	CHECK(bus.setDeferredBuffer(ring, 8));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	for (int i = 0; i < 3; i++) sendClassic(bus);
+	CHECK_EQ(classicFrames, 0);
+	CHECK_EQ(bus.pendingFrames(), 3);
+	CHECK_EQ(bus.poll(2), 2);
+	CHECK_EQ(classicFrames, 2);
+	CHECK_EQ(bus.poll(), 1);
+	CHECK_EQ(bus.pendingFrames(), 0);
+}
+
+TEST(deferred, fullRingCountsDrops)
+{
+	static CANDeferredFrame ring[4];
+	LoopbackCAN bus;
+	setUp(bus);
+	CHECK(bus.setDeferredBuffer(ring, 4));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	for (int i = 0; i < 6; i++) sendClassic(bus);
+	CANStats stats;
+	bus.getStats(stats);
+	CHECK(stats.deferredDropped > 0);
+	CHECK_EQ(stats.rxDropped, 0); //the deferred ring has its own counter
+	CHECK_EQ(bus.poll(16) + stats.deferredDropped, 6);
+}
+
+TEST(deferred, fdFramesWithoutFDRingAreDispatchedNow)
+{
+	static CANDeferredFrame ring[8];
+	LoopbackCAN bus;
+	setUp(bus);
+	CHECK(bus.setDeferredBuffer(ring, 8));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	sendFD(bus);
+	CHECK_EQ(fdFrames, 1);
+	CHECK_EQ(bus.poll(), 0);
+	CANStats stats;
+	bus.getStats(stats);
+	CHECK_EQ(stats.rxDropped, 0);
+	CHECK_EQ(stats.deferredDropped, 0);
+}
+
+TEST(deferred, fdFramesUseTheirOwnRing)
+{
+	static CANDeferredFrame ring[8];
+	static CANDeferredFrameFD ringFD[4];
+	LoopbackCAN bus;
+	setUp(bus);
+	CHECK(bus.setDeferredBuffer(ring, 8));
+	CHECK(bus.setDeferredBufferFD(ringFD, 4));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	sendFD(bus);
+	sendClassic(bus);
+	CHECK_EQ(fdFrames, 0);
+	CHECK_EQ(bus.poll(), 2);
+	CHECK_EQ(fdFrames, 1);
+	CHECK_EQ(classicFrames, 1);
+}
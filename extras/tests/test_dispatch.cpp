@@ -0,0 +1,230 @@
+#include "can_test.h"
+#include <can_common.h>
+#include <can_dispatch.h>
+#include <loopback_can.h>
+
+static int hits[CAN_DISPATCH_MAX_HANDLERS + 8];
+static int hitsFD;
+static uint32_t lastId;
+
+template <int N> static void countFrame(CAN_FRAME *frame)
+{
+	hits[N]++;
+	lastId = frame->id;
+}
+
+static void countFrameFD(CAN_FRAME_FD *frame)
+{
+	hitsFD++;
+	lastId = frame->id;
+}
+
+//More distinct callbacks than the table has handler slots
+template <int N> struct FillCallbacks
+{
+	static void run(void (**cbs)(CAN_FRAME *))
+	{
+		cbs[N - 1] = countFrame<N - 1>;
+		FillCallbacks<N - 1>::run(cbs);
+	}
+};
+template <> struct FillCallbacks<0>
+{
+	static void run(void (**cbs)(CAN_FRAME *)) {}
+};
+
+static const int NUM_CALLBACKS = CAN_DISPATCH_MAX_HANDLERS + 8;
+static void (*callbacks[NUM_CALLBACKS])(CAN_FRAME *);
+
+static void reset()
+{
+	memset(hits, 0, sizeof(hits));
+	hitsFD = 0;
+	lastId = 0;
+	FillCallbacks<NUM_CALLBACKS>::run(callbacks);
+}
+
+static bool send(CANDispatchTable &table, uint32_t id, bool extended)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	return table.dispatch(frame);
+}
+
+static bool sendFD(CANDispatchTable &table, uint32_t id, bool extended)
+{
+	CAN_FRAME_FD frame;
+	frame.id = id;
+	frame.extended = extended;
+	return table.dispatchFD(frame);
+}
+
+TEST(dispatch, standardAndExtendedIds)
+{
+	reset();
+	CANDispatchTable table;
+	CHECK(table.onId(0x123, false, callbacks[0]));
+	CHECK(table.onId(0x18FEF100, true, callbacks[1]));
+	CHECK(send(table, 0x123, false));
+	CHECK(send(table, 0x18FEF100, true));
+	CHECK(!send(table, 0x124, false));
+	CHECK(!send(table, 0x123, true));
+	CHECK_EQ(hits[0], 1);
+	CHECK_EQ(hits[1], 1);
+	CHECK(!table.onId(0x800, false, callbacks[0]));
+}
+
+TEST(dispatch, rangesAndRemoval)
+{
+	reset();
+	CANDispatchTable table;
+	CHECK(table.onRange(0x100, 0x10F, false, callbacks[0]));
+	CHECK(table.onRange(0x18DA0000, 0x18DAFFFF, true, callbacks[1]));
+	CHECK(table.onId(0x18DA00F1, true, callbacks[2]));
+	CHECK(send(table, 0x105, false));
+	CHECK(send(table, 0x18DA1234, true));
+	CHECK(send(table, 0x18DA00F1, true));
+	CHECK_EQ(hits[0], 1);
+	CHECK_EQ(hits[1], 1);
+	CHECK_EQ(hits[2], 1); //a single ID wins over a range covering it
+	table.removeRange(0x100, 0x10F, false);
+	table.removeRange(0x18DA0000, 0x18DAFFFF, true);
+	CHECK(!send(table, 0x105, false));
+	CHECK(!send(table, 0x18DA1234, true));
+	CHECK(send(table, 0x18DA00F1, true));
+}
+
+TEST(dispatch, classicAndFDHalvesAreIndependent)
+{
+	reset();
+	CANDispatchTable table;
+	CHECK(table.onId(0x200, false, callbacks[0]));
+	CHECK(table.onIdFD(0x200, false, countFrameFD));
+	CHECK(send(table, 0x200, false));
+	CHECK(sendFD(table, 0x200, false));
+	CHECK(table.onIdFD(0x200, false, NULL));
+	CHECK(send(table, 0x200, false));
+	CHECK(!sendFD(table, 0x200, false));
+	CHECK_EQ(hits[0], 2);
+	CHECK_EQ(hitsFD, 1);
+}
+
+TEST(dispatch, removedHandlersFreeTheirSlots)
+{
+	reset();
+	CANDispatchTable table;
+	for (int round = 0; round < NUM_CALLBACKS; round++)
+	{
+		CHECK(table.onId(0x100, false, callbacks[round]));
+		CHECK(send(table, 0x100, false));
+		table.removeId(0x100, false);
+	}
+	CHECK(table.onId(0x100, false, callbacks[0]));
+	for (int i = 0; i < NUM_CALLBACKS; i++) CHECK_EQ(hits[i], 1);
+}
+
+TEST(dispatch, replacedHandlersFreeTheirSlots)
+{
+	reset();
+	CANDispatchTable table;
+	for (int round = 0; round < NUM_CALLBACKS; round++)
+	{
+		CHECK(table.onId(0x18FF0000, true, callbacks[round]));
+		CHECK(table.onIdFD(0x18FF0000, true, countFrameFD));
+		CHECK(table.onIdFD(0x18FF0000, true, NULL));
+	}
+	CHECK(send(table, 0x18FF0000, true));
+	CHECK_EQ(hits[NUM_CALLBACKS - 1], 1);
+}
+
+TEST(dispatch, fullTableRefusesWithoutChangingAnything)
+{
+	reset();
+	CANDispatchTable table;
+	for (int i = 0; i < CAN_DISPATCH_MAX_HANDLERS; i++) CHECK(table.onId(i, false, callbacks[i]));
+	//a new pair on an ID that shares nothing can't get a slot
+	CHECK(table.onId(0x500, false, callbacks[0]));
+	CHECK(!table.onIdFD(0x500, false, countFrameFD));
+	CHECK(send(table, 0x500, false));
+	CHECK(!sendFD(table, 0x500, false));
+	//but replacing the only user of a slot reuses it
+	CHECK(table.onId(5, false, callbacks[CAN_DISPATCH_MAX_HANDLERS]));
+	CHECK(send(table, 5, false));
+	CHECK_EQ(hits[CAN_DISPATCH_MAX_HANDLERS], 1);
+	CHECK_EQ(hits[5], 0);
+}
+
+//Removals shift later entries back, every ID left must still be found and every removed one missed
+TEST(dispatch, extendedChurnKeepsLookupsRight)
+{
+	reset();
+	CANDispatchTable table;
+	static const int COUNT = 300;
+	static uint32_t ids[COUNT];
+	static bool present[COUNT];
+	uint32_t seed = 12345;
+	for (int i = 0; i < COUNT; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		ids[i] = 0x18000000 | ((uint32_t)i << 12) | ((seed >> 8) & 0xFFF); //i in the middle keeps them apart
+		present[i] = false;
+	}
+	bool allRight = true;
+	for (int round = 0; round < 40 && allRight; round++)
+	{
+		for (int i = 0; i < COUNT; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			bool want = ((seed >> 16) % 3) != 0;
+			if (want && !present[i]) allRight &= table.onId(ids[i], true, callbacks[i % CAN_DISPATCH_MAX_HANDLERS]);
+			else if (!want && present[i]) table.removeId(ids[i], true);
+			present[i] = want;
+		}
+		for (int i = 0; i < COUNT; i++)
+		{
+			if (send(table, ids[i], true) != present[i]) allRight = false;
+		}
+	}
+	CHECK(allRight);
+	for (int i = 0; i < COUNT; i++) table.removeId(ids[i], true);
+	for (int i = 0; i < COUNT; i++) CHECK(!send(table, ids[i], true));
+}
+
+class CountingListener : public CANListener
+{
+public:
+	CountingListener() : frames(0) {}
+	void gotFrame(CAN_FRAME *frame, int mailbox) { frames++; }
+	int frames;
+};
+
+//The ID table goes first and a frame it takes goes nowhere else
+TEST(dispatch, idTableTakesPrecedence)
+{
+	reset();
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CountingListener listener;
+	bus.attachObj(&listener);
+	listener.setGeneralHandler();
+	CHECK(bus.onId(0x123, false, callbacks[0]));
+	CHECK(bus.onIdFD(0x124, false, countFrameFD));
+	CAN_FRAME frame;
+	frame.id = 0x123;
+	frame.length = 1;
+	bus.sendFrame(frame);
+	CHECK_EQ(hits[0], 1);
+	CHECK_EQ(listener.frames, 0);
+	frame.id = 0x124; //only an FD callback, the classic frame carries on
+	bus.sendFrame(frame);
+	CHECK_EQ(hitsFD, 0);
+	CHECK_EQ(listener.frames, 1);
+	bus.removeId(0x123, false);
+	frame.id = 0x123;
+	bus.sendFrame(frame);
+	CHECK_EQ(hits[0], 1);
+	CHECK_EQ(listener.frames, 2);
+	bus.detachObj(&listener);
+}
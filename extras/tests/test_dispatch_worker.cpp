@@ -0,0 +1,98 @@
+#include "can_test.h"
+#include <dispatch_worker.h>
+#include <loopback_can.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+class CountingListener : public CANListener
+{
+public:
+	CountingListener() : frames(0) {}
+
+	void gotFrame(CAN_FRAME *frame, int mailbox)
+	{
+		frames++;
+	}
+
+	std::atomic<int> frames;
+};
+
+static std::atomic<int> generalFrames;
+
+static void countGeneral(CAN_FRAME *frame)
+{
+	generalFrames++;
+}
+
+static bool waitForIdle(LoopbackCAN &bus)
+{
+	for (int i = 0; i < 2000 && bus.pendingFrames(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return bus.pendingFrames() == 0;
+}
+
+TEST(dispatch_worker, handlesQueuedFrames)
+{
+	static CANDeferredFrame ring[64];
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	generalFrames = 0;
+	bus.setGeneralCallback(countGeneral);
+	CHECK(bus.setDeferredBuffer(ring, 64));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	CANDispatchWorker worker(bus, 8);
+	worker.start();
+	CHECK(worker.isRunning());
+	CAN_FRAME frame;
+	frame.id = 0x100;
+	for (int i = 0; i < 200; i++)
+	{
+		while (bus.pendingFrames() > 32) std::this_thread::yield();
+		CHECK(bus.sendFrame(frame));
+	}
+	CHECK(waitForIdle(bus));
+	worker.stop();
+	CHECK(!worker.isRunning());
+	CHECK_EQ(worker.framesHandled(), 200);
+	CHECK_EQ(generalFrames.load(), 200);
+}
+
+//Listeners come and go on this thread while the worker dispatches. Meant to be run under TSan / ASan too.
+TEST(dispatch_worker, listenerChangesWhileRunning)
+{
+	static CANDeferredFrame ring[256];
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CHECK(bus.setDeferredBuffer(ring, 256));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	CountingListener steady, churn[4];
+	bus.attachObj(&steady);
+	steady.setGeneralHandler();
+	CANDispatchWorker worker(bus, 4, 200, 10);
+	worker.start();
+
+	CAN_FRAME frame;
+	frame.id = 0x123;
+	int sent = 0;
+	for (int round = 0; round < 300; round++)
+	{
+		CountingListener &l = churn[round & 3];
+		bus.attachObj(&l);
+		l.setGeneralHandler();
+		for (int i = 0; i < 4; i++)
+		{
+			if (bus.sendFrame(frame)) sent++;
+		}
+		if (round & 1) l.removeGeneralHandler();
+		bus.detachObj(&l);
+	}
+	CHECK(waitForIdle(bus));
+	worker.stop();
+	CANStats stats;
+	bus.getStats(stats);
+	CHECK_EQ(steady.frames.load() + stats.deferredDropped + stats.rxDropped, sent);
+	CHECK_EQ(bus.getListenerCount(), 1);
+}
@@ -0,0 +1,111 @@
+#include "can_test.h"
+#include <can_filter_plan.h>
+#include <loopback_can.h>
+
+static bool admits(const CANFilter *filters, int count, uint32_t id, bool extended)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (filters[i].extended == extended && (id & filters[i].mask) == filters[i].id) return true;
+	}
+	return false;
+}
+
+static uint32_t totalAdmitted(const CANFilter *filters, int count)
+{
+	uint32_t total = 0;
+	for (int i = 0; i < count; i++) total += CANFilterPlanner::admittedCount(filters[i]);
+	return total;
+}
+
+TEST(filter_plan, alignedRangeIsOneFilter)
+{
+	CANFilterPlanner planner;
+	CHECK(planner.addRange(0x100, 0x10F));
+	CANFilter filters[4];
+	CHECK_EQ(planner.plan(filters, 4), 1);
+	CHECK_EQ(filters[0].id, 0x100);
+	CHECK_EQ(filters[0].mask, 0x7F0);
+	CHECK(!filters[0].extended);
+}
+
+TEST(filter_plan, unalignedRangeIsExactWhenThereIsRoom)
+{
+	CANFilterPlanner planner;
+	CHECK(planner.addRange(0x101, 0x106));
+	CANFilter filters[8];
+	int n = planner.plan(filters, 8);
+	CHECK_EQ(n, 4); //0x101, 0x102-0x103, 0x104-0x105, 0x106
+	CHECK_EQ(totalAdmitted(filters, n), 6);
+	for (uint32_t id = 0x0FF; id <= 0x108; id++) CHECK(admits(filters, n, id, false) == (id >= 0x101 && id <= 0x106));
+}
+
+TEST(filter_plan, mergingKeepsEveryWantedId)
+{
+	static const uint32_t ids[] = { 0x100, 0x101, 0x123, 0x200, 0x201, 0x2F0, 0x700, 0x7FF };
+	CANFilterPlanner planner;
+	for (unsigned i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) CHECK(planner.addId(ids[i]));
+	CANFilter filters[3];
+	int n = planner.plan(filters, 3);
+	CHECK(n > 0 && n <= 3);
+	for (unsigned i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) CHECK(admits(filters, n, ids[i], false));
+	//0x100 and 0x101 differ in one bit, merging them costs nothing
+	CANFilterPlanner pair;
+	pair.addId(0x100);
+	pair.addId(0x101);
+	CHECK_EQ(pair.plan(filters, 1), 1);
+	CHECK_EQ(CANFilterPlanner::admittedCount(filters[0]), 2);
+}
+
+TEST(filter_plan, duplicatesCollapse)
+{
+	CANFilterPlanner planner;
+	planner.addRange(0x18DA0000, 0x18DAFFFF);
+	planner.addId(0x18DA10F1);
+	planner.addId(0x18DA10F1, true);
+	CANFilter filters[1];
+	CHECK_EQ(planner.plan(filters, 1), 1);
+	CHECK(filters[0].extended);
+	CHECK_EQ(CANFilterPlanner::admittedCount(filters[0]), 0x10000);
+}
+
+TEST(filter_plan, standardAndExtendedNeedTwoFilters)
+{
+	CANFilterPlanner planner;
+	planner.addId(0x100);
+	planner.addId(0x18FEF100);
+	CANFilter filters[2];
+	CHECK_EQ(planner.plan(filters, 1), -1);
+	CHECK_EQ(planner.plan(filters, 2), 2);
+	CHECK(!planner.addId(0x800, false));
+	CHECK(!planner.addRange(0x700, 0x900, false));
+}
+
+TEST(filter_plan, maskedPattern)
+{
+	//PGN 0xFEF1 from any source at any priority
+	CANFilterPlanner planner;
+	CHECK(planner.addMasked(0x00FEF100, 0x00FFFF00, true));
+	CANFilter filters[1];
+	CHECK_EQ(planner.plan(filters, 1), 1);
+	CHECK(admits(filters, 1, 0x18FEF117, true));
+	CHECK(admits(filters, 1, 0x0CFEF100, true));
+	CHECK(!admits(filters, 1, 0x18FEF200, true));
+}
+
+TEST(filter_plan, applyProgramsTheBus)
+{
+	LoopbackCAN bus(4);
+	bus.begin(500000);
+	CANFilterPlanner planner;
+	planner.addRange(0x100, 0x107);
+	planner.addId(0x300);
+	CHECK_EQ(planner.apply(bus, 4), 2);
+	CAN_FRAME frame;
+	for (uint32_t id = 0xFE; id < 0x302; id++)
+	{
+		frame.id = id;
+		bus.sendFrame(frame);
+	}
+	CHECK_EQ(bus.available(), 9);
+}
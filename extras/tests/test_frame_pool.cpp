@@ -0,0 +1,128 @@
+#include "can_test.h"
+#include <can_frame_pool.h>
+#include <thread>
+#include <utility>
+
+TEST(frame_pool, allocUntilExhausted)
+{
+	CANFramePool<CAN_FRAME, 4> pool;
+	CHECK_EQ(pool.capacity(), 4);
+	CHECK_EQ(pool.available(), 4);
+	CANFrameRef<CAN_FRAME> refs[4];
+	for (int i = 0; i < 4; i++)
+	{
+		refs[i] = pool.alloc();
+		CHECK(refs[i]);
+		refs[i]->id = 0x100 + i;
+	}
+	CHECK_EQ(pool.available(), 0);
+	CHECK(!pool.alloc());
+	CHECK(!pool.make(*refs[0]));
+	CHECK_EQ(pool.getFailures(), 2);
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = i + 1; j < 4; j++) CHECK(refs[i].get() != refs[j].get());
+		CHECK_EQ(refs[i]->id, 0x100 + i);
+	}
+	refs[2].reset();
+	CHECK_EQ(pool.available(), 1);
+	CANFrameRef<CAN_FRAME> again = pool.alloc();
+	CHECK(again);
+	CHECK_EQ(again->id, 0x102); //contents are whatever the last user left
+	CHECK_EQ(pool.getFailures(), 2);
+}
+
+TEST(frame_pool, copyAndMoveCountReferences)
+{
+	CANFramePool<CAN_FRAME_FD, 2> pool;
+	CANFrameRef<CAN_FRAME_FD> first = pool.alloc();
+	CHECK_EQ(first.useCount(), 1);
+	CANFrameRef<CAN_FRAME_FD> copy(first);
+	CHECK_EQ(first.useCount(), 2);
+	CHECK(copy.get() == first.get());
+	CANFrameRef<CAN_FRAME_FD> moved(std::move(copy));
+	CHECK(!copy);
+	CHECK_EQ(copy.useCount(), 0);
+	CHECK_EQ(moved.useCount(), 2);
+	CANFrameRef<CAN_FRAME_FD> assigned;
+	assigned = moved;
+	CHECK_EQ(first.useCount(), 3);
+	assigned = CANFrameRef<CAN_FRAME_FD>(); //assigning an empty handle lets go
+	CHECK_EQ(first.useCount(), 2);
+	CHECK_EQ(pool.available(), 1);
+}
+
+TEST(frame_pool, lastResetReturnsTheFrame)
+{
+	CANFramePool<CAN_FRAME, 2> pool;
+	CANFrameRef<CAN_FRAME> a = pool.alloc();
+	CANFrameRef<CAN_FRAME> b = a;
+	CHECK_EQ(pool.available(), 1);
+	a.reset();
+	CHECK(!a);
+	CHECK_EQ(pool.available(), 1);
+	CHECK_EQ(b.useCount(), 1);
+	b.reset();
+	CHECK_EQ(pool.available(), 2);
+	{
+		CANFrameRef<CAN_FRAME> scoped = pool.alloc();
+		CHECK_EQ(pool.available(), 1);
+	}
+	CHECK_EQ(pool.available(), 2); //the destructor counts as the last reset
+}
+
+TEST(frame_pool, retainRejectsForeignAndFreeFrames)
+{
+	CANFramePool<CAN_FRAME, 2> pool, other;
+	CANFrameRef<CAN_FRAME> held = pool.alloc();
+	CANFrameRef<CAN_FRAME> kept = pool.retain(held.get());
+	CHECK(kept);
+	CHECK_EQ(held.useCount(), 2);
+
+	CANFrameRef<CAN_FRAME> foreign = other.alloc();
+	CHECK(!pool.retain(foreign.get()));
+	CHECK(!pool.retain((CAN_FRAME *)((uint8_t *)held.get() + 4))); //inside a node but not its start
+
+	CANFrameRef<CAN_FRAME> freed = pool.alloc();
+	CAN_FRAME *raw = freed.get();
+	freed.reset();
+	CHECK(!pool.retain(raw));
+	CHECK_EQ(pool.available(), 1);
+}
+
+//Two threads hammer alloc and release. Nothing may be handed out twice or lost.
+TEST(frame_pool, twoThreadStress)
+{
+	static CANFramePool<CAN_FRAME, 8> pool;
+	static const int ROUNDS = 200000;
+	int clashes[2] = { 0, 0 };
+	std::thread workers[2];
+	for (int t = 0; t < 2; t++)
+	{
+		workers[t] = std::thread([t, &clashes]() {
+			for (int i = 0; i < ROUNDS; i++)
+			{
+				CANFrameRef<CAN_FRAME> a = pool.alloc();
+				CANFrameRef<CAN_FRAME> b = pool.alloc();
+				//each thread holds at most 2 of 8, so both always succeed
+				if (!a || !b)
+				{
+					clashes[t]++;
+					continue;
+				}
+				a->id = (uint32_t)(t << 24 | i);
+				b->id = (uint32_t)(t << 24 | i) ^ 0x800000;
+				CANFrameRef<CAN_FRAME> copy = a;
+				if (a->id != (uint32_t)(t << 24 | i) || b->id != ((uint32_t)(t << 24 | i) ^ 0x800000) || copy.useCount() != 2) clashes[t]++;
+			}
+		});
+	}
+	for (int t = 0; t < 2; t++) workers[t].join();
+	CHECK_EQ(clashes[0] + clashes[1], 0);
+	CHECK_EQ(pool.available(), 8);
+	CHECK_EQ(pool.getFailures(), 0);
+	CANFrameRef<CAN_FRAME> all[8];
+	for (int i = 0; i < 8; i++) all[i] = pool.alloc();
+	for (int i = 0; i < 8; i++) CHECK(all[i]);
+	CHECK(!pool.alloc());
+}
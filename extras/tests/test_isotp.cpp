@@ -0,0 +1,274 @@
+#include "can_test.h"
+#include <can_isotp.h>
+#include <loopback_can.h>
+
+#include <string.h>
+
+//What one end saw: the last message received, send results and receive errors
+struct IsoTpLog
+{
+	IsoTpLog() : received(0), length(0), sendDone(0), sendResult(ISOTP_OK), rxErrors(0), rxError(ISOTP_OK) {}
+
+	int received;
+	uint32_t length;
+	uint8_t data[5000];
+	int sendDone;
+	CANIsoTpResult sendResult;
+	int rxErrors;
+	CANIsoTpResult rxError;
+};
+
+static void logReceived(uint8_t session, const uint8_t *data, uint32_t length, void *context)
+{
+	IsoTpLog *log = (IsoTpLog *)context;
+	log->received++;
+	log->length = length;
+	memcpy(log->data, data, length < sizeof(log->data) ? length : sizeof(log->data));
+}
+
+static void logSendDone(uint8_t session, CANIsoTpResult result, void *context)
+{
+	IsoTpLog *log = (IsoTpLog *)context;
+	log->sendDone++;
+	log->sendResult = result;
+}
+
+static void logRxError(uint8_t session, CANIsoTpResult result, void *context)
+{
+	IsoTpLog *log = (IsoTpLog *)context;
+	log->rxErrors++;
+	log->rxError = result;
+}
+
+//Two nodes on connected loopback buses, a tester on 0x7E0 talking to an ECU on 0x7E8. The loopback
+//delivers inside sendFrame so both use deferred dispatch, the engine wants frames handled next to service().
+//With STmin 0 a whole message lands in the ring before the other end polls so the rings are big.
+struct IsoTpPair
+{
+	IsoTpPair(uint8_t txDL = 8) : tester(testerBus), ecu(ecuBus)
+	{
+		testerBus.begin(500000);
+		ecuBus.begin(500000);
+		testerBus.connect(&ecuBus);
+		ecuBus.connect(&testerBus);
+		testerBus.watchFor();
+		ecuBus.watchFor();
+		testerBus.setDeferredBuffer(testerRing, RING);
+		ecuBus.setDeferredBuffer(ecuRing, RING);
+		testerBus.setDeferredBufferFD(testerRingFD, RING_FD);
+		ecuBus.setDeferredBufferFD(ecuRingFD, RING_FD);
+		testerBus.setDispatchMode(CAN_DISPATCH_DEFERRED);
+		ecuBus.setDispatchMode(CAN_DISPATCH_DEFERRED);
+		testerBus.attachObj(&tester);
+		ecuBus.attachObj(&ecu);
+		tester.setGeneralHandler();
+		ecu.setGeneralHandler();
+		testerSession = tester.addSession(0x7E0, 0x7E8, false, txDL);
+		ecuSession = ecu.addSession(0x7E8, 0x7E0, false, txDL);
+		tester.onSendDone(logSendDone, &testerLog);
+		tester.onReceiveError(logRxError, &testerLog);
+		ecu.onReceive(logReceived, &ecuLog);
+		ecu.onReceiveError(logRxError, &ecuLog);
+		ecu.setRxBuffer(ecuSession, rxBuffer, sizeof(rxBuffer));
+	}
+
+	~IsoTpPair()
+	{
+		testerBus.detachObj(&tester);
+		ecuBus.detachObj(&ecu);
+	}
+
+	//one pass of each node's main loop
+	void run()
+	{
+		testerBus.poll(RING);
+		tester.service();
+		ecuBus.poll(RING);
+		ecu.service();
+	}
+
+	//run both ends until the tester is done sending or the time runs out
+	bool finish(uint32_t timeoutMillis = 1000)
+	{
+		uint32_t start = millis();
+		while (tester.isSending(testerSession) && (uint32_t)(millis() - start) < timeoutMillis) run();
+		run(); //whatever the last frame set off at the other end
+		return !tester.isSending(testerSession);
+	}
+
+	static const uint16_t RING = 1024;
+	static const uint16_t RING_FD = 64;
+
+	LoopbackCAN testerBus, ecuBus;
+	CANDeferredFrame testerRing[RING], ecuRing[RING];
+	CANDeferredFrameFD testerRingFD[RING_FD], ecuRingFD[RING_FD];
+	CANIsoTp tester, ecu;
+	int testerSession, ecuSession;
+	IsoTpLog testerLog, ecuLog;
+	uint8_t rxBuffer[4096];
+};
+
+static void fillPattern(uint8_t *data, uint32_t length)
+{
+	for (uint32_t i = 0; i < length; i++) data[i] = (uint8_t)(i * 7 + (i >> 8));
+}
+
+TEST(isotp, singleFrameIsDoneImmediately)
+{
+	IsoTpPair pair;
+	CHECK(pair.testerSession >= 0);
+	const uint8_t request[3] = { 0x22, 0xF1, 0x90 };
+	CHECK(pair.tester.send(pair.testerSession, request, 3));
+	CHECK(!pair.tester.isSending(pair.testerSession));
+	CHECK_EQ(pair.testerLog.sendDone, 1);
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OK);
+	pair.run();
+	CHECK_EQ(pair.ecuLog.received, 1);
+	CHECK_EQ(pair.ecuLog.length, 3);
+	CHECK_EQ(pair.ecuLog.data[2], 0x90);
+	CHECK(!pair.tester.send(pair.testerSession, request, 0));
+}
+
+TEST(isotp, multiFrameWithFlowControl)
+{
+	IsoTpPair pair;
+	static uint8_t message[1000];
+	fillPattern(message, sizeof(message));
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(pair.finish());
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OK);
+	CHECK_EQ(pair.ecuLog.received, 1);
+	CHECK_EQ(pair.ecuLog.length, sizeof(message));
+	CHECK(memcmp(pair.ecuLog.data, message, sizeof(message)) == 0);
+	CHECK_EQ(pair.ecuLog.rxErrors, 0);
+}
+
+TEST(isotp, blockSizeAndSTminPaceTheSender)
+{
+	IsoTpPair pair;
+	pair.ecu.setFlowControl(pair.ecuSession, 4, 0xF5); //4 frames per block, 500us apart
+	static uint8_t message[200];
+	fillPattern(message, sizeof(message));
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	pair.run();
+	CHECK(pair.tester.isSending(pair.testerSession));
+	CHECK(pair.ecu.isReceiving(pair.ecuSession));
+	CHECK(pair.finish());
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OK);
+	CHECK_EQ(pair.ecuLog.length, sizeof(message));
+	CHECK(memcmp(pair.ecuLog.data, message, sizeof(message)) == 0);
+	CHECK(CANIsoTp::stMinToMicros(0xF5) == 500);
+	CHECK(CANIsoTp::stMinToMicros(20) == 20000);
+	CHECK(CANIsoTp::stMinToMicros(0x80) == 127000);
+}
+
+TEST(isotp, escapeLengthForLongMessages)
+{
+	IsoTpPair pair;
+	static uint8_t message[4500];
+	static uint8_t pool[2 * 5000];
+	fillPattern(message, sizeof(message));
+	pair.ecu.setRxBuffer(pair.ecuSession, NULL, 0);
+	CHECK(pair.ecu.setPool(pool, 5000, 2));
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(pair.finish());
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OK);
+	CHECK_EQ(pair.ecuLog.length, sizeof(message));
+	CHECK(memcmp(pair.ecuLog.data, message, sizeof(message)) == 0);
+}
+
+TEST(isotp, receiverOverflow)
+{
+	IsoTpPair pair;
+	static uint8_t small[16];
+	pair.ecu.setRxBuffer(pair.ecuSession, small, sizeof(small));
+	static uint8_t message[100];
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(pair.finish());
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OVERFLOW);
+	CHECK_EQ(pair.ecuLog.rxErrors, 1);
+	CHECK_EQ(pair.ecuLog.rxError, ISOTP_OVERFLOW);
+	CHECK_EQ(pair.ecuLog.received, 0);
+}
+
+TEST(isotp, noFlowControlTimesOut)
+{
+	IsoTpPair pair;
+	pair.tester.setTimeouts(20, 20);
+	pair.ecuBus.detachObj(&pair.ecu); //nobody answers
+	static uint8_t message[50];
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(pair.tester.isSending(pair.testerSession));
+	pair.tester.service();
+	CHECK(pair.tester.isSending(pair.testerSession)); //not yet
+	CHECK(pair.finish(500));
+	CHECK_EQ(pair.testerLog.sendDone, 1);
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_TIMEOUT_BS);
+}
+
+TEST(isotp, missingConsecutiveFrameTimesOut)
+{
+	IsoTpPair pair;
+	pair.ecu.setTimeouts(20, 20);
+	CAN_FRAME first;
+	first.id = 0x7E0;
+	first.length = 8;
+	first.data.uint8[0] = 0x10;
+	first.data.uint8[1] = 20;
+	memset(first.data.uint8 + 2, 0xAA, 6);
+	pair.testerBus.sendFrame(first); //straight on the bus, the tester's engine never sends the rest
+	pair.run();
+	CHECK(pair.ecu.isReceiving(pair.ecuSession));
+	uint32_t start = millis();
+	while (pair.ecu.isReceiving(pair.ecuSession) && (uint32_t)(millis() - start) < 500) pair.run();
+	CHECK(!pair.ecu.isReceiving(pair.ecuSession));
+	CHECK_EQ(pair.ecuLog.rxError, ISOTP_TIMEOUT_CR);
+	CHECK_EQ(pair.ecuLog.received, 0);
+}
+
+TEST(isotp, wrongSequenceNumberFailsTheReception)
+{
+	IsoTpPair pair;
+	CAN_FRAME frame;
+	frame.id = 0x7E0;
+	frame.length = 8;
+	frame.data.uint8[0] = 0x10;
+	frame.data.uint8[1] = 20;
+	pair.testerBus.sendFrame(frame);
+	frame.data.uint8[0] = 0x22; //should be 0x21
+	pair.testerBus.sendFrame(frame);
+	pair.run();
+	CHECK(!pair.ecu.isReceiving(pair.ecuSession));
+	CHECK_EQ(pair.ecuLog.rxError, ISOTP_WRONG_SN);
+}
+
+TEST(isotp, abortReportsToTheSender)
+{
+	IsoTpPair pair;
+	pair.ecuBus.detachObj(&pair.ecu);
+	static uint8_t message[50];
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(!pair.tester.send(pair.testerSession, message, sizeof(message))); //busy
+	pair.tester.abort(pair.testerSession);
+	CHECK(!pair.tester.isSending(pair.testerSession));
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_ABORTED);
+}
+
+TEST(isotp, fdFramesCarryMoreData)
+{
+	IsoTpPair pair(64);
+	pair.testerBus.beginFD(500000, 2000000);
+	pair.ecuBus.beginFD(500000, 2000000);
+	static uint8_t message[600];
+	fillPattern(message, sizeof(message));
+	CHECK(pair.tester.send(pair.testerSession, message, 60)); //FD single frame
+	pair.run();
+	CHECK_EQ(pair.ecuLog.received, 1);
+	CHECK_EQ(pair.ecuLog.length, 60);
+	CHECK(pair.tester.send(pair.testerSession, message, sizeof(message)));
+	CHECK(pair.finish());
+	CHECK_EQ(pair.testerLog.sendResult, ISOTP_OK);
+	CHECK_EQ(pair.ecuLog.received, 2);
+	CHECK_EQ(pair.ecuLog.length, sizeof(message));
+	CHECK(memcmp(pair.ecuLog.data, message, sizeof(message)) == 0);
+}
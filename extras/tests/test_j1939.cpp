@@ -0,0 +1,290 @@
+#include "can_test.h"
+#include <can_j1939.h>
+#include <loopback_can.h>
+
+#include <string.h>
+
+//What one node saw: the last message handed to a handler, send results and receive errors
+struct J1939Log
+{
+	J1939Log() : messages(0), pgn(0), source(0), destination(0), length(0), sendDone(0), sendResult(J1939_OK), rxErrors(0), rxError(J1939_OK) {}
+
+	int messages;
+	uint32_t pgn;
+	uint8_t source;
+	uint8_t destination;
+	uint16_t length;
+	uint8_t data[J1939_MAX_LENGTH];
+	int sendDone;
+	CANJ1939Result sendResult;
+	int rxErrors;
+	CANJ1939Result rxError;
+};
+
+static void logMessage(const CANJ1939Message &message, void *context)
+{
+	J1939Log *log = (J1939Log *)context;
+	log->messages++;
+	log->pgn = message.pgn;
+	log->source = message.source;
+	log->destination = message.destination;
+	log->length = message.length;
+	memcpy(log->data, message.data, message.length);
+}
+
+static void logSendDone(uint32_t pgn, uint8_t peer, CANJ1939Result result, void *context)
+{
+	J1939Log *log = (J1939Log *)context;
+	log->sendDone++;
+	log->sendResult = result;
+}
+
+static void logRxError(uint32_t pgn, uint8_t peer, CANJ1939Result result, void *context)
+{
+	J1939Log *log = (J1939Log *)context;
+	log->rxErrors++;
+	log->rxError = result;
+}
+
+//Two nodes on connected loopback buses. Like the ISO-TP tests they use deferred dispatch so frames
+//are handled from run() next to service() and not inside the other node's sendFrame.
+struct J1939Pair
+{
+	J1939Pair() : a(busA), b(busB)
+	{
+		busA.begin(250000);
+		busB.begin(250000);
+		busA.connect(&busB);
+		busB.connect(&busA);
+		busA.watchFor();
+		busB.watchFor();
+		busA.setDeferredBuffer(ringA, RING);
+		busB.setDeferredBuffer(ringB, RING);
+		busA.setDispatchMode(CAN_DISPATCH_DEFERRED);
+		busB.setDispatchMode(CAN_DISPATCH_DEFERRED);
+		busA.attachObj(&a);
+		busB.attachObj(&b);
+		a.setGeneralHandler();
+		b.setGeneralHandler();
+		a.onSendDone(logSendDone, &logA);
+		a.onReceiveError(logRxError, &logA);
+		b.onSendDone(logSendDone, &logB);
+		b.onReceiveError(logRxError, &logB);
+		b.setPool(pool, J1939_MAX_LENGTH, 2);
+	}
+
+	~J1939Pair()
+	{
+		busA.detachObj(&a);
+		busB.detachObj(&b);
+	}
+
+	void run()
+	{
+		busA.poll(RING);
+		a.service();
+		busB.poll(RING);
+		b.service();
+	}
+
+	//run both nodes until a's done callback has run expectedDone times or the time runs out
+	bool finishSend(int expectedDone, uint32_t timeoutMillis = 2000)
+	{
+		uint32_t start = millis();
+		while (logA.sendDone < expectedDone && (uint32_t)(millis() - start) < timeoutMillis) run();
+		run();
+		return logA.sendDone >= expectedDone;
+	}
+
+	//frame from address 0x10 straight onto the bus, past a's engine
+	void inject(uint32_t pgn, uint8_t destination, const uint8_t *data)
+	{
+		CAN_FRAME frame;
+		frame.id = CANJ1939::makeId(7, pgn, destination, 0x10);
+		frame.extended = true;
+		frame.length = 8;
+		memcpy(frame.data.uint8, data, 8);
+		busA.sendFrame(frame);
+		run();
+	}
+
+	static const uint16_t RING = 512;
+
+	LoopbackCAN busA, busB;
+	CANDeferredFrame ringA[RING], ringB[RING];
+	CANJ1939 a, b;
+	J1939Log logA, logB;
+	uint8_t pool[2 * J1939_MAX_LENGTH];
+};
+
+static void fillPattern(uint8_t *data, uint16_t length)
+{
+	for (uint16_t i = 0; i < length; i++) data[i] = (uint8_t)(i * 13 + (i >> 8));
+}
+
+TEST(j1939, idsAndPgns)
+{
+	CHECK_EQ(CANJ1939::pgnFromId(0x18FEF100), 0xFEF1);
+	CHECK_EQ(CANJ1939::pgnFromId(0x18EA2010), 0xEA00); //PDU1, destination isn't part of the PGN
+	CHECK_EQ(CANJ1939::makeId(6, 0xFEF1, 0x20, 0x00), 0x18FEF100);
+	CHECK_EQ(CANJ1939::makeId(6, 0xEA00, 0x20, 0x10), 0x18EA2010);
+}
+
+TEST(j1939, singleFrameGoesToExactAndAnySource)
+{
+	J1939Pair pair;
+	J1939Log exact, any, other;
+	CHECK(pair.b.subscribe(0xFEF1, logMessage, &exact, 0x10));
+	CHECK(pair.b.subscribe(0xFEF1, logMessage, &any));
+	CHECK(pair.b.subscribe(0xFEF1, logMessage, &other, 0x11));
+	pair.a.setAddress(0x10);
+	pair.b.setAddress(0x20);
+	const uint8_t data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	CHECK(pair.a.send(0xFEF1, 6, 0x20, data, 8));
+	CHECK_EQ(pair.logA.sendDone, 1);
+	pair.run();
+	CHECK_EQ(exact.messages, 1);
+	CHECK_EQ(any.messages, 1);
+	CHECK_EQ(other.messages, 0);
+	CHECK_EQ(any.destination, J1939_GLOBAL); //PDU2 is always global
+	CHECK_EQ(any.data[7], 8);
+	pair.b.unsubscribe(0xFEF1, 0x10);
+	CHECK(pair.a.send(0xFEF1, 6, J1939_GLOBAL, data, 8));
+	pair.run();
+	CHECK_EQ(exact.messages, 1);
+	CHECK_EQ(any.messages, 2);
+}
+
+TEST(j1939, pdu1ForOtherNodesIsDropped)
+{
+	J1939Pair pair;
+	J1939Log log;
+	pair.b.subscribe(0xEF00, logMessage, &log);
+	pair.a.setAddress(0x10);
+	pair.b.setAddress(0x20);
+	const uint8_t data[4] = { 9, 9, 9, 9 };
+	pair.a.send(0xEF00, 6, 0x30, data, 4);
+	pair.run();
+	CHECK_EQ(log.messages, 0);
+	pair.a.send(0xEF00, 6, 0x20, data, 4);
+	pair.run();
+	CHECK_EQ(log.messages, 1);
+	CHECK_EQ(log.destination, 0x20);
+	pair.b.setPromiscuous(true);
+	pair.a.send(0xEF00, 6, 0x30, data, 4);
+	pair.run();
+	CHECK_EQ(log.messages, 2);
+}
+
+TEST(j1939, broadcastAnnounceMessage)
+{
+	J1939Pair pair;
+	J1939Log log;
+	pair.b.subscribe(0xFECA, logMessage, &log);
+	pair.a.setAddress(0x10);
+	pair.b.setAddress(0x20);
+	uint8_t message[20];
+	fillPattern(message, sizeof(message));
+	CHECK(pair.a.send(0xFECA, 6, J1939_GLOBAL, message, sizeof(message)));
+	CHECK(!pair.a.send(0xFECA, 6, J1939_GLOBAL, message, sizeof(message))); //one BAM at a time
+	CHECK(pair.finishSend(1));
+	CHECK_EQ(pair.logA.sendResult, J1939_OK);
+	CHECK_EQ(log.messages, 1);
+	CHECK_EQ(log.source, 0x10);
+	CHECK_EQ(log.length, sizeof(message));
+	CHECK(memcmp(log.data, message, sizeof(message)) == 0);
+}
+
+TEST(j1939, connectionModeTransferOfTheLongestMessage)
+{
+	J1939Pair pair;
+	J1939Log log;
+	pair.b.subscribe(0xEF00, logMessage, &log);
+	pair.b.setPacketsPerCTS(16);
+	pair.a.setAddress(0x10);
+	pair.b.setAddress(0x20);
+	static uint8_t message[J1939_MAX_LENGTH];
+	fillPattern(message, sizeof(message));
+	CHECK(pair.a.send(0xEF00, 6, 0x20, message, sizeof(message)));
+	CHECK(pair.finishSend(1));
+	CHECK_EQ(pair.logA.sendResult, J1939_OK);
+	CHECK_EQ(log.messages, 1);
+	CHECK_EQ(log.destination, 0x20);
+	CHECK_EQ(log.length, J1939_MAX_LENGTH);
+	CHECK(memcmp(log.data, message, sizeof(message)) == 0);
+	CHECK_EQ(pair.logB.rxErrors, 0);
+	CHECK(!pair.a.send(0xEF00, 6, 0x20, message, J1939_MAX_LENGTH + 1));
+}
+
+TEST(j1939, receiverWithoutBuffersAborts)
+{
+	J1939Pair pair;
+	pair.b.setPool(NULL, 0, 0);
+	pair.a.setAddress(0x10);
+	pair.b.setAddress(0x20);
+	uint8_t message[30];
+	CHECK(pair.a.send(0xEF00, 6, 0x20, message, sizeof(message)));
+	CHECK(pair.finishSend(1));
+	CHECK_EQ(pair.logA.sendResult, J1939_ABORTED);
+	CHECK_EQ(pair.logB.rxErrors, 1);
+	CHECK_EQ(pair.logB.rxError, J1939_NO_RESOURCES);
+}
+
+TEST(j1939, outOfOrderPacketAbortsTheReception)
+{
+	J1939Pair pair;
+	pair.b.setAddress(0x20);
+	const uint8_t rts[8] = { 16, 20, 0, 3, 0xFF, 0x00, 0xEF, 0x00 };
+	pair.inject(J1939_PGN_TP_CM, 0x20, rts);
+	const uint8_t packet[8] = { 2, 0, 0, 0, 0, 0, 0, 0 }; //packet 1 is missing
+	pair.inject(J1939_PGN_TP_DT, 0x20, packet);
+	CHECK_EQ(pair.logB.rxErrors, 1);
+	CHECK_EQ(pair.logB.rxError, J1939_BAD_SEQUENCE);
+}
+
+TEST(j1939, senderAbortEndsTheReception)
+{
+	J1939Pair pair;
+	pair.b.setAddress(0x20);
+	const uint8_t rts[8] = { 16, 20, 0, 3, 0xFF, 0x00, 0xEF, 0x00 };
+	pair.inject(J1939_PGN_TP_CM, 0x20, rts);
+	const uint8_t abort[8] = { 255, 1, 0xFF, 0xFF, 0xFF, 0x00, 0xEF, 0x00 };
+	pair.inject(J1939_PGN_TP_CM, 0x20, abort);
+	CHECK_EQ(pair.logB.rxErrors, 1);
+	CHECK_EQ(pair.logB.rxError, J1939_ABORTED);
+}
+
+static bool waitForClaims(J1939Pair &pair)
+{
+	uint32_t start = millis();
+	while ((pair.a.getClaimState() == J1939_CLAIMING || pair.b.getClaimState() == J1939_CLAIMING) && (uint32_t)(millis() - start) < 2000) pair.run();
+	return pair.a.getClaimState() != J1939_CLAIMING && pair.b.getClaimState() != J1939_CLAIMING;
+}
+
+TEST(j1939, lowerNameKeepsTheAddress)
+{
+	J1939Pair pair;
+	const uint64_t arbitrary = 1ull << 63;
+	CHECK(pair.a.claimAddress(arbitrary | 0x2000, 0x80));
+	CHECK(pair.b.claimAddress(arbitrary | 0x1000, 0x80));
+	CHECK_EQ(pair.a.getClaimState(), J1939_CLAIMING);
+	const uint8_t data[1] = { 0 };
+	CHECK(!pair.a.send(0xFEF1, 6, J1939_GLOBAL, data, 1)); //not before the claim is through
+	CHECK(waitForClaims(pair));
+	CHECK_EQ(pair.b.getClaimState(), J1939_CLAIMED);
+	CHECK_EQ(pair.b.getAddress(), 0x80);
+	CHECK_EQ(pair.a.getClaimState(), J1939_CLAIMED);
+	CHECK_EQ(pair.a.getAddress(), 0x81);
+	CHECK(!pair.a.claimAddress(1, J1939_NULL_ADDRESS));
+}
+
+TEST(j1939, fixedAddressLoserCannotClaim)
+{
+	J1939Pair pair;
+	CHECK(pair.a.claimAddress(0x2000, 0x30));
+	CHECK(pair.b.claimAddress(0x1000, 0x30));
+	CHECK(waitForClaims(pair));
+	CHECK_EQ(pair.b.getAddress(), 0x30);
+	CHECK_EQ(pair.a.getClaimState(), J1939_CANNOT_CLAIM);
+	CHECK_EQ(pair.a.getAddress(), J1939_NULL_ADDRESS);
+}
@@ -0,0 +1,156 @@
+#include "can_test.h"
+#include <loopback_can.h>
+
+//Counts frames and optionally changes registrations from inside gotFrame
+class TestListener : public CANListener
+{
+public:
+	TestListener() : frames(0), removeOwn(false), detach(NULL), enable(NULL), bus(NULL) {}
+
+	void gotFrame(CAN_FRAME *frame, int mailbox)
+	{
+		frames++;
+		if (removeOwn) removeCallback(0);
+		if (detach) bus->detachObj(detach);
+		if (enable) enable->setCallback(0);
+	}
+
+	int frames;
+	bool removeOwn;
+	TestListener *detach;
+	TestListener *enable;
+	CAN_COMMON *bus;
+};
+
+static void sendOne(LoopbackCAN &bus)
+{
+	CAN_FRAME frame;
+	frame.id = 0x100;
+	frame.length = 1;
+	bus.sendFrame(frame);
+}
+
+TEST(listeners, removeCallbackInsideGotFrame)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CHECK_EQ(bus.watchFor(0x100), 0);
+	TestListener first, second;
+	bus.attachObj(&first);
+	bus.attachObj(&second);
+	first.setCallback(0);
+	second.setCallback(0);
+	first.removeOwn = true;
+
+	sendOne(bus);
+	CHECK_EQ(first.frames, 1);
+	CHECK_EQ(second.frames, 1);
+	sendOne(bus);
+	CHECK_EQ(first.frames, 1);
+	CHECK_EQ(second.frames, 2);
+}
+
+TEST(listeners, detachInsideGotFrame)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x100);
+	TestListener first, second;
+	bus.attachObj(&first);
+	bus.attachObj(&second);
+	first.setCallback(0);
+	second.setCallback(0);
+	first.detach = &second;
+	first.bus = &bus;
+
+	sendOne(bus);
+	CHECK_EQ(first.frames, 1);
+	CHECK_EQ(second.frames, 0);
+	CHECK_EQ(bus.getListenerCount(), 1);
+	first.detach = NULL;
+	sendOne(bus);
+	CHECK_EQ(first.frames, 2);
+	CHECK_EQ(second.frames, 0);
+}
+
+TEST(listeners, registrationInsideGotFrameTakesEffectNextFrame)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x100);
+	TestListener first, second;
+	bus.attachObj(&first);
+	bus.attachObj(&second);
+	first.setCallback(0);
+	first.enable = &second;
+
+	//immediate mode, nobody calls poll()
+	sendOne(bus);
+	CHECK_EQ(second.frames, 0);
+	sendOne(bus);
+	CHECK_EQ(first.frames, 2);
+	CHECK_EQ(second.frames, 1);
+	bus.updateListeners();
+	sendOne(bus);
+	CHECK_EQ(first.frames, 3);
+	CHECK_EQ(second.frames, 2);
+}
+
+TEST(listeners, listenerOnTwoBusesUpdatesBoth)
+{
+	LoopbackCAN busA, busB;
+	busA.begin(500000);
+	busB.begin(500000);
+	busA.watchFor(0x100);
+	busB.watchFor(0x100);
+	TestListener shared;
+	busA.attachObj(&shared);
+	busB.attachObj(&shared); //the one it calls back to
+	shared.setCallback(0);
+	sendOne(busA);
+	sendOne(busB);
+	CHECK_EQ(shared.frames, 2);
+	shared.removeCallback(0);
+	sendOne(busA);
+	sendOne(busB);
+	CHECK_EQ(shared.frames, 2);
+	busA.detachObj(&shared);
+	busB.detachObj(&shared);
+}
+
+TEST(listeners, pollCatchesUpOutsideDispatch)
+{
+	static CANDeferredFrame deferred[8];
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x100);
+	CHECK(bus.setDeferredBuffer(deferred, 8));
+	CHECK(bus.setDispatchMode(CAN_DISPATCH_DEFERRED));
+	TestListener first, second;
+	bus.attachObj(&first);
+	bus.attachObj(&second);
+	first.setCallback(0);
+	first.enable = &second;
+
+	sendOne(bus);
+	CHECK_EQ(bus.poll(), 1);
+	sendOne(bus);
+	CHECK_EQ(bus.poll(), 1);
+	CHECK_EQ(first.frames, 2);
+	CHECK_EQ(second.frames, 1);
+}
+
+TEST(listeners, generalHandlerGetsUnclaimedFrames)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x100);
+	TestListener general;
+	bus.attachObj(&general);
+	general.setGeneralHandler();
+	sendOne(bus);
+	CHECK_EQ(general.frames, 1);
+	general.removeGeneralHandler();
+	sendOne(bus);
+	CHECK_EQ(general.frames, 1);
+}
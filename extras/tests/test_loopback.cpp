@@ -0,0 +1,68 @@
+#include "can_test.h"
+#include <loopback_can.h>
+
+TEST(loopback, frameComesBackThroughFilter)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x123);
+	CAN_FRAME frame;
+	frame.id = 0x123;
+	frame.length = 2;
+	frame.data.bytes[0] = 0xAB;
+	frame.data.bytes[1] = 0xCD;
+	CHECK(bus.sendFrame(frame));
+
+	CAN_FRAME got;
+	CHECK_EQ(bus.available(), 1);
+	CHECK(bus.read(got));
+	CHECK_EQ(got.id, 0x123);
+	CHECK_EQ(got.length, 2);
+	CHECK_EQ(got.data.bytes[1], 0xCD);
+}
+
+TEST(loopback, unmatchedFrameIsRejected)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor(0x100, 0x7F0);
+	CAN_FRAME frame;
+	frame.id = 0x200;
+	bus.sendFrame(frame);
+	CHECK_EQ(bus.available(), 0);
+	CANStats stats;
+	bus.getStats(stats);
+	CHECK_EQ(stats.filterRejects, 1);
+}
+
+TEST(loopback, peersDeliverToEachOther)
+{
+	LoopbackCAN a, b;
+	a.begin(500000);
+	b.begin(500000);
+	a.connect(&b);
+	b.watchFor();
+	CAN_FRAME frame;
+	frame.id = 0x18FEF100;
+	frame.extended = true;
+	frame.length = 8;
+	frame.data.uint64 = 0x1122334455667788ull;
+	a.sendFrame(frame);
+	CAN_FRAME got;
+	CHECK(b.read(got));
+	CHECK(got.extended);
+	CHECK(got.data.uint64 == 0x1122334455667788ull);
+}
+
+TEST(loopback, busTimeAdvancesByFrameLength)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	uint64_t before = bus.getBusTimeNs();
+	CAN_FRAME frame;
+	frame.length = 8;
+	bus.sendFrame(frame);
+	//an 8 byte standard frame is at least 111 bits, 222us at 500k
+	CHECK(bus.getBusTimeNs() - before >= 222000);
+}
@@ -0,0 +1,191 @@
+#include "can_test.h"
+#include <can_packed.h>
+
+#include <string.h>
+
+static CAN_FRAME makeFrame(uint32_t id, uint8_t tag, uint8_t length = 8)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = 0;
+	frame.rtr = 0;
+	frame.timestamp = 1000 + tag;
+	frame.length = length;
+	for (int i = 0; i < 8; i++) frame.data.uint8[i] = (uint8_t)(tag + i);
+	return frame;
+}
+
+TEST(packed, classicRoundTrip)
+{
+	CAN_FRAME frame = makeFrame(0x18DAF110, 3, 5);
+	frame.extended = 1;
+	frame.rtr = 1;
+	uint8_t record[CAN_PACKED_MAX_RECORD];
+	CHECK_EQ(CANFrameView::packedSize(frame), CAN_PACKED_HEADER_SIZE + 5);
+	CHECK_EQ(CANFrameView::pack(frame, record, sizeof(record)), CAN_PACKED_HEADER_SIZE + 5);
+	CHECK_EQ(CANFrameView::pack(frame, record, CAN_PACKED_HEADER_SIZE + 4), 0); //no room, nothing written
+
+	CANFrameView view(record);
+	CHECK_EQ(view.id(), 0x18DAF110);
+	CHECK(view.extended());
+	CHECK(view.rtr());
+	CHECK(!view.fdMode());
+	CHECK_EQ(view.timestamp(), 1003);
+	CHECK_EQ(view.length(), 5);
+	CHECK_EQ(view[4], 7);
+	CHECK_EQ(view[5], 0); //past the payload reads as 0
+	CHECK_EQ(view.recordSize(), CAN_PACKED_HEADER_SIZE + 5);
+
+	CAN_FRAME back;
+	CHECK(view.toFrame(back));
+	CHECK_EQ(back.id, frame.id);
+	CHECK_EQ(back.extended, 1);
+	CHECK_EQ(back.rtr, 1);
+	CHECK_EQ(back.length, 5);
+	CHECK_EQ(back.timestamp, 1003);
+	CHECK(memcmp(back.data.uint8, frame.data.uint8, 5) == 0);
+	CHECK_EQ(back.data.uint8[5], 0);
+}
+
+TEST(packed, fdLengthsRoundUp)
+{
+	CAN_FRAME_FD frame;
+	frame.id = 0x123;
+	frame.extended = 0;
+	frame.rrs = 0;
+	frame.fdMode = 1;
+	frame.timestamp = 42;
+	for (int i = 0; i < 64; i++) frame.data.uint8[i] = (uint8_t)(0x80 + i);
+	static const uint8_t lengths[] = { 0, 8, 9, 12, 13, 21, 33, 48, 49, 64 };
+	static const uint8_t stored[] = { 0, 8, 12, 12, 16, 24, 48, 48, 64, 64 };
+	uint8_t record[CAN_PACKED_MAX_RECORD];
+	for (unsigned i = 0; i < sizeof(lengths); i++)
+	{
+		frame.length = lengths[i];
+		memset(record, 0xEE, sizeof(record));
+		CHECK_EQ(CANFrameView::packedSize(frame), CAN_PACKED_HEADER_SIZE + stored[i]);
+		CHECK_EQ(CANFrameView::pack(frame, record, sizeof(record)), CAN_PACKED_HEADER_SIZE + stored[i]);
+		CANFrameView view(record);
+		CHECK(view.fdMode());
+		CHECK_EQ(view.length(), stored[i]);
+		CAN_FRAME_FD back;
+		CHECK(view.toFrameFD(back));
+		CHECK_EQ(back.length, stored[i]);
+		CHECK(memcmp(back.data.uint8, frame.data.uint8, lengths[i]) == 0);
+		bool padded = true; //zero padded like a controller would, not whatever was in the frame
+		for (int b = lengths[i]; b < 64; b++)
+		{
+			if (back.data.uint8[b] != 0) padded = false;
+		}
+		CHECK(padded);
+		CAN_FRAME classic;
+		CHECK(!view.toFrame(classic)); //FD records never come out as classic frames
+	}
+}
+
+TEST(packed, attachNeedsAPowerOfTwo)
+{
+	static uint8_t storage[256];
+	CANPackedQueue queue;
+	CHECK(!queue.push(makeFrame(0x100, 0)));
+	CHECK(!queue.attach(storage, 200));
+	CHECK(!queue.attach(storage, 64)); //smaller than one FD record
+	CHECK(!queue.attach(NULL, 256));
+	CHECK_EQ(queue.capacity(), 0);
+	CHECK(queue.attach(storage, 256));
+	CHECK_EQ(queue.capacity(), 256);
+}
+
+TEST(packed, recordsSkipTheEndOfTheBuffer)
+{
+	static uint8_t storage[128];
+	CANPackedQueue queue(storage, sizeof(storage));
+	static const uint32_t RECORD = CAN_PACKED_HEADER_SIZE + 8;
+	for (int i = 0; i < 7; i++) CHECK(queue.push(makeFrame(0x100 + i, i)));
+	CHECK_EQ(queue.bytesUsed(), 7 * RECORD); //9 bytes left at the end, too few for another
+	CAN_FRAME got;
+	for (int i = 0; i < 3; i++)
+	{
+		CHECK(queue.pop(got));
+		CHECK_EQ(got.id, 0x100 + i);
+	}
+	CHECK(queue.push(makeFrame(0x107, 7)));
+	CHECK_EQ(storage[7 * RECORD], 0x80); //wrap marker where the record didn't fit
+	CHECK_EQ(queue.bytesUsed(), 4 * RECORD + (128 - 7 * RECORD) + RECORD); //the skipped bytes count until they are read past
+	CHECK_EQ(queue.count(), 5);
+	CHECK_EQ(storage[1], 0x07); //the new record starts the buffer again
+
+	for (int i = 3; i < 8; i++)
+	{
+		CANFrameView view;
+		CHECK(queue.peek(view));
+		CHECK_EQ(view.id(), 0x100 + i);
+		CHECK_EQ(view[0], i);
+		queue.drop();
+	}
+	CHECK(queue.isEmpty());
+	CHECK_EQ(queue.bytesUsed(), 0);
+	CHECK_EQ(queue.count(), 0);
+	CHECK(!queue.pop(got));
+}
+
+TEST(packed, recordThatEndsTheBufferNeedsNoMarker)
+{
+	static uint8_t storage[128];
+	CANPackedQueue queue(storage, sizeof(storage));
+	CAN_FRAME_FD big;
+	big.id = 0x200;
+	big.extended = 0;
+	big.rrs = 0;
+	big.fdMode = 1;
+	big.timestamp = 0;
+	big.length = 64;
+	memset(big.data.uint8, 0x55, 64);
+	CHECK(queue.push(makeFrame(0x100, 0, 1))); //10 bytes
+	CHECK(queue.pushFD(big));                //73, ends at 83
+	CHECK(queue.push(makeFrame(0x101, 1, 8))); //17, ends at 100
+	CHECK(queue.push(makeFrame(0x102, 2, 8))); //17, ends at 117
+	CHECK(queue.push(makeFrame(0x103, 3, 2))); //11, exactly at the end
+	CHECK_EQ(queue.bytesUsed(), 128);
+	CHECK(!queue.push(makeFrame(0x104, 4, 0)));
+	CAN_FRAME got;
+	CHECK(queue.pop(got));
+	CHECK_EQ(got.id, 0x100);
+	CHECK(!queue.pop(got)); //the FD record can't be a classic frame, it's dropped rather than blocking
+	CHECK_EQ(queue.count(), 3);
+	CHECK(queue.push(makeFrame(0x104, 4, 8)));
+	static const uint32_t ids[] = { 0x101, 0x102, 0x103, 0x104 };
+	for (int i = 0; i < 4; i++)
+	{
+		CHECK(queue.pop(got));
+		CHECK_EQ(got.id, ids[i]);
+	}
+	CHECK(queue.isEmpty());
+}
+
+TEST(packed, fullQueueRefusesUntilSomethingIsRead)
+{
+	static uint8_t storage[256];
+	CANPackedQueue queue(storage, sizeof(storage));
+	int pushed = 0;
+	while (queue.push(makeFrame(0x300, (uint8_t)pushed))) pushed++;
+	CHECK_EQ(pushed, 256 / (CAN_PACKED_HEADER_SIZE + 8));
+	CHECK_EQ(queue.count(), pushed);
+	CHECK(!queue.push(makeFrame(0x300, 0, 0))); //even a 9 byte record doesn't fit in the 1 byte left
+
+	CAN_FRAME_FD got;
+	CHECK(queue.popFD(got));
+	CHECK_EQ(got.data.uint8[0], 0);
+	CHECK_EQ(got.fdMode, 0);
+	CHECK(queue.push(makeFrame(0x300, (uint8_t)pushed)));
+	for (int i = 1; i <= pushed; i++)
+	{
+		CHECK(queue.popFD(got));
+		CHECK_EQ(got.data.uint8[0], i);
+	}
+	CHECK(queue.isEmpty());
+	queue.push(makeFrame(0x300, 0));
+	queue.clear();
+	CHECK(queue.isEmpty());
+	CHECK_EQ(queue.count(), 0);
+}
@@ -0,0 +1,113 @@
+#include "can_test.h"
+#include <can_ring.h>
+
+#include <thread>
+
+TEST(ring, sizeMustBeAPowerOfTwo)
+{
+	uint32_t storage[16];
+	CANRing<uint32_t> ring;
+	CHECK(!ring.isAttached());
+	CHECK(!ring.push(1));
+	CHECK(!ring.attach(storage, 12));
+	CHECK(!ring.attach(NULL, 16));
+	CHECK(ring.attach(storage, 16));
+	CHECK_EQ(ring.capacity(), 16);
+}
+
+TEST(ring, fifoOrderAndFull)
+{
+	CANRingBuffer<uint32_t, 4> ring;
+	CHECK(ring.isEmpty());
+	for (uint32_t i = 0; i < 4; i++) CHECK(ring.push(i));
+	CHECK(ring.isFull());
+	CHECK(!ring.push(99));
+	CHECK_EQ(ring.count(), 4);
+	CHECK_EQ(ring.space(), 0);
+	uint32_t value = 0;
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		CHECK(ring.pop(value));
+		CHECK_EQ(value, i);
+	}
+	CHECK(!ring.pop(value));
+}
+
+TEST(ring, bulkTransfersStopAtTheEdges)
+{
+	CANRingBuffer<uint32_t, 8> ring;
+	uint32_t in[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	uint32_t out[10];
+	CHECK_EQ(ring.pushBulk(in, 10), 8);
+	CHECK_EQ(ring.popBulk(out, 3), 3);
+	CHECK_EQ(out[2], 2);
+	//wraps around the end of the storage
+	CHECK_EQ(ring.pushBulk(in, 10), 3);
+	CHECK_EQ(ring.popBulk(out, 10), 8);
+	CHECK_EQ(out[0], 3);
+	CHECK_EQ(out[4], 7);
+	CHECK_EQ(out[5], 0);
+	CHECK_EQ(out[7], 2);
+	CHECK_EQ(ring.popBulk(out, 10), 0);
+}
+
+TEST(ring, peekAndDrop)
+{
+	CANRingBuffer<uint32_t, 4> ring;
+	CHECK(ring.peek() == NULL);
+	ring.drop(); //harmless when empty
+	ring.push(7);
+	ring.push(8);
+	CHECK(ring.peek() != NULL);
+	CHECK_EQ(*ring.peek(), 7);
+	ring.drop();
+	CHECK_EQ(*ring.peek(), 8);
+	ring.clear();
+	CHECK(ring.isEmpty());
+}
+
+TEST(ring, countersWrap)
+{
+	CANRingBuffer<uint32_t, 4> ring;
+	uint32_t value = 0;
+	for (uint32_t i = 0; i < 70000; i++)
+	{
+		CHECK(ring.push(i));
+		if (i & 1)
+		{
+			ring.pop(value);
+			ring.pop(value);
+			if (value != i) break;
+		}
+	}
+	CHECK_EQ(value, 69999);
+	CHECK(ring.isEmpty());
+}
+
+TEST(ring, producerAndConsumerThreads)
+{
+	static const uint32_t TOTAL = 200000;
+	CANRingBuffer<uint32_t, 64> ring;
+	std::thread producer([&ring]() {
+		for (uint32_t i = 0; i < TOTAL; i++)
+		{
+			while (!ring.push(i)) std::this_thread::yield();
+		}
+	});
+	uint32_t expected = 0;
+	bool inOrder = true;
+	while (expected < TOTAL)
+	{
+		uint32_t batch[16];
+		uint16_t n = ring.popBulk(batch, 16);
+		for (uint16_t i = 0; i < n; i++)
+		{
+			if (batch[i] != expected) inOrder = false;
+			expected++;
+		}
+		if (n == 0) std::this_thread::yield();
+	}
+	producer.join();
+	CHECK(inOrder);
+	CHECK(ring.isEmpty());
+}
@@ -0,0 +1,199 @@
+#include "can_test.h"
+#include <can_router.h>
+#include <loopback_can.h>
+
+static CAN_FRAME makeFrame(uint32_t id, bool extended, uint8_t tag = 0)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	frame.length = 1;
+	frame.data.bytes[0] = tag;
+	return frame;
+}
+
+//A loopback bus that hears its own frames, so sending on it fills its RX buffer for the router
+static void startBus(LoopbackCAN &bus, bool fd = false)
+{
+	if (fd) bus.beginFD(500000, 2000000);
+	else bus.begin(500000);
+	bus.watchFor();
+}
+
+//Puts a frame in the bus's own RX buffer as if it had come off the wire
+static void inject(LoopbackCAN &bus, uint32_t id, bool extended, uint8_t tag = 0)
+{
+	CAN_FRAME frame = makeFrame(id, extended, tag);
+	bus.sendFrame(frame);
+}
+
+TEST(router, routesByIdAndFrameType)
+{
+	LoopbackCAN a, b, c;
+	startBus(a);
+	startBus(b);
+	startBus(c);
+	CANRouter router;
+	int busA = router.addBus(a);
+	int busB = router.addBus(b);
+	int busC = router.addBus(c);
+	CHECK(router.addRoute(busA, 0x100, 0x700, false, 1 << busB) >= 0);
+	CHECK(router.addRoute(busA, 0x123, 0x7FF, false, 1 << busC) >= 0);
+	CHECK(router.addRoute(busA, 0, 0, true, CAN_ROUTER_ALL_BUSES) >= 0);
+	inject(a, 0x123, false, 1); //both standard routes
+	inject(a, 0x200, false, 2); //nothing
+	inject(a, 0x123, true, 3);  //only the extended one
+	CHECK_EQ(router.service(), 3);
+	CHECK_EQ(router.getForwarded(), 4);
+
+	CAN_FRAME got;
+	CHECK(b.read(got));
+	CHECK_EQ(got.data.bytes[0], 1);
+	CHECK(b.read(got));
+	CHECK_EQ(got.data.bytes[0], 3);
+	CHECK(got.extended);
+	CHECK(!b.read(got));
+	CHECK(c.read(got));
+	CHECK_EQ(got.data.bytes[0], 1);
+	CHECK(c.read(got));
+	CHECK_EQ(got.data.bytes[0], 3);
+	CHECK(!c.read(got));
+	CHECK_EQ(a.available(), 0); //never sent back where it came from
+}
+
+TEST(router, remapRewritesTheId)
+{
+	LoopbackCAN a, b;
+	startBus(a);
+	startBus(b);
+	CANRouter router;
+	router.addBus(a);
+	router.addBus(b);
+	int standard = router.addRoute(0, 0x100, 0x700, false, 1 << 1);
+	int extended = router.addRoute(0, 0x18DA0000, 0x1FFF0000, true, 1 << 1);
+	CHECK(router.setRemap(standard, 0xFF, 0x700));
+	CHECK(router.setRemap(extended, 0xFFFFFFFF, 0x00010000));
+	CHECK(!router.setRemap(standard, 0xFF, 0x800)); //doesn't fit in 11 bits
+	CHECK(!router.setRemap(extended, 0, 0x20000000));
+	CHECK(!router.setRemap(standard + 5, 0, 0));
+	inject(a, 0x1AB, false);
+	inject(a, 0x18DAF110, true);
+	router.service();
+	CAN_FRAME got;
+	CHECK(b.read(got));
+	CHECK_EQ(got.id, 0x7AB);
+	CHECK(!got.extended);
+	CHECK(b.read(got));
+	CHECK_EQ(got.id, 0x18DBF110);
+	CHECK(got.extended);
+
+	//a keepMask wider than the ID can't leak into the bits above it
+	router.setRemap(standard, 0xFFFFFFFF, 0);
+	inject(a, 0x1AB, false);
+	router.service();
+	CHECK(b.read(got));
+	CHECK_EQ(got.id, 0x1AB);
+}
+
+TEST(router, busyDestinationQueuesThenDrops)
+{
+	LoopbackCAN a, b;
+	startBus(a);
+	startBus(b);
+	CANRouter router;
+	router.addBus(a);
+	router.addBus(b);
+	router.addRoute(0, 0, 0, false, 1 << 1);
+	b.setListenOnlyMode(true); //refuses everything
+	for (int i = 0; i < 200; i++) inject(a, 0x100, false, (uint8_t)i);
+	while (a.available()) router.service();
+	uint16_t waiting = router.pending(1);
+	CHECK(waiting > 0);
+	CHECK_EQ(waiting + router.getDropped(), 200);
+	CHECK(router.getDropped() > 0);
+	CANStats stats;
+	b.getStats(stats);
+	CHECK(stats.txDropped > 0);
+
+	b.setListenOnlyMode(false);
+	router.service();
+	CHECK_EQ(router.pending(1), 0);
+	CAN_FRAME got;
+	for (int i = 0; i < waiting; i++)
+	{
+		CHECK(b.read(got));
+		CHECK_EQ(got.data.bytes[0], i); //oldest first, the overflow was what got dropped
+	}
+	CHECK(!b.read(got));
+}
+
+TEST(router, losslessDestinationHoldsTheSourceBack)
+{
+	LoopbackCAN a, b;
+	startBus(a);
+	startBus(b);
+	CANRouter router;
+	router.addBus(a);
+	router.addBus(b);
+	router.setLossless(1, true);
+	router.addRoute(0, 0, 0, false, 1 << 1);
+	b.setListenOnlyMode(true);
+	for (int i = 0; i < 200; i++) inject(a, 0x100, false, (uint8_t)i);
+	for (int i = 0; i < 100; i++) router.service();
+	CHECK_EQ(router.getDropped(), 0);
+	CHECK(a.available() > 0); //the rest waits in the source
+	CHECK_EQ(router.pending(1) + a.available(), 200);
+
+	b.setListenOnlyMode(false);
+	while (a.available() || router.pending(1)) router.service();
+	CAN_FRAME got;
+	for (int i = 0; i < 200; i++)
+	{
+		CHECK(b.read(got));
+		CHECK_EQ(got.data.bytes[0], (uint8_t)i);
+	}
+	CHECK_EQ(router.getDropped(), 0);
+}
+
+TEST(router, bridgesClassicAndFD)
+{
+	LoopbackCAN classic(16, false), fd;
+	startBus(classic);
+	startBus(fd, true);
+	CANRouter router;
+	int busClassic = router.addBus(classic);
+	int busFD = router.addBus(fd, true);
+	router.addRoute(busClassic, 0x100, 0x7FF, false, 1 << busFD);
+
+	//classic to FD goes out as a classic frame. Only one direction routed yet or the router would read it back.
+	inject(classic, 0x100, false, 0x11);
+	router.service();
+	CAN_FRAME_FD gotFD;
+	CHECK(fd.readFD(gotFD));
+	CHECK_EQ(gotFD.id, 0x100);
+	CHECK_EQ(gotFD.fdMode, 0);
+	CHECK_EQ(gotFD.length, 1);
+	CHECK_EQ(gotFD.data.uint8[0], 0x11);
+
+	//FD frames that fit in 8 bytes become classic ones, longer ones are dropped
+	router.clearRoutes();
+	router.addRoute(busFD, 0x200, 0x7FF, false, 1 << busClassic);
+	CAN_FRAME_FD out;
+	out.id = 0x200;
+	out.extended = 0;
+	out.fdMode = 1;
+	out.length = 8;
+	for (int i = 0; i < 8; i++) out.data.uint8[i] = (uint8_t)(0xA0 + i);
+	fd.sendFrameFD(out);
+	out.length = 12;
+	fd.sendFrameFD(out);
+	router.service();
+	CAN_FRAME got;
+	CHECK(classic.read(got));
+	CHECK_EQ(got.id, 0x200);
+	CHECK_EQ(got.length, 8);
+	CHECK_EQ(got.data.bytes[7], 0xA7);
+	CHECK(!classic.read(got));
+	CHECK_EQ(router.getDropped(), 1);
+	CHECK_EQ(router.getForwarded(), 2);
+}
@@ -0,0 +1,122 @@
+#include "can_test.h"
+#include <can_signal.h>
+
+TEST(signal, intelRoundTrip)
+{
+	typedef CANSignal<8, 16, CAN_INTEL, false, 1, 4> EngineRPM;
+	BytesUnion data;
+	data.value = 0;
+	EngineRPM::set(data, 3000.0f);
+	CHECK_EQ(EngineRPM::raw(data), 12000);
+	CHECK_EQ(data.bytes[1], 12000 & 0xFF);
+	CHECK_EQ(data.bytes[2], 12000 >> 8);
+	CHECK(EngineRPM::get(data) == 3000.0f);
+}
+
+TEST(signal, motorolaLeavesNeighboursAlone)
+{
+	//DBC start bit 7 is the MSB of byte 0, so a 12 bit Motorola signal covers byte 0 and the top of byte 1
+	typedef CANSignal<7, 12, CAN_MOTOROLA> Field;
+	BytesUnion data;
+	data.value = 0xFFFFFFFFFFFFFFFFull;
+	Field::set(data, 0xABC);
+	CHECK_EQ(data.bytes[0], 0xAB);
+	CHECK_EQ(data.bytes[1], 0xCF);
+	CHECK_EQ(data.bytes[2], 0xFF);
+	CHECK_EQ(Field::raw(data), 0xABC);
+}
+
+TEST(signal, signedValueIsSignExtended)
+{
+	typedef CANSignal<4, 8, CAN_INTEL, true> Temp;
+	BytesUnion data;
+	data.value = 0;
+	Temp::set(data, -3.0f);
+	CHECK_EQ(Temp::value(data), -3);
+	CHECK_EQ(Temp::raw(data), 0xFD);
+	CHECK(Temp::get(data) == -3.0f);
+}
+
+TEST(signal, offsetAndRounding)
+{
+	typedef CANSignal<0, 8, CAN_INTEL, false, 1, 2, -40> Coolant;
+	BytesUnion data;
+	data.value = 0;
+	Coolant::set(data, 20.3f);
+	CHECK_EQ(Coolant::raw(data), 121);
+	Coolant::set(data, 20.2f);
+	CHECK_EQ(Coolant::raw(data), 120);
+}
+
+TEST(signal, narrowFieldsSaturate)
+{
+	typedef CANSignal<0, 8> U8;
+	typedef CANSignal<8, 8, CAN_INTEL, true> S8;
+	BytesUnion data;
+	data.value = 0;
+	U8::set(data, 1000.0f);
+	CHECK_EQ(U8::raw(data), 255);
+	U8::set(data, -5.0f);
+	CHECK_EQ(U8::raw(data), 0);
+	S8::set(data, 1000.0f);
+	CHECK_EQ(S8::value(data), 127);
+	S8::set(data, -1000.0f);
+	CHECK_EQ(S8::value(data), -128);
+}
+
+TEST(signal, wideFieldsSaturateExactly)
+{
+	typedef CANSignal<0, 32> U32;
+	typedef CANSignal<32, 32, CAN_INTEL, true> S32;
+	typedef CANSignal<0, 25> U25;
+	typedef CANSignal<0, 64> U64;
+	typedef CANSignal<0, 64, CAN_INTEL, true> S64;
+	BytesUnion data;
+	data.value = 0;
+	U32::set(data, 5e9f);
+	CHECK_EQ(U32::raw(data), 0xFFFFFFFFll);
+	S32::set(data, 5e9f);
+	CHECK_EQ(S32::value(data), 2147483647ll);
+	S32::set(data, -5e9f);
+	CHECK_EQ(S32::value(data), -2147483647ll - 1);
+	U25::set(data, 1e9f);
+	CHECK_EQ(U25::raw(data), 0x1FFFFFF);
+	U64::set(data, 1e30f);
+	CHECK(U64::raw(data) == 0xFFFFFFFFFFFFFFFFull);
+	S64::set(data, -1e30f);
+	CHECK(S64::raw(data) == 0x8000000000000000ull);
+}
+
+TEST(signal, wideFieldsRoundTripExactly)
+{
+	typedef CANSignal<0, 32> U32;
+	typedef CANSignal<32, 32, CAN_INTEL, true, 1, 1000, -1000> S32; //0.001 steps
+	typedef CANSignal<16, 24> U24;
+	BytesUnion data;
+	data.value = 0;
+	//odd values past 2^24 don't survive a float
+	U32::set(data, 4294967293.0);
+	CHECK_EQ(U32::raw(data), 0xFFFFFFFDll);
+	CHECK(U32::get(data) == 4294967293.0);
+	U32::set(data, 16777217.0);
+	CHECK(U32::get(data) == 16777217.0);
+	S32::set(data, 1234567.891);
+	CHECK_EQ(S32::value(data), 1235567891ll);
+	CHECK(S32::get(data) > 1234567.8905 && S32::get(data) < 1234567.8915);
+	S32::set(data, -1000.0);
+	CHECK_EQ(S32::value(data), 0);
+	//narrow fields keep float
+	CHECK(sizeof(U24::get(data)) == sizeof(float));
+	CHECK(sizeof(U32::get(data)) == sizeof(double));
+}
+
+TEST(signal, fdPayloadBeyondEightBytes)
+{
+	typedef CANSignal<400, 16> Far;
+	BytesUnion_FD data;
+	memset(data.uint8, 0, sizeof(data.uint8));
+	Far::set(data, 0x1234);
+	CHECK_EQ(data.uint8[50], 0x34);
+	CHECK_EQ(data.uint8[51], 0x12);
+	CHECK_EQ(Far::raw(data), 0x1234);
+}
@@ -0,0 +1,108 @@
+#include "can_test.h"
+#include <socket_can.h>
+
+#include <string.h>
+
+/*
+Runs against a real vcan0 and skips when there isn't one. To set it up:
+    sudo modprobe vcan && sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+Two sockets on the same interface see each other's frames but not their own.
+*/
+
+#define VCAN "vcan0"
+
+static CAN_FRAME makeFrame(uint32_t id, bool extended, uint8_t tag)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	frame.rtr = 0;
+	frame.length = 8;
+	for (int i = 0; i < 8; i++) frame.data.uint8[i] = (uint8_t)(tag + i);
+	return frame;
+}
+
+TEST(socket_can, framesGoThroughKernelFilters)
+{
+	SocketCAN tx(VCAN), rx(VCAN);
+	if (!tx.begin(500000) || !rx.begin(500000)) SKIP(VCAN " is not available");
+	rx.watchFor(0x123);
+	rx.watchFor(0x18DA00F1, 0x1FFF00FF); //mailbox 1
+	CAN_FRAME frame = makeFrame(0x123, false, 1);
+	CHECK(tx.sendFrame(frame));
+	frame = makeFrame(0x124, false, 2); //nobody asked for it
+	CHECK(tx.sendFrame(frame));
+	frame = makeFrame(0x18DA10F1, true, 3);
+	frame.length = 3;
+	CHECK(tx.sendFrame(frame));
+	CHECK_EQ(rx.service(100), 2);
+
+	CAN_FRAME got;
+	CHECK(rx.read(got));
+	CHECK_EQ(got.id, 0x123);
+	CHECK(!got.extended);
+	CHECK_EQ(got.length, 8);
+	CHECK_EQ(got.data.uint8[7], 8);
+	CHECK(rx.read(got));
+	CHECK_EQ(got.id, 0x18DA10F1);
+	CHECK(got.extended);
+	CHECK_EQ(got.length, 3);
+	CHECK_EQ(got.data.uint8[2], 5);
+	CHECK(!rx.read(got));
+	CHECK_EQ(rx.findMailbox(0x18DA10F1, true), 1);
+	CHECK_EQ(rx.findMailbox(0x124, false), -1);
+
+	tx.setListenOnlyMode(true);
+	CHECK(!tx.sendFrame(frame));
+	CHECK_EQ(rx.service(10), 0);
+}
+
+TEST(socket_can, batchesLongerThanOneSystemCall)
+{
+	SocketCAN tx(VCAN), rx(VCAN);
+	if (!tx.begin(500000) || !rx.begin(500000)) SKIP(VCAN " is not available");
+	rx.watchFor();
+	static const int COUNT = SOCKET_CAN_BATCH * 2 + 5;
+	CAN_FRAME frames[COUNT];
+	for (int i = 0; i < COUNT; i++) frames[i] = makeFrame(0x200 + i, false, (uint8_t)i);
+	CHECK_EQ(tx.sendBatch(frames, COUNT), COUNT);
+	for (int tries = 0; rx.available() < COUNT && tries < 10; tries++) rx.service(50);
+	CHECK_EQ(rx.available(), COUNT);
+	CAN_FRAME got[COUNT];
+	CHECK_EQ(rx.readBatch(got, COUNT), COUNT);
+	bool inOrder = true;
+	for (int i = 0; i < COUNT; i++)
+	{
+		if (got[i].id != (uint32_t)(0x200 + i) || got[i].data.uint8[0] != (uint8_t)i) inOrder = false;
+	}
+	CHECK(inOrder);
+
+	CANStats stats;
+	tx.getStats(stats);
+	CHECK_EQ(stats.txFrames, COUNT);
+}
+
+TEST(socket_can, fdFramesWhenTheInterfaceAllowsThem)
+{
+	SocketCAN tx(VCAN), rx(VCAN);
+	if (!tx.beginFD(500000, 2000000) || !rx.beginFD(500000, 2000000)) SKIP(VCAN " is not available or not FD capable");
+	rx.watchFor();
+	CAN_FRAME_FD frame;
+	frame.id = 0x300;
+	frame.extended = 0;
+	frame.fdMode = 1;
+	frame.rrs = 0;
+	frame.length = 21; //goes out as 24
+	for (int i = 0; i < 64; i++) frame.data.uint8[i] = (uint8_t)(0x40 + i);
+	CHECK(tx.sendFrameFD(frame));
+	frame.length = 65;
+	CHECK(!tx.sendFrameFD(frame));
+	CHECK_EQ(rx.service(100), 1);
+	CAN_FRAME_FD got;
+	CHECK(rx.readFD(got));
+	CHECK_EQ(got.id, 0x300);
+	CHECK_EQ(got.fdMode, 1);
+	CHECK_EQ(got.length, 24);
+	CHECK(memcmp(got.data.uint8, frame.data.uint8, 21) == 0);
+	CHECK_EQ(got.data.uint8[21], 0); //padding, not what was past the length
+}
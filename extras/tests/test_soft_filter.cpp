@@ -0,0 +1,124 @@
+#include "can_test.h"
+#include <can_soft_filter.h>
+#include <string.h>
+
+//Built a second time into can_tests_scalar with CAN_SOFT_FILTER_SCALAR so the plain C kernel is covered too
+
+struct RefFilter
+{
+	uint32_t id;
+	uint32_t mask;
+	bool extended;
+	bool enabled;
+};
+
+//What the hardware would do, one filter at a time
+static uint64_t refMatch(const RefFilter *filters, int count, uint32_t id, bool extended)
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const RefFilter &f = filters[i];
+		uint32_t width = f.extended ? 0x1FFFFFFF : 0x7FF;
+		if (f.enabled && f.extended == extended && ((id ^ f.id) & f.mask & width) == 0) bits |= 1ull << i;
+	}
+	return bits;
+}
+
+static uint32_t seed = 1;
+static uint32_t nextRandom()
+{
+	seed = seed * 1664525 + 1013904223;
+	return seed;
+}
+
+static bool matchesReference(int count)
+{
+	RefFilter filters[64];
+	CANSoftFilter soft;
+	for (int i = 0; i < count; i++)
+	{
+		RefFilter &f = filters[i];
+		f.extended = (nextRandom() >> 28) & 1;
+		f.id = nextRandom() & (f.extended ? 0x1FFFFFFF : 0x7FF);
+		f.mask = nextRandom() | nextRandom(); //mostly set bits so some IDs miss
+		f.enabled = true;
+		if (soft.add(f.id, f.mask, f.extended) != i) return false;
+	}
+
+	static const uint16_t FRAMES = 500;
+	uint32_t ids[FRAMES];
+	uint8_t extended[FRAMES];
+	uint64_t got[FRAMES];
+	for (int n = 0; n < FRAMES; n++)
+	{
+		//half near a filter's ID so there are plenty of hits, half anywhere
+		const RefFilter &f = filters[nextRandom() % count];
+		if (n & 1)
+		{
+			extended[n] = f.extended;
+			ids[n] = f.id ^ (nextRandom() & ~f.mask & (f.extended ? 0x1FFFFFFF : 0x7FF));
+		}
+		else
+		{
+			extended[n] = (nextRandom() >> 28) & 1;
+			ids[n] = nextRandom() & (extended[n] ? 0x1FFFFFFF : 0x7FF);
+		}
+	}
+	soft.matchBatch(ids, extended, FRAMES, got);
+	for (int n = 0; n < FRAMES; n++)
+	{
+		uint64_t expected = refMatch(filters, count, ids[n], extended[n]);
+		if (got[n] != expected || soft.match(ids[n], extended[n]) != expected) return false;
+	}
+	return true;
+}
+
+TEST(soft_filter, matchBatchAgreesWithTheReference)
+{
+	static const int counts[] = { 1, 7, 8, 9, 64 };
+	for (unsigned i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		for (int round = 0; round < 20; round++) CHECK(matchesReference(counts[i]));
+	}
+#if defined(CAN_SOFT_FILTER_SCALAR)
+	CHECK(strcmp(CANSoftFilter::getKernelName(), "scalar") == 0);
+#endif
+}
+
+TEST(soft_filter, standardAndExtendedNeverMix)
+{
+	CANSoftFilter soft;
+	CHECK_EQ(soft.add(0x123, 0x7FF, false), 0);
+	CHECK_EQ(soft.add(0x123, 0x1FFFFFFF, true), 1);
+	CHECK(soft.match(0x123, false) == 1);
+	CHECK(soft.match(0x123, true) == 2);
+	CHECK(!soft.accepts(0x124, false));
+}
+
+TEST(soft_filter, disableKeepsTheOtherBitNumbers)
+{
+	CANSoftFilter soft;
+	for (int i = 0; i < 10; i++) CHECK_EQ(soft.add(0x100 + i, 0x7FF, false), i);
+	soft.disable(3);
+	CHECK_EQ(soft.getCount(), 10);
+	CHECK(soft.match(0x103, false) == 0);
+	CHECK(soft.match(0x104, false) == (1ull << 4));
+	CHECK(soft.match(0x109, false) == (1ull << 9));
+	CHECK_EQ(soft.add(0x200, 0x7FF, false), 10); //new ones go after it, not into the hole
+	CHECK(soft.match(0x200, false) == (1ull << 10));
+	CHECK(soft.set(3, 0x300, 0x7FF, false)); //set() puts it back in use
+	CHECK(soft.match(0x300, false) == (1ull << 3));
+}
+
+TEST(soft_filter, fullAndEmpty)
+{
+	CANSoftFilter soft;
+	CHECK(!soft.accepts(0, false));
+	for (int i = 0; i < CAN_SOFT_FILTER_MAX; i++) CHECK_EQ(soft.add(i, 0, true), i);
+	CHECK_EQ(soft.add(0, 0, true), -1);
+	CHECK(!soft.set(CAN_SOFT_FILTER_MAX, 0, 0, true));
+	CHECK(soft.match(0x1ABCDEF, true) == ~0ull);
+	soft.clear();
+	CHECK(!soft.accepts(0x1ABCDEF, true));
+}
@@ -0,0 +1,173 @@
+#include "can_test.h"
+#include <can_stats.h>
+#include <can_common.h>
+#include <loopback_can.h>
+
+#include <string.h>
+
+struct FakeClock
+{
+	FakeClock() { hostUseFakeClock(true); }
+	~FakeClock() { hostUseFakeClock(false); }
+};
+
+static CAN_FRAME makeFrame(uint32_t id, bool extended, uint8_t length, uint8_t fill)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	frame.rtr = 0;
+	frame.length = length;
+	for (int i = 0; i < 8; i++) frame.data.bytes[i] = fill;
+	return frame;
+}
+
+TEST(stats, snapshotCountsFramesAndLoad)
+{
+	FakeClock clock;
+	CANStatistics stats;
+	CAN_FRAME frame = makeFrame(0x123, false, 8, 0);
+	CAN_FRAME_FD fd;
+	fd.id = 0x456;
+	fd.extended = 0;
+	fd.fdMode = 1;
+	fd.length = 20;
+	for (int i = 0; i < 1000; i++) stats.countTX(frame); //111 bits each, 222ms at 500k
+	stats.countRX(frame);
+	stats.countRXFD(fd);
+	stats.countRXDropped(2);
+	stats.countDeferredDropped(4);
+	stats.countTXDropped();
+	stats.countSchedulerDropped(5);
+	stats.countOverrun();
+	stats.countFilterReject(3);
+	stats.countErrorFrame();
+	stats.countBusOff();
+	stats.countCallback(40);
+	stats.countCallback(10);
+	stats.setErrorCounters(96, 7);
+	hostAdvanceClock(1000000);
+
+	CANStats out;
+	stats.snapshot(out, 500000, 0);
+	CHECK_EQ(out.txFrames, 1000);
+	CHECK_EQ(out.txBytes, 8000);
+	CHECK_EQ(out.rxFrames, 1);
+	CHECK_EQ(out.rxFramesFD, 1);
+	CHECK_EQ(out.rxBytes, 28);
+	CHECK_EQ(out.rxDropped, 2);
+	CHECK_EQ(out.deferredDropped, 4);
+	CHECK_EQ(out.txDropped, 1);
+	CHECK_EQ(out.schedulerDropped, 5);
+	CHECK_EQ(out.rxOverruns, 1);
+	CHECK_EQ(out.filterRejects, 3);
+	CHECK_EQ(out.errorFrames, 1);
+	CHECK_EQ(out.busOffCount, 1);
+	CHECK_EQ(out.callbackCalls, 2);
+	CHECK_EQ(out.callbackMicros, 50);
+	CHECK_EQ(out.callbackMaxMicros, 40);
+	CHECK_EQ(out.txErrorCounter, 96);
+	CHECK_EQ(out.rxErrorCounter, 7);
+	CHECK_EQ(out.elapsedMillis, 1000);
+	//the FD frame's data phase isn't counted without a data rate, the nominal part is too small to show
+	CHECK_EQ(out.busLoadPercent, 22);
+	stats.snapshot(out, 0, 0);
+	CHECK_EQ(out.busLoadPercent, 0); //no rate, no load
+	stats.snapshot(out, 100000, 0);
+	CHECK_EQ(out.busLoadPercent, 100); //more bits than the time allows is capped
+}
+
+TEST(stats, resetStartsAgain)
+{
+	FakeClock clock;
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CAN_FRAME frame = makeFrame(0x100, false, 4, 0xAA);
+	bus.sendFrame(frame);
+	hostAdvanceClock(5000);
+	CANStats out;
+	bus.getStats(out);
+	CHECK_EQ(out.txFrames, 1);
+	CHECK_EQ(out.rxFrames, 1);
+	CHECK_EQ(out.elapsedMillis, 5);
+	bus.resetStats();
+	bus.getStats(out);
+	CHECK_EQ(out.txFrames, 0);
+	CHECK_EQ(out.rxFrames, 0);
+	CHECK_EQ(out.txBytes, 0);
+	CHECK_EQ(out.elapsedMillis, 0);
+	CHECK_EQ(out.busLoadPercent, 0);
+	bus.sendFrame(frame);
+	bus.getStats(out);
+	CHECK_EQ(out.txFrames, 1);
+}
+
+TEST(stats, unstuffedBitCounts)
+{
+	CAN_FRAME frame = makeFrame(0x123, false, 8, 0);
+	CHECK_EQ(CANStatistics::frameBits(frame), 111);
+	frame.extended = true;
+	CHECK_EQ(CANStatistics::frameBits(frame), 131);
+	frame.rtr = 1; //a remote frame carries no data whatever the DLC says
+	CHECK_EQ(CANStatistics::frameBits(frame), 67);
+
+	CAN_FRAME_FD fd;
+	fd.id = 0x123;
+	fd.extended = 0;
+	fd.fdMode = 1;
+	fd.length = 9; //goes out as 12
+	uint32_t nominal, data;
+	CANStatistics::frameBitsFD(fd, nominal, data);
+	CHECK_EQ(nominal, 30);
+	CHECK_EQ(data, 1 + 4 + 96 + 4 + 23);
+	fd.length = 64;
+	CANStatistics::frameBitsFD(fd, nominal, data);
+	CHECK_EQ(data, 1 + 4 + 512 + 4 + 28);
+	fd.fdMode = 0;
+	fd.length = 8;
+	CANStatistics::frameBitsFD(fd, nominal, data);
+	CHECK_EQ(nominal, 111);
+	CHECK_EQ(data, 0);
+}
+
+TEST(stats, stuffBitsFollowTheContents)
+{
+	//ID 0, no data: SOF through CRC is 34 dominant bits, a stuff bit after every fifth but the last run
+	CAN_FRAME frame = makeFrame(0, false, 0, 0);
+	CHECK_EQ(CANStatistics::stuffedFrameBits(frame), 47 + 6);
+
+	//alternating bits never need stuffing in the data, zeros need one every five
+	CAN_FRAME zeros = makeFrame(0x2AA, false, 8, 0x00);
+	CAN_FRAME alternating = makeFrame(0x2AA, false, 8, 0x55);
+	uint32_t zeroBits = CANStatistics::stuffedFrameBits(zeros);
+	uint32_t altBits = CANStatistics::stuffedFrameBits(alternating);
+	CHECK(zeroBits >= 111 + 64 / 5);
+	CHECK(altBits < zeroBits);
+	CHECK(altBits >= 111);
+	//worst case is one stuff bit per four after the first
+	CHECK(zeroBits <= 111 + (1 + 11 + 3 + 4 + 64 + 15 - 1) / 4);
+
+	CAN_FRAME_FD fd;
+	fd.id = 0x2AA;
+	fd.extended = 0;
+	fd.fdMode = 0;
+	fd.length = 8;
+	memset(fd.data.uint8, 0, 64);
+	uint32_t nominal, data;
+	CANStatistics::stuffedFrameBitsFD(fd, nominal, data);
+	CHECK_EQ(nominal, zeroBits); //classic frames in an FD struct count the same
+	CHECK_EQ(data, 0);
+
+	fd.fdMode = 1;
+	fd.length = 64;
+	uint32_t plainNominal, plainData;
+	CANStatistics::frameBitsFD(fd, plainNominal, plainData);
+	CANStatistics::stuffedFrameBitsFD(fd, nominal, data);
+	CHECK(nominal >= plainNominal);
+	CHECK(data >= plainData + 512 / 5); //64 zero bytes
+	memset(fd.data.uint8, 0x55, 64);
+	uint32_t altData;
+	CANStatistics::stuffedFrameBitsFD(fd, nominal, altData);
+	CHECK(altData < plainData + 4);
+}
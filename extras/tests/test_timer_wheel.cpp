@@ -0,0 +1,154 @@
+#include "can_test.h"
+#include <can_timer_wheel.h>
+
+//Records the wheel tick every timer fired at
+struct FireLog
+{
+	CANTimerWheel *wheel;
+	uint32_t firedAt[8];
+	int fires[8];
+	int restart;            //timer the callback starts again, -1 for none
+	uint32_t restartTicks;
+	bool stopPartner;       //callback stops timer ^ 1
+};
+
+static void recordFire(uint16_t timer, void *context)
+{
+	FireLog *log = (FireLog *)context;
+	log->firedAt[timer] = log->wheel->getTick();
+	log->fires[timer]++;
+	if (log->restart == timer) log->wheel->start(timer, log->restartTicks);
+	if (log->stopPartner) log->wheel->stop(timer ^ 1);
+}
+
+static void resetLog(FireLog &log, CANTimerWheel &wheel)
+{
+	log.wheel = &wheel;
+	for (int i = 0; i < 8; i++)
+	{
+		log.firedAt[i] = 0;
+		log.fires[i] = 0;
+	}
+	log.restart = -1;
+	log.restartTicks = 0;
+	log.stopPartner = false;
+}
+
+TEST(timer_wheel, attachNeedsStorage)
+{
+	CANTimerWheel wheel;
+	CANTimer timers[2];
+	CHECK(!wheel.attach(NULL, 2));
+	CHECK(wheel.attach(timers, 2));
+	CHECK(!wheel.isRunning(0));
+	CHECK(!wheel.isRunning(5));
+	wheel.start(5, 10); //out of range, ignored
+	CHECK_EQ(wheel.advance(20, NULL, NULL), 0);
+}
+
+//Every delay from every starting position in the first few laps, across both levels and the
+//boundary where a timer goes to the coarse level instead of the fine one (delta == SLOTS)
+TEST(timer_wheel, firesOnTheExactTick)
+{
+	static const uint32_t S = CAN_TIMER_WHEEL_SLOTS;
+	CANTimer timers[1];
+	FireLog log;
+	bool allExact = true;
+	for (uint32_t startAt = 0; startAt < 2 * S + 3 && allExact; startAt++)
+	{
+		for (uint32_t delay = 1; delay < 3 * S + 3 && allExact; delay++)
+		{
+			CANTimerWheel wheel;
+			wheel.attach(timers, 1);
+			resetLog(log, wheel);
+			wheel.advance(startAt, recordFire, &log);
+			wheel.start(0, delay);
+			wheel.advance(delay - 1, recordFire, &log);
+			if (log.fires[0] != 0) allExact = false;
+			wheel.advance(1, recordFire, &log);
+			if (log.fires[0] != 1 || log.firedAt[0] != startAt + delay) allExact = false;
+			if (wheel.isRunning(0)) allExact = false;
+		}
+	}
+	CHECK(allExact);
+}
+
+TEST(timer_wheel, longDelaysTakeExtraLaps)
+{
+	static const uint32_t S = CAN_TIMER_WHEEL_SLOTS;
+	static const uint32_t delays[] = { S * S - 1, S * S, S * S + 1, 3 * S * S + 17, 100000 };
+	CANTimer timers[1];
+	FireLog log;
+	for (unsigned i = 0; i < sizeof(delays) / sizeof(delays[0]); i++)
+	{
+		CANTimerWheel wheel;
+		wheel.attach(timers, 1);
+		resetLog(log, wheel);
+		wheel.advance(5 + i, recordFire, &log);
+		wheel.start(0, delays[i]);
+		wheel.advance(delays[i] - 1, recordFire, &log);
+		CHECK_EQ(log.fires[0], 0);
+		CHECK_EQ(wheel.advance(1, recordFire, &log), 1);
+		CHECK_EQ(log.firedAt[0], 5 + i + delays[i]);
+	}
+}
+
+TEST(timer_wheel, zeroDelayIsOneTick)
+{
+	CANTimerWheel wheel;
+	CANTimer timers[1];
+	wheel.attach(timers, 1);
+	FireLog log;
+	resetLog(log, wheel);
+	wheel.start(0, 0);
+	CHECK_EQ(wheel.advance(1, recordFire, &log), 1);
+}
+
+TEST(timer_wheel, stopAndRestart)
+{
+	CANTimerWheel wheel;
+	CANTimer timers[3];
+	wheel.attach(timers, 3);
+	FireLog log;
+	resetLog(log, wheel);
+	wheel.start(0, 10);
+	wheel.start(1, 10);
+	wheel.start(2, 200);
+	wheel.stop(1);
+	wheel.stop(1); //twice is fine
+	wheel.start(2, 5); //restarting moves it
+	CHECK_EQ(wheel.advance(300, recordFire, &log), 2);
+	CHECK_EQ(log.firedAt[0], 10);
+	CHECK_EQ(log.fires[1], 0);
+	CHECK_EQ(log.fires[2], 1);
+	CHECK_EQ(log.firedAt[2], 5);
+}
+
+TEST(timer_wheel, callbackRestartKeepsThePeriod)
+{
+	CANTimerWheel wheel;
+	CANTimer timers[1];
+	wheel.attach(timers, 1);
+	FireLog log;
+	resetLog(log, wheel);
+	log.restart = 0;
+	log.restartTicks = 7;
+	wheel.start(0, 7);
+	CHECK_EQ(wheel.advance(700, recordFire, &log), 100);
+	CHECK_EQ(log.firedAt[0], 700);
+	CHECK(wheel.isRunning(0));
+}
+
+TEST(timer_wheel, callbackCanStopATimerDueInTheSameTick)
+{
+	CANTimerWheel wheel;
+	CANTimer timers[2];
+	wheel.attach(timers, 2);
+	FireLog log;
+	resetLog(log, wheel);
+	log.stopPartner = true;
+	wheel.start(0, 4);
+	wheel.start(1, 4);
+	CHECK_EQ(wheel.advance(10, recordFire, &log), 1); //whichever fires first stops the other
+	CHECK_EQ(log.fires[0] + log.fires[1], 1);
+}
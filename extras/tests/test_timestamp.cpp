@@ -0,0 +1,71 @@
+#include "can_test.h"
+#include <can_timestamp.h>
+
+TEST(timestamp, microsecondTicks)
+{
+	CANTimeBase base;
+	CHECK(base.update(1) == 1000ull);
+	CHECK(base.update(2500000) == 2500000000ull);
+}
+
+TEST(timestamp, wrapOf32BitCounter)
+{
+	CANTimeBase base;
+	base.update(0xFFFFFF00);
+	CHECK(base.update(0x10) == (0x100000000ull + 0x10) * 1000);
+	CHECK(base.update(0x20) == (0x100000000ull + 0x20) * 1000);
+}
+
+TEST(timestamp, wrapOf16BitCounter)
+{
+	CANTimeBase base;
+	base.setTickRate(1000000, 16);
+	base.update(60000);
+	//the counter only has 16 bits, 70000 is 4464 after a wrap
+	CHECK(base.update(70000) == (65536ull + 4464) * 1000);
+	CHECK(base.update(30000) == (65536ull + 30000) * 1000);
+}
+
+TEST(timestamp, smallStepBackIsNotAWrap)
+{
+	CANTimeBase base;
+	base.setTickRate(1000000, 16);
+	base.update(5000);
+	CHECK(base.update(4990) == 4990000ull);
+	CHECK(base.update(5010) == 5010000ull);
+	//a real wrap is still seen after the out of order stamp
+	base.update(65000);
+	CHECK(base.update(10) == (65536ull + 10) * 1000);
+}
+
+TEST(timestamp, toNsPlacesLateStampsInThePreviousEpoch)
+{
+	CANTimeBase base;
+	base.setTickRate(1000000, 16);
+	base.update(65500);
+	base.update(20);
+	CHECK(base.toNs(65510) == 65510000ull);
+	CHECK(base.toNs(30) == (65536ull + 30) * 1000);
+}
+
+TEST(timestamp, otherTickRates)
+{
+	CANTimeBase base;
+	base.setTickRate(40000000);
+	CHECK(base.update(40000000) == 1000000000ull);
+	CHECK(base.ticksToNs(3) == 75ull);
+}
+
+TEST(timestamp, histogramBucketsAndPercentiles)
+{
+	CANLatencyHistogram histogram;
+	for (int i = 0; i < 90; i++) histogram.record(3);
+	for (int i = 0; i < 10; i++) histogram.record(1000);
+	CHECK_EQ(histogram.getCount(), 100);
+	CHECK_EQ(histogram.getBucket(2), 90);
+	CHECK_EQ(histogram.getMin(), 3);
+	CHECK_EQ(histogram.getMax(), 1000);
+	CHECK_EQ(histogram.getAverage(), (90 * 3 + 10 * 1000) / 100);
+	CHECK_EQ(histogram.getPercentile(50), 4);
+	CHECK_EQ(histogram.getPercentile(99), 1000);
+}
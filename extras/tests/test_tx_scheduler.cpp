@@ -0,0 +1,144 @@
+#include "can_test.h"
+#include <can_tx_scheduler.h>
+#include <loopback_can.h>
+
+static CAN_FRAME makeFrame(uint32_t id, bool extended, uint8_t priority, uint8_t tag = 0)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	frame.priority = priority;
+	frame.length = 1;
+	frame.data.bytes[0] = tag;
+	return frame;
+}
+
+TEST(tx_scheduler, priorityThenArbitrationOrder)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANTxScheduler scheduler(bus);
+	CHECK(scheduler.queue(makeFrame(0x300, false, 5)));
+	CHECK(scheduler.queue(makeFrame(0x100 << 18, true, 5))); //same base ID as the standard 0x100
+	CHECK(scheduler.queue(makeFrame(0x100, false, 5, 1)));
+	CHECK(scheduler.queue(makeFrame(0x100, false, 5, 2))); //same ID keeps queue order
+	CHECK(scheduler.queue(makeFrame(0x7FF, false, 0)));
+	CHECK(scheduler.queue(makeFrame(0x050, false, 9)));
+	CHECK_EQ(scheduler.pending(), 6);
+	CHECK_EQ(scheduler.service(), 6);
+	CHECK_EQ(scheduler.pending(), 0);
+
+	static const uint32_t ids[] = { 0x7FF, 0x100, 0x100, 0x100 << 18, 0x300, 0x050 };
+	CAN_FRAME got;
+	for (int i = 0; i < 6; i++)
+	{
+		CHECK(bus.read(got));
+		CHECK_EQ(got.id, ids[i]);
+		if (i == 1 || i == 2) CHECK_EQ(got.data.bytes[0], i);
+	}
+	CHECK(CANTxScheduler::arbitrationKey(0x100, false) < CANTxScheduler::arbitrationKey(0x100 << 18, true));
+	CHECK(CANTxScheduler::arbitrationKey(0x100 << 18, true) < CANTxScheduler::arbitrationKey(0x101, false));
+}
+
+TEST(tx_scheduler, refusedFrameKeepsItsPlace)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANTxScheduler scheduler(bus);
+	scheduler.queue(makeFrame(0x200, false, 1, 1));
+	scheduler.queue(makeFrame(0x200, false, 1, 2));
+	bus.setListenOnlyMode(true); //driver refuses everything
+	CHECK_EQ(scheduler.service(), 0);
+	CHECK_EQ(scheduler.pending(), 2);
+	bus.setListenOnlyMode(false);
+	CHECK_EQ(scheduler.service(), 2);
+	CAN_FRAME got;
+	CHECK(bus.read(got));
+	CHECK_EQ(got.data.bytes[0], 1);
+	CHECK(bus.read(got));
+	CHECK_EQ(got.data.bytes[0], 2);
+}
+
+TEST(tx_scheduler, rateLimitHoldsFramesBack)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANTxScheduler scheduler(bus);
+	CHECK(scheduler.setRateLimit(0x123, false, 1000000)); //once a second, longer than the test
+	scheduler.queue(makeFrame(0x123, false, 0, 1));
+	scheduler.queue(makeFrame(0x123, false, 0, 2));
+	scheduler.queue(makeFrame(0x400, false, 3));
+	CHECK_EQ(scheduler.service(), 2); //the second 0x123 is held, the lower priority frame goes past it
+	CHECK_EQ(scheduler.pending(), 1);
+	CHECK_EQ(scheduler.service(), 0);
+	CAN_FRAME got;
+	CHECK(bus.read(got));
+	CHECK_EQ(got.id, 0x123);
+	CHECK(bus.read(got));
+	CHECK_EQ(got.id, 0x400);
+	scheduler.removeRateLimit(0x123, false);
+	CHECK_EQ(scheduler.service(), 1);
+	CHECK(bus.read(got));
+	CHECK_EQ(got.data.bytes[0], 2);
+}
+
+TEST(tx_scheduler, fdFramesOnAClassicBusAreRefused)
+{
+	LoopbackCAN bus(16, false);
+	bus.begin(500000);
+	bus.watchFor();
+	CANTxScheduler scheduler(bus);
+	CAN_FRAME_FD fd;
+	fd.id = 0x100;
+	fd.extended = 0;
+	fd.fdMode = 1;
+	fd.length = 12;
+	CHECK(!scheduler.queueFD(fd));
+	CHECK(scheduler.queue(makeFrame(0x200, false, 0)));
+	CHECK_EQ(scheduler.service(), 1); //nothing stuck in front of it
+	CHECK_EQ(scheduler.pending(), 0);
+
+	LoopbackCAN fdBus;
+	fdBus.beginFD(500000, 2000000);
+	CANTxScheduler fdScheduler(fdBus);
+	CHECK(fdScheduler.queueFD(fd));
+	fd.length = 65;
+	CHECK(!fdScheduler.queueFD(fd));
+	fd.fdMode = 0;
+	fd.length = 12; //classic frame can't carry 12 bytes
+	CHECK(!fdScheduler.queueFD(fd));
+	CHECK_EQ(fdScheduler.pending(), 1);
+}
+
+TEST(tx_scheduler, classicFramesOverEightBytesAreRefused)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANTxScheduler scheduler(bus);
+	CAN_FRAME frame = makeFrame(0x100, false, 0);
+	frame.length = 9;
+	CHECK(!scheduler.queue(frame));
+	CHECK_EQ(scheduler.pending(), 0);
+	CHECK_EQ(scheduler.service(), 0);
+	CHECK_EQ(bus.available(), 0);
+}
+
+TEST(tx_scheduler, fullQueueCountsDrops)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	CANTxScheduler scheduler(bus);
+	for (int i = 0; i < CAN_TXSCHED_DEPTH; i++) CHECK(scheduler.queue(makeFrame(0x100 + i, false, 0)));
+	CHECK(!scheduler.queue(makeFrame(0x7FF, false, 0)));
+	CANStats stats;
+	bus.getStats(stats);
+	CHECK_EQ(stats.schedulerDropped, 1);
+	CHECK_EQ(stats.txDropped, 0); //router backlogs and the scheduler are told apart
+	scheduler.clear();
+	CHECK_EQ(scheduler.pending(), 0);
+	CHECK(scheduler.queue(makeFrame(0x7FF, false, 0)));
+}
@@ -0,0 +1,168 @@
+#include "can_test.h"
+#include <can_value_cache.h>
+#include <loopback_can.h>
+
+static CAN_FRAME makeFrame(uint32_t id, uint8_t first)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = id > 0x7FF;
+	frame.length = 2;
+	frame.data.bytes[0] = first;
+	frame.data.bytes[1] = 0x55;
+	return frame;
+}
+
+TEST(value_cache, onlyTrackedIdsAreKept)
+{
+	CANValueCache cache;
+	CHECK(cache.track(0x100, false));
+	CHECK(cache.update(makeFrame(0x100, 1)));
+	CHECK(cache.update(makeFrame(0x200, 1))); //untracked IDs always count as changed
+	CHECK_EQ(cache.getCount(), 1);
+	CANCachedValue value;
+	CHECK(cache.read(0x100, false, value));
+	CHECK_EQ(value.length, 2);
+	CHECK_EQ(value.data[0], 1);
+	CHECK_EQ(value.frames, 1);
+	CHECK(!cache.read(0x200, false, value));
+	CHECK(!cache.read(0x100, true, value));
+}
+
+TEST(value_cache, changesAreCounted)
+{
+	CANValueCache cache;
+	cache.track(0x18FEF100, true);
+	CHECK(cache.update(makeFrame(0x18FEF100, 1)));
+	CHECK(!cache.update(makeFrame(0x18FEF100, 1)));
+	CHECK(cache.update(makeFrame(0x18FEF100, 2)));
+	CAN_FRAME shorter = makeFrame(0x18FEF100, 2);
+	shorter.length = 1;
+	CHECK(cache.update(shorter));
+	CHECK_EQ(cache.getChanges(0x18FEF100, true), 3);
+	CAN_FRAME out;
+	CHECK(cache.readFrame(0x18FEF100, true, out));
+	CHECK_EQ(out.length, 1);
+	CHECK_EQ(out.data.bytes[0], 2);
+	CHECK(out.extended);
+}
+
+TEST(value_cache, trackAllStopsWhenFull)
+{
+	CANValueCache cache;
+	cache.setTrackAll(true);
+	for (uint32_t id = 0; id < CAN_VALUE_CACHE_SLOTS + 10; id++) cache.update(makeFrame(id, 1));
+	CHECK_EQ(cache.getCount(), CAN_VALUE_CACHE_SLOTS - 1);
+	CANCachedValue value;
+	CHECK(cache.read(0, false, value));
+	cache.clear();
+	CHECK_EQ(cache.getCount(), 0);
+	CHECK(!cache.read(0, false, value));
+}
+
+TEST(value_cache, fdFramesShareTheEntry)
+{
+	CANValueCache cache;
+	cache.track(0x300, false);
+	CAN_FRAME_FD fd;
+	fd.id = 0x300;
+	fd.extended = 0;
+	fd.length = 12;
+	for (int i = 0; i < 12; i++) fd.data.uint8[i] = i;
+	CHECK(cache.updateFD(fd));
+	CHECK(!cache.updateFD(fd));
+	CANCachedValue value;
+	CHECK(cache.read(0x300, false, value));
+	CHECK_EQ(value.length, 12);
+	CHECK_EQ(value.data[CAN_VALUE_CACHE_DATA - 1], CAN_VALUE_CACHE_DATA - 1);
+}
+
+TEST(value_cache, fdChangesPastTheKeptBytesCount)
+{
+	CANValueCache cache;
+	cache.track(0x310, false);
+	CAN_FRAME_FD fd;
+	fd.id = 0x310;
+	fd.extended = 0;
+	fd.length = 64;
+	for (int i = 0; i < 64; i++) fd.data.uint8[i] = i;
+	CHECK(cache.updateFD(fd));
+	CHECK(!cache.updateFD(fd));
+	fd.data.uint8[63] = 0xEE; //well past CAN_VALUE_CACHE_DATA
+	CHECK(cache.updateFD(fd));
+	CHECK(!cache.updateFD(fd));
+	fd.data.uint8[CAN_VALUE_CACHE_DATA] = 0xEE;
+	CHECK(cache.updateFD(fd));
+	CHECK_EQ(cache.getChanges(0x310, false), 3);
+}
+
+//Counts frames per ID. The first one to see a repeat of 0x100 sends 0x200 from inside gotFrame.
+class ChangeListener : public CANListener
+{
+public:
+	ChangeListener() : bus(NULL), first(0), second(0) {}
+
+	void gotFrame(CAN_FRAME *frame, int mailbox)
+	{
+		if (frame->id == 0x100) first++;
+		else second++;
+		if (bus && frame->id == 0x100 && first == 2)
+		{
+			CAN_FRAME nested = makeFrame(0x200, 7);
+			bus->sendFrame(nested);
+		}
+	}
+
+	LoopbackCAN *bus;
+	int first;
+	int second;
+};
+
+TEST(value_cache, onlyOnChangeListenersSkipRepeats)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANValueCache cache;
+	cache.setTrackAll(true);
+	bus.attachValueCache(&cache);
+	ChangeListener all, changes;
+	bus.attachObj(&all);
+	bus.attachObj(&changes);
+	all.setGeneralHandler();
+	changes.setGeneralHandler();
+	changes.setOnlyOnChange(true);
+
+	CAN_FRAME frame = makeFrame(0x100, 1);
+	bus.sendFrame(frame);
+	bus.sendFrame(frame);
+	frame.data.bytes[0] = 2;
+	bus.sendFrame(frame);
+	CHECK_EQ(all.first, 3);
+	CHECK_EQ(changes.first, 2);
+}
+
+TEST(value_cache, nestedReceiveKeepsTheRepeatFlag)
+{
+	LoopbackCAN bus;
+	bus.begin(500000);
+	bus.watchFor();
+	CANValueCache cache;
+	cache.setTrackAll(true);
+	bus.attachValueCache(&cache);
+	ChangeListener all, changes;
+	all.bus = &bus; //receives the repeat and loops a new frame back while it is being dispatched
+	bus.attachObj(&all);
+	bus.attachObj(&changes);
+	all.setGeneralHandler();
+	changes.setGeneralHandler();
+	changes.setOnlyOnChange(true);
+
+	CAN_FRAME frame = makeFrame(0x100, 1);
+	bus.sendFrame(frame);
+	bus.sendFrame(frame);
+	CHECK_EQ(all.first, 2);
+	CHECK_EQ(all.second, 1);
+	CHECK_EQ(changes.second, 1);
+	CHECK_EQ(changes.first, 1);
+}
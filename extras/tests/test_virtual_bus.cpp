@@ -0,0 +1,110 @@
+#include "can_test.h"
+#include <virtual_bus.h>
+
+static CAN_FRAME makeFrame(uint32_t id, bool extended, bool rtr, uint8_t length = 0)
+{
+	CAN_FRAME frame;
+	frame.id = id;
+	frame.extended = extended;
+	frame.rtr = rtr ? 1 : 0;
+	frame.length = length;
+	frame.data.value = 0;
+	return frame;
+}
+
+TEST(virtual_bus, arbitrationOrder)
+{
+	CANVirtualBus bus(500000);
+	//one frame per node so every one of them is offered in the same arbitration
+	CANVirtualNode extRemote(bus), extData(bus), stdRemote(bus), stdData(bus), higher(bus), receiver(bus);
+	CANVirtualNode *senders[] = { &extRemote, &extData, &stdRemote, &stdData, &higher };
+	for (int i = 0; i < 5; i++) senders[i]->begin(500000);
+	receiver.begin(500000);
+	receiver.watchFor();
+	CHECK(extRemote.sendFrameAt(makeFrame(0x100 << 18, true, true), 0));
+	CHECK(extData.sendFrameAt(makeFrame(0x100 << 18, true, false), 0));
+	CHECK(stdRemote.sendFrameAt(makeFrame(0x100, false, true), 0));
+	CHECK(stdData.sendFrameAt(makeFrame(0x100, false, false), 0));
+	CHECK(higher.sendFrameAt(makeFrame(0x101, false, false), 0));
+	CHECK_EQ(bus.runUntilIdle(), 5);
+
+	//standard beats extended with the same base ID, data beats remote, then the higher ID
+	static const struct { uint32_t id; bool extended; bool rtr; } expected[] = {
+		{ 0x100, false, false }, { 0x100, false, true }, { 0x100 << 18, true, false }, { 0x100 << 18, true, true }, { 0x101, false, false } };
+	CAN_FRAME got;
+	for (int i = 0; i < 5; i++)
+	{
+		CHECK(receiver.read(got));
+		CHECK_EQ(got.id, expected[i].id);
+		CHECK_EQ(got.extended, expected[i].extended);
+		CHECK_EQ(got.rtr, expected[i].rtr);
+	}
+	CHECK(CANVirtualNode::arbitrationKey(0x100, false, true) < CANVirtualNode::arbitrationKey(0x100 << 18, true, false));
+}
+
+//ID 0, no data: SOF to the end of the CRC is 34 dominant bits which take a stuff bit after every fifth,
+//6 in all, on top of the 47 bits from SOF through interframe space
+TEST(virtual_bus, exactFrameTime)
+{
+	CANVirtualBus bus(500000);
+	CAN_FRAME_FD frame;
+	frame.id = 0;
+	frame.extended = 0;
+	frame.fdMode = 0;
+	frame.length = 0;
+	CHECK_EQ(bus.frameTimeNs(frame, false), 53 * 2000);
+
+	CANVirtualNode sender(bus), receiver(bus);
+	sender.begin(500000);
+	receiver.begin(500000);
+	receiver.watchFor();
+	CAN_FRAME classic = makeFrame(0, false, false);
+	CHECK(sender.sendFrame(classic));
+	CHECK_EQ(bus.runUntilIdle(), 1);
+	CHECK_EQ(bus.now(), 53 * 2000);
+	CHECK_EQ(bus.getBusyNs(), 53 * 2000);
+
+	bus.setRates(250000, 0);
+	CHECK_EQ(bus.frameTimeNs(frame, false), 53 * 4000);
+}
+
+//Two IDs released together every millisecond. The lower one goes first, the other waits for it.
+TEST(virtual_bus, loadAndWorstCaseResponse)
+{
+	CANVirtualBus bus(500000);
+	CANVirtualNode a(bus), b(bus), receiver(bus);
+	a.begin(500000);
+	b.begin(500000);
+	receiver.begin(500000);
+	receiver.watchFor();
+	CAN_FRAME first = makeFrame(0x100, false, false, 8);
+	CAN_FRAME second = makeFrame(0x200, false, false, 8);
+	first.data.value = 0x0123456789ABCDEFull;
+	second.data.value = 0xFEDCBA9876543210ull;
+	for (int period = 0; period < 10; period++)
+	{
+		CHECK(a.sendFrameAt(first, period * 1000000ull));
+		CHECK(b.sendFrameAt(second, period * 1000000ull));
+	}
+	CHECK_EQ(bus.runUntil(10000000ull), 20);
+
+	CAN_FRAME_FD fd;
+	a.canToFD(first, fd);
+	uint64_t t1 = bus.frameTimeNs(fd, false);
+	b.canToFD(second, fd);
+	uint64_t t2 = bus.frameTimeNs(fd, false);
+	const CANVirtualIdStats *s1 = bus.getIdStats(0x100, false);
+	const CANVirtualIdStats *s2 = bus.getIdStats(0x200, false);
+	CHECK(s1 != NULL && s2 != NULL);
+	CHECK_EQ(s1->frames, 10);
+	CHECK_EQ(s1->worstQueueNs, 0);
+	CHECK_EQ(s1->worstResponseNs, t1);
+	CHECK_EQ(s2->worstQueueNs, t1);
+	CHECK_EQ(s2->worstResponseNs, t1 + t2);
+	CHECK_EQ(bus.getBusyNs(), 10 * (t1 + t2));
+	CHECK_EQ(bus.getLoadPercent(), 10 * (t1 + t2) * 100 / 10000000ull);
+	CHECK_EQ(receiver.available(), 20);
+	bus.resetStats();
+	CHECK(bus.getIdStats(0x100, false) == NULL);
+	CHECK_EQ(bus.getLoadPercent(), 0);
+}
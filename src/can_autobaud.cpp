@@ -0,0 +1,161 @@
+#include "can_autobaud.h"
+
+//Most used first: J1939 / OBD-II and CANopen defaults, then the rest of the CiA 301 table
+static const uint32_t defaultRates[] = {500000, 250000, 125000, 1000000, 800000, 100000, 50000, 83333, 33333, 20000, 10000};
+
+CANAutoBaud::CANAutoBaud(CAN_COMMON &bus) : bus(bus)
+{
+	setCandidates(defaultRates, sizeof(defaultRates) / sizeof(defaultRates[0]));
+	numOrder = 0;
+	current = 0;
+	round = 0;
+	rounds = 2;
+	framesNeeded = 2;
+	dwell = CAN_AUTOBAUD_DWELL;
+	rateStart = 0;
+	baseFrames = 0;
+	baseErrors = 0;
+	baseREC = 0;
+	detected = 0;
+	state = AUTOBAUD_IDLE;
+}
+
+/**
+ * \brief Replace the list of rates to try
+ *
+ * \param rates Rates in the order to try them, most likely first
+ * \param count Up to CAN_AUTOBAUD_MAX_RATES
+ */
+bool CANAutoBaud::setCandidates(const uint32_t *rates, uint8_t count)
+{
+	if (rates == NULL || count == 0 || count > CAN_AUTOBAUD_MAX_RATES) return false;
+	for (uint8_t i = 0; i < count; i++) candidates[i] = rates[i];
+	numCandidates = count;
+	return true;
+}
+
+void CANAutoBaud::setDwell(uint32_t millis)
+{
+	dwell = millis ? millis : 1;
+}
+
+//Passes over the whole list before giving up, 0 to keep trying until cancel()
+void CANAutoBaud::setRounds(uint8_t numRounds)
+{
+	rounds = numRounds;
+}
+
+//Error free frames needed to accept a rate. One can be a fluke at a rate that divides the real one.
+void CANAutoBaud::setFramesNeeded(uint8_t frames)
+{
+	framesNeeded = frames ? frames : 1;
+}
+
+/**
+ * \brief Begin probing
+ *
+ * \param hint Rate to try first, typically the one found last time. 0 for none.
+ */
+void CANAutoBaud::start(uint32_t hint)
+{
+	numOrder = 0;
+	if (hint) order[numOrder++] = hint;
+	for (uint8_t i = 0; i < numCandidates; i++)
+	{
+		if (candidates[i] != hint) order[numOrder++] = candidates[i];
+	}
+	round = 0;
+	detected = 0;
+	tryRate(0);
+}
+
+void CANAutoBaud::tryRate(uint8_t idx)
+{
+	current = idx;
+	bus.disable();
+	bus.setListenOnlyMode(true);
+	bus.set_baudrate(order[idx]);
+	bus.enable();
+
+	CANStats stats;
+	bus.getStats(stats);
+	baseFrames = framesSeen(stats);
+	baseErrors = stats.errorFrames;
+	baseREC = stats.rxErrorCounter;
+	rateStart = millis();
+	state = AUTOBAUD_LISTENING;
+}
+
+void CANAutoBaud::nextRate()
+{
+	if (current + 1 < numOrder)
+	{
+		tryRate(current + 1);
+		return;
+	}
+	round++;
+	if (rounds && round >= rounds)
+	{
+		state = AUTOBAUD_FAILED;
+		return;
+	}
+	tryRate(0);
+}
+
+uint32_t CANAutoBaud::framesSeen(const CANStats &stats)
+{
+	return stats.rxFrames + stats.rxFramesFD + stats.filterRejects;
+}
+
+/**
+ * \brief Check on the rate being tried, move on if it is wrong
+ *
+ * \ret  The state after this call. Call it from loop() until it isn't AUTOBAUD_LISTENING.
+ */
+CANAutoBaudState CANAutoBaud::service()
+{
+	if (state != AUTOBAUD_LISTENING) return state;
+
+	CANStats stats;
+	bus.getStats(stats);
+	if (stats.errorFrames != baseErrors || stats.rxErrorCounter > baseREC)
+	{
+		nextRate();
+		return state;
+	}
+	if (framesSeen(stats) - baseFrames >= framesNeeded)
+	{
+		detected = order[current];
+		bus.setListenOnlyMode(false);
+		state = AUTOBAUD_FOUND;
+		return state;
+	}
+	if ((uint32_t)(millis() - rateStart) >= dwell) nextRate();
+	return state;
+}
+
+/**
+ * \brief Blocking version for setup() and beginAutoSpeed()
+ *
+ * \ret  Detected rate or 0. On 0 the bus is left in listen only mode at the last rate tried.
+ */
+uint32_t CANAutoBaud::run(uint32_t timeoutMillis)
+{
+	uint32_t began = millis();
+	start(detected);
+	while (service() == AUTOBAUD_LISTENING)
+	{
+		if ((uint32_t)(millis() - began) >= timeoutMillis)
+		{
+			cancel();
+			break;
+		}
+		delay(1);
+	}
+	return (state == AUTOBAUD_FOUND) ? detected : 0;
+}
+
+void CANAutoBaud::cancel()
+{
+	if (state == AUTOBAUD_LISTENING) state = AUTOBAUD_FAILED;
+}
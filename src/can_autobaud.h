@@ -0,0 +1,79 @@
+#ifndef _CAN_AUTOBAUD_
+#define _CAN_AUTOBAUD_
+
+#include <can_common.h>
+
+//How long to listen at each rate in milliseconds. A bus with traffic every 100ms needs at least that.
+#ifndef CAN_AUTOBAUD_DWELL
+#define CAN_AUTOBAUD_DWELL 250
+#endif
+
+#ifndef CAN_AUTOBAUD_MAX_RATES
+#define CAN_AUTOBAUD_MAX_RATES 12
+#endif
+
+enum CANAutoBaudState
+{
+    AUTOBAUD_IDLE = 0,
+    AUTOBAUD_LISTENING,     //trying a rate
+    AUTOBAUD_FOUND,         //getDetected() has the rate, the bus runs at it
+    AUTOBAUD_FAILED         //every rate tried for the given number of rounds
+};
+
+/*
+Finds the bitrate of a running bus without disturbing it. Drivers can build beginAutoSpeed() on
+it, sketches can use it directly on any CAN_COMMON.
+
+The bus is put in listen only mode so no error frames or acknowledges are sent while the rate is
+wrong, then each candidate rate is tried in turn. A rate is taken as soon as enough frames arrive
+with no new errors, and dropped as soon as the driver reports an error (or the receive error
+counter goes up) or after the dwell time passes in silence. Candidates start with the hint and
+go on from the most common rates in vehicles and industrial networks.
+
+Frames are seen through the bus statistics so the filters have to let something through - call
+watchFor() first unless the driver counts filter rejects. Frames received while probing are
+passed on as usual.
+*/
+class CANAutoBaud
+{
+public:
+    CANAutoBaud(CAN_COMMON &bus);
+
+    bool setCandidates(const uint32_t *rates, uint8_t count);
+    void setDwell(uint32_t millis);
+    void setRounds(uint8_t rounds);
+    void setFramesNeeded(uint8_t frames);
+
+    void start(uint32_t hint = 0);
+    CANAutoBaudState service();
+    uint32_t run(uint32_t timeoutMillis);
+    void cancel();
+
+    CANAutoBaudState getState() const { return state; }
+    uint32_t getDetected() const { return detected; }
+    uint32_t getCurrentRate() const { return (state == AUTOBAUD_LISTENING) ? order[current] : 0; }
+
+private:
+    void tryRate(uint8_t idx);
+    void nextRate();
+    uint32_t framesSeen(const CANStats &stats);
+
+    CAN_COMMON &bus;
+    uint32_t candidates[CAN_AUTOBAUD_MAX_RATES];
+    uint8_t numCandidates;
+    uint32_t order[CAN_AUTOBAUD_MAX_RATES + 1]; //hint first, then the candidates
+    uint8_t numOrder;
+    uint8_t current;
+    uint8_t round;
+    uint8_t rounds;         //0 = keep going until cancel()
+    uint8_t framesNeeded;
+    uint32_t dwell;
+    uint32_t rateStart;
+    uint32_t baseFrames;
+    uint32_t baseErrors;
+    uint8_t baseREC;
+    uint32_t detected;
+    CANAutoBaudState state;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "can_bittiming.h"
+
+/**
+ * \brief Sample point CiA recommends for a nominal bitrate
+ *
+ * \ret  Per mille, 875 up to 500k, 800 up to 800k, 750 above
+ */
+uint16_t CANBitTimingSolver::defaultSamplePoint(uint32_t bitrate)
+{
+	if (bitrate > 800000) return 750;
+	if (bitrate > 500000) return 800;
+	return 875;
+}
+
+//Data phase sample points, earlier as the bits get shorter
+uint16_t CANBitTimingSolver::defaultSamplePointFD(uint32_t dataRate)
+{
+	if (dataRate > 5000000) return 700;
+	if (dataRate > 2000000) return 750;
+	return 800;
+}
+
+bool CANBitTimingSolver::solve(const CANBitTimingLimits &limits, uint32_t bitrate, CANBitTiming &out)
+{
+	return solve(limits, bitrate, defaultSamplePoint(bitrate), out);
+}
+
+/**
+ * \brief Find the timing for one bitrate
+ *
+ * \param limits What the controller's registers can hold
+ * \param bitrate Wanted bitrate
+ * \param samplePoint Wanted sample point in per mille
+ * \param out Filled in if a setting was found
+ *
+ * \ret  false if no setting gets within CAN_BITTIMING_MAX_ERROR_PPM of the rate
+ */
+bool CANBitTimingSolver::solve(const CANBitTimingLimits &limits, uint32_t bitrate, uint16_t samplePoint, CANBitTiming &out)
+{
+	if (bitrate == 0 || limits.clock == 0 || samplePoint >= 1000) return false;
+
+	uint32_t tqMax = 1 + limits.tseg1Max + limits.tseg2Max;
+	uint32_t tqMin = 1 + limits.tseg1Min + limits.tseg2Min;
+	if (tqMin < 4) tqMin = 4; //sync + prop + phase1 + phase2, one each at least
+
+	uint64_t bestError = UINT64_MAX;
+	uint32_t bestSpError = UINT32_MAX;
+	bool found = false;
+
+	//most quanta first so ties go to the finest resolution
+	for (uint32_t tq = tqMax; tq >= tqMin; tq--)
+	{
+		uint64_t perBrp = (uint64_t)bitrate * tq;
+		uint64_t brp = (limits.clock + perBrp / 2) / perBrp;
+		if (brp < limits.brpMin || brp > limits.brpMax || brp == 0) continue;
+
+		uint64_t produced = brp * perBrp; //clock that would give the exact rate
+		uint64_t error = (produced > limits.clock) ? produced - limits.clock : limits.clock - produced;
+		if (error > bestError) continue;
+
+		//split the quanta around the sample point, then push back into what the registers allow
+		int32_t tseg2 = tq - (tq * samplePoint + 500) / 1000;
+		if (tseg2 < limits.tseg2Min) tseg2 = limits.tseg2Min;
+		if (tseg2 > limits.tseg2Max) tseg2 = limits.tseg2Max;
+		int32_t tseg1 = tq - 1 - tseg2;
+		if (tseg1 > limits.tseg1Max) tseg1 = limits.tseg1Max;
+		if (tseg1 < limits.tseg1Min) tseg1 = limits.tseg1Min;
+		tseg2 = tq - 1 - tseg1;
+		if (tseg2 < limits.tseg2Min || tseg2 > limits.tseg2Max || tseg2 < 1) continue;
+
+		uint32_t sp = (tq - tseg2) * 1000 / tq;
+		uint32_t spError = (sp > samplePoint) ? sp - samplePoint : samplePoint - sp;
+		if (error == bestError && spError >= bestSpError) continue;
+
+		bestError = error;
+		bestSpError = spError;
+		found = true;
+		out.brp = (uint16_t)brp;
+		out.tseg1 = (uint16_t)tseg1;
+		out.tseg2 = (uint8_t)tseg2;
+		out.samplePoint = (uint16_t)sp;
+		if (error == 0 && spError == 0) break;
+	}
+	if (!found) return false;
+
+	uint32_t tq = 1 + out.tseg1 + out.tseg2;
+	out.bitrate = (uint32_t)((limits.clock + (uint64_t)out.brp * tq / 2) / ((uint64_t)out.brp * tq));
+	out.errorPpm = (int32_t)(((int64_t)limits.clock - (int64_t)bitrate * out.brp * tq) * 1000000 / ((int64_t)bitrate * out.brp * tq));
+	uint8_t sjw = out.tseg2;
+	if (sjw > out.tseg1) sjw = out.tseg1;
+	if (sjw > limits.sjwMax) sjw = limits.sjwMax;
+	out.sjw = sjw ? sjw : 1;
+	out.tdc = false;
+	out.tdco = 0;
+
+	int32_t absError = out.errorPpm < 0 ? -out.errorPpm : out.errorPpm;
+	return absError <= CAN_BITTIMING_MAX_ERROR_PPM;
+}
+
+/**
+ * \brief Solve both phases of a CAN-FD setup
+ *
+ * \ret  false if either phase has no usable setting
+ *
+ * \note Transmitter delay compensation is needed once the transceiver loop delay gets near a data
+ * bit. It is turned on above 1 Mbit if dataLimits.tdcoMax isn't 0, with the offset clamped to it.
+ */
+bool CANBitTimingSolver::solveFD(const CANBitTimingLimits &nominalLimits, const CANBitTimingLimits &dataLimits,
+                                 uint32_t nominalRate, uint32_t dataRate, CANBitTiming &nominal, CANBitTiming &data)
+{
+	if (!solve(nominalLimits, nominalRate, nominal)) return false;
+	if (!solve(dataLimits, dataRate, defaultSamplePointFD(dataRate), data)) return false;
+
+	if (dataLimits.tdcoMax && dataRate > 1000000)
+	{
+		uint32_t offset = (uint32_t)data.brp * (1 + data.tseg1);
+		data.tdco = (offset > dataLimits.tdcoMax) ? dataLimits.tdcoMax : (uint8_t)offset;
+		data.tdc = true;
+	}
+	return true;
+}
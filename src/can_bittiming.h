@@ -0,0 +1,61 @@
+#ifndef _CAN_BITTIMING_
+#define _CAN_BITTIMING_
+
+#include <Arduino.h>
+
+//Largest bitrate error solve() accepts, in parts per million. CAN itself tolerates about 0.5% per node at best.
+#ifndef CAN_BITTIMING_MAX_ERROR_PPM
+#define CAN_BITTIMING_MAX_ERROR_PPM 5000
+#endif
+
+//What a controller's timing registers can hold. TSEG1 is propagation plus phase segment 1, all in time quanta.
+struct CANBitTimingLimits
+{
+    uint32_t clock;         //Hz going into the prescaler
+    uint16_t brpMin;
+    uint16_t brpMax;
+    uint16_t tseg1Min;
+    uint16_t tseg1Max;
+    uint8_t tseg2Min;
+    uint8_t tseg2Max;
+    uint8_t sjwMax;
+    uint8_t tdcoMax;        //transmitter delay compensation offset limit in clock periods, 0 if the controller has none
+};
+
+//One solved phase. Register encodings (value - 1 and the like) are left to the driver.
+struct CANBitTiming
+{
+    uint32_t bitrate;       //what the settings really give
+    int32_t errorPpm;       //bitrate - requested, in ppm of requested
+    uint16_t brp;
+    uint16_t tseg1;
+    uint8_t tseg2;
+    uint8_t sjw;
+    uint16_t samplePoint;   //per mille
+    uint8_t tdco;           //in controller clock periods (minimum time quanta), only valid if tdc is set
+    bool tdc;
+};
+
+/*
+Works out prescaler and segment lengths for a bitrate on a given controller, the same job every
+driver's set_baudrate does by hand or from a table. Rates are matched as exactly as the clock
+allows, and among the settings that match equally well the one nearest the wanted sample point
+with the most time quanta per bit wins. SJW is made as large as the controller and phase
+segment 2 allow since that gives the most tolerance for clock differences between nodes.
+
+For FD the data phase is solved the same way and, when the controller has it and the data rate is
+over 1 Mbit, transmitter delay compensation is turned on with the secondary sample point at the
+data phase sample point.
+*/
+class CANBitTimingSolver
+{
+public:
+    static bool solve(const CANBitTimingLimits &limits, uint32_t bitrate, uint16_t samplePoint, CANBitTiming &out);
+    static bool solve(const CANBitTimingLimits &limits, uint32_t bitrate, CANBitTiming &out);
+    static bool solveFD(const CANBitTimingLimits &nominalLimits, const CANBitTimingLimits &dataLimits,
+                        uint32_t nominalRate, uint32_t dataRate, CANBitTiming &nominal, CANBitTiming &data);
+    static uint16_t defaultSamplePoint(uint32_t bitrate);
+    static uint16_t defaultSamplePointFD(uint32_t dataRate);
+};
+
+#endif
@@ -0,0 +1,308 @@
+#include "can_capture.h"
+
+static const uint8_t captureMagic[6] = { 'C', 'A', 'N', 'C', 'A', 'P' };
+
+static inline uint8_t *putVarint(uint8_t *out, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+//Returns bytes used or 0 if the varint runs past end or is longer than 5 bytes
+static inline size_t getVarint(const uint8_t *in, const uint8_t *end, uint32_t &value)
+{
+	value = 0;
+	for (int i = 0; i < 5 && in + i < end; i++)
+	{
+		value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+		if (!(in[i] & 0x80)) return i + 1;
+	}
+	return 0;
+}
+
+//Signed deltas as varints: small steps either way stay small
+static inline uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+bool CANCaptureRecord::toFrame(CAN_FRAME &frame) const
+{
+	if (fdMode() || dlcCode > 8) return false;
+	frame.id = id;
+	frame.fid = 0;
+	frame.timestamp = (uint32_t)timestamp;
+	frame.rtr = rtr() ? 1 : 0;
+	frame.extended = extended();
+	frame.length = dlcCode;
+	frame.data.uint64 = 0;
+	if (!rtr()) memcpy(frame.data.uint8, data, dlcCode);
+	return true;
+}
+
+bool CANCaptureRecord::toFrameFD(CAN_FRAME_FD &frame) const
+{
+	uint8_t len = rtr() ? 0 : length();
+	frame.id = id;
+	frame.fid = 0;
+	frame.timestamp = (uint32_t)timestamp;
+	frame.rrs = rtr() ? 1 : 0;
+	frame.extended = extended();
+	frame.fdMode = fdMode() ? 1 : 0;
+	frame.length = length();
+	memcpy(frame.data.uint8, data, len);
+	if (len < 64) memset(frame.data.uint8 + len, 0, 64 - len);
+	return true;
+}
+
+CANCaptureWriter::CANCaptureWriter(CANCaptureSink sinkFunc, void *context)
+{
+	sink = sinkFunc;
+	sinkContext = context;
+	begin();
+}
+
+//Start a new capture. Not safe while write() may be running.
+void CANCaptureWriter::begin()
+{
+	fill[0] = fill[1] = 0;
+	ready[0] = ready[1] = false;
+	active = 0;
+	started = false;
+	lastTimestamp = 0;
+	dropped = 0;
+	written = 0;
+	memcpy(buffers[0], captureMagic, sizeof(captureMagic));
+	buffers[0][6] = CAN_CAPTURE_VERSION;
+	buffers[0][7] = 0;
+	fill[0] = CAN_CAPTURE_HEADER_SIZE;
+}
+
+/**
+ * \brief Encode one record
+ *
+ * \param out At least CAN_CAPTURE_MAX_RECORD bytes
+ * \param delta Time field as stored: zigzag encoded, except the whole timestamp in the first record
+ * \param length Payload length, already one FD can send (fdLengthDecoding[code])
+ *
+ * \ret  Size of the record
+ */
+size_t CANCaptureWriter::encode(uint8_t *out, uint32_t delta, uint8_t flags, uint32_t id, const uint8_t *payload, uint8_t length)
+{
+	uint8_t *p = putVarint(out, delta);
+	*p++ = flags | fdLengthEncoding[length];
+	p = putVarint(p, id);
+	if (!(flags & CAN_PACKED_RTR))
+	{
+		memcpy(p, payload, length);
+		p += length;
+	}
+	return p - out;
+}
+
+//Hand the active buffer over to service() and start filling the other one
+bool CANCaptureWriter::swap()
+{
+	uint8_t other = active ^ 1;
+	if (__atomic_load_n(&ready[other], __ATOMIC_ACQUIRE)) return false; //still being written out
+	fill[other] = 0;
+	__atomic_store_n(&ready[active], true, __ATOMIC_RELEASE);
+	active = other;
+	return true;
+}
+
+bool CANCaptureWriter::append(uint8_t flags, uint32_t id, uint32_t timestamp, const uint8_t *payload, uint8_t length)
+{
+	if (fill[active] + CAN_CAPTURE_MAX_RECORD > CAN_CAPTURE_BUFFER_SIZE && !swap())
+	{
+		dropped++;
+		return false;
+	}
+	uint32_t delta = started ? zigzag((int32_t)(timestamp - lastTimestamp)) : timestamp;
+	uint8_t *out = buffers[active] + fill[active];
+	uint8_t stored = fdLengthDecoding[fdLengthEncoding[length]];
+	if (stored > length && !(flags & CAN_PACKED_RTR))
+	{
+		//odd FD lengths are padded like the controller would
+		uint8_t padded[64];
+		memcpy(padded, payload, length);
+		memset(padded + length, 0, stored - length);
+		fill[active] += encode(out, delta, flags, id, padded, stored);
+	}
+	else fill[active] += encode(out, delta, flags, id, payload, stored);
+	lastTimestamp = timestamp;
+	started = true;
+	written++;
+	//pass it on as soon as it's full rather than waiting for the next frame
+	if (fill[active] + CAN_CAPTURE_MAX_RECORD > CAN_CAPTURE_BUFFER_SIZE) swap();
+	return true;
+}
+
+bool CANCaptureWriter::write(const CAN_FRAME &frame)
+{
+	uint8_t flags = (frame.extended ? CAN_PACKED_EXTENDED : 0) | (frame.rtr ? CAN_PACKED_RTR : 0);
+	return append(flags, frame.id, frame.timestamp, frame.data.uint8, frame.length > 8 ? 8 : frame.length);
+}
+
+bool CANCaptureWriter::writeFD(const CAN_FRAME_FD &frame)
+{
+	uint8_t flags = (frame.extended ? CAN_PACKED_EXTENDED : 0) | (frame.rrs ? CAN_PACKED_RTR : 0) | (frame.fdMode ? CAN_PACKED_FD : 0);
+	return append(flags, frame.id, frame.timestamp, frame.data.uint8, frame.length > 64 ? 64 : frame.length);
+}
+
+void CANCaptureWriter::gotFrame(CAN_FRAME *frame, int mailbox)
+{
+	write(*frame);
+}
+
+void CANCaptureWriter::gotFrameFD(CAN_FRAME_FD *frame, int mailbox)
+{
+	writeFD(*frame);
+}
+
+/**
+ * \brief Pass any full buffer to the sink
+ *
+ * \ret  Number of buffers written out
+ */
+int CANCaptureWriter::service()
+{
+	int count = 0;
+	//only one buffer can be waiting at a time, swap() won't hand over a second until the first is back
+	for (int i = 0; i < 2; i++)
+	{
+		if (!__atomic_load_n(&ready[i], __ATOMIC_ACQUIRE)) continue;
+		if (sink) sink(buffers[i], fill[i], sinkContext);
+		__atomic_store_n(&ready[i], false, __ATOMIC_RELEASE);
+		count++;
+	}
+	return count;
+}
+
+/**
+ * \brief Write out everything captured so far, including the part filled buffer
+ *
+ * \note Runs on the producer's side: stop feeding the writer first (remove it as a listener) or
+ * call this from the same context as write().
+ */
+void CANCaptureWriter::flush()
+{
+	service();
+	if (fill[active] > 0 && swap()) service();
+}
+
+CANCaptureReader::CANCaptureReader()
+{
+	data = NULL;
+	length = 0;
+	rewind();
+}
+
+CANCaptureReader::CANCaptureReader(const uint8_t *buffer, size_t size)
+{
+	attach(buffer, size);
+}
+
+/**
+ * \brief Read a capture from memory
+ *
+ * \ret  false if the data doesn't start with a capture header this code understands
+ */
+bool CANCaptureReader::attach(const uint8_t *buffer, size_t size)
+{
+	data = NULL;
+	length = 0;
+	if (buffer && size >= CAN_CAPTURE_HEADER_SIZE && !memcmp(buffer, captureMagic, sizeof(captureMagic)) && buffer[6] == CAN_CAPTURE_VERSION)
+	{
+		data = buffer;
+		length = size;
+	}
+	rewind();
+	return data != NULL;
+}
+
+void CANCaptureReader::rewind()
+{
+	pos = CAN_CAPTURE_HEADER_SIZE;
+	time = 0;
+}
+
+/**
+ * \brief Decode the record at offset
+ *
+ * \param record Gets the record. Its timestamp is added on to whatever record.timestamp already holds.
+ *
+ * \ret  Offset of the following record, or 0 at the end of the data or if the record is incomplete
+ */
+size_t CANCaptureReader::decode(size_t offset, CANCaptureRecord &record) const
+{
+	if (data == NULL || offset >= length) return 0;
+	const uint8_t *p = data + offset;
+	const uint8_t *end = data + length;
+	uint32_t delta;
+	size_t used = getVarint(p, end, delta);
+	if (!used) return 0;
+	p += used;
+	if (p >= end) return 0;
+	uint8_t head = *p++;
+	used = getVarint(p, end, record.id);
+	if (!used) return 0;
+	p += used;
+	record.flags = head & (CAN_PACKED_EXTENDED | CAN_PACKED_RTR | CAN_PACKED_FD);
+	record.dlcCode = head & 0x0F;
+	record.data = p;
+	if (!(head & CAN_PACKED_RTR)) p += fdLengthDecoding[record.dlcCode];
+	if (p > end) return 0;
+	if (offset == CAN_CAPTURE_HEADER_SIZE) record.timestamp += delta;
+	else
+	{
+		int64_t step = unzigzag(delta);
+		if (step >= 0 || record.timestamp > (uint64_t)-step) record.timestamp += step;
+		else record.timestamp = 0;
+	}
+	return p - data;
+}
+
+//Next record in the capture. false at the end.
+bool CANCaptureReader::next(CANCaptureRecord &record)
+{
+	record.timestamp = time;
+	size_t following = decode(pos, record);
+	if (!following) return false;
+	pos = following;
+	time = record.timestamp;
+	return true;
+}
+
+CANCaptureReader::iterator::iterator(const CANCaptureReader *r, size_t offset) : reader(r), pos(offset)
+{
+	record.timestamp = 0;
+	if (pos != SIZE_MAX) ++(*this);
+}
+
+CANCaptureReader::iterator &CANCaptureReader::iterator::operator++()
+{
+	size_t following = reader->decode(pos, record);
+	pos = following ? following : SIZE_MAX;
+	return *this;
+}
+
+CANCaptureReader::iterator CANCaptureReader::begin() const
+{
+	return iterator(this, data ? CAN_CAPTURE_HEADER_SIZE : SIZE_MAX);
+}
+
+CANCaptureReader::iterator CANCaptureReader::end() const
+{
+	return iterator(this, SIZE_MAX);
+}
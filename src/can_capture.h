@@ -0,0 +1,138 @@
+#ifndef _CAN_CAPTURE_
+#define _CAN_CAPTURE_
+
+#include <can_common.h>
+#include "can_packed.h"
+
+/*
+Compact binary bus log. A capture is an 8 byte header followed by one record per frame:
+
+    header      "CANCAP", version (1), reserved (0)
+    varint      timestamp minus the previous record's timestamp, zigzag encoded (0, -1, 1, -2 ... become
+                0, 1, 2, 3 ...) so a frame stamped before the one logged ahead of it costs a byte or two.
+                The first record stores the whole timestamp, not zigzag encoded.
+    byte        bits 0-3 DLC code (fdLengthEncoding), bit 4 extended, bit 5 RTR / RRS, bit 6 FD frame
+    varint      ID
+    payload     fdLengthDecoding[DLC code] bytes, none for RTR frames
+
+Varints are 7 bits per byte, low bits first, top bit set on every byte but the last. Timestamps are
+the frame's timestamp field (microseconds with most drivers), kept as signed 32 bit deltas so they
+may wrap. A classic 8 byte frame with an 11 bit ID takes 12-13 bytes, roughly what it takes on the
+wire.
+*/
+
+#define CAN_CAPTURE_HEADER_SIZE 8
+#define CAN_CAPTURE_VERSION 1
+//varint delta + flags + varint ID + payload
+#define CAN_CAPTURE_MAX_RECORD (5 + 1 + 5 + 64)
+
+//Size of each of the two writer buffers
+#ifndef CAN_CAPTURE_BUFFER_SIZE
+#define CAN_CAPTURE_BUFFER_SIZE 1024
+#endif
+
+//One decoded record. data points into the capture itself, nothing is copied until toFrame / toFrameFD.
+struct CANCaptureRecord
+{
+    uint64_t timestamp; //sum of all deltas so far, never wraps. Stops at 0 if stamps go back past the first one.
+    uint32_t id;
+    uint8_t flags;      //CAN_PACKED_EXTENDED / CAN_PACKED_RTR / CAN_PACKED_FD
+    uint8_t dlcCode;
+    const uint8_t *data;
+
+    bool extended() const { return (flags & CAN_PACKED_EXTENDED) != 0; }
+    bool rtr() const { return (flags & CAN_PACKED_RTR) != 0; }
+    bool fdMode() const { return (flags & CAN_PACKED_FD) != 0; }
+    uint8_t length() const { return fdLengthDecoding[dlcCode]; }
+    CANPayloadView payload() const { return CANPayloadView(data, rtr() ? 0 : length()); }
+
+    bool toFrame(CAN_FRAME &frame) const;
+    bool toFrameFD(CAN_FRAME_FD &frame) const;
+};
+
+//Gets each filled writer buffer, in order. Concatenating everything it is given makes the capture.
+typedef void (*CANCaptureSink)(const uint8_t *data, size_t length, void *context);
+
+/*
+Streaming capture writer with two buffers. write() (or the listener interface, so the writer can be
+attached to a bus and fed from its ISR) fills one buffer while the other is waiting to be passed to
+the sink by service(), which runs in loop() and is free to take its time writing to an SD card or
+a file. If both buffers are full the frame is dropped and counted.
+*/
+class CANCaptureWriter : public CANListener
+{
+public:
+    CANCaptureWriter(CANCaptureSink sink, void *context = NULL);
+
+    void begin();
+    bool write(const CAN_FRAME &frame);
+    bool writeFD(const CAN_FRAME_FD &frame);
+    int service();
+    void flush();
+    uint32_t getDropped() const { return dropped; }
+    uint32_t getWritten() const { return written; }
+
+    void gotFrame(CAN_FRAME *frame, int mailbox);
+    void gotFrameFD(CAN_FRAME_FD *frame, int mailbox);
+
+    static size_t encode(uint8_t *out, uint32_t delta, uint8_t flags, uint32_t id, const uint8_t *payload, uint8_t length);
+
+private:
+    bool append(uint8_t flags, uint32_t id, uint32_t timestamp, const uint8_t *payload, uint8_t length);
+    bool swap();
+
+    CANCaptureSink sink;
+    void *sinkContext;
+    uint8_t buffers[2][CAN_CAPTURE_BUFFER_SIZE];
+    uint16_t fill[2];
+    bool ready[2];      //set by the producer when a buffer is full, cleared by service() once it's been written out
+    uint8_t active;     //buffer the producer is filling
+    bool started;       //a record has been written, lastTimestamp is valid
+    uint32_t lastTimestamp;
+    uint32_t dropped;
+    uint32_t written;
+};
+
+/*
+Walks the records of a capture held in memory (a buffer, flash, or a memory mapped file). Records
+are decoded in place. Stops at the end of the data or at the first record that is cut short.
+*/
+class CANCaptureReader
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const CANCaptureReader *reader, size_t offset);
+        const CANCaptureRecord &operator*() const { return record; }
+        const CANCaptureRecord *operator->() const { return &record; }
+        iterator &operator++();
+        bool operator!=(const iterator &other) const { return pos != other.pos; }
+    private:
+        const CANCaptureReader *reader;
+        size_t pos;   //offset of the record after this one, or SIZE_MAX at the end
+        CANCaptureRecord record;
+    };
+
+    CANCaptureReader();
+    CANCaptureReader(const uint8_t *data, size_t length);
+
+    bool attach(const uint8_t *data, size_t length);
+    bool isValid() const { return data != NULL; }
+    bool next(CANCaptureRecord &record);
+    void rewind();
+    size_t offset() const { return pos; }
+
+    iterator begin() const;
+    iterator end() const;
+
+    size_t decode(size_t offset, CANCaptureRecord &record) const;
+
+private:
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+    uint64_t time;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include <can_common.h>
+#include "can_value_cache.h"
 
 //CAN FD only allows discrete frame lengths after the normal CAN 8 byte limit. They are encoded below
 //as a FLASH based look up table for ease of use
@@ -7,6 +8,9 @@ const uint8_t fdLengthEncoding[65] = {0 ,1 ,2 ,3 ,4 ,5 ,6 ,7 ,8 ,9 ,9 ,9 ,9 ,10,
 								  13,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,
 								  14,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15};
 
+//and the other way - number of data bytes for each of the 16 DLC codes
+const uint8_t fdLengthDecoding[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
 CAN_FRAME::CAN_FRAME()
 {
 	id = 0;
@@ -32,11 +36,15 @@ CAN_FRAME_FD::CAN_FRAME_FD()
 	for (int i = 0; i < 8; i++) data.uint64[i] = 0;
 }
 
+uint32_t CANListener::changeCount = 0;
+
 CANListener::CANListener()
 {
-	callbacksActive = 0;
+	memset(callbacksActive, 0, sizeof(callbacksActive));
 	generalCBActive = false;
-    numFilters = 32;
+    numFilters = CAN_MAX_MAILBOXES;
+    owner = NULL;
+    onlyOnChange = false;
 }
 
 //an empty version so that the linker doesn't complain that no implementation exists.
@@ -50,43 +58,67 @@ void CANListener::gotFrameFD(CAN_FRAME_FD *frame, int mailbox)
 
 }
 
+//Let the buses know their fan-out lists need rebuilding. The one we were attached to last does it now (or after its
+//current dispatch if this came from one of its callbacks), others at their next poll() / updateListeners(). Until
+//then they dispatch straight from their listener tables so the change is never missed.
+void CANListener::changed()
+{
+	__atomic_fetch_add(&changeCount, 1, __ATOMIC_RELEASE);
+	if (owner) owner->updateListeners();
+}
+
+/**
+ * \brief Only hand over frames whose payload differs from the last one with the same ID
+ *
+ * \note Needs a CANValueCache attached to the bus tracking the IDs. Frames of untracked IDs always count as changed.
+ */
+void CANListener::setOnlyOnChange(bool state)
+{
+	__atomic_store_n(&onlyOnChange, state, __ATOMIC_RELAXED);
+}
+
 void CANListener::setCallback(uint8_t mailBox)
 {
-	if ( mailBox < numFilters )
+	if ( mailBox < numFilters && mailBox < CAN_MAX_MAILBOXES )
 	{
-		callbacksActive |= (1<<mailBox);
+		__atomic_fetch_or(&callbacksActive[mailBox / 32], 1ul << (mailBox & 31), __ATOMIC_RELAXED); //the receive context may be clearing another bit
+		changed();
 	}
 }
 
 void CANListener::removeCallback(uint8_t mailBox)
 {
-	if ( mailBox < numFilters )
+	if ( mailBox < numFilters && mailBox < CAN_MAX_MAILBOXES )
 	{
-		callbacksActive &= ~(1ull<<mailBox);
+		__atomic_fetch_and(&callbacksActive[mailBox / 32], ~(1ul << (mailBox & 31)), __ATOMIC_RELAXED);
+		changed();
 	}  
 }
 
 void CANListener::setGeneralHandler()
 {
-	generalCBActive = true;
+	__atomic_store_n(&generalCBActive, true, __ATOMIC_RELAXED);
+	changed();
 }
 
 void CANListener::removeGeneralHandler()
 {
-	generalCBActive = false;
+	__atomic_store_n(&generalCBActive, false, __ATOMIC_RELAXED);
+	changed();
 }
 
 void CANListener::initialize()
 {
-   callbacksActive = 0;
+   for (int i = 0; i < CAN_MAILBOX_WORDS; i++) __atomic_store_n(&callbacksActive[i], 0, __ATOMIC_RELAXED);
+   changed();
 }
 
 bool CANListener::isCallbackActive(int callback)
 {
-	if (callback == -1) return generalCBActive;
+	if (callback == -1) return __atomic_load_n(&generalCBActive, __ATOMIC_RELAXED);
 
-	if (callback < numFilters)
-		return (callbacksActive & (1ull << callback))?true:false;
+	if (callback >= 0 && callback < numFilters && callback < CAN_MAX_MAILBOXES)
+		return (__atomic_load_n(&callbacksActive[callback / 32], __ATOMIC_RELAXED) & (1ul << (callback & 31)))?true:false;
 
 	return false;
 }
@@ -94,6 +126,7 @@ bool CANListener::isCallbackActive(int callback)
 void CANListener::setNumFilters(int numFilt)
 {
 	numFilters = numFilt;
+	changed();
 }
 
 /*
@@ -103,9 +136,9 @@ and they've got blank or very simple implementations below.
 
 CAN_COMMON::CAN_COMMON(int numFilt)
 {
-    numFilters = numFilt;
-    memset(cbCANFrame, 0, 4 * numFilters);
-	memset(cbCANFrameFD, 0, 4 * numFilters);
+    numFilters = (numFilt > CAN_MAX_MAILBOXES) ? CAN_MAX_MAILBOXES : numFilt;
+    memset(cbCANFrame, 0, sizeof(cbCANFrame));
+	memset(cbCANFrameFD, 0, sizeof(cbCANFrameFD));
 
     cbGeneral = NULL;
 	cbGeneralFD = NULL;
@@ -117,7 +150,30 @@ CAN_COMMON::CAN_COMMON(int numFilt)
     txFault = false;
 	debuggingMode = false;
 	fdSupported = false;
-    for (int i = 0; i < SIZE_LISTENERS; i++) listener[i] = 0;
+    listenerSlots = CAN_LISTENER_TABLE_START;
+    listenerTable = new CANListener *[listenerSlots];
+    for (int i = 0; i < listenerSlots; i++) listenerTable[i] = 0;
+    listenerMap = NULL;
+    listenerVersion = CANListener::changeCount;
+    inDispatch = 0;
+	idDispatch = NULL;
+	softFilter = NULL;
+	valueCache = NULL;
+	latencyStats = NULL;
+	timeCallbacks = false;
+	dispatchMode = CAN_DISPATCH_IMMEDIATE;
+	handlerBudget = 0;
+}
+
+CAN_COMMON::~CAN_COMMON()
+{
+	for (int i = 0; i < listenerSlots; i++)
+	{
+		if (listenerTable[i] && listenerTable[i]->owner == this) listenerTable[i]->owner = NULL;
+	}
+	delete[] listenerTable;
+	freeListenerMap(listenerMap);
+	delete idDispatch;
 }
 
 void CAN_COMMON::setDebuggingMode(bool mode)
@@ -213,33 +269,154 @@ uint32_t CAN_COMMON::getDataSpeedFD()
 	return 0;
 }
 
+/**
+ * \brief Register a listener object
+ *
+ * \ret  true. The listener table grows as needed, there is no fixed limit any more.
+ *
+ * \note Like before, this clears the listener's mailbox registrations. Call setCallback / setGeneralHandler afterwards.
+ */
 boolean CAN_COMMON::attachObj(CANListener *listener)
 {
-	for (int i = 0; i < SIZE_LISTENERS; i++)
+	int slot = -1;
+	for (int i = 0; i < listenerSlots; i++)
 	{
-		if (this->listener[i] == NULL)
+		if (listenerTable[i] == NULL)
 		{
-			this->listener[i] = listener;
-			listener->initialize();
-			return true;
+			slot = i;
+			break;
 		}
 	}
-	return false;
+	if (slot == -1)
+	{
+		CANListener **bigger = new CANListener *[listenerSlots * 2];
+		for (int i = 0; i < listenerSlots * 2; i++) bigger[i] = (i < listenerSlots) ? listenerTable[i] : NULL;
+		CANListener **old = listenerTable;
+		noInterrupts();
+		listenerTable = bigger;
+		slot = listenerSlots;
+		listenerSlots *= 2;
+		interrupts();
+		delete[] old;
+	}
+	noInterrupts();
+	listenerTable[slot] = listener;
+	listener->owner = this;
+	interrupts();
+	listener->initialize(); //rebuilds the lists through owner
+	return true;
 }
 
 boolean CAN_COMMON::detachObj(CANListener *listener)
 {
-	for (int i = 0; i < SIZE_LISTENERS; i++)
+	for (int i = 0; i < listenerSlots; i++)
 	{
-		if (this->listener[i] == listener)
+		if (listenerTable[i] == listener)
 		{
-			this->listener[i] = NULL;
+			noInterrupts();
+			listenerTable[i] = NULL;
+			if (listener->owner == this) listener->owner = NULL;
+			//a dispatch in progress keeps walking the current map until it can be rebuilt, so take the listener out of it now
+			if (listenerMap)
+			{
+				for (int n = 0; n < listenerMap->start[numFilters + 1]; n++)
+				{
+					if (listenerMap->entries[n] == listener) listenerMap->entries[n] = NULL;
+				}
+			}
+			interrupts();
+			updateListeners();
 			return true;
 		}
 	}
 	return false;
 }
 
+int CAN_COMMON::getListenerCount()
+{
+	int count = 0;
+	for (int i = 0; i < listenerSlots; i++)
+	{
+		if (listenerTable[i]) count++;
+	}
+	return count;
+}
+
+/*
+Work out which listeners want which mailbox, laid out so dispatch can walk just those. Buckets are
+the mailboxes 0 .. numFilters - 1 then one for general handlers. Returns NULL if nobody wants anything.
+*/
+CANListenerMap *CAN_COMMON::buildListenerMap()
+{
+	int buckets = numFilters + 1;
+	uint16_t total = 0;
+	for (int i = 0; i < listenerSlots; i++)
+	{
+		if (listenerTable[i] == NULL) continue;
+		for (int mb = -1; mb < numFilters; mb++)
+		{
+			if (listenerTable[i]->isCallbackActive(mb)) total++;
+		}
+	}
+	if (total == 0) return NULL;
+
+	CANListenerMap *map = new CANListenerMap;
+	map->start = new uint16_t[buckets + 1];
+	map->entries = new CANListener *[total];
+	uint16_t n = 0;
+	for (int bucket = 0; bucket < buckets; bucket++)
+	{
+		int mb = (bucket == numFilters) ? -1 : bucket;
+		map->start[bucket] = n;
+		for (int i = 0; i < listenerSlots; i++)
+		{
+			if (listenerTable[i] && listenerTable[i]->isCallbackActive(mb)) map->entries[n++] = listenerTable[i];
+		}
+	}
+	map->start[buckets] = n;
+	return map;
+}
+
+void CAN_COMMON::freeListenerMap(CANListenerMap *map)
+{
+	if (map == NULL) return;
+	delete[] map->start;
+	delete[] map->entries;
+	delete map;
+}
+
+/**
+ * \brief Rebuild the per mailbox listener lists
+ *
+ * \note Done automatically by attachObj / detachObj and when a listener attached to this bus changes
+ * its registrations. A listener attached to several buses only updates the last one straight away,
+ * the others catch up at their next poll(), attachObj(), detachObj() or updateListeners().
+ *
+ * Nothing is allocated or freed while this bus is dispatching a frame: called from one of its
+ * callbacks this only leaves the lists marked out of date. Dispatch notices that and walks the
+ * listener table directly, so changes made from a callback or for another bus take effect with
+ * the next frame either way, the lists only make it faster.
+ */
+void CAN_COMMON::updateListeners()
+{
+	if (__atomic_load_n(&inDispatch, __ATOMIC_ACQUIRE)) return; //listenerVersion stays behind so the rebuild isn't forgotten
+	uint32_t version = __atomic_load_n(&CANListener::changeCount, __ATOMIC_ACQUIRE);
+	//built with interrupts on, the receive context only ever reads the table. Only the swap is held off.
+	CANListenerMap *map = buildListenerMap();
+	noInterrupts();
+	if (__atomic_load_n(&inDispatch, __ATOMIC_ACQUIRE))
+	{
+		interrupts();
+		freeListenerMap(map);
+		return;
+	}
+	CANListenerMap *old = listenerMap;
+	listenerMap = map;
+	__atomic_store_n(&listenerVersion, version, __ATOMIC_RELEASE);
+	interrupts();
+	freeListenerMap(old);
+}
+
 /**
  * \brief Set up a general callback that will be used if no callback was registered for receiving mailbox
  *
@@ -351,14 +528,11 @@ int CAN_COMMON::watchFor(uint32_t id, uint32_t mask)
 }
 
 //A bit more complicated. Makes sure that the range from id1 to id2 is let through. This might open
-//the floodgates if you aren't careful.
-//There are undoubtedly better ways to calculate the proper values for the filter but this way seems to work.
-//It'll be kind of slow if you try to let a huge span through though.
+//the floodgates if you aren't careful. Use CANFilterPlanner if you need a tighter fit over several filters.
 int CAN_COMMON::watchForRange(uint32_t id1, uint32_t id2)
 {
 	uint32_t id = 0;
 	uint32_t mask = 0;
-	uint32_t temp;
 
 	if (id1 > id2) 
 	{   //looks funny I know. In place swap with no temporary storage. Neato!
@@ -367,38 +541,581 @@ int CAN_COMMON::watchForRange(uint32_t id1, uint32_t id2)
 		id1 = id1 ^ id2;
 	}
 
-	id = id1;
-
 	if (id2 <= 0x7FF) mask = 0x7FF;
 	else mask = 0x1FFFFFFF;
 
 	/* Here is a quick overview of the theory behind these calculations.
-	   We start with mask set to 11 or 29 set bits (all 1's)
-	   and id set to the lowest ID in the range.
-	   From there we go through every single ID possible in the range. For each ID
-	   we AND with the current ID. At the end only bits that never changed and were 1's
-	   will still be 1's. This yields the ID we can match against to let these frames through
-	   The mask is calculated by finding the bitfield difference between the lowest ID and
-	   the current ID. This calculation will be 1 anywhere the bits were different. We invert
-	   this so that it is 1 anywhere the bits where the same. Then we AND with the current Mask.
-	   At the end the mask will be 1 anywhere the bits never changed. This is the perfect mask.
+	   Counting from id1 up to id2 every bit at or below the highest bit where id1 and id2 differ
+	   takes on both values somewhere along the way (the count has to carry into that bit).
+	   Every bit above it never changes. So the mask is just the bits above the highest
+	   differing bit and the ID is id1 with everything below that cleared.
+	   This used to be found by walking every ID in the range which got very slow for big 29 bit spans.
 	*/
-	for (uint32_t c = id1; c <= id2; c++)
+	uint32_t diff = id1 ^ id2;
+	if (diff)
 	{
-		id &= c;
-		temp = (~(id1 ^ c)) & 0x1FFFFFFF;
-		mask &= temp;
+		int highBit = 31 - __builtin_clz(diff);
+		if (highBit >= 31) mask = 0;
+		else mask &= ~((1ul << (highBit + 1)) - 1);
 	}
-	//output of the above crazy loop is actually the end result.
+	id = id1 & mask;
+
 	if (id > 0x7FF) return setRXFilter(id, mask, true);
 	else return setRXFilter(id, mask, false);
 }
 
+/**
+ * \brief Give the common layer storage to queue received frames in
+ *
+ * \param buffer Array of frames that will be used as a ring buffer
+ * \param size Number of frames in buffer. Must be a power of two.
+ *
+ * \ret  true if the buffer was accepted
+ *
+ * \note Drivers that don't do their own buffering call queueRXFrame from the receive interrupt and the
+ * default rx_avail / available / get_rx_buff pull from this ring. No interrupt masking is needed as long as
+ * there is only one producer (the ISR) and one consumer (the main loop).
+ */
+bool CAN_COMMON::setRXBuffer(CAN_FRAME *buffer, uint16_t size)
+{
+	return rxRing.attach(buffer, size);
+}
+
+bool CAN_COMMON::setRXBufferFD(CAN_FRAME_FD *buffer, uint16_t size)
+{
+	return rxRingFD.attach(buffer, size);
+}
+
+/**
+ * \brief Queue a received frame into the common RX ring
+ *
+ * \param frame The frame to queue. It is copied.
+ *
+ * \ret  true if queued, false if the ring was full or no buffer was set
+ */
+bool CAN_COMMON::queueRXFrame(CAN_FRAME &frame)
+{
+	return rxRing.push(frame);
+}
+
+bool CAN_COMMON::queueRXFrameFD(CAN_FRAME_FD &frame)
+{
+	return rxRingFD.push(frame);
+}
+
+/**
+ * \brief Work out which mailbox the hardware would have put a frame with this ID in
+ *
+ * \ret  Mailbox / filter number, or -1 if no filter takes the ID
+ *
+ * \note The default doesn't know the driver's filters and always says -1, so frames fed through
+ * receiveFrame go to the general callbacks. Drivers that keep a copy of their filters override it.
+ */
+int CAN_COMMON::findMailbox(uint32_t /*id*/, bool /*extended*/)
+{
+	return -1;
+}
+
+bool CAN_COMMON::rx_avail()
+{
+	return !rxRing.isEmpty();
+}
+
+uint16_t CAN_COMMON::available()
+{
+	return rxRing.count();
+}
+
+uint32_t CAN_COMMON::get_rx_buff(CAN_FRAME &msg)
+{
+	return rxRing.pop(msg) ? 1 : 0;
+}
+
+/**
+ * \brief Send frames with a given ID to a callback, regardless of which mailbox received them
+ *
+ * \param id The CAN ID. IDs over 0x7FF are treated as extended.
+ * \param cb A function pointer to a function with prototype "void functionname(CAN_FRAME *frame);"
+ *
+ * \ret  true if the ID was registered
+ *
+ * \note This is a software table looked at before the mailbox callbacks. It is handy once the hardware
+ * filters have run out: open the filters wide and route here instead. The table (about 5k) is allocated
+ * the first time one of these functions is called.
+ *
+ * A frame with a callback here goes to that callback only. Mailbox callbacks, listeners and the general
+ * callback never see it, and it is handed over even when it repeats the last payload (setOnlyOnChange()
+ * is for listeners). Frames without an entry, or a classic frame whose ID only has an onIdFD() callback,
+ * carry on to the mailbox callbacks as usual.
+ */
+bool CAN_COMMON::onId(uint32_t id, void (*cb)(CAN_FRAME *))
+{
+	return onId(id, (id > 0x7FF), cb);
+}
+
+bool CAN_COMMON::onId(uint32_t id, bool extended, void (*cb)(CAN_FRAME *))
+{
+	if (!idDispatch) idDispatch = new CANDispatchTable();
+	return idDispatch->onId(id, extended, cb);
+}
+
+bool CAN_COMMON::onIdFD(uint32_t id, bool extended, void (*cb)(CAN_FRAME_FD *))
+{
+	if (!idDispatch) idDispatch = new CANDispatchTable();
+	return idDispatch->onIdFD(id, extended, cb);
+}
+
+bool CAN_COMMON::onRange(uint32_t lo, uint32_t hi, void (*cb)(CAN_FRAME *))
+{
+	return onRange(lo, hi, (lo > 0x7FF || hi > 0x7FF), cb);
+}
+
+bool CAN_COMMON::onRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *))
+{
+	if (!idDispatch) idDispatch = new CANDispatchTable();
+	return idDispatch->onRange(lo, hi, extended, cb);
+}
+
+bool CAN_COMMON::onRangeFD(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME_FD *))
+{
+	if (!idDispatch) idDispatch = new CANDispatchTable();
+	return idDispatch->onRangeFD(lo, hi, extended, cb);
+}
+
+void CAN_COMMON::removeId(uint32_t id, bool extended)
+{
+	if (idDispatch) idDispatch->removeId(id, extended);
+}
+
+void CAN_COMMON::removeRange(uint32_t lo, uint32_t hi, bool extended)
+{
+	if (idDispatch) idDispatch->removeRange(lo, hi, extended);
+}
+
+/**
+ * \brief Hand a received frame to whatever callbacks want it
+ *
+ * \param frame The received frame
+ * \param mailbox Mailbox / filter that accepted the frame or -1 if unknown
+ * \param unchanged The frame repeats its ID's last payload, listeners set to setOnlyOnChange() skip it
+ *
+ * \ret  true if at least one callback or listener took the frame
+ *
+ * \note Order is: ID table, mailbox callback, listeners registered on the mailbox, then the general
+ * callback or listeners registered as general handlers if nothing else matched. Whichever matches
+ * first takes the frame, so an ID table entry hides the frame from everything after it.
+ */
+bool CAN_COMMON::dispatchFrame(CAN_FRAME &frame, int mailbox, bool unchanged)
+{
+	if (idDispatch && idDispatch->dispatch(frame)) return true;
+
+	//registrations changed since the map was built (from a callback, or for another bus) can't be
+	//rebuilt here, nothing is allocated in the receive context, so walk the listener table instead
+	bool stale = __atomic_load_n(&listenerVersion, __ATOMIC_ACQUIRE) != __atomic_load_n(&CANListener::changeCount, __ATOMIC_ACQUIRE);
+	//the map is never rebuilt in here, a callback changing registrations only marks it out of date
+	__atomic_fetch_add(&inDispatch, 1, __ATOMIC_ACQUIRE);
+	bool handled = dispatchListeners(frame, mailbox, unchanged, stale);
+	__atomic_fetch_sub(&inDispatch, 1, __ATOMIC_RELEASE);
+	return handled;
+}
+
+bool CAN_COMMON::dispatchListeners(CAN_FRAME &frame, int mailbox, bool unchanged, bool stale)
+{
+	const CANListenerMap *map = stale ? NULL : listenerMap;
+	if (mailbox >= 0 && mailbox < numFilters)
+	{
+		if (cbCANFrame[mailbox])
+		{
+			cbCANFrame[mailbox](&frame);
+			return true;
+		}
+		if (stale && walkListenerTable(&frame, (CAN_FRAME_FD *)NULL, mailbox, unchanged)) return true;
+		if (map && map->start[mailbox] != map->start[mailbox + 1])
+		{
+			for (int i = map->start[mailbox]; i < map->start[mailbox + 1]; i++)
+			{
+				CANListener *l = map->entries[i];
+				if (l && l->isCallbackActive(mailbox) && (!unchanged || !__atomic_load_n(&l->onlyOnChange, __ATOMIC_RELAXED))) l->gotFrame(&frame, mailbox);
+			}
+			return true;
+		}
+	}
+
+	if (cbGeneral)
+	{
+		cbGeneral(&frame);
+		return true;
+	}
+	if (stale) return walkListenerTable(&frame, (CAN_FRAME_FD *)NULL, -1, unchanged);
+	if (map == NULL) return false;
+	for (int i = map->start[numFilters]; i < map->start[numFilters + 1]; i++)
+	{
+		CANListener *l = map->entries[i];
+		if (l && l->isCallbackActive(-1) && (!unchanged || !__atomic_load_n(&l->onlyOnChange, __ATOMIC_RELAXED))) l->gotFrame(&frame, -1);
+	}
+	return map->start[numFilters] != map->start[numFilters + 1];
+}
+
+//Slow path while the map is out of date: every attached listener registered on the mailbox (-1 for general
+//handlers), in table order. Exactly one of frame / frameFD is set.
+bool CAN_COMMON::walkListenerTable(CAN_FRAME *frame, CAN_FRAME_FD *frameFD, int mailbox, bool unchanged)
+{
+	bool found = false;
+	for (int i = 0; i < listenerSlots; i++)
+	{
+		CANListener *l = listenerTable[i];
+		if (l == NULL || !l->isCallbackActive(mailbox)) continue;
+		found = true;
+		if (unchanged && __atomic_load_n(&l->onlyOnChange, __ATOMIC_RELAXED)) continue;
+		if (frame) l->gotFrame(frame, mailbox);
+		else l->gotFrameFD(frameFD, mailbox);
+	}
+	return found;
+}
+
+bool CAN_COMMON::dispatchFrameFD(CAN_FRAME_FD &frame, int mailbox, bool unchanged)
+{
+	if (idDispatch && idDispatch->dispatchFD(frame)) return true;
+
+	//registrations changed since the map was built (from a callback, or for another bus) can't be
+	//rebuilt here, nothing is allocated in the receive context, so walk the listener table instead
+	bool stale = __atomic_load_n(&listenerVersion, __ATOMIC_ACQUIRE) != __atomic_load_n(&CANListener::changeCount, __ATOMIC_ACQUIRE);
+	//the map is never rebuilt in here, a callback changing registrations only marks it out of date
+	__atomic_fetch_add(&inDispatch, 1, __ATOMIC_ACQUIRE);
+	bool handled = dispatchListenersFD(frame, mailbox, unchanged, stale);
+	__atomic_fetch_sub(&inDispatch, 1, __ATOMIC_RELEASE);
+	return handled;
+}
+
+bool CAN_COMMON::dispatchListenersFD(CAN_FRAME_FD &frame, int mailbox, bool unchanged, bool stale)
+{
+	const CANListenerMap *map = stale ? NULL : listenerMap;
+	if (mailbox >= 0 && mailbox < numFilters)
+	{
+		if (cbCANFrameFD[mailbox])
+		{
+			cbCANFrameFD[mailbox](&frame);
+			return true;
+		}
+		if (stale && walkListenerTable((CAN_FRAME *)NULL, &frame, mailbox, unchanged)) return true;
+		if (map && map->start[mailbox] != map->start[mailbox + 1])
+		{
+			for (int i = map->start[mailbox]; i < map->start[mailbox + 1]; i++)
+			{
+				CANListener *l = map->entries[i];
+				if (l && l->isCallbackActive(mailbox) && (!unchanged || !__atomic_load_n(&l->onlyOnChange, __ATOMIC_RELAXED))) l->gotFrameFD(&frame, mailbox);
+			}
+			return true;
+		}
+	}
+
+	if (cbGeneralFD)
+	{
+		cbGeneralFD(&frame);
+		return true;
+	}
+	if (stale) return walkListenerTable((CAN_FRAME *)NULL, &frame, -1, unchanged);
+	if (map == NULL) return false;
+	for (int i = map->start[numFilters]; i < map->start[numFilters + 1]; i++)
+	{
+		CANListener *l = map->entries[i];
+		if (l && l->isCallbackActive(-1) && (!unchanged || !__atomic_load_n(&l->onlyOnChange, __ATOMIC_RELAXED))) l->gotFrameFD(&frame, -1);
+	}
+	return map->start[numFilters] != map->start[numFilters + 1];
+}
+
+/**
+ * \brief Filter received frames in software
+ *
+ * \param filter Frames none of its filters match are counted as filter rejects and go no further.
+ * NULL to take everything again.
+ *
+ * \note Meant for when the application needs more IDs than the controller has filters: open the
+ * hardware with watchFor() and list the IDs here. The filter is read from receiveFrame (usually the
+ * ISR) so don't change it while the bus is running.
+ */
+void CAN_COMMON::setSoftFilter(const CANSoftFilter *filter)
+{
+	softFilter = filter;
+}
+
+/**
+ * \brief Keep a CANValueCache up to date from this bus
+ *
+ * \param cache Updated for every received frame (after the soft filter), NULL to stop
+ *
+ * \note Listeners set to setOnlyOnChange() skip frames the cache reports as repeats
+ */
+void CAN_COMMON::attachValueCache(CANValueCache *cache)
+{
+	valueCache = cache;
+}
+
+/**
+ * \brief Entry point for drivers: dispatch a received frame and buffer it if no callback wanted it
+ *
+ * \ret  false only if the frame was dropped because the RX ring was full (or not set up)
+ */
+bool CAN_COMMON::receiveFrame(CAN_FRAME &frame, int mailbox)
+{
+	timeBase.update(frame.timestamp);
+	if (softFilter && !softFilter->accepts(frame.id, frame.extended))
+	{
+		stats.countFilterReject();
+		return true;
+	}
+	stats.countRX(frame);
+	bool unchanged = valueCache && !valueCache->update(frame);
+	if (dispatchMode == CAN_DISPATCH_DEFERRED)
+	{
+		CANDeferredFrame entry;
+		entry.frame = frame;
+		entry.arrival = micros();
+		entry.mailbox = (int8_t)mailbox;
+		entry.unchanged = unchanged;
+		if (deferredRing.push(entry)) return true;
+		stats.countDeferredDropped();
+		return false;
+	}
+	return finishReceive(frame, mailbox, (latencyStats || timeCallbacks) ? micros() : 0, unchanged);
+}
+
+bool CAN_COMMON::receiveFrameFD(CAN_FRAME_FD &frame, int mailbox)
+{
+	timeBase.update(frame.timestamp);
+	if (softFilter && !softFilter->accepts(frame.id, frame.extended))
+	{
+		stats.countFilterReject();
+		return true;
+	}
+	stats.countRXFD(frame);
+	bool unchanged = valueCache && !valueCache->updateFD(frame);
+	//without an FD deferred ring FD frames are dispatched straight away rather than lost
+	if (dispatchMode == CAN_DISPATCH_DEFERRED && deferredRingFD.isAttached())
+	{
+		CANDeferredFrameFD entry;
+		entry.frame = frame;
+		entry.arrival = micros();
+		entry.mailbox = (int8_t)mailbox;
+		entry.unchanged = unchanged;
+		if (deferredRingFD.push(entry)) return true;
+		stats.countDeferredDropped();
+		return false;
+	}
+	return finishReceiveFD(frame, mailbox, (latencyStats || timeCallbacks) ? micros() : 0, unchanged);
+}
+
+//Dispatch, then buffer the frame if nobody took it. arrival is only used when latency or callback timing is on.
+bool CAN_COMMON::finishReceive(CAN_FRAME &frame, int mailbox, uint32_t arrival, bool unchanged)
+{
+	uint32_t start = (timeCallbacks || handlerBudget) ? micros() : 0;
+	bool handled = dispatchFrame(frame, mailbox, unchanged);
+	noteDispatched(handled, arrival, start);
+	if (handled || queueRXFrame(frame)) return true;
+	stats.countRXDropped();
+	return false;
+}
+
+bool CAN_COMMON::finishReceiveFD(CAN_FRAME_FD &frame, int mailbox, uint32_t arrival, bool unchanged)
+{
+	uint32_t start = (timeCallbacks || handlerBudget) ? micros() : 0;
+	bool handled = dispatchFrameFD(frame, mailbox, unchanged);
+	noteDispatched(handled, arrival, start);
+	if (handled || queueRXFrameFD(frame)) return true;
+	stats.countRXDropped();
+	return false;
+}
+
+void CAN_COMMON::noteDispatched(bool handled, uint32_t arrival, uint32_t start)
+{
+	if (!latencyStats && !timeCallbacks && !handlerBudget) return;
+	uint32_t now = micros();
+	if (latencyStats) latencyStats->rxToDispatch.record(now - arrival);
+	if (!handled) return;
+	if (timeCallbacks) stats.countCallback(now - start);
+	if (handlerBudget && (now - start) > handlerBudget) stats.countHandlerOverrun();
+}
+
+/**
+ * \brief Choose whether callbacks run in the receive interrupt or later from poll()
+ *
+ * \param mode CAN_DISPATCH_IMMEDIATE (the default) or CAN_DISPATCH_DEFERRED
+ *
+ * \ret  false if deferred mode was asked for before setDeferredBuffer gave it somewhere to queue
+ *
+ * \note In deferred mode the ISR only copies the frame into a lock-free ring. A slow handler then
+ * delays other handlers but no longer stalls reception. FD frames are only deferred once
+ * setDeferredBufferFD has been given a ring too, until then they are still dispatched in the ISR.
+ */
+bool CAN_COMMON::setDispatchMode(CANDispatchMode mode)
+{
+	if (mode == CAN_DISPATCH_DEFERRED && !deferredRing.isAttached()) return false;
+	dispatchMode = mode;
+	return true;
+}
+
+CANDispatchMode CAN_COMMON::getDispatchMode()
+{
+	return dispatchMode;
+}
+
+//Storage for frames waiting for poll(). Size must be a power of two.
+bool CAN_COMMON::setDeferredBuffer(CANDeferredFrame *buffer, uint16_t size)
+{
+	return deferredRing.attach(buffer, size);
+}
+
+bool CAN_COMMON::setDeferredBufferFD(CANDeferredFrameFD *buffer, uint16_t size)
+{
+	return deferredRingFD.attach(buffer, size);
+}
+
+/**
+ * \brief Time limit for a single dispatch
+ *
+ * \param micros Budget in microseconds, 0 to turn the check off
+ *
+ * \note A dispatch that runs over is counted in the handlerOverruns statistic and ends the current poll()
+ * batch early so the rest of loop() gets a turn.
+ */
+void CAN_COMMON::setHandlerBudget(uint32_t micros)
+{
+	handlerBudget = micros;
+}
+
+/**
+ * \brief Run callbacks for frames queued in deferred dispatch mode
+ *
+ * \param maxFrames Most frames to handle in this call
+ * \param budgetMicros Stop once this much time has been spent (checked between frames). 0 for no limit.
+ *
+ * \ret  Number of frames handled. pendingFrames() says how many are still waiting.
+ *
+ * \note Call from loop() or from a worker task. Only one context may call poll().
+ */
+uint16_t CAN_COMMON::poll(uint16_t maxFrames, uint32_t budgetMicros)
+{
+	//outside the receive context, so catch up with listener changes made from callbacks or for other buses
+	if (__atomic_load_n(&listenerVersion, __ATOMIC_RELAXED) != __atomic_load_n(&CANListener::changeCount, __ATOMIC_ACQUIRE)) updateListeners();
+
+	uint16_t done = 0;
+	uint32_t start = micros();
+	bool fromFD = false; //alternate between the rings so neither starves
+
+	while (done < maxFrames)
+	{
+		uint32_t overrunsBefore = handlerBudget ? stats.handlerOverrunCount() : 0;
+		CANDeferredFrame *entry = NULL;
+		CANDeferredFrameFD *entryFD = NULL;
+		if (fromFD) entryFD = deferredRingFD.peek();
+		if (!entryFD) entry = deferredRing.peek();
+		if (!entry && !entryFD) entryFD = deferredRingFD.peek();
+		if (!entry && !entryFD) break;
+
+		if (entry)
+		{
+			finishReceive(entry->frame, entry->mailbox, entry->arrival, entry->unchanged);
+			deferredRing.drop();
+		}
+		else
+		{
+			finishReceiveFD(entryFD->frame, entryFD->mailbox, entryFD->arrival, entryFD->unchanged);
+			deferredRingFD.drop();
+		}
+		fromFD = !fromFD;
+		done++;
+
+		if (handlerBudget && stats.handlerOverrunCount() != overrunsBefore) break;
+		if (budgetMicros && (uint32_t)(micros() - start) >= budgetMicros) break;
+	}
+	return done;
+}
+
+//Frames queued by the ISR that poll() hasn't handled yet
+uint16_t CAN_COMMON::pendingFrames()
+{
+	return deferredRing.count() + deferredRingFD.count();
+}
+
+/**
+ * \brief Take a snapshot of the interface counters
+ *
+ * \param out Filled in with the counters and the bus load since the last resetStats()
+ */
+void CAN_COMMON::getStats(CANStats &out)
+{
+	stats.snapshot(out, busSpeed, fd_DataSpeed);
+}
+
+void CAN_COMMON::resetStats()
+{
+	stats.reset();
+}
+
+/**
+ * \brief Time every dispatch that a callback handled and add it to the callback time counters
+ *
+ * \note Costs two micros() calls per received frame so it is off by default.
+ */
+void CAN_COMMON::setCallbackTiming(bool state)
+{
+	timeCallbacks = state;
+}
+
+/**
+ * \brief Tell the common layer what unit this driver's CAN_FRAME::timestamp is in
+ *
+ * \param ticksPerSecond Timestamp counter frequency. Defaults to 1000000 (micros())
+ * \param counterBits Width of the counter if it wraps before 32 bits
+ */
+void CAN_COMMON::setTimestampRate(uint32_t ticksPerSecond, uint8_t counterBits)
+{
+	timeBase.setTickRate(ticksPerSecond, counterBits);
+}
+
+/**
+ * \brief Extend a received frame's timestamp to 64 bit nanoseconds
+ *
+ * \note Rollover is tracked from the frames passing through receiveFrame so this is meant for
+ * frames received recently, not ones stored for longer than a counter wrap.
+ */
+uint64_t CAN_COMMON::timestampNs(const CAN_FRAME &frame)
+{
+	return timeBase.toNs(frame.timestamp);
+}
+
+uint64_t CAN_COMMON::timestampNsFD(const CAN_FRAME_FD &frame)
+{
+	return timeBase.toNs(frame.timestamp);
+}
+
+/**
+ * \brief Start recording latency histograms into stats. NULL stops recording.
+ *
+ * \note RX latency runs from receiveFrame being called by the driver until dispatch finishes, so it
+ * includes handler run time (and queueing time in deferred dispatch). It is measured with micros().
+ */
+void CAN_COMMON::attachLatencyStats(CANLatencyStats *stats)
+{
+	latencyStats = stats;
+}
+
+CANLatencyStats *CAN_COMMON::getLatencyStats()
+{
+	return latencyStats;
+}
+
+//Called when a queued frame is finally accepted by the driver. enqueueMicros is micros() from when it was queued.
+void CAN_COMMON::recordTXLatency(uint32_t enqueueMicros)
+{
+	if (latencyStats) latencyStats->enqueueToTx.record(micros() - enqueueMicros);
+}
+
 //these next few functions would normally be pure abstract but they're implemented here
 //so that not every class needs to implement FD functionality to work.
 uint32_t CAN_COMMON::get_rx_buffFD(CAN_FRAME_FD &msg)
 {
-	return 0;
+	return rxRingFD.pop(msg) ? 1 : 0;
 }
 uint32_t CAN_COMMON::set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed)
 {
@@ -415,6 +1132,61 @@ uint32_t CAN_COMMON::initFD(uint32_t nominalRate, uint32_t dataRate)
 	return 0;
 }
 
+/**
+ * \brief Read up to max frames in one call
+ *
+ * \param out Array that receives the frames
+ * \param max Size of the out array
+ *
+ * \ret  Number of frames actually read. Stops early as soon as no more frames are waiting.
+ */
+size_t CAN_COMMON::readBatch(CAN_FRAME *out, size_t max)
+{
+	size_t count = 0;
+	while (count < max && get_rx_buff(out[count])) count++;
+	return count;
+}
+
+/**
+ * \brief Send up to n frames in one call
+ *
+ * \param in Array of frames to send
+ * \param n Number of frames in the array
+ *
+ * \ret  Number of frames accepted for transmission. Stops at the first frame the driver refuses
+ * so the caller can retry from in[returned value] later and ordering is preserved.
+ */
+size_t CAN_COMMON::sendBatch(const CAN_FRAME *in, size_t n)
+{
+	size_t count = 0;
+	while (count < n)
+	{
+		CAN_FRAME frame = in[count]; //sendFrame takes a non-const reference
+		if (!sendFrame(frame)) break;
+		count++;
+	}
+	return count;
+}
+
+size_t CAN_COMMON::readBatchFD(CAN_FRAME_FD *out, size_t max)
+{
+	size_t count = 0;
+	while (count < max && get_rx_buffFD(out[count])) count++;
+	return count;
+}
+
+size_t CAN_COMMON::sendBatchFD(const CAN_FRAME_FD *in, size_t n)
+{
+	size_t count = 0;
+	while (count < n)
+	{
+		CAN_FRAME_FD frame = in[count];
+		if (!sendFrameFD(frame)) break;
+		count++;
+	}
+	return count;
+}
+
 //try to put a standard CAN frame into a CAN_FRAME_FD structure
 bool CAN_COMMON::canToFD(CAN_FRAME &source, CAN_FRAME_FD &dest)
 {
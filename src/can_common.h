@@ -2,6 +2,12 @@
 #define _CAN_COMMON_
 
 #include <Arduino.h>
+#include "can_ring.h"
+#include "can_dispatch.h"
+#include "can_filter_plan.h"
+#include "can_soft_filter.h"
+#include "can_timestamp.h"
+#include "can_stats.h"
 
 /** Define the typical baudrate for CAN communication. */
 #ifdef CAN_BPS_500K
@@ -25,7 +31,16 @@
 #define CAN_BPS_25K		25000
 
 
-#define SIZE_LISTENERS	4 //number of classes that can register as listeners with this class
+//Starting size of the listener table, attachObj grows it when it fills up. This used to be SIZE_LISTENERS, the fixed
+//size of a public listener[] array drivers walked themselves. Drivers must hand received frames to receiveFrame /
+//dispatchFrame (or their FD versions) now, which find the listeners that want them.
+#define CAN_LISTENER_TABLE_START	4
+
+//Most mailboxes / filters a driver can have callbacks for. FD controllers can need 128.
+#ifndef CAN_MAX_MAILBOXES
+#define CAN_MAX_MAILBOXES 64
+#endif
+#define CAN_MAILBOX_WORDS ((CAN_MAX_MAILBOXES + 31) / 32)
 #define CAN_DEFAULT_BAUD	500000
 #define CAN_DEFAULT_FD_RATE 4000000
 
@@ -36,6 +51,7 @@
 #define detachGeneralHandler removeGeneralHandler
 
 extern const uint8_t fdLengthEncoding[65];
+extern const uint8_t fdLengthDecoding[16];
 
 class BitRef
 {
@@ -94,7 +110,7 @@ typedef union {
         {
             if (pos < 0 || pos > 63) return 0;
             int bitFieldIdx = pos / 8;
-            return (bitField[bitFieldIdx] >> pos) & 1;
+            return (bitField[bitFieldIdx] >> (pos & 7)) & 1;
         }
         BitRef operator[]( int pos )
         {
@@ -121,7 +137,7 @@ typedef union {
         {
             if (pos < 0 || pos > 511) return 0; //64 8 bit bytes is 512 bits, we start counting bits at 0
             int bitfieldIdx = pos / 8;
-            return (bitField[bitfieldIdx] >> pos) & 1;
+            return (bitField[bitfieldIdx] >> (pos & 7)) & 1;
         }
         BitRef operator[]( int pos )
         {
@@ -164,6 +180,9 @@ public:
     uint8_t length;       // Number of data bytes
 };
 
+class CAN_COMMON;
+class CANValueCache;
+
 class CANListener
 {
 public:
@@ -179,11 +198,48 @@ public:
   void initialize();
   bool isCallbackActive(int callback);
   void setNumFilters(int numFilt);
+  void setOnlyOnChange(bool state);
 
 private:
-  uint32_t callbacksActive; //bitfield letting the code know which callbacks to actually try to use (for object oriented callbacks only)
+  friend class CAN_COMMON;
+  void changed();
+
+  static uint32_t changeCount; //bumped by every change so each bus can tell its fan-out lists are out of date
+  uint32_t callbacksActive[CAN_MAILBOX_WORDS]; //bitfield letting the code know which callbacks to actually try to use (for object oriented callbacks only)
   bool generalCBActive; //is the general callback registered?
   int numFilters; //filters, mailboxes, whichever, how many do we have?
+  bool onlyOnChange; //skip frames the bus's value cache says repeat the last payload of their ID
+  CAN_COMMON *owner; //bus this was last attached to, it rebuilds its lists as soon as something changes
+};
+
+//Listeners per mailbox, precomputed so dispatch only calls the ones that want the frame
+struct CANListenerMap
+{
+    uint16_t *start;        //mailbox n uses entries[start[n]] .. entries[start[n + 1] - 1], general handlers come last
+    CANListener **entries;
+};
+
+enum CANDispatchMode
+{
+    CAN_DISPATCH_IMMEDIATE = 0, //callbacks run inside receiveFrame (the driver's ISR)
+    CAN_DISPATCH_DEFERRED = 1   //receiveFrame only queues, callbacks run from poll()
+};
+
+//What the ISR queues in deferred dispatch mode
+struct CANDeferredFrame
+{
+    CAN_FRAME frame;
+    uint32_t arrival; //micros() when the driver handed the frame over
+    int8_t mailbox;
+    bool unchanged;   //same payload as the last frame with this ID (value cache)
+};
+
+struct CANDeferredFrameFD
+{
+    CAN_FRAME_FD frame;
+    uint32_t arrival;
+    int8_t mailbox;
+    bool unchanged;
 };
 
 /*Abstract function that mostly just sets an interface that all descendants must implement */
@@ -192,6 +248,7 @@ class CAN_COMMON
 public:
 
     CAN_COMMON(int numFilt);
+    virtual ~CAN_COMMON();
 
     //Public API that needs to be re-implemented by subclasses
 	virtual int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended) = 0;
@@ -203,14 +260,23 @@ public:
 	virtual void enable() = 0;
 	virtual void disable() = 0;
 	virtual bool sendFrame(CAN_FRAME& txFrame) = 0;
-	virtual bool rx_avail() = 0;
-	virtual uint16_t available() = 0; //like rx_avail but returns the number of waiting frames
-	virtual uint32_t get_rx_buff(CAN_FRAME &msg) = 0;
+    //These have default versions that use the common RX ring (see setRXBuffer). Drivers with their own buffering override them.
+	virtual bool rx_avail();
+	virtual uint16_t available(); //like rx_avail but returns the number of waiting frames
+	virtual uint32_t get_rx_buff(CAN_FRAME &msg);
     //These aren't abstract because not all CAN drivers would support FD
     virtual uint32_t get_rx_buffFD(CAN_FRAME_FD &msg);
     virtual uint32_t set_baudrateFD(uint32_t nominalSpeed, uint32_t dataSpeed);
     virtual bool sendFrameFD(CAN_FRAME_FD& txFrame);
     virtual uint32_t initFD(uint32_t nominalRate, uint32_t dataRate);    
+    //Batch versions of read / send. The defaults just loop over the single frame calls above.
+    //Drivers that can move a whole mailbox burst at once should override these.
+    virtual size_t readBatch(CAN_FRAME *out, size_t max);
+    virtual size_t sendBatch(const CAN_FRAME *in, size_t n);
+    virtual size_t readBatchFD(CAN_FRAME_FD *out, size_t max);
+    virtual size_t sendBatchFD(const CAN_FRAME_FD *in, size_t n);
+    //Mailbox / filter that would accept this ID, for frames fed in from software (replay). -1 if none or unknown.
+    virtual int findMailbox(uint32_t id, bool extended);
 
     //Public API common to all subclasses - don't need to be re-implemented
     //wrapper for syntactic sugar reasons
@@ -230,6 +296,8 @@ public:
     int setRXFilter(uint32_t id, uint32_t mask, bool extended);
     boolean attachObj(CANListener *listener);
 	boolean detachObj(CANListener *listener);
+    void updateListeners();
+    int getListenerCount();
     void setGeneralCallback( void (*cb)(CAN_FRAME *) );
 	void setCallback(uint8_t mailbox, void (*cb)(CAN_FRAME *));
     void removeCallback();
@@ -243,6 +311,50 @@ public:
     bool hasRXFault();
     bool hasTXFault();
     void setDebuggingMode(bool mode);
+    bool setRXBuffer(CAN_FRAME *buffer, uint16_t size);
+    bool setRXBufferFD(CAN_FRAME_FD *buffer, uint16_t size);
+    //called by a driver (usually from its ISR) to hand a received frame to the common RX ring
+    bool queueRXFrame(CAN_FRAME &frame);
+    bool queueRXFrameFD(CAN_FRAME_FD &frame);
+    //software routing by ID, independent of the hardware filters. Extended status is automatic like watchFor
+    bool onId(uint32_t id, void (*cb)(CAN_FRAME *));
+    bool onId(uint32_t id, bool extended, void (*cb)(CAN_FRAME *));
+    bool onIdFD(uint32_t id, bool extended, void (*cb)(CAN_FRAME_FD *));
+    bool onRange(uint32_t lo, uint32_t hi, void (*cb)(CAN_FRAME *));
+    bool onRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *));
+    bool onRangeFD(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME_FD *));
+    void removeId(uint32_t id, bool extended);
+    void removeRange(uint32_t lo, uint32_t hi, bool extended);
+    //called by a driver for every received frame. Runs ID, mailbox, listener and general callbacks in that order
+    bool dispatchFrame(CAN_FRAME &frame, int mailbox, bool unchanged = false);
+    bool dispatchFrameFD(CAN_FRAME_FD &frame, int mailbox, bool unchanged = false);
+    //dispatchFrame and, if nobody took the frame, queueRXFrame
+    bool receiveFrame(CAN_FRAME &frame, int mailbox);
+    bool receiveFrameFD(CAN_FRAME_FD &frame, int mailbox);
+    //acceptance filtering after the hardware, for when there are more IDs than filters
+    void setSoftFilter(const CANSoftFilter *filter);
+    //newest frame per ID for readers that only want the current state
+    void attachValueCache(CANValueCache *cache);
+    //64 bit timestamps and latency tracking
+    void setTimestampRate(uint32_t ticksPerSecond, uint8_t counterBits = 32);
+    uint64_t timestampNs(const CAN_FRAME &frame);
+    uint64_t timestampNsFD(const CAN_FRAME_FD &frame);
+    void attachLatencyStats(CANLatencyStats *stats);
+    CANLatencyStats *getLatencyStats();
+    void recordTXLatency(uint32_t enqueueMicros);
+    //traffic and error counters
+    void getStats(CANStats &out);
+    void resetStats();
+    void setCallbackTiming(bool state);
+    CANStatistics &getStatistics() { return stats; } //for helpers outside the driver that need to count (TX queues etc)
+    //deferred dispatch - keep callbacks out of interrupt context
+    bool setDispatchMode(CANDispatchMode mode);
+    CANDispatchMode getDispatchMode();
+    bool setDeferredBuffer(CANDeferredFrame *buffer, uint16_t size);
+    bool setDeferredBufferFD(CANDeferredFrameFD *buffer, uint16_t size);
+    void setHandlerBudget(uint32_t micros);
+    uint16_t poll(uint16_t maxFrames = 16, uint32_t budgetMicros = 0);
+    uint16_t pendingFrames();
 
     //pubic API for CAN-FD mode
     inline uint32_t readFD(CAN_FRAME_FD &msg) { return get_rx_buffFD(msg); }
@@ -260,11 +372,17 @@ public:
     bool debuggingMode;
 
 protected:
-	CANListener *listener[SIZE_LISTENERS];
+	CANListener **listenerTable; //listenerSlots entries, unused ones are NULL. Drivers don't walk this, see receiveFrame
+    uint16_t listenerSlots;
+    CANListenerMap *listenerMap; //NULL if no listener wants anything
+    uint32_t listenerVersion; //CANListener::changeCount when listenerMap was built
+    uint8_t inDispatch; //listener dispatches in progress, listenerMap is not replaced while nonzero
+    CANListenerMap *buildListenerMap();
+    static void freeListenerMap(CANListenerMap *map);
     void (*cbGeneral)(CAN_FRAME *); //general callback if no per-mailbox or per-filter entries matched
-    void (*cbCANFrame[32])(CAN_FRAME *); //array of function pointers - disgusting syntax though.
+    void (*cbCANFrame[CAN_MAX_MAILBOXES])(CAN_FRAME *); //array of function pointers - disgusting syntax though.
     void (*cbGeneralFD)(CAN_FRAME_FD *); //general callback if no per-mailbox or per-filter entries matched - FD version
-    void (*cbCANFrameFD[32])(CAN_FRAME_FD *); //array of function pointers - disgusting syntax though - FD version
+    void (*cbCANFrameFD[CAN_MAX_MAILBOXES])(CAN_FRAME_FD *); //array of function pointers - disgusting syntax though - FD version
     uint32_t busSpeed;
     uint32_t fd_DataSpeed;
     int numFilters;
@@ -273,6 +391,25 @@ protected:
     bool faulted;
     bool rxFault;
     bool txFault;    
+    CANRing<CAN_FRAME> rxRing;
+    CANRing<CAN_FRAME_FD> rxRingFD;
+    CANDispatchTable *idDispatch; //created on first use of onId / onRange
+    const CANSoftFilter *softFilter;
+    CANValueCache *valueCache;
+    CANTimeBase timeBase;
+    CANLatencyStats *latencyStats;
+    CANStatistics stats; //drivers update the counters only they can see (TX, overruns, error counters)
+    bool timeCallbacks;
+    bool dispatchListeners(CAN_FRAME &frame, int mailbox, bool unchanged, bool stale);
+    bool dispatchListenersFD(CAN_FRAME_FD &frame, int mailbox, bool unchanged, bool stale);
+    bool walkListenerTable(CAN_FRAME *frame, CAN_FRAME_FD *frameFD, int mailbox, bool unchanged);
+    bool finishReceive(CAN_FRAME &frame, int mailbox, uint32_t arrival, bool unchanged);
+    bool finishReceiveFD(CAN_FRAME_FD &frame, int mailbox, uint32_t arrival, bool unchanged);
+    void noteDispatched(bool handled, uint32_t arrival, uint32_t start);
+    CANDispatchMode dispatchMode;
+    CANRing<CANDeferredFrame> deferredRing;
+    CANRing<CANDeferredFrameFD> deferredRingFD;
+    uint32_t handlerBudget;
 };
 
 #endif
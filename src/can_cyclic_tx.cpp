@@ -0,0 +1,268 @@
+#include "can_cyclic_tx.h"
+
+#define VALID(h) ((h) >= 0 && (h) < CAN_CYCLIC_MAX && messages[h].used)
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b)
+	{
+		uint32_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static uint32_t millisToTicks(uint32_t millis)
+{
+	return (uint32_t)((uint64_t)millis * 1000 / CAN_CYCLIC_TICK_MICROS);
+}
+
+CANCyclicTx::CANCyclicTx(CAN_COMMON &canBus) : bus(canBus)
+{
+	scheduler = NULL;
+	for (int i = 0; i < CAN_CYCLIC_MAX; i++) messages[i].used = false;
+	wheel.attach(timers, CAN_CYCLIC_MAX);
+	lastMicros = micros();
+	tickRemainder = 0;
+	wheelTarget = wheel.getTick();
+}
+
+int CANCyclicTx::allocMessage(uint32_t periodMillis)
+{
+	uint32_t period = millisToTicks(periodMillis);
+	if (period == 0) return -1;
+	for (int i = 0; i < CAN_CYCLIC_MAX; i++)
+	{
+		if (messages[i].used) continue;
+		Message &m = messages[i];
+		m.frameFD = NULL;
+		m.update = NULL;
+		m.updateFD = NULL;
+		m.context = NULL;
+		m.period = period;
+		m.phase = pickPhase(period, i);
+		m.sent = 0;
+		m.missed = 0;
+		m.enabled = true;
+		m.pending = false;
+		return i;
+	}
+	return -1;
+}
+
+/**
+ * \brief Send a classic frame periodically
+ *
+ * \param frame Copied in. getFrame() gives access to the copy.
+ * \param periodMillis Period, at least one tick
+ * \param update Called with the copy right before each send, NULL to send it as is
+ *
+ * \ret  Handle for the other calls or -1 if full or the period is under a tick
+ */
+int CANCyclicTx::add(const CAN_FRAME &frame, uint32_t periodMillis, CANCyclicUpdate update, void *context)
+{
+	int handle = allocMessage(periodMillis);
+	if (handle < 0) return -1;
+	Message &m = messages[handle];
+	m.frame = frame;
+	m.update = update;
+	m.context = context;
+	m.used = true;
+	schedule(handle);
+	return handle;
+}
+
+//As add() but sent straight from frame, which has to stay around until remove()
+int CANCyclicTx::addFD(CAN_FRAME_FD *frame, uint32_t periodMillis, CANCyclicUpdateFD update, void *context)
+{
+	if (frame == NULL) return -1;
+	int handle = allocMessage(periodMillis);
+	if (handle < 0) return -1;
+	Message &m = messages[handle];
+	m.frameFD = frame;
+	m.updateFD = update;
+	m.context = context;
+	m.used = true;
+	schedule(handle);
+	return handle;
+}
+
+void CANCyclicTx::remove(int handle)
+{
+	if (!VALID(handle)) return;
+	wheel.stop(handle);
+	messages[handle].used = false;
+}
+
+/**
+ * \brief Fix the offset of a message instead of the one add() picked
+ *
+ * \param offsetMillis Sent when the time base modulo the period equals this
+ */
+bool CANCyclicTx::setPhase(int handle, uint32_t offsetMillis)
+{
+	if (!VALID(handle)) return false;
+	Message &m = messages[handle];
+	m.phase = millisToTicks(offsetMillis) % m.period;
+	if (m.enabled) schedule(handle);
+	return true;
+}
+
+//Change the period. The phase is picked again against the other messages.
+bool CANCyclicTx::setPeriod(int handle, uint32_t periodMillis)
+{
+	uint32_t period = millisToTicks(periodMillis);
+	if (!VALID(handle) || period == 0) return false;
+	Message &m = messages[handle];
+	m.period = period;
+	m.phase = pickPhase(period, handle);
+	if (m.enabled) schedule(handle);
+	return true;
+}
+
+//Pause or resume a message. It keeps its phase.
+bool CANCyclicTx::setEnabled(int handle, bool enabled)
+{
+	if (!VALID(handle)) return false;
+	Message &m = messages[handle];
+	m.enabled = enabled;
+	m.pending = false;
+	if (enabled) schedule(handle);
+	else wheel.stop(handle);
+	return true;
+}
+
+//Send once right now (on change), the periodic schedule carries on unchanged
+bool CANCyclicTx::sendNow(int handle)
+{
+	if (!VALID(handle)) return false;
+	return transmit(messages[handle]);
+}
+
+//The frame a classic message sends, to change between sends without an update callback. NULL for FD.
+CAN_FRAME *CANCyclicTx::getFrame(int handle)
+{
+	if (!VALID(handle) || messages[handle].frameFD) return NULL;
+	return &messages[handle].frame;
+}
+
+uint32_t CANCyclicTx::getSent(int handle) const
+{
+	return VALID(handle) ? messages[handle].sent : 0;
+}
+
+//Periods that ran out with the previous frame still not accepted by the driver, or that service() was too late for
+uint32_t CANCyclicTx::getMissed(int handle) const
+{
+	return VALID(handle) ? messages[handle].missed : 0;
+}
+
+//Queue the frames on a CANTxScheduler instead of handing them to the driver, NULL to go direct again
+void CANCyclicTx::setScheduler(CANTxScheduler *txScheduler)
+{
+	scheduler = txScheduler;
+}
+
+/*
+Offset for a new message that collides least with the others. Two messages with periods P and Q
+and offsets a and b go out in the same tick iff a = b modulo gcd(P, Q), and then do so once every
+lcm(P, Q) ticks. So each offset costs, per message it meets, 1 / lcm(P, Q) = gcd(P, Q) / (P * Q);
+P is the same for every candidate so gcd / Q is enough to compare them. Only run when messages are
+added or changed.
+*/
+uint32_t CANCyclicTx::pickPhase(uint32_t period, int skip) const
+{
+	uint32_t best = 0;
+	uint32_t bestCost = 0xFFFFFFFF;
+	for (uint32_t offset = 0; offset < period; offset++)
+	{
+		uint32_t cost = 0;
+		for (int i = 0; i < CAN_CYCLIC_MAX; i++)
+		{
+			const Message &m = messages[i];
+			if (!m.used || i == skip) continue;
+			uint32_t g = gcd(period, m.period);
+			if (offset % g == m.phase % g) cost += (uint32_t)(((uint64_t)g << 16) / m.period);
+		}
+		if (cost < bestCost)
+		{
+			best = offset;
+			bestCost = cost;
+			if (cost == 0) break;
+		}
+	}
+	return best;
+}
+
+//Current position of the time base in ticks, including time since the last service()
+uint32_t CANCyclicTx::nowTick() const
+{
+	return wheelTarget + ((uint32_t)(micros() - lastMicros) + tickRemainder) / CAN_CYCLIC_TICK_MICROS;
+}
+
+//Start the timer for the next tick after now that is on the message's schedule
+void CANCyclicTx::schedule(int handle)
+{
+	Message &m = messages[handle];
+	uint32_t now = nowTick();
+	uint32_t wait = (m.phase + m.period - now % m.period) % m.period;
+	if (wait == 0) wait = m.period;
+	wheel.start(handle, now + wait - wheel.getTick());
+}
+
+bool CANCyclicTx::transmit(Message &m)
+{
+	if (m.frameFD)
+	{
+		if (m.updateFD && !m.updateFD(*m.frameFD, m.context)) return true;
+		if (scheduler ? !scheduler->queueFD(*m.frameFD) : !bus.sendFrameFD(*m.frameFD)) return false;
+	}
+	else
+	{
+		if (m.update && !m.update(m.frame, m.context)) return true;
+		if (scheduler ? !scheduler->queue(m.frame) : !bus.sendFrame(m.frame)) return false;
+	}
+	m.sent++;
+	return true;
+}
+
+void CANCyclicTx::timerExpired(uint16_t timer, void *context)
+{
+	CANCyclicTx *self = (CANCyclicTx *)context;
+	Message &m = self->messages[timer];
+	//next one from the schedule, not from now, so late service() calls don't add up. It is the first
+	//on the schedule after the tick service() is catching up to: after a stall the periods that went
+	//by count as missed instead of all going out back to back.
+	uint32_t fired = self->wheel.getTick();
+	uint32_t target = self->wheelTarget;
+	uint32_t wait = (m.phase + m.period - target % m.period) % m.period;
+	if (wait == 0) wait = m.period;
+	uint32_t next = target + wait - fired;
+	self->wheel.start(timer, next);
+	m.missed += next / m.period - 1;
+	if (m.pending) m.missed++;
+	m.pending = !self->transmit(m);
+}
+
+/**
+ * \brief Send what is due and retry what the driver refused
+ *
+ * \ret  Number of messages that came due
+ */
+int CANCyclicTx::service()
+{
+	uint32_t now = micros();
+	uint32_t elapsed = (uint32_t)(now - lastMicros) + tickRemainder;
+	lastMicros = now;
+	tickRemainder = elapsed % CAN_CYCLIC_TICK_MICROS;
+	wheelTarget += elapsed / CAN_CYCLIC_TICK_MICROS;
+	int fired = wheel.advance(elapsed / CAN_CYCLIC_TICK_MICROS, timerExpired, this);
+
+	for (int i = 0; i < CAN_CYCLIC_MAX; i++)
+	{
+		Message &m = messages[i];
+		if (m.used && m.pending) m.pending = !transmit(m);
+	}
+	return fired;
+}
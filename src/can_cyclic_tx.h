@@ -0,0 +1,98 @@
+#ifndef _CAN_CYCLIC_TX_
+#define _CAN_CYCLIC_TX_
+
+#include <can_common.h>
+#include "can_timer_wheel.h"
+#include "can_tx_scheduler.h"
+
+//Periodic messages one CANCyclicTx can hold
+#ifndef CAN_CYCLIC_MAX
+#define CAN_CYCLIC_MAX 32
+#endif
+
+//Schedule resolution in microseconds. Periods and phases are whole ticks.
+#ifndef CAN_CYCLIC_TICK_MICROS
+#define CAN_CYCLIC_TICK_MICROS 1000
+#endif
+
+//Fill in the payload right before the frame goes out. Return false to skip this cycle.
+typedef bool (*CANCyclicUpdate)(CAN_FRAME &frame, void *context);
+typedef bool (*CANCyclicUpdateFD)(CAN_FRAME_FD &frame, void *context);
+
+/*
+Periodic transmission: the 10ms / 20ms / 100ms status frames every ECU sends.
+
+Each message has a period and a phase (offset from the common time base) and sits on a timer wheel,
+so service() only touches the messages that are due and costs the same with 3 messages or 30. A
+message's next send is always worked out from its schedule, not from when service() got to it, so
+a late service() call shows up as jitter on that one frame and never as drift.
+
+add() picks the phase itself unless told otherwise: the offset that coincides least with the
+messages already there (weighted by how often they would coincide), so 20 messages at 10ms go out
+spread over the 10ms rather than in one burst that loses arbitration to itself.
+
+Frames are sent from the scheduler's own copy (classic) or straight from the caller's frame (FD).
+An update callback, if given, is called on that frame just before it is sent so signals can be
+packed in place with the latest values instead of being copied in ahead of time.
+
+If the driver refuses a frame (mailboxes full) it is retried on every service() until its next
+period comes round, then counted as missed. A service() call more than a period late sends each
+message once and counts the periods it slept through as missed too. Frames can go through a CANTxScheduler instead of
+straight to the driver with setScheduler().
+
+Call service() from loop() at least once per tick for the least jitter.
+*/
+class CANCyclicTx
+{
+public:
+    CANCyclicTx(CAN_COMMON &bus);
+
+    int add(const CAN_FRAME &frame, uint32_t periodMillis, CANCyclicUpdate update = NULL, void *context = NULL);
+    int addFD(CAN_FRAME_FD *frame, uint32_t periodMillis, CANCyclicUpdateFD update = NULL, void *context = NULL);
+    void remove(int handle);
+    bool setPhase(int handle, uint32_t offsetMillis);
+    bool setPeriod(int handle, uint32_t periodMillis);
+    bool setEnabled(int handle, bool enabled);
+    bool sendNow(int handle);
+    CAN_FRAME *getFrame(int handle);
+    uint32_t getSent(int handle) const;
+    uint32_t getMissed(int handle) const;
+
+    void setScheduler(CANTxScheduler *scheduler);
+    int service();
+
+private:
+    struct Message
+    {
+        CAN_FRAME frame;
+        CAN_FRAME_FD *frameFD;  //caller's frame for FD messages, NULL for classic
+        CANCyclicUpdate update;
+        CANCyclicUpdateFD updateFD;
+        void *context;
+        uint32_t period;        //ticks
+        uint32_t phase;         //ticks, 0 .. period - 1
+        uint32_t sent;
+        uint32_t missed;
+        bool used;
+        bool enabled;
+        bool pending;           //due but the driver hasn't taken it yet
+    };
+
+    int allocMessage(uint32_t periodMillis);
+    uint32_t pickPhase(uint32_t period, int skip) const;
+    void schedule(int handle);
+    bool transmit(Message &m);
+    uint32_t nowTick() const;
+    static void timerExpired(uint16_t timer, void *context);
+
+    CAN_COMMON &bus;
+    CANTxScheduler *scheduler;
+    Message messages[CAN_CYCLIC_MAX];
+    CANTimerWheel wheel;
+    CANTimer timers[CAN_CYCLIC_MAX];
+    uint32_t lastMicros;
+    uint32_t tickRemainder;
+    uint32_t wheelTarget;
+};
+
+#endif
@@ -0,0 +1,369 @@
+#include "can_decoder.h"
+
+#define OP_MOTOROLA 1
+#define OP_SIGNED   2
+
+#define HASH_SLOTS (CAN_DECODER_MAX_MESSAGES * 2)
+
+static_assert(CAN_DECODER_MAX_MESSAGES < 128, "message indexes are stored in a byte");
+
+static inline uint32_t messageKey(uint32_t id, bool extended)
+{
+	return extended ? ((id & 0x1FFFFFFF) | 0x80000000ul) : (id & 0x7FF);
+}
+
+static inline uint32_t messageSlot(uint32_t key)
+{
+	return ((key * 2654435761ul) >> 16) % HASH_SLOTS;
+}
+
+//FNV-1a folded to 16 bits. Only used to find signals by name so the names themselves needn't be stored.
+static uint16_t nameHash(const char *name, int len)
+{
+	uint32_t hash = 2166136261ul;
+	for (int i = 0; (len < 0) ? name[i] != 0 : i < len; i++)
+	{
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619ul;
+	}
+	return (uint16_t)(hash ^ (hash >> 16));
+}
+
+CANDecoder::CANDecoder()
+{
+	clear();
+	for (int i = 0; i < CAN_DECODER_MAX_OUTPUTS; i++) outputs[i] = NULL;
+}
+
+void CANDecoder::clear()
+{
+	numOps = 0;
+	numMessages = 0;
+	memset(hashTable, 0, sizeof(hashTable));
+}
+
+int CANDecoder::findMessage(uint32_t id, bool extended)
+{
+	uint32_t key = messageKey(id, extended);
+	uint32_t slot = messageSlot(key);
+	for (int probe = 0; probe < HASH_SLOTS; probe++)
+	{
+		uint8_t entry = hashTable[slot];
+		if (entry == 0) return -1;
+		if (messages[entry - 1].key == key) return entry - 1;
+		slot = (slot + 1) % HASH_SLOTS;
+	}
+	return -1;
+}
+
+/**
+ * \brief Start a new message definition. Following addSignal calls add signals to it.
+ *
+ * \param id CAN ID of the message
+ * \param extended true for a 29 bit ID
+ * \param length Expected payload length in bytes (DBC DLC)
+ *
+ * \ret  false if the message already exists or the tables are full
+ */
+bool CANDecoder::addMessage(uint32_t id, bool extended, uint8_t length)
+{
+	if (numMessages >= CAN_DECODER_MAX_MESSAGES) return false;
+	if (findMessage(id, extended) >= 0) return false;
+
+	Message &msg = messages[numMessages];
+	msg.key = messageKey(id, extended);
+	msg.firstOp = numOps;
+	msg.numOps = 0;
+	msg.length = length;
+
+	uint32_t slot = messageSlot(msg.key);
+	while (hashTable[slot]) slot = (slot + 1) % HASH_SLOTS;
+	hashTable[slot] = ++numMessages;
+	return true;
+}
+
+/**
+ * \brief Add a signal to the message most recently added
+ *
+ * \param startBit DBC start bit (LSB for Intel, MSB for Motorola)
+ * \param length Signal length in bits (1-64)
+ * \param motorola true for big endian (DBC @0), false for little endian (DBC @1)
+ * \param isSigned true if the raw value is two's complement
+ * \param scale, offset physical = raw * scale + offset
+ * \param name Optional, used by findSignal
+ *
+ * \ret  false if the signal doesn't fit in a 64 byte payload, spans more than 8 bytes or the tables are full
+ */
+bool CANDecoder::addSignal(uint16_t startBit, uint8_t length, bool motorola, bool isSigned, float scale, float offset, const char *name)
+{
+	if (numMessages == 0 || numOps >= CAN_DECODER_MAX_SIGNALS) return false;
+	Message &msg = messages[numMessages - 1];
+	if (msg.numOps >= CAN_DECODER_MAX_MSG_SIGNALS) return false;
+	if (length < 1 || length > 64 || startBit > 511) return false;
+
+	uint8_t lead = motorola ? (7 - (startBit % 8)) : (startBit % 8);
+	if (lead + length > 64) return false;
+
+	SignalOp &op = ops[numOps];
+	op.firstByte = startBit / 8;
+	op.numBytes = (lead + length + 7) / 8;
+	op.endByte = op.firstByte + op.numBytes;
+	if (op.endByte > 64) return false;
+	//the op stores the final right shift so decoding doesn't need to know the byte order beyond the swap
+	op.shift = motorola ? (64 - lead - length) : lead;
+	op.length = length;
+	op.flags = (motorola ? OP_MOTOROLA : 0) | (isSigned ? OP_SIGNED : 0);
+	op.scale = scale;
+	op.offset = offset;
+	op.nameHash = name ? nameHash(name, -1) : 0;
+
+	numOps++;
+	msg.numOps++;
+	return true;
+}
+
+int CANDecoder::decodeBytes(int msg, const uint8_t *bytes, uint8_t length, float *values)
+{
+	const Message &m = messages[msg];
+	const SignalOp *op = &ops[m.firstOp];
+	for (int i = 0; i < m.numOps; i++, op++)
+	{
+		if (op->endByte > length)
+		{
+			values[i] = NAN; //frame too short to hold this signal
+			continue;
+		}
+		uint64_t window = 0;
+		memcpy(&window, bytes + op->firstByte, op->numBytes);
+		if (op->flags & OP_MOTOROLA) window = __builtin_bswap64(window);
+		uint64_t raw = (window >> op->shift) & ((~0ull) >> (64 - op->length));
+		float v;
+		if (op->flags & OP_SIGNED) v = (float)((int64_t)(raw << (64 - op->length)) >> (64 - op->length));
+		else v = (float)raw;
+		values[i] = v * op->scale + op->offset;
+	}
+	return m.numOps;
+}
+
+/**
+ * \brief Decode every known signal in a frame
+ *
+ * \param frame The frame to decode
+ * \param values Array that receives the scaled values, one per signal in definition order.
+ * Must have room for CAN_DECODER_MAX_MSG_SIGNALS (or signalCount()) entries.
+ *
+ * \ret  Number of values written or -1 if the ID isn't known. Signals that lie past the end of the
+ * frame's payload are set to NAN.
+ */
+int CANDecoder::decode(const CAN_FRAME &frame, float *values)
+{
+	int msg = findMessage(frame.id, frame.extended);
+	if (msg < 0) return -1;
+	return decodeBytes(msg, frame.data.uint8, frame.length > 8 ? 8 : frame.length, values);
+}
+
+int CANDecoder::decodeFD(const CAN_FRAME_FD &frame, float *values)
+{
+	int msg = findMessage(frame.id, frame.extended);
+	if (msg < 0) return -1;
+	return decodeBytes(msg, frame.data.uint8, frame.length > 64 ? 64 : frame.length, values);
+}
+
+/**
+ * \brief Find the position of a signal in the decoded value array
+ *
+ * \ret  Index or -1 if not found. Lookup is by a 16 bit name hash so pick distinct names.
+ */
+int CANDecoder::findSignal(uint32_t id, bool extended, const char *name)
+{
+	int msg = findMessage(id, extended);
+	if (msg < 0 || name == NULL) return -1;
+	uint16_t hash = nameHash(name, -1);
+	for (int i = 0; i < messages[msg].numOps; i++)
+	{
+		if (ops[messages[msg].firstOp + i].nameHash == hash) return i;
+	}
+	return -1;
+}
+
+int CANDecoder::signalCount(uint32_t id, bool extended)
+{
+	int msg = findMessage(id, extended);
+	if (msg < 0) return -1;
+	return messages[msg].numOps;
+}
+
+bool CANDecoder::attachOutput(CANDecodeListener *output)
+{
+	for (int i = 0; i < CAN_DECODER_MAX_OUTPUTS; i++)
+	{
+		if (outputs[i] == NULL)
+		{
+			outputs[i] = output;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CANDecoder::detachOutput(CANDecodeListener *output)
+{
+	for (int i = 0; i < CAN_DECODER_MAX_OUTPUTS; i++)
+	{
+		if (outputs[i] == output)
+		{
+			outputs[i] = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+void CANDecoder::forward(uint32_t id, bool extended, int count)
+{
+	for (int i = 0; i < CAN_DECODER_MAX_OUTPUTS; i++)
+	{
+		if (outputs[i]) outputs[i]->gotDecoded(id, extended, scratch, (uint8_t)count);
+	}
+}
+
+void CANDecoder::gotFrame(CAN_FRAME *frame, int /*mailbox*/)
+{
+	int count = decode(*frame, scratch);
+	if (count >= 0) forward(frame->id, frame->extended, count);
+}
+
+void CANDecoder::gotFrameFD(CAN_FRAME_FD *frame, int /*mailbox*/)
+{
+	int count = decodeFD(*frame, scratch);
+	if (count >= 0) forward(frame->id, frame->extended, count);
+}
+
+static const char *skipSpaces(const char *p)
+{
+	while (*p == ' ' || *p == '\t') p++;
+	return p;
+}
+
+static const char *nextLine(const char *p)
+{
+	while (*p && *p != '\n') p++;
+	return (*p == '\n') ? p + 1 : p;
+}
+
+/**
+ * \brief Load message and signal definitions from DBC text
+ *
+ * \param text Null terminated DBC file contents
+ *
+ * \ret  Number of signals loaded or -1 if a BO_ or SG_ line couldn't be parsed or didn't fit
+ *
+ * \note Only BO_ and SG_ lines are looked at. Multiplexed signals (m0, m1 ...) are skipped,
+ * multiplexor switches (M) are decoded as normal signals. Everything else in the file is ignored.
+ */
+int CANDecoder::loadDBC(const char *text)
+{
+	int loaded = 0;
+	bool inMessage = false;
+	const char *p = text;
+
+	while (*p)
+	{
+		const char *line = skipSpaces(p);
+		p = nextLine(line);
+
+		if (strncmp(line, "BO_ ", 4) == 0)
+		{
+			char *end;
+			uint32_t rawId = strtoul(line + 4, &end, 10);
+			const char *colon = strchr(end, ':');
+			if (colon == NULL || colon > p) return -1;
+			uint8_t dlc = (uint8_t)strtoul(colon + 1, NULL, 10);
+			bool extended = (rawId & 0x80000000ul) != 0;
+			if (!addMessage(rawId & 0x1FFFFFFF, extended, dlc)) return -1;
+			inMessage = true;
+		}
+		else if (strncmp(line, "SG_ ", 4) == 0)
+		{
+			if (!inMessage) return -1;
+			const char *name = skipSpaces(line + 4);
+			const char *nameEnd = name;
+			while (*nameEnd && *nameEnd != ' ' && *nameEnd != ':' && *nameEnd != '\n') nameEnd++;
+			const char *colon = strchr(nameEnd, ':');
+			if (colon == NULL || colon > p) return -1;
+			const char *mux = skipSpaces(nameEnd);
+			if (*mux == 'm') continue; //multiplexed signal, not supported
+
+			//SG_ name : start|length@order sign (scale,offset) [min|max] "unit" receivers
+			char *end;
+			uint16_t start = (uint16_t)strtoul(colon + 1, &end, 10);
+			if (*end != '|') return -1;
+			uint8_t length = (uint8_t)strtoul(end + 1, &end, 10);
+			if (*end != '@') return -1;
+			bool motorola = (end[1] == '0');
+			bool isSigned = (end[2] == '-');
+			const char *paren = strchr(end, '(');
+			if (paren == NULL || paren > p) return -1;
+			float scale = (float)strtod(paren + 1, &end);
+			if (*end != ',') return -1;
+			float offset = (float)strtod(end + 1, &end);
+
+			char nameBuf[64];
+			int nameLen = nameEnd - name;
+			if (nameLen > 63) nameLen = 63;
+			memcpy(nameBuf, name, nameLen);
+			nameBuf[nameLen] = 0;
+			if (!addSignal(start, length, motorola, isSigned, scale, offset, nameBuf)) return -1;
+			loaded++;
+		}
+		else if (*line != '\n' && *line != '\r' && *line != 0)
+		{
+			inMessage = false; //any other statement ends the current message's signal list
+		}
+	}
+	return loaded;
+}
+
+static uint32_t readLE32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static float readFloat(const uint8_t *p)
+{
+	uint32_t bits = readLE32(p);
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+/**
+ * \brief Load definitions from the compact binary format described in can_decoder.h
+ *
+ * \ret  Number of signals loaded or -1 if the table is truncated or doesn't fit
+ */
+int CANDecoder::loadTable(const uint8_t *table, size_t length)
+{
+	int loaded = 0;
+	size_t pos = 0;
+	while (pos < length)
+	{
+		if (pos + 6 > length) return -1;
+		uint32_t rawId = readLE32(table + pos);
+		uint8_t dlc = table[pos + 4];
+		uint8_t count = table[pos + 5];
+		pos += 6;
+		if (!addMessage(rawId & 0x1FFFFFFF, (rawId & 0x80000000ul) != 0, dlc)) return -1;
+		for (int i = 0; i < count; i++)
+		{
+			if (pos + 12 > length) return -1;
+			uint16_t start = table[pos] | (table[pos + 1] << 8);
+			uint8_t len = table[pos + 2];
+			uint8_t flags = table[pos + 3];
+			if (!addSignal(start, len, (flags & OP_MOTOROLA) != 0, (flags & OP_SIGNED) != 0, readFloat(table + pos + 4), readFloat(table + pos + 8))) return -1;
+			pos += 12;
+			loaded++;
+		}
+	}
+	return loaded;
+}
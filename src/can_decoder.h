@@ -0,0 +1,101 @@
+#ifndef _CAN_DECODER_
+#define _CAN_DECODER_
+
+#include <can_common.h>
+
+//Table sizes. Everything is statically allocated, nothing is allocated per frame.
+#ifndef CAN_DECODER_MAX_MESSAGES
+#define CAN_DECODER_MAX_MESSAGES 32
+#endif
+
+#ifndef CAN_DECODER_MAX_SIGNALS
+#define CAN_DECODER_MAX_SIGNALS 256
+#endif
+
+//most signals any one message can have (sets the size of the scratch value array)
+#ifndef CAN_DECODER_MAX_MSG_SIGNALS
+#define CAN_DECODER_MAX_MSG_SIGNALS 64
+#endif
+
+#ifndef CAN_DECODER_MAX_OUTPUTS
+#define CAN_DECODER_MAX_OUTPUTS 4
+#endif
+
+//Receives the result of decoding a frame. values[i] is signal i of the message in definition order.
+class CANDecodeListener
+{
+public:
+    virtual void gotDecoded(uint32_t id, bool extended, const float *values, uint8_t count) = 0;
+};
+
+/*
+Runtime signal decoder. Signal definitions are loaded from a subset of DBC (BO_ and SG_ lines,
+multiplexed signals are skipped) or from a compact binary table, then compiled into a flat array of
+extraction ops grouped by message. Decoding a frame is one hash lookup on the ID followed by a
+straight walk over that message's ops: load the bytes, shift, mask, sign extend, scale.
+
+It is a CANListener so it can be attached to any CAN_COMMON with attachObj() and registered as a
+general or per mailbox handler. Decoded values are passed on to the attached CANDecodeListeners.
+
+Binary table format, all little endian, repeated per message:
+    uint32 id (bit 31 set for extended, as in DBC), uint8 length, uint8 signal count
+    then per signal: uint16 start bit, uint8 length, uint8 flags (bit 0 Motorola, bit 1 signed),
+                     float scale, float offset
+*/
+class CANDecoder : public CANListener
+{
+public:
+    CANDecoder();
+
+    void clear();
+    bool addMessage(uint32_t id, bool extended, uint8_t length);
+    bool addSignal(uint16_t startBit, uint8_t length, bool motorola, bool isSigned, float scale, float offset, const char *name = NULL);
+    int loadDBC(const char *text);
+    int loadTable(const uint8_t *table, size_t length);
+
+    int decode(const CAN_FRAME &frame, float *values);
+    int decodeFD(const CAN_FRAME_FD &frame, float *values);
+    int findSignal(uint32_t id, bool extended, const char *name);
+    int signalCount(uint32_t id, bool extended);
+    bool attachOutput(CANDecodeListener *output);
+    bool detachOutput(CANDecodeListener *output);
+
+    //CANListener interface
+    void gotFrame(CAN_FRAME *frame, int mailbox);
+    void gotFrameFD(CAN_FRAME_FD *frame, int mailbox);
+
+private:
+    struct SignalOp
+    {
+        float scale;
+        float offset;
+        uint16_t nameHash;
+        uint8_t firstByte;
+        uint8_t numBytes;
+        uint8_t endByte;
+        uint8_t shift;
+        uint8_t length;
+        uint8_t flags;
+    };
+    struct Message
+    {
+        uint32_t key;
+        uint16_t firstOp;
+        uint8_t numOps;
+        uint8_t length;
+    };
+
+    int findMessage(uint32_t id, bool extended);
+    int decodeBytes(int msg, const uint8_t *bytes, uint8_t length, float *values);
+    void forward(uint32_t id, bool extended, int count);
+
+    SignalOp ops[CAN_DECODER_MAX_SIGNALS];
+    Message messages[CAN_DECODER_MAX_MESSAGES];
+    uint8_t hashTable[CAN_DECODER_MAX_MESSAGES * 2]; //message index + 1, 0 = empty
+    CANDecodeListener *outputs[CAN_DECODER_MAX_OUTPUTS];
+    float scratch[CAN_DECODER_MAX_MSG_SIGNALS];
+    uint16_t numOps;
+    uint8_t numMessages;
+};
+
+#endif
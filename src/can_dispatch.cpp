@@ -0,0 +1,309 @@
+#include "can_dispatch.h"
+#include "can_common.h"
+
+#define EXT_KEY_EMPTY   0
+#define EXT_KEY_DELETED 0xFFFFFFFFul
+#define EXT_KEY_USED    0x80000000ul
+
+static_assert((CAN_DISPATCH_EXT_SLOTS & (CAN_DISPATCH_EXT_SLOTS - 1)) == 0, "CAN_DISPATCH_EXT_SLOTS must be a power of two");
+static_assert(CAN_DISPATCH_MAX_HANDLERS < 255, "handler indexes are stored in a byte");
+
+static constexpr int log2Slots(uint32_t n)
+{
+	return (n <= 1) ? 0 : 1 + log2Slots(n >> 1);
+}
+
+//Fibonacci hashing. Extended IDs tend to differ in just a few bits (source address, PGN byte) which are
+//often not the low ones. The multiply mixes every ID bit into the top bits of the product and we use those.
+static inline uint32_t extHash(uint32_t id)
+{
+	return (uint32_t)(id * 2654435761ul) >> (32 - log2Slots(CAN_DISPATCH_EXT_SLOTS));
+}
+
+CANDispatchTable::CANDispatchTable()
+{
+	clear();
+}
+
+void CANDispatchTable::clear()
+{
+	memset(stdTable, 0, sizeof(stdTable));
+	memset(extKeys, 0, sizeof(extKeys));
+	memset(extHandler, 0, sizeof(extHandler));
+	memset(handlers, 0, sizeof(handlers));
+	numHandlers = 0;
+	numRanges = 0;
+}
+
+//Returns handler index + 1 with a reference taken, or 0 if there is no free handler slot. The same
+//callback pair shared by many IDs only takes one slot.
+uint8_t CANDispatchTable::acquireHandler(void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *))
+{
+	int freeSlot = -1;
+	for (int i = 0; i < numHandlers; i++)
+	{
+		if (handlers[i].refs == 0)
+		{
+			if (freeSlot < 0) freeSlot = i;
+		}
+		else if (handlers[i].cb == cb && handlers[i].cbFD == cbFD)
+		{
+			handlers[i].refs++;
+			return i + 1;
+		}
+	}
+	if (freeSlot < 0)
+	{
+		if (numHandlers >= CAN_DISPATCH_MAX_HANDLERS) return 0;
+		freeSlot = numHandlers++;
+	}
+	handlers[freeSlot].cb = cb;
+	handlers[freeSlot].cbFD = cbFD;
+	handlers[freeSlot].refs = 1;
+	return freeSlot + 1;
+}
+
+/*
+Move an entry's reference from handler current (0 for none) to the (cb, cbFD) pair, or to nothing if
+both are NULL. current is let go of first so its slot can be reused when this was its last user.
+A freed slot keeps its callbacks until reused, so dispatch racing with the change still calls a
+valid pair. Returns false and leaves the entry on current if no slot is free.
+*/
+bool CANDispatchTable::swapHandler(uint8_t current, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), uint8_t &handler)
+{
+	handler = current;
+	if (current && handlers[current - 1].cb == cb && handlers[current - 1].cbFD == cbFD) return true;
+	if (current) handlers[current - 1].refs--;
+	if (!cb && !cbFD)
+	{
+		handler = 0;
+		return true;
+	}
+	handler = acquireHandler(cb, cbFD);
+	if (handler) return true;
+	if (current) handlers[current - 1].refs++; //only possible if current still had other users
+	handler = current;
+	return false;
+}
+
+//Find the slot holding id or, if forInsert is set and id isn't there, the first usable slot along its probe chain.
+int CANDispatchTable::findExtSlot(uint32_t id, bool forInsert) const
+{
+	uint32_t key = id | EXT_KEY_USED;
+	uint32_t idx = extHash(id);
+	int firstFree = -1;
+	for (int probe = 0; probe < CAN_DISPATCH_EXT_SLOTS; probe++)
+	{
+		uint32_t k = extKeys[idx];
+		if (k == key) return idx;
+		if (k == EXT_KEY_EMPTY)
+		{
+			if (firstFree < 0) firstFree = idx;
+			break;
+		}
+		if (k == EXT_KEY_DELETED && firstFree < 0) firstFree = idx;
+		idx = (idx + 1) & (CAN_DISPATCH_EXT_SLOTS - 1);
+	}
+	return forInsert ? firstFree : -1;
+}
+
+/*
+Backward shift deletion: pull later entries of the probe chain back over the freed slot so no
+tombstones build up and misses keep stopping at the first empty slot. An entry is written to its new
+slot before its old one is given up, and slots being given up are marked deleted (which probes walk
+past) until the end, so a lookup from the ISR in the middle of this still finds every entry.
+*/
+void CANDispatchTable::removeExtSlot(int slot)
+{
+	const uint32_t mask = CAN_DISPATCH_EXT_SLOTS - 1;
+	__atomic_store_n(&extKeys[slot], EXT_KEY_DELETED, __ATOMIC_RELEASE);
+	uint32_t hole = slot;
+	uint32_t idx = (hole + 1) & mask;
+	while (extKeys[idx] != EXT_KEY_EMPTY)
+	{
+		uint32_t key = extKeys[idx];
+		uint32_t home = extHash(key & 0x1FFFFFFF);
+		//the entry can fill the hole unless its home lies after the hole, up to where it is now
+		if (((idx - home) & mask) >= ((idx - hole) & mask))
+		{
+			extHandler[hole] = extHandler[idx];
+			__atomic_store_n(&extKeys[hole], key, __ATOMIC_RELEASE);
+			__atomic_store_n(&extKeys[idx], EXT_KEY_DELETED, __ATOMIC_RELEASE);
+			hole = idx;
+		}
+		idx = (idx + 1) & mask;
+	}
+	extHandler[hole] = 0;
+	__atomic_store_n(&extKeys[hole], EXT_KEY_EMPTY, __ATOMIC_RELEASE);
+}
+
+uint8_t CANDispatchTable::lookup(uint32_t id, bool extended) const
+{
+	if (!extended) return stdTable[id & 0x7FF];
+
+	int slot = findExtSlot(id & 0x1FFFFFFF, false);
+	if (slot >= 0) return extHandler[slot];
+
+	for (int i = 0; i < numRanges; i++)
+	{
+		if (id >= ranges[i].lo && id <= ranges[i].hi) return ranges[i].handler;
+	}
+	return 0;
+}
+
+bool CANDispatchTable::setEntry(uint32_t id, bool extended, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), bool isFD)
+{
+	int slot = -1;
+	uint8_t current;
+
+	if (extended)
+	{
+		id &= 0x1FFFFFFF;
+		slot = findExtSlot(id, true);
+		if (slot < 0) return false; //hash is full
+		current = (extKeys[slot] == (id | EXT_KEY_USED)) ? extHandler[slot] : 0;
+	}
+	else
+	{
+		if (id > 0x7FF) return false;
+		current = stdTable[id];
+	}
+
+	//keep whichever half of the pair we aren't replacing
+	if (current)
+	{
+		if (isFD) cb = handlers[current - 1].cb;
+		else cbFD = handlers[current - 1].cbFD;
+	}
+
+	uint8_t handler;
+	if (!swapHandler(current, cb, cbFD, handler)) return false;
+
+	if (extended)
+	{
+		if (handler)
+		{
+			extHandler[slot] = handler;
+			extKeys[slot] = id | EXT_KEY_USED;
+		}
+		else if (extKeys[slot] == (id | EXT_KEY_USED)) removeExtSlot(slot);
+	}
+	else stdTable[id] = handler;
+	return true;
+}
+
+bool CANDispatchTable::setRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), bool isFD)
+{
+	if (lo > hi)
+	{
+		uint32_t temp = lo;
+		lo = hi;
+		hi = temp;
+	}
+
+	if (!extended)
+	{
+		if (hi > 0x7FF) return false;
+		for (uint32_t id = lo; id <= hi; id++)
+		{
+			if (!setEntry(id, false, cb, cbFD, isFD)) return false;
+		}
+		return true;
+	}
+
+	if (hi > 0x1FFFFFFF) return false;
+
+	//an existing identical range is updated in place, otherwise a new one is appended
+	for (int i = 0; i < numRanges; i++)
+	{
+		if (ranges[i].lo == lo && ranges[i].hi == hi)
+		{
+			Handler &h = handlers[ranges[i].handler - 1];
+			if (isFD) cb = h.cb;
+			else cbFD = h.cbFD;
+			uint8_t handler;
+			if (!swapHandler(ranges[i].handler, cb, cbFD, handler)) return false;
+			if (handler) ranges[i].handler = handler;
+			else ranges[i] = ranges[--numRanges];
+			return true;
+		}
+	}
+
+	if (!cb && !cbFD) return true;
+	if (numRanges >= CAN_DISPATCH_MAX_RANGES) return false;
+	uint8_t handler = acquireHandler(cb, cbFD);
+	if (!handler) return false;
+	ranges[numRanges].lo = lo;
+	ranges[numRanges].hi = hi;
+	ranges[numRanges].handler = handler;
+	numRanges++;
+	return true;
+}
+
+/**
+ * \brief Route frames with this ID to a callback
+ *
+ * \param id The CAN ID
+ * \param extended true for a 29 bit ID, false for an 11 bit one
+ * \param cb A function pointer to a function with prototype "void functionname(CAN_FRAME *frame);"
+ *
+ * \ret  false if the tables are full or the ID is out of range
+ */
+bool CANDispatchTable::onId(uint32_t id, bool extended, void (*cb)(CAN_FRAME *))
+{
+	return setEntry(id, extended, cb, NULL, false);
+}
+
+bool CANDispatchTable::onIdFD(uint32_t id, bool extended, void (*cb)(CAN_FRAME_FD *))
+{
+	return setEntry(id, extended, NULL, cb, true);
+}
+
+/**
+ * \brief Route every ID from lo to hi (inclusive) to a callback
+ *
+ * \note Standard ranges are expanded into the direct table. Extended ranges are kept in a short list
+ * (CAN_DISPATCH_MAX_RANGES) that is only checked when the per-ID hash misses.
+ */
+bool CANDispatchTable::onRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *))
+{
+	return setRange(lo, hi, extended, cb, NULL, false);
+}
+
+bool CANDispatchTable::onRangeFD(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME_FD *))
+{
+	return setRange(lo, hi, extended, NULL, cb, true);
+}
+
+void CANDispatchTable::removeId(uint32_t id, bool extended)
+{
+	setEntry(id, extended, NULL, NULL, false);
+	setEntry(id, extended, NULL, NULL, true);
+}
+
+void CANDispatchTable::removeRange(uint32_t lo, uint32_t hi, bool extended)
+{
+	setRange(lo, hi, extended, NULL, NULL, false);
+	setRange(lo, hi, extended, NULL, NULL, true);
+}
+
+//Returns true if a callback took the frame
+bool CANDispatchTable::dispatch(CAN_FRAME &frame) const
+{
+	uint8_t handler = lookup(frame.id, frame.extended);
+	if (!handler) return false;
+	void (*cb)(CAN_FRAME *) = handlers[handler - 1].cb;
+	if (!cb) return false;
+	cb(&frame);
+	return true;
+}
+
+bool CANDispatchTable::dispatchFD(CAN_FRAME_FD &frame) const
+{
+	uint8_t handler = lookup(frame.id, frame.extended);
+	if (!handler) return false;
+	void (*cb)(CAN_FRAME_FD *) = handlers[handler - 1].cbFD;
+	if (!cb) return false;
+	cb(&frame);
+	return true;
+}
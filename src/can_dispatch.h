@@ -0,0 +1,79 @@
+#ifndef _CAN_DISPATCH_
+#define _CAN_DISPATCH_
+
+#include <Arduino.h>
+
+class CAN_FRAME;
+class CAN_FRAME_FD;
+
+//How many distinct callback (classic, FD) pairs can be in use at once across all IDs
+#ifndef CAN_DISPATCH_MAX_HANDLERS
+#define CAN_DISPATCH_MAX_HANDLERS 32
+#endif
+
+//Slots in the 29 bit ID hash. Must be a power of two. Keep the table under 75% full for short probes,
+//so the default takes up to about 380 IDs.
+#ifndef CAN_DISPATCH_EXT_SLOTS
+#define CAN_DISPATCH_EXT_SLOTS 512
+#endif
+
+//Extended ID ranges are too big to expand into the hash so they are kept in a short list
+//that is only searched when the hash misses.
+#ifndef CAN_DISPATCH_MAX_RANGES
+#define CAN_DISPATCH_MAX_RANGES 8
+#endif
+
+/*
+Software routing of received frames by CAN ID. Standard IDs index straight into a 2048 entry
+table, extended IDs go through an open addressing hash. Either way a frame finds its handler with
+one lookup no matter how many IDs are registered. Table entries are one byte indexes into a small
+array of callbacks so the whole thing is about 5k of RAM with the default sizes.
+*/
+class CANDispatchTable
+{
+public:
+    CANDispatchTable();
+
+    bool onId(uint32_t id, bool extended, void (*cb)(CAN_FRAME *));
+    bool onIdFD(uint32_t id, bool extended, void (*cb)(CAN_FRAME_FD *));
+    bool onRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *));
+    bool onRangeFD(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME_FD *));
+    void removeId(uint32_t id, bool extended);
+    void removeRange(uint32_t lo, uint32_t hi, bool extended);
+    void clear();
+
+    bool dispatch(CAN_FRAME &frame) const;
+    bool dispatchFD(CAN_FRAME_FD &frame) const;
+
+private:
+    struct Handler
+    {
+        void (*cb)(CAN_FRAME *);
+        void (*cbFD)(CAN_FRAME_FD *);
+        uint16_t refs;      //table entries and ranges using this pair, the slot is free when 0
+    };
+    struct Range
+    {
+        uint32_t lo;
+        uint32_t hi;
+        uint8_t handler;
+    };
+
+    uint8_t lookup(uint32_t id, bool extended) const;
+    uint8_t acquireHandler(void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *));
+    bool swapHandler(uint8_t current, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), uint8_t &handler);
+    bool setEntry(uint32_t id, bool extended, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), bool isFD);
+    bool setRange(uint32_t lo, uint32_t hi, bool extended, void (*cb)(CAN_FRAME *), void (*cbFD)(CAN_FRAME_FD *), bool isFD);
+    int findExtSlot(uint32_t id, bool forInsert) const;
+    void removeExtSlot(int slot);
+
+    Handler handlers[CAN_DISPATCH_MAX_HANDLERS];
+    uint8_t numHandlers;                        //slots ever used, free ones below this are reused first
+    uint8_t stdTable[2048];                     //handler index + 1 for each 11 bit ID, 0 = nothing registered
+    uint32_t extKeys[CAN_DISPATCH_EXT_SLOTS];   //ID | 0x80000000 when used, 0 when empty, 0xFFFFFFFF while removeExtSlot runs
+    uint8_t extHandler[CAN_DISPATCH_EXT_SLOTS];
+    Range ranges[CAN_DISPATCH_MAX_RANGES];
+    uint8_t numRanges;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "can_filter_plan.h"
+#include "can_common.h"
+
+static inline uint32_t widthMask(bool extended)
+{
+	return extended ? 0x1FFFFFFF : 0x7FF;
+}
+
+static inline CANFilter mergeFilters(const CANFilter &a, const CANFilter &b)
+{
+	CANFilter merged;
+	merged.extended = a.extended;
+	merged.mask = a.mask & b.mask & ~(a.id ^ b.id) & widthMask(a.extended);
+	merged.id = a.id & merged.mask;
+	return merged;
+}
+
+CANFilterPlanner::CANFilterPlanner()
+{
+	clear();
+}
+
+void CANFilterPlanner::clear()
+{
+	numEntries = 0;
+}
+
+/**
+ * \brief Number of distinct IDs a filter lets through
+ *
+ * \note Saturates at 0xFFFFFFFF which can't happen for a 29 bit filter anyway.
+ */
+uint32_t CANFilterPlanner::admittedCount(const CANFilter &filter)
+{
+	uint32_t wild = widthMask(filter.extended) & ~filter.mask;
+	return 1ul << __builtin_popcount(wild);
+}
+
+bool CANFilterPlanner::addBlock(uint32_t id, uint32_t mask, bool extended)
+{
+	if (numEntries >= CAN_FILTER_PLAN_MAX_ENTRIES)
+	{
+		//make room by merging the cheapest pair. Still correct, just less exact.
+		if (!reduce(CAN_FILTER_PLAN_MAX_ENTRIES - 1)) return false;
+	}
+	entries[numEntries].id = id & mask;
+	entries[numEntries].mask = mask;
+	entries[numEntries].extended = extended;
+	numEntries++;
+	return true;
+}
+
+bool CANFilterPlanner::addId(uint32_t id)
+{
+	return addId(id, (id > 0x7FF));
+}
+
+bool CANFilterPlanner::addId(uint32_t id, bool extended)
+{
+	if (id > widthMask(extended)) return false;
+	return addBlock(id, widthMask(extended), extended);
+}
+
+/**
+ * \brief Add an id / mask pair as is
+ *
+ * For sets that are a pattern rather than a range, J1939 PGNs from any priority and source for instance.
+ */
+bool CANFilterPlanner::addMasked(uint32_t id, uint32_t mask, bool extended)
+{
+	mask &= widthMask(extended);
+	return addBlock(id, mask, extended);
+}
+
+bool CANFilterPlanner::addRange(uint32_t lo, uint32_t hi)
+{
+	return addRange(lo, hi, (lo > 0x7FF || hi > 0x7FF));
+}
+
+/**
+ * \brief Add every ID from lo to hi (inclusive)
+ *
+ * \note The range is stored as the minimal list of aligned power of two blocks so nothing outside it is
+ * admitted unless filters later have to be merged.
+ */
+bool CANFilterPlanner::addRange(uint32_t lo, uint32_t hi, bool extended)
+{
+	uint32_t full = widthMask(extended);
+	if (lo > hi)
+	{
+		uint32_t temp = lo;
+		lo = hi;
+		hi = temp;
+	}
+	if (hi > full) return false;
+
+	//64 bit math so hi == 0x1FFFFFFF doesn't overflow when stepping past it
+	uint64_t cur = lo;
+	while (cur <= hi)
+	{
+		//largest block that starts at cur (alignment) and doesn't run past hi
+		int bits = cur ? __builtin_ctz((uint32_t)cur) : 29;
+		while (bits > 0 && cur + (1ull << bits) - 1 > hi) bits--;
+		uint32_t mask = full & ~((1ul << bits) - 1);
+		if (!addBlock((uint32_t)cur, mask, extended)) return false;
+		cur += (1ull << bits);
+	}
+	return true;
+}
+
+//Greedily merge filters until there are at most target of them. Returns false if that can't be done,
+//which only happens when target is 1 and both standard and extended filters are wanted.
+bool CANFilterPlanner::reduce(int target)
+{
+	while (numEntries > target)
+	{
+		int bestA = -1, bestB = -1;
+		int64_t bestCost = 0;
+		for (int a = 0; a < numEntries; a++)
+		{
+			for (int b = a + 1; b < numEntries; b++)
+			{
+				if (entries[a].extended != entries[b].extended) continue;
+				CANFilter merged = mergeFilters(entries[a], entries[b]);
+				int64_t cost = (int64_t)admittedCount(merged) - admittedCount(entries[a]) - admittedCount(entries[b]);
+				if (bestA < 0 || cost < bestCost)
+				{
+					bestA = a;
+					bestB = b;
+					bestCost = cost;
+				}
+			}
+		}
+		if (bestA < 0) return false;
+		entries[bestA] = mergeFilters(entries[bestA], entries[bestB]);
+		entries[bestB] = entries[--numEntries];
+	}
+	return true;
+}
+
+/**
+ * \brief Work out the filters needed to pass everything added so far
+ *
+ * \param out Array to receive the filters
+ * \param maxFilters How many hardware filters are available (size of out)
+ *
+ * \ret  Number of filters written to out or -1 if it can't be done in maxFilters
+ *
+ * \note The planner's working set is reduced in place so calling this again with a smaller maxFilters
+ * keeps refining the same plan.
+ */
+int CANFilterPlanner::plan(CANFilter *out, int maxFilters)
+{
+	if (maxFilters <= 0) return -1;
+	if (!reduce(maxFilters)) return -1;
+	for (int i = 0; i < numEntries; i++) out[i] = entries[i];
+	return numEntries;
+}
+
+/**
+ * \brief Plan the filters and program them into a CAN interface
+ *
+ * \param bus Interface to program with setRXFilter(mailbox, ...)
+ * \param maxFilters How many mailboxes may be used
+ * \param firstMailbox First mailbox to use. Mailboxes are used consecutively from here.
+ *
+ * \ret  Number of filters programmed or -1 on failure
+ */
+int CANFilterPlanner::apply(CAN_COMMON &bus, int maxFilters, int firstMailbox)
+{
+	if (maxFilters <= 0 || !reduce(maxFilters)) return -1;
+	for (int i = 0; i < numEntries; i++)
+	{
+		if (bus.setRXFilter((uint8_t)(firstMailbox + i), entries[i].id, entries[i].mask, entries[i].extended) < 0) return -1;
+	}
+	return numEntries;
+}
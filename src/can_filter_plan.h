@@ -0,0 +1,53 @@
+#ifndef _CAN_FILTER_PLAN_
+#define _CAN_FILTER_PLAN_
+
+#include <Arduino.h>
+
+class CAN_COMMON;
+
+//Working set size for the planner. A 29 bit range splits into at most 56 aligned blocks.
+#ifndef CAN_FILTER_PLAN_MAX_ENTRIES
+#define CAN_FILTER_PLAN_MAX_ENTRIES 64
+#endif
+
+struct CANFilter
+{
+    uint32_t id;
+    uint32_t mask;
+    bool extended;
+};
+
+/*
+Turns an arbitrary collection of IDs and ID ranges into a small set of id/mask filters.
+
+Every range is first split into aligned power of two blocks, each of which is an exact id/mask
+pair. If that needs more filters than the hardware has, the pair of filters whose merge lets the
+fewest extra IDs through is merged, over and over, until it fits. Merging a pair where one already
+covers the other costs nothing so duplicates and overlaps collapse first.
+*/
+class CANFilterPlanner
+{
+public:
+    CANFilterPlanner();
+
+    void clear();
+    bool addId(uint32_t id);
+    bool addId(uint32_t id, bool extended);
+    bool addRange(uint32_t lo, uint32_t hi);
+    bool addRange(uint32_t lo, uint32_t hi, bool extended);
+    bool addMasked(uint32_t id, uint32_t mask, bool extended);
+
+    int plan(CANFilter *out, int maxFilters);
+    int apply(CAN_COMMON &bus, int maxFilters, int firstMailbox = 0);
+
+    static uint32_t admittedCount(const CANFilter &filter);
+
+private:
+    bool addBlock(uint32_t id, uint32_t mask, bool extended);
+    bool reduce(int target);
+
+    CANFilter entries[CAN_FILTER_PLAN_MAX_ENTRIES];
+    int numEntries;
+};
+
+#endif
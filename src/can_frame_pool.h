@@ -0,0 +1,199 @@
+#ifndef _CAN_FRAME_POOL_
+#define _CAN_FRAME_POOL_
+
+#include <can_common.h>
+
+#define CAN_POOL_NONE 0xFFFF
+
+template<typename T> class CANFramePoolBase;
+
+//A frame plus its bookkeeping. The frame comes first so a T * from the pool is also a node pointer.
+template<typename T>
+struct CANPoolNode
+{
+    T frame;
+    uint32_t refs;
+    uint16_t next;      //free list link, only meaningful while the node is free
+    uint16_t index;
+    CANFramePoolBase<T> *owner;
+};
+
+/*
+Counted reference to a pooled frame. Copying a handle adds a reference, destroying or resetting one
+drops it, and the frame goes back to its pool when the last handle lets go. Handles can be copied
+into queues, listeners, loggers and the like without ever copying the frame itself. Counting is
+atomic so handles can be passed between an ISR and loop() (or threads on the host), but a single
+handle object must not be used from two places at once.
+*/
+template<typename T>
+class CANFrameRef
+{
+public:
+    CANFrameRef() : node(NULL) {}
+    explicit CANFrameRef(CANPoolNode<T> *n) : node(n) {} //takes over a reference the caller already holds
+    CANFrameRef(const CANFrameRef &other) : node(other.node)
+    {
+        if (node) __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+    }
+    CANFrameRef(CANFrameRef &&other) : node(other.node) { other.node = NULL; }
+    ~CANFrameRef() { reset(); }
+
+    CANFrameRef &operator=(CANFrameRef other)
+    {
+        CANPoolNode<T> *tmp = node;
+        node = other.node;
+        other.node = tmp;
+        return *this;
+    }
+
+    void reset()
+    {
+        if (node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) node->owner->release(node);
+        node = NULL;
+    }
+
+    T *get() const { return node ? &node->frame : NULL; }
+    T &operator*() const { return node->frame; }
+    T *operator->() const { return &node->frame; }
+    explicit operator bool() const { return node != NULL; }
+    uint32_t useCount() const { return node ? __atomic_load_n(&node->refs, __ATOMIC_RELAXED) : 0; }
+
+private:
+    CANPoolNode<T> *node;
+};
+
+/*
+Lock free fixed size frame allocator. Free nodes form a Treiber stack. The head holds a 16 bit node
+index and a 16 bit tag that changes on every push and pop, so one 32 bit compare and swap is enough
+(no 64 bit atomics needed on Cortex-M3) and a node that is popped and pushed back between another
+context's load and CAS can't fool it (ABA). Allocation and release are safe from any number of
+ISRs and threads at once.
+
+Use CANFramePool<T, N> which carries its storage, this base only exists so handles don't need N.
+*/
+template<typename T>
+class CANFramePoolBase
+{
+public:
+    /**
+     * \brief Take a free frame
+     *
+     * \ret  Handle holding the only reference, empty if the pool is exhausted. The frame's contents
+     * are whatever the last user left in it.
+     */
+    CANFrameRef<T> alloc()
+    {
+        uint32_t old = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint32_t replacement;
+        do
+        {
+            uint16_t idx = (uint16_t)old;
+            if (idx == CAN_POOL_NONE)
+            {
+                __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+                return CANFrameRef<T>();
+            }
+            //may read a node someone else just took, the tag makes the CAS fail in that case
+            uint16_t next = __atomic_load_n(&nodes[idx].next, __ATOMIC_RELAXED);
+            replacement = ((old + 0x10000) & 0xFFFF0000) | next;
+        } while (!__atomic_compare_exchange_n(&head, &old, replacement, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        CANPoolNode<T> *node = &nodes[(uint16_t)old];
+        __atomic_store_n(&node->refs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&freeCount, 1, __ATOMIC_RELAXED);
+        return CANFrameRef<T>(node);
+    }
+
+    //Allocate and fill with a copy of frame. Empty handle if the pool is exhausted.
+    CANFrameRef<T> make(const T &frame)
+    {
+        CANFrameRef<T> ref = alloc();
+        if (ref) *ref = frame;
+        return ref;
+    }
+
+    /**
+     * \brief New handle for a frame that is already held somewhere else
+     *
+     * For code that is handed a plain T * (listener callbacks for instance) and wants to keep the frame.
+     * \ret  Empty handle if frame doesn't belong to this pool or isn't allocated
+     */
+    CANFrameRef<T> retain(T *frame)
+    {
+        CANPoolNode<T> *node = (CANPoolNode<T> *)frame;
+        if (node < nodes || node >= nodes + count) return CANFrameRef<T>();
+        if ((size_t)((uint8_t *)node - (uint8_t *)nodes) % sizeof(CANPoolNode<T>)) return CANFrameRef<T>();
+        uint32_t refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+        do
+        {
+            if (refs == 0) return CANFrameRef<T>();
+        } while (!__atomic_compare_exchange_n(&node->refs, &refs, refs + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return CANFrameRef<T>(node);
+    }
+
+    uint16_t capacity() const { return count; }
+    uint16_t available() const { return __atomic_load_n(&freeCount, __ATOMIC_RELAXED); }
+    uint32_t getFailures() const { return __atomic_load_n(&failures, __ATOMIC_RELAXED); }
+
+protected:
+    friend class CANFrameRef<T>;
+
+    void setup(CANPoolNode<T> *storage, uint16_t num)
+    {
+        nodes = storage;
+        count = num;
+        for (uint16_t i = 0; i < count; i++)
+        {
+            nodes[i].refs = 0;
+            nodes[i].index = i;
+            nodes[i].next = (i + 1 < count) ? i + 1 : CAN_POOL_NONE;
+            nodes[i].owner = this;
+        }
+        head = count ? 0 : CAN_POOL_NONE;
+        freeCount = count;
+        failures = 0;
+    }
+
+    void release(CANPoolNode<T> *node)
+    {
+        uint32_t old = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        uint32_t replacement;
+        do
+        {
+            __atomic_store_n(&node->next, (uint16_t)old, __ATOMIC_RELAXED);
+            replacement = ((old + 0x10000) & 0xFFFF0000) | node->index;
+        } while (!__atomic_compare_exchange_n(&head, &old, replacement, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        __atomic_fetch_add(&freeCount, 1, __ATOMIC_RELAXED);
+    }
+
+private:
+    CANPoolNode<T> *nodes;
+    uint16_t count;
+    uint32_t head;      //tag << 16 | index of the first free node
+    uint16_t freeCount;
+    uint32_t failures;  //alloc() calls that found the pool empty
+};
+
+/*
+Pool of N frames of type T (CAN_FRAME or CAN_FRAME_FD), all storage inside the object so it can be
+a global. For example
+
+    CANFramePool<CAN_FRAME_FD, 32> fdPool;
+    CANFrameRef<CAN_FRAME_FD> frame = fdPool.alloc();
+*/
+template<typename T, uint16_t N>
+class CANFramePool : public CANFramePoolBase<T>
+{
+    static_assert(N > 0 && N < CAN_POOL_NONE, "pool size must be 1 - 65534");
+
+public:
+    CANFramePool() { this->setup(storage, N); }
+
+private:
+    CANFramePool(const CANFramePool &);
+    CANFramePool &operator=(const CANFramePool &);
+
+    CANPoolNode<T> storage[N];
+};
+
+#endif
@@ -0,0 +1,530 @@
+#include "can_isotp.h"
+
+//protocol control information, top nibble of the first byte
+#define PCI_SINGLE      0x00
+#define PCI_FIRST       0x10
+#define PCI_CONSECUTIVE 0x20
+#define PCI_FLOW        0x30
+
+#define FC_CTS      0
+#define FC_WAIT     1
+#define FC_OVERFLOW 2
+
+//longest message a first frame can announce without the 32 bit escape
+#define FF_SHORT_MAX 4095
+
+CANIsoTp::CANIsoTp(CAN_COMMON &canBus) : bus(canBus)
+{
+	for (int i = 0; i < CAN_ISOTP_MAX_SESSIONS; i++) sessions[i].active = false;
+	wheel.attach(timers, CAN_ISOTP_MAX_SESSIONS * 2);
+	lastMicros = micros();
+	tickRemainder = 0;
+	wheelTarget = wheel.getTick();
+	nBsMicros = nCrMicros = CAN_ISOTP_DEFAULT_TIMEOUT * 1000ul;
+	pool = NULL;
+	poolBlockSize = 0;
+	poolBlocks = 0;
+	poolFree = 0;
+	receivedCB = NULL;
+	receivedContext = NULL;
+	sendDoneCB = NULL;
+	sendDoneContext = NULL;
+	rxErrorCB = NULL;
+	rxErrorContext = NULL;
+}
+
+/**
+ * \brief Set up a connection to another node
+ *
+ * \param txId ID this end sends on
+ * \param rxId ID the other end sends on
+ * \param extended Both IDs are 29 bit
+ * \param txDL Longest frame to send, 8 for classic CAN or 12 - 64 to send CAN-FD frames
+ *
+ * \ret  Session number or -1 if there are no free sessions
+ */
+int CANIsoTp::addSession(uint32_t txId, uint32_t rxId, bool extended, uint8_t txDL)
+{
+	for (int i = 0; i < CAN_ISOTP_MAX_SESSIONS; i++)
+	{
+		Session &s = sessions[i];
+		if (s.active) continue;
+		s.txId = txId;
+		s.rxId = rxId;
+		s.extended = extended;
+		s.pad = true;
+		s.padValue = CAN_ISOTP_DEFAULT_PADDING;
+		s.txDL = (txDL <= 8) ? 8 : fdLengthDecoding[fdLengthEncoding[txDL > 64 ? 64 : txDL]];
+		s.blockSize = 0;
+		s.stMin = 0;
+		s.rxBuffer = NULL;
+		s.rxBufferSize = 0;
+		s.txState = IDLE;
+		s.txData = NULL;
+		s.rxState = IDLE;
+		s.rxData = NULL;
+		s.rxPoolBlock = -1;
+		s.fcPending = false;
+		s.active = true;
+		return i;
+	}
+	return -1;
+}
+
+void CANIsoTp::removeSession(uint8_t session)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS) return;
+	abort(session);
+	sessions[session].active = false;
+}
+
+//Block size and STmin this end asks the sender for. 0, 0 (the default) means send everything as fast as possible.
+void CANIsoTp::setFlowControl(uint8_t session, uint8_t blockSize, uint8_t stMin)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS) return;
+	sessions[session].blockSize = blockSize;
+	sessions[session].stMin = stMin;
+}
+
+//Where to reassemble messages for this session. Messages that don't fit go to the pool.
+void CANIsoTp::setRxBuffer(uint8_t session, uint8_t *buffer, uint32_t size)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS) return;
+	sessions[session].rxBuffer = buffer;
+	sessions[session].rxBufferSize = buffer ? size : 0;
+}
+
+//Fill unused bytes of short frames (pad = true, the default) or send them with a shorter DLC
+void CANIsoTp::setPadding(uint8_t session, bool pad, uint8_t value)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS) return;
+	sessions[session].pad = pad;
+	sessions[session].padValue = value;
+}
+
+/**
+ * \brief Shared reassembly buffers for sessions without a buffer of their own
+ *
+ * \param storage blocks * blockSize bytes
+ * \param blockSize Longest message a block can hold
+ * \param blocks Number of blocks, up to 32
+ *
+ * \note Only change the pool while nothing is being received
+ */
+bool CANIsoTp::setPool(uint8_t *storage, uint32_t blockSize, uint8_t blocks)
+{
+	if (blocks > 32) return false;
+	pool = storage;
+	poolBlockSize = storage ? blockSize : 0;
+	poolBlocks = storage ? blocks : 0;
+	poolFree = (poolBlocks == 32) ? 0xFFFFFFFF : ((1ul << poolBlocks) - 1);
+	return true;
+}
+
+void CANIsoTp::setTimeouts(uint16_t nBsMillis, uint16_t nCrMillis)
+{
+	nBsMicros = nBsMillis * 1000ul;
+	nCrMicros = nCrMillis * 1000ul;
+}
+
+void CANIsoTp::onReceive(CANIsoTpReceived callback, void *context)
+{
+	receivedCB = callback;
+	receivedContext = context;
+}
+
+void CANIsoTp::onSendDone(CANIsoTpEvent callback, void *context)
+{
+	sendDoneCB = callback;
+	sendDoneContext = context;
+}
+
+void CANIsoTp::onReceiveError(CANIsoTpEvent callback, void *context)
+{
+	rxErrorCB = callback;
+	rxErrorContext = context;
+}
+
+bool CANIsoTp::isSending(uint8_t session)
+{
+	return session < CAN_ISOTP_MAX_SESSIONS && sessions[session].txState != IDLE;
+}
+
+bool CANIsoTp::isReceiving(uint8_t session)
+{
+	return session < CAN_ISOTP_MAX_SESSIONS && sessions[session].rxState == RECEIVING;
+}
+
+//STmin byte to microseconds. Reserved values mean the longest time, 127ms.
+uint32_t CANIsoTp::stMinToMicros(uint8_t stMin)
+{
+	if (stMin <= 0x7F) return stMin * 1000ul;
+	if (stMin >= 0xF1 && stMin <= 0xF9) return (stMin - 0xF0) * 100ul;
+	return 127000ul;
+}
+
+//The wheel only moves in service() so count the time since then as well or the timer fires early.
+//Timers started from an expiry callback also have to allow for the ticks the wheel still has to catch up.
+void CANIsoTp::startTimer(uint16_t timer, uint32_t delayMicros)
+{
+	uint32_t since = (uint32_t)(micros() - lastMicros) + tickRemainder;
+	uint32_t behind = wheelTarget - wheel.getTick();
+	wheel.start(timer, behind + (since + delayMicros + CAN_ISOTP_TICK_MICROS - 1) / CAN_ISOTP_TICK_MICROS);
+}
+
+int8_t CANIsoTp::allocBlock()
+{
+	if (!poolFree) return -1;
+	int8_t block = __builtin_ctz(poolFree);
+	poolFree &= ~(1ul << block);
+	return block;
+}
+
+void CANIsoTp::releaseRx(Session &s)
+{
+	if (s.rxPoolBlock >= 0) poolFree |= (1ul << s.rxPoolBlock);
+	s.rxPoolBlock = -1;
+	s.rxData = NULL;
+}
+
+//Build a frame from PCI + payload (copied once, straight into the frame) and send it
+bool CANIsoTp::sendPDU(Session &s, const uint8_t *pci, uint8_t pciLength, const uint8_t *payload, uint8_t payloadLength)
+{
+	uint8_t len = pciLength + payloadLength;
+	uint8_t dl = len;
+	if (len > 8) dl = fdLengthDecoding[fdLengthEncoding[len]]; //FD frames can only have some lengths
+	else if (s.pad) dl = 8;
+
+	if (s.txDL > 8)
+	{
+		CAN_FRAME_FD frame;
+		frame.id = s.txId;
+		frame.extended = s.extended;
+		frame.fdMode = 1;
+		frame.length = dl;
+		memcpy(frame.data.uint8, pci, pciLength);
+		if (payloadLength) memcpy(frame.data.uint8 + pciLength, payload, payloadLength);
+		if (dl > len) memset(frame.data.uint8 + len, s.padValue, dl - len);
+		return bus.sendFrameFD(frame);
+	}
+	CAN_FRAME frame;
+	frame.id = s.txId;
+	frame.extended = s.extended;
+	frame.length = dl;
+	memcpy(frame.data.uint8, pci, pciLength);
+	if (payloadLength) memcpy(frame.data.uint8 + pciLength, payload, payloadLength);
+	if (dl > len) memset(frame.data.uint8 + len, s.padValue, dl - len);
+	return bus.sendFrame(frame);
+}
+
+bool CANIsoTp::sendFlowControl(Session &s, uint8_t status)
+{
+	uint8_t pci[3] = { (uint8_t)(PCI_FLOW | status), s.blockSize, s.stMin };
+	s.fcPending = !sendPDU(s, pci, 3, NULL, 0);
+	s.fcStatus = status;
+	return !s.fcPending;
+}
+
+/**
+ * \brief Start sending a message
+ *
+ * \param data Message. Frames are built straight from it so leave it alone until the done callback.
+ * \param length Message length
+ *
+ * \ret  false if the session is already sending or the driver wouldn't take the first frame
+ *
+ * \note A message that fits in a single frame is finished (done callback included) before this returns
+ */
+bool CANIsoTp::send(uint8_t session, const uint8_t *data, uint32_t length)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS || length == 0) return false;
+	Session &s = sessions[session];
+	if (!s.active || s.txState != IDLE) return false;
+	uint8_t pci[6];
+
+	if (length <= 7 || (s.txDL > 8 && length <= (uint32_t)s.txDL - 2))
+	{
+		uint8_t pciLength = 1;
+		pci[0] = PCI_SINGLE | (uint8_t)length;
+		if (length > 7) //FD single frame, length in the second byte
+		{
+			pci[0] = PCI_SINGLE;
+			pci[1] = (uint8_t)length;
+			pciLength = 2;
+		}
+		if (!sendPDU(s, pci, pciLength, data, (uint8_t)length)) return false;
+		if (sendDoneCB) sendDoneCB(session, ISOTP_OK, sendDoneContext);
+		return true;
+	}
+
+	uint8_t pciLength = 2;
+	if (length <= FF_SHORT_MAX)
+	{
+		pci[0] = PCI_FIRST | (uint8_t)(length >> 8);
+		pci[1] = (uint8_t)length;
+	}
+	else
+	{
+		pci[0] = PCI_FIRST;
+		pci[1] = 0;
+		pci[2] = (uint8_t)(length >> 24);
+		pci[3] = (uint8_t)(length >> 16);
+		pci[4] = (uint8_t)(length >> 8);
+		pci[5] = (uint8_t)length;
+		pciLength = 6;
+	}
+	uint8_t first = s.txDL - pciLength;
+	if (!sendPDU(s, pci, pciLength, data, first)) return false;
+	s.txData = data;
+	s.txLength = length;
+	s.txSent = first;
+	s.txSN = 1;
+	s.txState = WAIT_FC;
+	startTimer(txTimer(session), nBsMicros);
+	return true;
+}
+
+void CANIsoTp::abort(uint8_t session)
+{
+	if (session >= CAN_ISOTP_MAX_SESSIONS) return;
+	if (sessions[session].txState != IDLE) finishSend(session, ISOTP_ABORTED);
+	if (sessions[session].rxState == RECEIVING) failReceive(session, ISOTP_ABORTED);
+}
+
+void CANIsoTp::finishSend(uint8_t idx, CANIsoTpResult result)
+{
+	Session &s = sessions[idx];
+	wheel.stop(txTimer(idx));
+	s.txState = IDLE;
+	s.txData = NULL;
+	if (sendDoneCB) sendDoneCB(idx, result, sendDoneContext);
+}
+
+void CANIsoTp::failReceive(uint8_t idx, CANIsoTpResult result)
+{
+	Session &s = sessions[idx];
+	wheel.stop(rxTimer(idx));
+	s.rxState = IDLE;
+	s.fcPending = false;
+	releaseRx(s);
+	if (rxErrorCB) rxErrorCB(idx, result, rxErrorContext);
+}
+
+//Send consecutive frames until the block is done, STmin says wait or the driver is full
+void CANIsoTp::pump(uint8_t idx)
+{
+	Session &s = sessions[idx];
+	while (s.txState == SENDING && !wheel.isRunning(txTimer(idx)))
+	{
+		uint8_t pci = PCI_CONSECUTIVE | s.txSN;
+		uint32_t left = s.txLength - s.txSent;
+		uint8_t n = (left < (uint32_t)s.txDL - 1) ? (uint8_t)left : s.txDL - 1;
+		if (!sendPDU(s, &pci, 1, s.txData + s.txSent, n)) return; //service() tries again
+		s.txSent += n;
+		s.txSN = (s.txSN + 1) & 0x0F;
+		if (s.txSent >= s.txLength)
+		{
+			finishSend(idx, ISOTP_OK);
+			return;
+		}
+		if (s.txBlockSize && --s.txBlockLeft == 0)
+		{
+			s.txState = WAIT_FC;
+			startTimer(txTimer(idx), nBsMicros);
+			return;
+		}
+		if (s.txGapMicros) startTimer(txTimer(idx), s.txGapMicros);
+	}
+}
+
+void CANIsoTp::handleFlowControl(uint8_t idx, const uint8_t *data, uint8_t length)
+{
+	Session &s = sessions[idx];
+	if (s.txState != WAIT_FC || length < 3) return;
+	switch (data[0] & 0x0F)
+	{
+	case FC_CTS:
+		s.txBlockSize = data[1];
+		s.txBlockLeft = data[1];
+		s.txGapMicros = stMinToMicros(data[2]);
+		s.txState = SENDING;
+		wheel.stop(txTimer(idx));
+		pump(idx);
+		break;
+	case FC_WAIT:
+		startTimer(txTimer(idx), nBsMicros);
+		break;
+	case FC_OVERFLOW:
+		finishSend(idx, ISOTP_OVERFLOW);
+		break;
+	default:
+		finishSend(idx, ISOTP_UNEXPECTED);
+		break;
+	}
+}
+
+void CANIsoTp::handleFirstFrame(uint8_t idx, const uint8_t *data, uint8_t length)
+{
+	Session &s = sessions[idx];
+	if (length < 8) return; //first frames always fill the frame
+	uint32_t len = ((uint32_t)(data[0] & 0x0F) << 8) | data[1];
+	uint8_t offset = 2;
+	if (len == 0)
+	{
+		len = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5];
+		offset = 6;
+	}
+	if (len <= (uint32_t)(length - offset)) return; //should have been a single frame, ignored as the standard says
+
+	if (s.rxState == RECEIVING) failReceive(idx, ISOTP_UNEXPECTED);
+
+	uint8_t *buffer = NULL;
+	if (s.rxBuffer && s.rxBufferSize >= len) buffer = s.rxBuffer;
+	else if (poolBlockSize >= len)
+	{
+		int8_t block = allocBlock();
+		if (block >= 0)
+		{
+			s.rxPoolBlock = block;
+			buffer = pool + block * poolBlockSize;
+		}
+	}
+	if (buffer == NULL)
+	{
+		sendFlowControl(s, FC_OVERFLOW);
+		s.fcPending = false; //not worth retrying, the sender times out anyway
+		if (rxErrorCB) rxErrorCB(idx, ISOTP_OVERFLOW, rxErrorContext);
+		return;
+	}
+
+	s.rxData = buffer;
+	s.rxLength = len;
+	s.rxReceived = length - offset;
+	memcpy(buffer, data + offset, s.rxReceived);
+	s.rxSN = 1;
+	s.rxBlockLeft = s.blockSize;
+	s.rxState = RECEIVING;
+	sendFlowControl(s, FC_CTS);
+	startTimer(rxTimer(idx), nCrMicros);
+}
+
+void CANIsoTp::handleConsecutive(uint8_t idx, const uint8_t *data, uint8_t length)
+{
+	Session &s = sessions[idx];
+	if (s.rxState != RECEIVING) return;
+	if ((data[0] & 0x0F) != s.rxSN)
+	{
+		failReceive(idx, ISOTP_WRONG_SN);
+		return;
+	}
+	uint32_t left = s.rxLength - s.rxReceived;
+	uint32_t n = (left < (uint32_t)length - 1) ? left : (uint32_t)length - 1;
+	memcpy(s.rxData + s.rxReceived, data + 1, n);
+	s.rxReceived += n;
+	s.rxSN = (s.rxSN + 1) & 0x0F;
+
+	if (s.rxReceived >= s.rxLength)
+	{
+		wheel.stop(rxTimer(idx));
+		s.rxState = IDLE;
+		s.fcPending = false;
+		if (receivedCB) receivedCB(idx, s.rxData, s.rxLength, receivedContext);
+		releaseRx(s);
+		return;
+	}
+	if (s.blockSize && --s.rxBlockLeft == 0)
+	{
+		s.rxBlockLeft = s.blockSize;
+		sendFlowControl(s, FC_CTS);
+	}
+	startTimer(rxTimer(idx), nCrMicros);
+}
+
+void CANIsoTp::handle(uint32_t id, bool extended, const uint8_t *data, uint8_t length)
+{
+	if (length == 0) return;
+	int idx;
+	for (idx = 0; idx < CAN_ISOTP_MAX_SESSIONS; idx++)
+	{
+		Session &s = sessions[idx];
+		if (s.active && s.rxId == id && s.extended == extended) break;
+	}
+	if (idx == CAN_ISOTP_MAX_SESSIONS) return;
+
+	switch (data[0] & 0xF0)
+	{
+	case PCI_SINGLE:
+	{
+		uint8_t len = data[0] & 0x0F;
+		const uint8_t *payload = data + 1;
+		if (len == 0 && length > 8) //FD single frame
+		{
+			len = data[1];
+			payload = data + 2;
+		}
+		if (len == 0 || payload + len > data + length) return;
+		if (sessions[idx].rxState == RECEIVING) failReceive(idx, ISOTP_UNEXPECTED);
+		if (receivedCB) receivedCB(idx, payload, len, receivedContext);
+		break;
+	}
+	case PCI_FIRST:
+		handleFirstFrame(idx, data, length);
+		break;
+	case PCI_CONSECUTIVE:
+		handleConsecutive(idx, data, length);
+		break;
+	case PCI_FLOW:
+		handleFlowControl(idx, data, length);
+		break;
+	}
+}
+
+void CANIsoTp::gotFrame(CAN_FRAME *frame, int mailbox)
+{
+	if (frame->rtr) return;
+	handle(frame->id, frame->extended, frame->data.uint8, frame->length > 8 ? 8 : frame->length);
+}
+
+void CANIsoTp::gotFrameFD(CAN_FRAME_FD *frame, int mailbox)
+{
+	if (frame->rrs) return;
+	handle(frame->id, frame->extended, frame->data.uint8, frame->length > 64 ? 64 : frame->length);
+}
+
+void CANIsoTp::timerExpired(uint16_t timer, void *context)
+{
+	CANIsoTp *self = (CANIsoTp *)context;
+	uint8_t idx = timer / 2;
+	Session &s = self->sessions[idx];
+	if (timer == rxTimer(idx))
+	{
+		if (s.rxState == RECEIVING) self->failReceive(idx, ISOTP_TIMEOUT_CR);
+		return;
+	}
+	if (s.txState == WAIT_FC) self->finishSend(idx, ISOTP_TIMEOUT_BS);
+	else if (s.txState == SENDING) self->pump(idx); //STmin is up
+}
+
+/**
+ * \brief Run timers and retry anything the driver refused
+ *
+ * \ret  Number of timers that ran out
+ */
+int CANIsoTp::service()
+{
+	uint32_t now = micros();
+	uint32_t elapsed = (uint32_t)(now - lastMicros) + tickRemainder;
+	lastMicros = now;
+	tickRemainder = elapsed % CAN_ISOTP_TICK_MICROS;
+	wheelTarget += elapsed / CAN_ISOTP_TICK_MICROS;
+	int fired = wheel.advance(elapsed / CAN_ISOTP_TICK_MICROS, timerExpired, this);
+
+	for (int idx = 0; idx < CAN_ISOTP_MAX_SESSIONS; idx++)
+	{
+		Session &s = sessions[idx];
+		if (!s.active) continue;
+		if (s.fcPending && s.rxState == RECEIVING) sendFlowControl(s, s.fcStatus);
+		if (s.txState == SENDING) pump(idx);
+	}
+	return fired;
+}
@@ -0,0 +1,171 @@
+#ifndef _CAN_ISOTP_
+#define _CAN_ISOTP_
+
+#include <can_common.h>
+#include "can_timer_wheel.h"
+
+#ifndef CAN_ISOTP_MAX_SESSIONS
+#define CAN_ISOTP_MAX_SESSIONS 8
+#endif
+
+//Resolution of the protocol timers. STmin goes down to 100us so anything coarser rounds it up.
+#ifndef CAN_ISOTP_TICK_MICROS
+#define CAN_ISOTP_TICK_MICROS 100
+#endif
+
+//N_Bs / N_Cr defaults in milliseconds
+#ifndef CAN_ISOTP_DEFAULT_TIMEOUT
+#define CAN_ISOTP_DEFAULT_TIMEOUT 1000
+#endif
+
+#ifndef CAN_ISOTP_DEFAULT_PADDING
+#define CAN_ISOTP_DEFAULT_PADDING 0xCC
+#endif
+
+enum CANIsoTpResult
+{
+    ISOTP_OK = 0,
+    ISOTP_TIMEOUT_BS,       //no flow control from the receiver in time (N_Bs)
+    ISOTP_TIMEOUT_CR,       //consecutive frame didn't arrive in time (N_Cr)
+    ISOTP_WRONG_SN,         //consecutive frame out of sequence
+    ISOTP_OVERFLOW,         //message too big for the receiver's buffer (either end)
+    ISOTP_UNEXPECTED,       //new first / single frame in the middle of a reception, or a bad flow control
+    ISOTP_ABORTED           //abort() called
+};
+
+//A complete message arrived. data is only valid during the call.
+typedef void (*CANIsoTpReceived)(uint8_t session, const uint8_t *data, uint32_t length, void *context);
+//A send finished (ISOTP_OK or why it failed) or a reception failed
+typedef void (*CANIsoTpEvent)(uint8_t session, CANIsoTpResult result, void *context);
+
+/*
+ISO 15765-2 (ISO-TP) transport over any CAN_COMMON, classic or FD.
+
+Each session is a pair of IDs: frames go out on txId, frames from the other end (data and flow
+control) arrive on rxId. A session can send and receive at the same time. Sessions with a TX_DL
+over 8 send FD frames with the longer single / first frame formats, received frames are taken in
+whatever length they arrive. Messages up to 4 GB are handled with the FD style escape lengths.
+
+Nothing is copied that doesn't have to be. send() segments straight out of the caller's buffer,
+which has to stay untouched until the done callback. Single frames are handed to the receive
+callback straight from the CAN frame. Longer messages are reassembled directly into the session's
+buffer (setRxBuffer) or, if that isn't set or is too small, a block from the shared pool (setPool).
+
+The engine is a CANListener: attach it to the bus with attachObj() and register it as general
+handler or for the mailboxes that receive the rxIds. Call service() often, it runs the timers and
+sends consecutive frames paced by STmin. With STmin 0 consecutive frames go out as fast as the
+driver takes them. Frame handling and service() must run in the same context - use deferred
+dispatch (CAN_COMMON::setDispatchMode) and call poll() next to service() when frames arrive in an ISR.
+*/
+class CANIsoTp : public CANListener
+{
+public:
+    CANIsoTp(CAN_COMMON &bus);
+
+    int addSession(uint32_t txId, uint32_t rxId, bool extended = false, uint8_t txDL = 8);
+    void removeSession(uint8_t session);
+    void setFlowControl(uint8_t session, uint8_t blockSize, uint8_t stMin);
+    void setRxBuffer(uint8_t session, uint8_t *buffer, uint32_t size);
+    void setPadding(uint8_t session, bool pad, uint8_t value = CAN_ISOTP_DEFAULT_PADDING);
+    bool setPool(uint8_t *storage, uint32_t blockSize, uint8_t blocks);
+    void setTimeouts(uint16_t nBsMillis, uint16_t nCrMillis);
+
+    void onReceive(CANIsoTpReceived callback, void *context = NULL);
+    void onSendDone(CANIsoTpEvent callback, void *context = NULL);
+    void onReceiveError(CANIsoTpEvent callback, void *context = NULL);
+
+    bool send(uint8_t session, const uint8_t *data, uint32_t length);
+    void abort(uint8_t session);
+    bool isSending(uint8_t session);
+    bool isReceiving(uint8_t session);
+    int service();
+
+    void gotFrame(CAN_FRAME *frame, int mailbox);
+    void gotFrameFD(CAN_FRAME_FD *frame, int mailbox);
+
+    static uint32_t stMinToMicros(uint8_t stMin);
+
+private:
+    enum State
+    {
+        IDLE,
+        WAIT_FC,    //sender waiting for flow control
+        SENDING,    //sender allowed to send consecutive frames
+        RECEIVING
+    };
+    struct Session
+    {
+        uint32_t txId;
+        uint32_t rxId;
+        bool extended;
+        bool active;
+        bool pad;
+        uint8_t padValue;
+        uint8_t txDL;
+        uint8_t blockSize;      //what we ask the other end for
+        uint8_t stMin;
+        uint8_t *rxBuffer;
+        uint32_t rxBufferSize;
+
+        uint8_t txState;
+        const uint8_t *txData;
+        uint32_t txLength;
+        uint32_t txSent;
+        uint8_t txSN;
+        uint8_t txBlockSize;    //what the other end asked us for
+        uint8_t txBlockLeft;
+        uint32_t txGapMicros;   //STmin the other end asked for
+
+        uint8_t rxState;
+        uint8_t *rxData;
+        uint32_t rxLength;
+        uint32_t rxReceived;
+        uint8_t rxSN;
+        uint8_t rxBlockLeft;
+        int8_t rxPoolBlock;
+        bool fcPending;         //flow control the driver didn't take yet
+        uint8_t fcStatus;
+    };
+
+    void handle(uint32_t id, bool extended, const uint8_t *data, uint8_t length);
+    void handleFlowControl(uint8_t idx, const uint8_t *data, uint8_t length);
+    void handleFirstFrame(uint8_t idx, const uint8_t *data, uint8_t length);
+    void handleConsecutive(uint8_t idx, const uint8_t *data, uint8_t length);
+    bool sendPDU(Session &s, const uint8_t *pci, uint8_t pciLength, const uint8_t *payload, uint8_t payloadLength);
+    bool sendFlowControl(Session &s, uint8_t status);
+    void pump(uint8_t idx);
+    void finishSend(uint8_t idx, CANIsoTpResult result);
+    void failReceive(uint8_t idx, CANIsoTpResult result);
+    void releaseRx(Session &s);
+    int8_t allocBlock();
+    void startTimer(uint16_t timer, uint32_t delayMicros);
+    static void timerExpired(uint16_t timer, void *context);
+
+    //two timers per session: TX (N_Bs, STmin pacing) and RX (N_Cr)
+    static inline uint16_t txTimer(uint8_t idx) { return idx * 2; }
+    static inline uint16_t rxTimer(uint8_t idx) { return idx * 2 + 1; }
+
+    CAN_COMMON &bus;
+    Session sessions[CAN_ISOTP_MAX_SESSIONS];
+    CANTimerWheel wheel;
+    CANTimer timers[CAN_ISOTP_MAX_SESSIONS * 2];
+    uint32_t lastMicros;
+    uint32_t tickRemainder;
+    uint32_t wheelTarget;   //tick the wheel will be at once the advance in progress is done
+    uint32_t nBsMicros;
+    uint32_t nCrMicros;
+
+    uint8_t *pool;
+    uint32_t poolBlockSize;
+    uint8_t poolBlocks;
+    uint32_t poolFree;      //bit per block
+
+    CANIsoTpReceived receivedCB;
+    void *receivedContext;
+    CANIsoTpEvent sendDoneCB;
+    void *sendDoneContext;
+    CANIsoTpEvent rxErrorCB;
+    void *rxErrorContext;
+};
+
+#endif
@@ -0,0 +1,755 @@
+#include "can_j1939.h"
+#include "can_filter_plan.h"
+
+//transport protocol connection management control bytes
+#define CM_RTS      16
+#define CM_CTS      17
+#define CM_EOMA     19
+#define CM_BAM      32
+#define CM_ABORT    255
+
+//connection abort reasons
+#define ABORT_BUSY      1
+#define ABORT_RESOURCES 2
+#define ABORT_TIMEOUT   3
+#define ABORT_SEQUENCE  7
+
+//J1939-21 timeouts in milliseconds
+#define T1  750     //between data packets
+#define T2  1250    //receiver, after sending CTS
+#define T3  1250    //sender, after the last packet of a window or the RTS
+#define T4  1050    //sender, after a CTS holding the connection open
+#define CLAIM_WAIT 250
+
+#define INDEX_SLOTS (CAN_J1939_MAX_HANDLERS * 2)
+#define INDEX_EMPTY 0xFF
+#define CLAIM_TIMER CAN_J1939_MAX_SESSIONS
+
+static_assert((CAN_J1939_MAX_HANDLERS & (CAN_J1939_MAX_HANDLERS - 1)) == 0, "CAN_J1939_MAX_HANDLERS must be a power of two");
+static_assert(CAN_J1939_MAX_HANDLERS < INDEX_EMPTY, "handler numbers have to fit the index");
+
+CANJ1939::CANJ1939(CAN_COMMON &canBus) : bus(canBus)
+{
+	numHandlers = 0;
+	rebuildIndex();
+	promiscuous = false;
+	for (int i = 0; i < CAN_J1939_MAX_SESSIONS; i++)
+	{
+		sessions[i].state = IDLE;
+		sessions[i].poolBlock = -1;
+	}
+	wheel.attach(timers, CAN_J1939_MAX_SESSIONS + 1);
+	lastMillis = millis();
+	tickRemainder = 0;
+	wheelTarget = wheel.getTick();
+	packetsPerCTS = 16;
+	pool = NULL;
+	poolBlockSize = 0;
+	poolBlocks = 0;
+	poolFree = 0;
+	address = J1939_NULL_ADDRESS;
+	name = 0;
+	claimState = J1939_UNCLAIMED;
+	for (int i = 0; i < 8; i++) claimedBy[i] = 0;
+	filterMax = 0;
+	filterFirst = 0;
+	sendDoneCB = NULL;
+	sendDoneContext = NULL;
+	rxErrorCB = NULL;
+	rxErrorContext = NULL;
+}
+
+//PGN of a 29 bit ID. For PDU1 formats (PF < 240) the destination byte isn't part of it.
+uint32_t CANJ1939::pgnFromId(uint32_t id)
+{
+	uint32_t pgn = (id >> 8) & 0x3FFFF;
+	if (((pgn >> 8) & 0xFF) < 240) pgn &= 0x3FF00;
+	return pgn;
+}
+
+uint32_t CANJ1939::makeId(uint8_t priority, uint32_t pgn, uint8_t destination, uint8_t source)
+{
+	pgn &= 0x3FFFF;
+	if (((pgn >> 8) & 0xFF) < 240) pgn = (pgn & 0x3FF00) | destination;
+	return ((uint32_t)(priority & 7) << 26) | (pgn << 8) | source;
+}
+
+uint8_t CANJ1939::hashSlot(uint32_t pgn, uint16_t source)
+{
+	uint32_t h = (pgn * 2654435761ul) ^ ((uint32_t)source * 40503ul);
+	return (h >> 16) & (INDEX_SLOTS - 1);
+}
+
+int CANJ1939::findHandler(uint32_t pgn, uint16_t source) const
+{
+	uint8_t slot = hashSlot(pgn, source);
+	for (int probe = 0; probe < INDEX_SLOTS; probe++)
+	{
+		uint8_t idx = index[slot];
+		if (idx == INDEX_EMPTY) return -1;
+		if (handlers[idx].pgn == pgn && handlers[idx].source == source) return idx;
+		slot = (slot + 1) & (INDEX_SLOTS - 1);
+	}
+	return -1;
+}
+
+void CANJ1939::rebuildIndex()
+{
+	for (int i = 0; i < INDEX_SLOTS; i++) index[i] = INDEX_EMPTY;
+	for (uint8_t i = 0; i < numHandlers; i++)
+	{
+		uint8_t slot = hashSlot(handlers[i].pgn, handlers[i].source);
+		while (index[slot] != INDEX_EMPTY) slot = (slot + 1) & (INDEX_SLOTS - 1);
+		index[slot] = i;
+	}
+}
+
+/**
+ * \brief Have messages with this PGN passed to a handler
+ *
+ * \param pgn Parameter group number, destination byte 0 for PDU1 PGNs
+ * \param source Only from this source address, or J1939_ANY_SOURCE
+ *
+ * \ret  false if the table is full. Subscribing the same PGN and source again replaces the handler.
+ *
+ * \note Call applyFilters() afterwards if the hardware filters are managed here
+ */
+bool CANJ1939::subscribe(uint32_t pgn, CANJ1939Handler handler, void *context, uint16_t source)
+{
+	if (handler == NULL || source > J1939_ANY_SOURCE) return false;
+	pgn = pgnFromId(pgn << 8);
+	int idx = findHandler(pgn, source);
+	if (idx < 0)
+	{
+		if (numHandlers >= CAN_J1939_MAX_HANDLERS) return false;
+		idx = numHandlers++;
+		handlers[idx].pgn = pgn;
+		handlers[idx].source = source;
+		rebuildIndex();
+	}
+	handlers[idx].callback = handler;
+	handlers[idx].context = context;
+	return true;
+}
+
+void CANJ1939::unsubscribe(uint32_t pgn, uint16_t source)
+{
+	int idx = findHandler(pgnFromId(pgn << 8), source);
+	if (idx < 0) return;
+	handlers[idx] = handlers[--numHandlers];
+	rebuildIndex();
+}
+
+//Also take PDU1 messages addressed to other nodes (for loggers and gateways). Transport sessions stay our own.
+void CANJ1939::setPromiscuous(bool state)
+{
+	promiscuous = state;
+}
+
+/**
+ * \brief Reassembly buffers for transport protocol receptions
+ *
+ * \param storage blocks * blockSize bytes
+ * \param blockSize Longest message a block can hold, J1939_MAX_LENGTH for anything
+ * \param blocks Number of blocks and so of receptions at once, up to 32
+ *
+ * \note Only change the pool while nothing is being received
+ */
+bool CANJ1939::setPool(uint8_t *storage, uint16_t blockSize, uint8_t blocks)
+{
+	if (blocks > 32) return false;
+	pool = storage;
+	poolBlockSize = storage ? blockSize : 0;
+	poolBlocks = storage ? blocks : 0;
+	poolFree = (poolBlocks == 32) ? 0xFFFFFFFF : ((1ul << poolBlocks) - 1);
+	return true;
+}
+
+//Packets we let an RTS/CTS sender send per CTS (the sender's own limit still applies)
+void CANJ1939::setPacketsPerCTS(uint8_t packets)
+{
+	packetsPerCTS = packets ? packets : 1;
+}
+
+//Filters for one subscription. Priority is always left open, PDU1 PGNs need us and global as destination.
+static void planPgn(CANFilterPlanner &planner, uint32_t pgn, uint16_t source, uint8_t address, bool promiscuous)
+{
+	uint32_t sourceBits = (source == J1939_ANY_SOURCE) ? 0 : (source & 0xFF);
+	uint32_t sourceMask = (source == J1939_ANY_SOURCE) ? 0 : 0xFF;
+	if (((pgn >> 8) & 0xFF) >= 240) planner.addMasked((pgn << 8) | sourceBits, 0x3FFFF00 | sourceMask, true);
+	else if (promiscuous) planner.addMasked((pgn << 8) | sourceBits, 0x3FF0000 | sourceMask, true);
+	else
+	{
+		planner.addMasked(((pgn | J1939_GLOBAL) << 8) | sourceBits, 0x3FFFF00 | sourceMask, true);
+		if (address < J1939_NULL_ADDRESS) planner.addMasked(((pgn | address) << 8) | sourceBits, 0x3FFFF00 | sourceMask, true);
+	}
+}
+
+/**
+ * \brief Program the hardware filters to let through only what is subscribed
+ *
+ * \param maxFilters Mailboxes / filters to use
+ * \param firstMailbox Where they start
+ *
+ * \ret  Filters used or -1 if the driver refused one
+ *
+ * \note Redone automatically when our address changes. Transport and address claim PGNs are
+ * always included. If the subscriptions need more filters than there are, close ones get merged
+ * and a few extra IDs come through, dispatch still drops them.
+ */
+int CANJ1939::applyFilters(int maxFilters, int firstMailbox)
+{
+	filterMax = maxFilters;
+	filterFirst = firstMailbox;
+	CANFilterPlanner planner;
+	planPgn(planner, J1939_PGN_TP_CM, J1939_ANY_SOURCE, address, false);
+	planPgn(planner, J1939_PGN_TP_DT, J1939_ANY_SOURCE, address, false);
+	planPgn(planner, J1939_PGN_ADDRESS_CLAIMED, J1939_ANY_SOURCE, address, false);
+	planPgn(planner, J1939_PGN_REQUEST, J1939_ANY_SOURCE, address, false);
+	for (uint8_t i = 0; i < numHandlers; i++) planPgn(planner, handlers[i].pgn, handlers[i].source, address, promiscuous);
+	return planner.apply(bus, maxFilters, firstMailbox);
+}
+
+//Use a fixed address without claiming it (for networks with preassigned addresses)
+void CANJ1939::setAddress(uint8_t newAddress)
+{
+	address = newAddress;
+	claimState = J1939_CLAIMED;
+	wheel.stop(CLAIM_TIMER);
+	if (filterMax) applyFilters(filterMax, filterFirst);
+}
+
+/**
+ * \brief Claim an address (J1939-81)
+ *
+ * \param name 64 bit NAME. Lower wins when two nodes want the same address. If the arbitrary
+ * address capable bit (63) is set another address from 128 - 247 is tried after losing.
+ * \param preferred Address to claim first
+ *
+ * \note Normal messages can be sent once getClaimState() says J1939_CLAIMED, 250ms without objections
+ */
+bool CANJ1939::claimAddress(uint64_t newName, uint8_t preferred)
+{
+	if (preferred >= J1939_NULL_ADDRESS) return false;
+	name = newName;
+	address = preferred;
+	claimState = J1939_CLAIMING;
+	sendClaim();
+	startTimer(CLAIM_TIMER, CLAIM_WAIT);
+	if (filterMax) applyFilters(filterMax, filterFirst);
+	return true;
+}
+
+void CANJ1939::sendClaim()
+{
+	uint8_t data[8];
+	for (int i = 0; i < 8; i++) data[i] = (uint8_t)(name >> (8 * i));
+	sendRaw(6, J1939_PGN_ADDRESS_CLAIMED, J1939_GLOBAL, data, 8);
+}
+
+//Next address from the self configurable range nobody else has claimed
+bool CANJ1939::pickNewAddress()
+{
+	if (!(name >> 63)) return false;
+	for (int n = 0; n < 120; n++)
+	{
+		uint8_t candidate = 128 + ((address >= 128 && address < 248 ? address - 128 + 1 : 0) + n) % 120;
+		if (candidate == address) continue;
+		if (!(claimedBy[candidate / 32] & (1ul << (candidate & 31))))
+		{
+			address = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void CANJ1939::handleClaim(uint8_t source, const uint8_t *data, uint8_t length)
+{
+	if (length < 8 || source >= J1939_NULL_ADDRESS) return;
+	uint64_t theirs = 0;
+	for (int i = 7; i >= 0; i--) theirs = (theirs << 8) | data[i];
+	if (theirs == name) return; //our own claim coming back
+	claimedBy[source / 32] |= (1ul << (source & 31));
+
+	if (source != address || (claimState != J1939_CLAIMING && claimState != J1939_CLAIMED)) return;
+	if (name < theirs)
+	{
+		sendClaim(); //we keep it, tell them
+		return;
+	}
+	if (pickNewAddress())
+	{
+		claimState = J1939_CLAIMING;
+		sendClaim();
+		startTimer(CLAIM_TIMER, CLAIM_WAIT);
+	}
+	else
+	{
+		address = J1939_NULL_ADDRESS;
+		claimState = J1939_CANNOT_CLAIM;
+		wheel.stop(CLAIM_TIMER);
+		sendClaim(); //from the null address this is "cannot claim"
+	}
+	if (filterMax) applyFilters(filterMax, filterFirst);
+}
+
+void CANJ1939::handleRequest(uint8_t source, uint8_t destination, const uint8_t *data, uint8_t length)
+{
+	if (length < 3) return;
+	uint32_t pgn = data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16);
+	if (pgn == J1939_PGN_ADDRESS_CLAIMED && claimState != J1939_UNCLAIMED) sendClaim();
+}
+
+bool CANJ1939::sendRaw(uint8_t priority, uint32_t pgn, uint8_t destination, const uint8_t *data, uint8_t length)
+{
+	CAN_FRAME frame;
+	frame.id = makeId(priority, pgn, destination, address);
+	frame.extended = true;
+	frame.length = length;
+	memcpy(frame.data.uint8, data, length);
+	return bus.sendFrame(frame);
+}
+
+bool CANJ1939::sendCM(uint8_t destination, uint8_t control, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint32_t pgn)
+{
+	uint8_t data[8] = { control, b1, b2, b3, b4, (uint8_t)pgn, (uint8_t)(pgn >> 8), (uint8_t)(pgn >> 16) };
+	return sendRaw(7, J1939_PGN_TP_CM, destination, data, 8);
+}
+
+/**
+ * \brief Send a message, over the transport protocol if it doesn't fit a frame
+ *
+ * \param pgn Parameter group number
+ * \param priority 0 (highest) - 7. Transport frames always go at 7.
+ * \param destination Node address or J1939_GLOBAL. Ignored for PDU2 PGNs which are always global.
+ * \param data Message. Longer ones are sent straight from it so leave it alone until the done callback.
+ * \param length Up to J1939_MAX_LENGTH
+ *
+ * \ret  false if we have no address, a transport send to the same destination is running, no
+ * session is free or the driver refused the first frame
+ */
+bool CANJ1939::send(uint32_t pgn, uint8_t priority, uint8_t destination, const uint8_t *data, uint16_t length)
+{
+	if (claimState != J1939_CLAIMED || length > J1939_MAX_LENGTH) return false;
+	pgn = pgnFromId(pgn << 8);
+	if (((pgn >> 8) & 0xFF) >= 240) destination = J1939_GLOBAL;
+
+	if (length <= 8)
+	{
+		if (!sendRaw(priority, pgn, destination, data, (uint8_t)length)) return false;
+		if (sendDoneCB) sendDoneCB(pgn, destination, J1939_OK, sendDoneContext);
+		return true;
+	}
+
+	bool broadcast = (destination == J1939_GLOBAL);
+	if (findSession(true, destination, broadcast) >= 0) return false;
+	int idx = newSession();
+	if (idx < 0) return false;
+	Session &s = sessions[idx];
+	s.peer = destination;
+	s.priority = priority;
+	s.pgn = pgn;
+	s.length = length;
+	s.packets = (length + 6) / 7;
+	s.next = 1;
+	s.txData = data;
+	if (!sendCM(destination, broadcast ? CM_BAM : CM_RTS, (uint8_t)length, (uint8_t)(length >> 8), s.packets, 0xFF, pgn)) return false;
+	if (broadcast)
+	{
+		s.state = TX_BAM;
+		startTimer(idx, CAN_J1939_BAM_GAP);
+	}
+	else
+	{
+		s.state = TX_WAIT_CTS;
+		startTimer(idx, T3);
+	}
+	return true;
+}
+
+//Ask a node (or everyone) to send a PGN
+bool CANJ1939::request(uint32_t pgn, uint8_t destination)
+{
+	if (claimState != J1939_CLAIMED && claimState != J1939_CANNOT_CLAIM) return false;
+	uint8_t data[3] = { (uint8_t)pgn, (uint8_t)(pgn >> 8), (uint8_t)(pgn >> 16) };
+	return sendRaw(6, J1939_PGN_REQUEST, destination, data, 3);
+}
+
+void CANJ1939::onSendDone(CANJ1939Event callback, void *context)
+{
+	sendDoneCB = callback;
+	sendDoneContext = context;
+}
+
+void CANJ1939::onReceiveError(CANJ1939Event callback, void *context)
+{
+	rxErrorCB = callback;
+	rxErrorContext = context;
+}
+
+int CANJ1939::findSession(bool tx, uint8_t peer, bool broadcast) const
+{
+	for (int i = 0; i < CAN_J1939_MAX_SESSIONS; i++)
+	{
+		const Session &s = sessions[i];
+		if (s.state == IDLE || s.peer != peer) continue;
+		bool isTx = (s.state == TX_BAM || s.state == TX_WAIT_CTS || s.state == TX_SENDING);
+		bool isBroadcast = (s.state == TX_BAM || s.state == RX_BAM);
+		if (isTx == tx && isBroadcast == broadcast) return i;
+	}
+	return -1;
+}
+
+int CANJ1939::newSession()
+{
+	for (int i = 0; i < CAN_J1939_MAX_SESSIONS; i++)
+	{
+		if (sessions[i].state == IDLE) return i;
+	}
+	return -1;
+}
+
+int8_t CANJ1939::allocBlock()
+{
+	if (!poolFree) return -1;
+	int8_t block = __builtin_ctz(poolFree);
+	poolFree &= ~(1ul << block);
+	return block;
+}
+
+void CANJ1939::releaseSession(Session &s)
+{
+	if (s.poolBlock >= 0) poolFree |= (1ul << s.poolBlock);
+	s.poolBlock = -1;
+	s.rxData = NULL;
+	s.txData = NULL;
+	s.state = IDLE;
+}
+
+void CANJ1939::finishSend(uint8_t idx, CANJ1939Result result)
+{
+	Session &s = sessions[idx];
+	wheel.stop(idx);
+	uint32_t pgn = s.pgn;
+	uint8_t peer = s.peer;
+	releaseSession(s);
+	if (sendDoneCB) sendDoneCB(pgn, peer, result, sendDoneContext);
+}
+
+void CANJ1939::failReceive(uint8_t idx, CANJ1939Result result, bool sendAbort)
+{
+	Session &s = sessions[idx];
+	wheel.stop(idx);
+	uint32_t pgn = s.pgn;
+	uint8_t peer = s.peer;
+	if (sendAbort)
+	{
+		uint8_t reason = (result == J1939_TIMEOUT) ? ABORT_TIMEOUT : (result == J1939_BAD_SEQUENCE) ? ABORT_SEQUENCE : ABORT_RESOURCES;
+		sendCM(peer, CM_ABORT, reason, 0xFF, 0xFF, 0xFF, pgn);
+	}
+	releaseSession(s);
+	if (rxErrorCB) rxErrorCB(pgn, peer, result, rxErrorContext);
+}
+
+bool CANJ1939::sendPacket(Session &s)
+{
+	uint8_t data[8];
+	uint16_t offset = (s.next - 1) * 7;
+	uint16_t n = (s.length - offset < 7) ? s.length - offset : 7;
+	data[0] = (uint8_t)s.next;
+	memcpy(data + 1, s.txData + offset, n);
+	if (n < 7) memset(data + 1 + n, 0xFF, 7 - n);
+	if (!sendRaw(7, J1939_PGN_TP_DT, s.peer, data, 8)) return false;
+	s.next++;
+	return true;
+}
+
+//Send what the session may send now. Stops when the driver is full, service() picks it up again.
+void CANJ1939::pump(uint8_t idx)
+{
+	Session &s = sessions[idx];
+	if (s.state == TX_BAM)
+	{
+		if (wheel.isRunning(idx) || !sendPacket(s)) return;
+		if (s.next > s.packets) finishSend(idx, J1939_OK);
+		else startTimer(idx, CAN_J1939_BAM_GAP);
+		return;
+	}
+	while (s.state == TX_SENDING && s.next <= s.windowEnd)
+	{
+		if (!sendPacket(s)) return;
+	}
+	if (s.state == TX_SENDING)
+	{
+		//window done, the receiver answers with the next CTS or the end of message ack
+		s.state = TX_WAIT_CTS;
+		startTimer(idx, T3);
+	}
+}
+
+void CANJ1939::sendCTS(uint8_t idx)
+{
+	Session &s = sessions[idx];
+	uint8_t left = s.packets - s.next + 1;
+	uint8_t n = (left < s.window) ? left : s.window;
+	startTimer(idx, T2);
+	s.ctsPending = !sendCM(s.peer, CM_CTS, n, (uint8_t)s.next, 0xFF, 0xFF, s.pgn);
+	if (!s.ctsPending) s.windowEnd = s.next + n - 1;
+}
+
+void CANJ1939::handleCM(uint8_t source, uint8_t destination, uint8_t priority, const uint8_t *data, uint8_t length)
+{
+	if (length < 8) return;
+	uint32_t pgn = data[5] | ((uint32_t)data[6] << 8) | ((uint32_t)data[7] << 16);
+	uint16_t size = data[1] | ((uint16_t)data[2] << 8);
+	bool toUs = (destination == address);
+	int idx;
+
+	switch (data[0])
+	{
+	case CM_BAM:
+	case CM_RTS:
+	{
+		bool broadcast = (data[0] == CM_BAM);
+		if (broadcast ? destination != J1939_GLOBAL : !toUs) return;
+		if (size <= 8 || size > J1939_MAX_LENGTH || data[3] < (size + 6) / 7) return;
+		//a new announcement from the same sender replaces the one in progress
+		idx = findSession(false, source, broadcast);
+		if (idx >= 0) failReceive(idx, J1939_ABORTED, false);
+
+		idx = newSession();
+		int8_t block = (idx >= 0 && poolBlockSize >= size) ? allocBlock() : -1;
+		if (block < 0)
+		{
+			if (!broadcast) sendCM(source, CM_ABORT, idx < 0 ? ABORT_BUSY : ABORT_RESOURCES, 0xFF, 0xFF, 0xFF, pgn);
+			if (rxErrorCB) rxErrorCB(pgn, source, J1939_NO_RESOURCES, rxErrorContext);
+			return;
+		}
+		Session &s = sessions[idx];
+		s.peer = source;
+		s.priority = priority;
+		s.pgn = pgn;
+		s.length = size;
+		s.packets = (size + 6) / 7;
+		s.next = 1;
+		s.poolBlock = block;
+		s.rxData = pool + block * poolBlockSize;
+		s.ctsPending = false;
+		if (broadcast)
+		{
+			s.state = RX_BAM;
+			startTimer(idx, T1);
+		}
+		else
+		{
+			s.state = RX_CMDT;
+			s.window = (data[4] < packetsPerCTS) ? data[4] : packetsPerCTS;
+			if (s.window == 0) s.window = 1;
+			sendCTS(idx);
+		}
+		break;
+	}
+	case CM_CTS:
+		if (!toUs) return;
+		idx = findSession(true, source, false);
+		if (idx < 0) return;
+		{
+			Session &s = sessions[idx];
+			if (data[1] == 0)
+			{
+				startTimer(idx, T4); //receiver wants us to hold on
+				s.state = TX_WAIT_CTS;
+				return;
+			}
+			if (data[2] == 0 || data[2] > s.packets) return;
+			s.next = data[2]; //may go back to resend packets
+			s.windowEnd = (s.next + data[1] - 1 > s.packets) ? s.packets : s.next + data[1] - 1;
+			s.state = TX_SENDING;
+			wheel.stop(idx);
+			pump(idx);
+		}
+		break;
+	case CM_EOMA:
+		if (!toUs) return;
+		idx = findSession(true, source, false);
+		if (idx >= 0) finishSend(idx, J1939_OK);
+		break;
+	case CM_ABORT:
+		if (!toUs) return;
+		idx = findSession(true, source, false);
+		if (idx >= 0 && sessions[idx].pgn == pgn) finishSend(idx, J1939_ABORTED);
+		idx = findSession(false, source, false);
+		if (idx >= 0 && sessions[idx].pgn == pgn) failReceive(idx, J1939_ABORTED, false);
+		break;
+	}
+}
+
+void CANJ1939::handleDT(uint8_t source, uint8_t destination, const uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+	if (length < 2) return;
+	bool broadcast = (destination == J1939_GLOBAL);
+	if (!broadcast && destination != address) return;
+	int idx = findSession(false, source, broadcast);
+	if (idx < 0) return;
+	Session &s = sessions[idx];
+
+	if (data[0] != s.next)
+	{
+		if (!broadcast && data[0] < s.next) return; //a resent packet we already have
+		failReceive(idx, J1939_BAD_SEQUENCE, !broadcast);
+		return;
+	}
+	uint16_t offset = (s.next - 1) * 7;
+	uint16_t n = (s.length - offset < 7) ? s.length - offset : 7;
+	if (n > length - 1) n = length - 1;
+	memcpy(s.rxData + offset, data + 1, n);
+	s.next++;
+
+	if (s.next > s.packets)
+	{
+		wheel.stop(idx);
+		if (!broadcast) sendCM(source, CM_EOMA, (uint8_t)s.length, (uint8_t)(s.length >> 8), s.packets, 0xFF, s.pgn);
+		CANJ1939Message message;
+		message.pgn = s.pgn;
+		message.priority = s.priority;
+		message.source = source;
+		message.destination = destination;
+		message.length = s.length;
+		message.timestamp = timestamp;
+		//free the session first so a handler can start a new transfer from here
+		uint8_t *buffer = s.rxData;
+		int8_t block = s.poolBlock;
+		s.poolBlock = -1;
+		releaseSession(s);
+		message.data = buffer;
+		dispatch(message);
+		if (block >= 0) poolFree |= (1ul << block);
+		return;
+	}
+	if (!broadcast && s.next > s.windowEnd)
+	{
+		sendCTS(idx);
+		return;
+	}
+	startTimer(idx, T1);
+}
+
+void CANJ1939::dispatch(const CANJ1939Message &message)
+{
+	//look both up before calling, a handler may change the table
+	int exact = findHandler(message.pgn, message.source);
+	int any = findHandler(message.pgn, J1939_ANY_SOURCE);
+	CANJ1939Handler exactCB = (exact >= 0) ? handlers[exact].callback : NULL;
+	void *exactContext = (exact >= 0) ? handlers[exact].context : NULL;
+	CANJ1939Handler anyCB = (any >= 0) ? handlers[any].callback : NULL;
+	void *anyContext = (any >= 0) ? handlers[any].context : NULL;
+	if (exactCB) exactCB(message, exactContext);
+	if (anyCB) anyCB(message, anyContext);
+}
+
+void CANJ1939::gotFrame(CAN_FRAME *frame, int mailbox)
+{
+	if (!frame->extended || frame->rtr) return;
+	uint32_t id = frame->id;
+	uint8_t length = frame->length > 8 ? 8 : frame->length;
+	uint8_t pf = (id >> 16) & 0xFF;
+	uint8_t source = id & 0xFF;
+	uint8_t destination = (pf < 240) ? (uint8_t)(id >> 8) : J1939_GLOBAL;
+	uint32_t pgn = pgnFromId(id);
+	uint8_t priority = (id >> 26) & 7;
+
+	switch (pgn)
+	{
+	case J1939_PGN_TP_CM:
+		handleCM(source, destination, priority, frame->data.uint8, length);
+		return;
+	case J1939_PGN_TP_DT:
+		handleDT(source, destination, frame->data.uint8, length, frame->timestamp);
+		return;
+	case J1939_PGN_ADDRESS_CLAIMED:
+		handleClaim(source, frame->data.uint8, length);
+		break;
+	case J1939_PGN_REQUEST:
+		if (destination == address || destination == J1939_GLOBAL) handleRequest(source, destination, frame->data.uint8, length);
+		break;
+	}
+	if (destination != address && destination != J1939_GLOBAL && !promiscuous) return;
+
+	CANJ1939Message message;
+	message.pgn = pgn;
+	message.priority = priority;
+	message.source = source;
+	message.destination = destination;
+	message.length = length;
+	message.data = frame->data.uint8;
+	message.timestamp = frame->timestamp;
+	dispatch(message);
+}
+
+//J1939-22 (FD) uses a different frame layout, only classic frames that came in through FD callbacks are taken
+void CANJ1939::gotFrameFD(CAN_FRAME_FD *frame, int mailbox)
+{
+	if (frame->fdMode) return;
+	CAN_FRAME classic;
+	if (!bus.fdToCan(*frame, classic)) return;
+	gotFrame(&classic, mailbox);
+}
+
+//Same catch up as CANIsoTp::startTimer, in milliseconds
+void CANJ1939::startTimer(uint16_t timer, uint32_t delayMillis)
+{
+	uint32_t since = (uint32_t)(millis() - lastMillis) + tickRemainder;
+	uint32_t behind = wheelTarget - wheel.getTick();
+	wheel.start(timer, behind + (since + delayMillis + CAN_J1939_TICK_MILLIS - 1) / CAN_J1939_TICK_MILLIS);
+}
+
+void CANJ1939::timerExpired(uint16_t timer, void *context)
+{
+	CANJ1939 *self = (CANJ1939 *)context;
+	if (timer == CLAIM_TIMER)
+	{
+		if (self->claimState == J1939_CLAIMING) self->claimState = J1939_CLAIMED;
+		return;
+	}
+	Session &s = self->sessions[timer];
+	switch (s.state)
+	{
+	case RX_BAM:
+		self->failReceive(timer, J1939_TIMEOUT, false);
+		break;
+	case RX_CMDT:
+		self->failReceive(timer, J1939_TIMEOUT, true);
+		break;
+	case TX_BAM:
+		self->pump(timer);
+		break;
+	case TX_WAIT_CTS:
+		self->sendCM(s.peer, CM_ABORT, ABORT_TIMEOUT, 0xFF, 0xFF, 0xFF, s.pgn);
+		self->finishSend(timer, J1939_TIMEOUT);
+		break;
+	}
+}
+
+/**
+ * \brief Run timers and retry anything the driver refused
+ *
+ * \ret  Number of timers that ran out
+ */
+int CANJ1939::service()
+{
+	uint32_t now = millis();
+	uint32_t elapsed = (uint32_t)(now - lastMillis) + tickRemainder;
+	lastMillis = now;
+	tickRemainder = elapsed % CAN_J1939_TICK_MILLIS;
+	wheelTarget += elapsed / CAN_J1939_TICK_MILLIS;
+	int fired = wheel.advance(elapsed / CAN_J1939_TICK_MILLIS, timerExpired, this);
+
+	for (int i = 0; i < CAN_J1939_MAX_SESSIONS; i++)
+	{
+		Session &s = sessions[i];
+		if (s.state == RX_CMDT && s.ctsPending) sendCTS(i);
+		if (s.state == TX_SENDING || (s.state == TX_BAM && !wheel.isRunning(i))) pump(i);
+	}
+	return fired;
+}
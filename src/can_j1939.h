@@ -0,0 +1,210 @@
+#ifndef _CAN_J1939_
+#define _CAN_J1939_
+
+#include <can_common.h>
+#include "can_timer_wheel.h"
+
+//PGN / source pairs that can be subscribed at once
+#ifndef CAN_J1939_MAX_HANDLERS
+#define CAN_J1939_MAX_HANDLERS 32
+#endif
+
+//Transport sessions (BAM or RTS/CTS, either direction) running at the same time
+#ifndef CAN_J1939_MAX_SESSIONS
+#define CAN_J1939_MAX_SESSIONS 8
+#endif
+
+//Resolution of the protocol timers in milliseconds
+#ifndef CAN_J1939_TICK_MILLIS
+#define CAN_J1939_TICK_MILLIS 5
+#endif
+
+//Gap between the data packets of a BAM we send, J1939-21 allows 50 - 200ms
+#ifndef CAN_J1939_BAM_GAP
+#define CAN_J1939_BAM_GAP 50
+#endif
+
+#define J1939_GLOBAL        0xFF    //destination address for everyone
+#define J1939_NULL_ADDRESS  0xFE    //source address of a node that couldn't claim one
+#define J1939_ANY_SOURCE    0x100   //subscribe() from every source
+
+#define J1939_PGN_REQUEST           0xEA00
+#define J1939_PGN_ADDRESS_CLAIMED   0xEE00
+#define J1939_PGN_TP_CM             0xEC00
+#define J1939_PGN_TP_DT             0xEB00
+
+//Longest message the transport protocol carries, 255 packets of 7 bytes
+#define J1939_MAX_LENGTH 1785
+
+enum CANJ1939Result
+{
+    J1939_OK = 0,
+    J1939_TIMEOUT,          //the other end went quiet (T1 - T4)
+    J1939_ABORTED,          //connection abort from the other end or abort() here
+    J1939_NO_RESOURCES,     //no free session or reassembly buffer
+    J1939_BAD_SEQUENCE      //data packet out of order
+};
+
+enum CANJ1939ClaimState
+{
+    J1939_UNCLAIMED = 0,
+    J1939_CLAIMING,         //claim sent, waiting 250ms for objections
+    J1939_CLAIMED,
+    J1939_CANNOT_CLAIM      //lost every address we could use, now at J1939_NULL_ADDRESS
+};
+
+//A received message, single frame or reassembled. data is only valid during the callback.
+struct CANJ1939Message
+{
+    uint32_t pgn;
+    uint8_t priority;
+    uint8_t source;
+    uint8_t destination;    //J1939_GLOBAL for PDU2 PGNs and broadcasts
+    uint16_t length;
+    const uint8_t *data;
+    uint32_t timestamp;     //of the last frame
+};
+
+typedef void (*CANJ1939Handler)(const CANJ1939Message &message, void *context);
+//A transport send finished or a transport reception failed. peer is the destination / source.
+typedef void (*CANJ1939Event)(uint32_t pgn, uint8_t peer, CANJ1939Result result, void *context);
+
+/*
+SAE J1939 on top of any CAN_COMMON: PGN dispatch, the transport protocol and address claiming.
+
+Handlers are subscribed per PGN, either from one source address or from all of them, and found
+through a small hash table so dispatch costs the same whether there are two subscriptions or
+thirty. A message goes to the handler for its exact source and then the one for any source.
+applyFilters() turns the subscriptions into hardware filters (through CANFilterPlanner) so the
+controller drops everything else before it costs an interrupt.
+
+Messages over 8 bytes use the transport protocol: BAM to the global address, RTS/CTS to one node.
+Several receptions can run at once (one BAM and one RTS/CTS per sender), each reassembled into a
+block from the pool given to setPool(). send() picks the transport by length and destination and
+sends straight out of the caller's buffer, which has to stay untouched until the done callback.
+
+Attach to the bus with attachObj() and register as general handler or for the mailboxes the
+filters went to, then call service() often. Frame handling and service() must run in the same
+context - use deferred dispatch and poll() next to service() when frames arrive in an ISR.
+*/
+class CANJ1939 : public CANListener
+{
+public:
+    CANJ1939(CAN_COMMON &bus);
+
+    bool subscribe(uint32_t pgn, CANJ1939Handler handler, void *context = NULL, uint16_t source = J1939_ANY_SOURCE);
+    void unsubscribe(uint32_t pgn, uint16_t source = J1939_ANY_SOURCE);
+    void setPromiscuous(bool state);
+    bool setPool(uint8_t *storage, uint16_t blockSize, uint8_t blocks);
+    void setPacketsPerCTS(uint8_t packets);
+    int applyFilters(int maxFilters, int firstMailbox = 0);
+
+    void setAddress(uint8_t address);
+    bool claimAddress(uint64_t name, uint8_t preferred);
+    uint8_t getAddress() const { return address; }
+    CANJ1939ClaimState getClaimState() const { return claimState; }
+
+    bool send(uint32_t pgn, uint8_t priority, uint8_t destination, const uint8_t *data, uint16_t length);
+    bool request(uint32_t pgn, uint8_t destination);
+    void onSendDone(CANJ1939Event callback, void *context = NULL);
+    void onReceiveError(CANJ1939Event callback, void *context = NULL);
+    int service();
+
+    void gotFrame(CAN_FRAME *frame, int mailbox);
+    void gotFrameFD(CAN_FRAME_FD *frame, int mailbox);
+
+    static uint32_t pgnFromId(uint32_t id);
+    static uint32_t makeId(uint8_t priority, uint32_t pgn, uint8_t destination, uint8_t source);
+
+private:
+    enum State
+    {
+        IDLE,
+        RX_BAM,
+        RX_CMDT,
+        TX_BAM,
+        TX_WAIT_CTS,    //RTS or a window sent, waiting for CTS or the end of message ack
+        TX_SENDING      //CTS window open, packets go out as the driver takes them
+    };
+    struct Handler
+    {
+        uint32_t pgn;
+        uint16_t source;
+        CANJ1939Handler callback;
+        void *context;
+    };
+    struct Session
+    {
+        uint8_t state;
+        uint8_t peer;           //sender for receptions, destination for sends
+        uint8_t priority;
+        uint32_t pgn;
+        uint16_t length;
+        uint8_t packets;
+        uint16_t next;          //next packet number expected / to send, from 1
+        uint16_t windowEnd;     //last packet of the current CTS window
+        uint8_t window;         //packets per CTS agreed for a reception
+        bool ctsPending;        //CTS the driver refused, service() retries it
+        int8_t poolBlock;
+        uint8_t *rxData;
+        const uint8_t *txData;
+    };
+
+    void dispatch(const CANJ1939Message &message);
+    int findHandler(uint32_t pgn, uint16_t source) const;
+    void rebuildIndex();
+    static uint8_t hashSlot(uint32_t pgn, uint16_t source);
+
+    void handleCM(uint8_t source, uint8_t destination, uint8_t priority, const uint8_t *data, uint8_t length);
+    void handleDT(uint8_t source, uint8_t destination, const uint8_t *data, uint8_t length, uint32_t timestamp);
+    void handleClaim(uint8_t source, const uint8_t *data, uint8_t length);
+    void handleRequest(uint8_t source, uint8_t destination, const uint8_t *data, uint8_t length);
+    void sendClaim();
+    bool pickNewAddress();
+    bool sendRaw(uint8_t priority, uint32_t pgn, uint8_t destination, const uint8_t *data, uint8_t length);
+    bool sendCM(uint8_t destination, uint8_t control, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint32_t pgn);
+    bool sendPacket(Session &s);
+    void pump(uint8_t idx);
+    void sendCTS(uint8_t idx);
+    int findSession(bool tx, uint8_t peer, bool broadcast) const;
+    int newSession();
+    void finishSend(uint8_t idx, CANJ1939Result result);
+    void failReceive(uint8_t idx, CANJ1939Result result, bool sendAbort);
+    void releaseSession(Session &s);
+    int8_t allocBlock();
+    void startTimer(uint16_t timer, uint32_t delayMillis);
+    static void timerExpired(uint16_t timer, void *context);
+
+    CAN_COMMON &bus;
+    Handler handlers[CAN_J1939_MAX_HANDLERS];
+    uint8_t numHandlers;
+    uint8_t index[CAN_J1939_MAX_HANDLERS * 2]; //open addressing over handlers, 0xFF = empty
+    bool promiscuous;
+
+    Session sessions[CAN_J1939_MAX_SESSIONS];
+    CANTimerWheel wheel;
+    CANTimer timers[CAN_J1939_MAX_SESSIONS + 1]; //one per session and the address claim
+    uint32_t lastMillis;
+    uint32_t tickRemainder;
+    uint32_t wheelTarget;
+    uint8_t packetsPerCTS;
+
+    uint8_t *pool;
+    uint16_t poolBlockSize;
+    uint8_t poolBlocks;
+    uint32_t poolFree;
+
+    uint8_t address;
+    uint64_t name;
+    CANJ1939ClaimState claimState;
+    uint32_t claimedBy[8];  //bit per address someone else has claimed
+    int filterMax;          //what applyFilters was last called with so an address change can redo it
+    int filterFirst;
+
+    CANJ1939Event sendDoneCB;
+    void *sendDoneContext;
+    CANJ1939Event rxErrorCB;
+    void *rxErrorContext;
+};
+
+#endif
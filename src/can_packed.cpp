@@ -0,0 +1,258 @@
+#include "can_packed.h"
+
+#define WRAP_MARKER 0x80
+
+static void write32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static size_t packCommon(uint8_t flags, uint32_t id, uint32_t timestamp, const uint8_t *payload, uint8_t length, uint8_t *out, size_t space)
+{
+	uint8_t code = fdLengthEncoding[length];
+	uint8_t stored = fdLengthDecoding[code];
+	size_t size = CAN_PACKED_HEADER_SIZE + stored;
+	if (out == NULL || space < size) return 0;
+
+	out[0] = code | flags;
+	write32(out + 1, id);
+	write32(out + 5, timestamp);
+	memcpy(out + CAN_PACKED_HEADER_SIZE, payload, length);
+	if (stored > length) memset(out + CAN_PACKED_HEADER_SIZE + length, 0, stored - length);
+	return size;
+}
+
+size_t CANFrameView::packedSize(const CAN_FRAME &frame)
+{
+	return CAN_PACKED_HEADER_SIZE + (frame.length > 8 ? 8 : frame.length);
+}
+
+size_t CANFrameView::packedSize(const CAN_FRAME_FD &frame)
+{
+	return CAN_PACKED_HEADER_SIZE + fdLengthDecoding[fdLengthEncoding[frame.length > 64 ? 64 : frame.length]];
+}
+
+/**
+ * \brief Write a frame as a packed record
+ *
+ * \param frame Frame to pack
+ * \param out Where to write the record
+ * \param space Bytes available at out
+ *
+ * \ret  Size of the record or 0 if it didn't fit
+ */
+size_t CANFrameView::pack(const CAN_FRAME &frame, uint8_t *out, size_t space)
+{
+	uint8_t flags = (frame.extended ? CAN_PACKED_EXTENDED : 0) | (frame.rtr ? CAN_PACKED_RTR : 0);
+	return packCommon(flags, frame.id, frame.timestamp, frame.data.uint8, frame.length > 8 ? 8 : frame.length, out, space);
+}
+
+size_t CANFrameView::pack(const CAN_FRAME_FD &frame, uint8_t *out, size_t space)
+{
+	uint8_t flags = (frame.extended ? CAN_PACKED_EXTENDED : 0) | (frame.rrs ? CAN_PACKED_RTR : 0) | (frame.fdMode ? CAN_PACKED_FD : 0);
+	return packCommon(flags, frame.id, frame.timestamp, frame.data.uint8, frame.length > 64 ? 64 : frame.length, out, space);
+}
+
+/**
+ * \brief Copy the record into a classic frame
+ *
+ * \ret  false if the record holds more than 8 bytes or is an FD frame
+ */
+bool CANFrameView::toFrame(CAN_FRAME &frame) const
+{
+	if (rec == NULL || fdMode() || dlcCode() > 8) return false;
+	frame.id = id();
+	frame.fid = 0;
+	frame.timestamp = timestamp();
+	frame.rtr = rtr() ? 1 : 0;
+	frame.extended = extended();
+	frame.length = length();
+	frame.data.uint64 = 0;
+	memcpy(frame.data.uint8, data(), frame.length);
+	return true;
+}
+
+bool CANFrameView::toFrameFD(CAN_FRAME_FD &frame) const
+{
+	if (rec == NULL) return false;
+	frame.id = id();
+	frame.fid = 0;
+	frame.timestamp = timestamp();
+	frame.rrs = rtr() ? 1 : 0;
+	frame.extended = extended();
+	frame.fdMode = fdMode() ? 1 : 0;
+	frame.length = length();
+	memcpy(frame.data.uint8, data(), frame.length);
+	if (frame.length < 64) memset(frame.data.uint8 + frame.length, 0, 64 - frame.length);
+	return true;
+}
+
+CANPackedQueue::CANPackedQueue()
+{
+	buffer = NULL;
+	mask = 0;
+	clear();
+}
+
+CANPackedQueue::CANPackedQueue(uint8_t *storage, uint32_t size)
+{
+	attach(storage, size);
+}
+
+/**
+ * \brief Use storage as the queue buffer
+ *
+ * \param storage Byte buffer
+ * \param size Size of the buffer. Must be a power of two and at least CAN_PACKED_MAX_RECORD.
+ *
+ * \ret  true if the storage was accepted
+ */
+bool CANPackedQueue::attach(uint8_t *storage, uint32_t size)
+{
+	if (storage == NULL || size < CAN_PACKED_MAX_RECORD || (size & (size - 1)) != 0)
+	{
+		buffer = NULL;
+		mask = 0;
+		clear();
+		return false;
+	}
+	buffer = storage;
+	mask = size - 1;
+	clear();
+	return true;
+}
+
+//Not safe while the producer is running
+void CANPackedQueue::clear()
+{
+	head = 0;
+	tail = 0;
+	pushed = 0;
+	popped = 0;
+	pendingHead = 0;
+}
+
+//Producer side. Find room for size contiguous bytes, skipping the end of the buffer if needed
+uint8_t *CANPackedQueue::reserve(size_t size)
+{
+	if (buffer == NULL) return NULL;
+	uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	uint32_t pos = h & mask;
+	uint32_t contiguous = mask + 1 - pos;
+	uint32_t needed = size + ((size > contiguous) ? contiguous : 0);
+	if (mask + 1 - (h - t) < needed) return NULL;
+
+	if (size > contiguous)
+	{
+		buffer[pos] = WRAP_MARKER;
+		h += contiguous;
+		pos = 0;
+	}
+	pendingHead = h + size;
+	return buffer + pos;
+}
+
+void CANPackedQueue::commit()
+{
+	__atomic_store_n(&pushed, pushed + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&head, pendingHead, __ATOMIC_RELEASE);
+}
+
+bool CANPackedQueue::push(const CAN_FRAME &frame)
+{
+	size_t size = CANFrameView::packedSize(frame);
+	uint8_t *dest = reserve(size);
+	if (dest == NULL) return false;
+	CANFrameView::pack(frame, dest, size);
+	commit();
+	return true;
+}
+
+bool CANPackedQueue::pushFD(const CAN_FRAME_FD &frame)
+{
+	size_t size = CANFrameView::packedSize(frame);
+	uint8_t *dest = reserve(size);
+	if (dest == NULL) return false;
+	CANFrameView::pack(frame, dest, size);
+	commit();
+	return true;
+}
+
+//Consumer side. Oldest record or NULL, stepping over a wrap marker if there is one
+const uint8_t *CANPackedQueue::front()
+{
+	if (buffer == NULL) return NULL;
+	uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	if (h == t) return NULL;
+	uint32_t pos = t & mask;
+	if (buffer[pos] == WRAP_MARKER)
+	{
+		t += mask + 1 - pos;
+		__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+		if (h == t) return NULL;
+		pos = 0;
+	}
+	return buffer + pos;
+}
+
+/**
+ * \brief Look at the oldest record in place
+ *
+ * \param view Set to the record. Valid until drop() or pop() is called.
+ *
+ * \ret  false if the queue is empty
+ */
+bool CANPackedQueue::peek(CANFrameView &view)
+{
+	const uint8_t *rec = front();
+	if (rec == NULL) return false;
+	view = CANFrameView(rec);
+	return true;
+}
+
+void CANPackedQueue::drop()
+{
+	const uint8_t *rec = front();
+	if (rec == NULL) return;
+	uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	__atomic_store_n(&popped, popped + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&tail, t + (uint32_t)CANFrameView(rec).recordSize(), __ATOMIC_RELEASE);
+}
+
+bool CANPackedQueue::pop(CAN_FRAME &frame)
+{
+	CANFrameView view;
+	if (!peek(view)) return false;
+	bool ok = view.toFrame(frame);
+	drop(); //a record that doesn't fit a classic frame is dropped rather than blocking the queue
+	return ok;
+}
+
+bool CANPackedQueue::popFD(CAN_FRAME_FD &frame)
+{
+	CANFrameView view;
+	if (!peek(view)) return false;
+	view.toFrameFD(frame);
+	drop();
+	return true;
+}
+
+bool CANPackedQueue::isEmpty() const
+{
+	return __atomic_load_n(&head, __ATOMIC_ACQUIRE) == __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+}
+
+uint32_t CANPackedQueue::bytesUsed() const
+{
+	return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+}
+
+uint32_t CANPackedQueue::count() const
+{
+	return __atomic_load_n(&pushed, __ATOMIC_ACQUIRE) - __atomic_load_n(&popped, __ATOMIC_ACQUIRE);
+}
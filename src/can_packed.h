@@ -0,0 +1,124 @@
+#ifndef _CAN_PACKED_
+#define _CAN_PACKED_
+
+#include <can_common.h>
+
+/*
+Variable length frame records. CAN_FRAME_FD always takes 80 bytes even for an 8 byte classic frame,
+a packed record is a 9 byte header followed by only the payload bytes that are actually valid:
+
+    byte 0      bits 0-3 DLC code (fdLengthEncoding), bit 4 extended, bit 5 RTR / RRS, bit 6 FD frame
+                bit 7 is never set in a record (CANPackedQueue uses 0x80 as a wrap marker)
+    bytes 1-4   ID, little endian
+    bytes 5-8   timestamp, little endian
+    bytes 9..   payload, fdLengthDecoding[DLC code] bytes
+
+fid and priority are not stored. They only matter to drivers and on transmit.
+FD lengths that aren't valid on the wire (9-11, 13-15 ...) are rounded up and zero padded like a
+controller would.
+*/
+
+#define CAN_PACKED_HEADER_SIZE 9
+#define CAN_PACKED_MAX_RECORD (CAN_PACKED_HEADER_SIZE + 64)
+
+#define CAN_PACKED_EXTENDED 0x10
+#define CAN_PACKED_RTR      0x20
+#define CAN_PACKED_FD       0x40
+
+//Non-owning pointer + length into a payload, wherever it lives
+class CANPayloadView
+{
+public:
+    CANPayloadView() : bytes(NULL), len(0) {}
+    CANPayloadView(const uint8_t *data, uint8_t length) : bytes(data), len(length) {}
+    CANPayloadView(const CAN_FRAME &frame) : bytes(frame.data.uint8), len(frame.length > 8 ? 8 : frame.length) {}
+    CANPayloadView(const CAN_FRAME_FD &frame) : bytes(frame.data.uint8), len(frame.length > 64 ? 64 : frame.length) {}
+
+    const uint8_t *data() const { return bytes; }
+    uint8_t length() const { return len; }
+    uint8_t operator[](int idx) const { return (idx >= 0 && idx < len) ? bytes[idx] : 0; }
+
+private:
+    const uint8_t *bytes;
+    uint8_t len;
+};
+
+//Read only view of one packed record. Nothing is copied until toFrame / toFrameFD is called.
+class CANFrameView
+{
+public:
+    CANFrameView() : rec(NULL) {}
+    explicit CANFrameView(const uint8_t *record) : rec(record) {}
+
+    bool isValid() const { return rec != NULL; }
+    uint8_t dlcCode() const { return rec[0] & 0x0F; }
+    bool extended() const { return (rec[0] & CAN_PACKED_EXTENDED) != 0; }
+    bool rtr() const { return (rec[0] & CAN_PACKED_RTR) != 0; }
+    bool fdMode() const { return (rec[0] & CAN_PACKED_FD) != 0; }
+    uint32_t id() const { return read32(rec + 1); }
+    uint32_t timestamp() const { return read32(rec + 5); }
+    uint8_t length() const { return fdLengthDecoding[dlcCode()]; }
+    const uint8_t *data() const { return rec + CAN_PACKED_HEADER_SIZE; }
+    CANPayloadView payload() const { return CANPayloadView(data(), length()); }
+    uint8_t operator[](int idx) const { return payload()[idx]; }
+    size_t recordSize() const { return CAN_PACKED_HEADER_SIZE + length(); }
+    const uint8_t *record() const { return rec; }
+
+    bool toFrame(CAN_FRAME &frame) const;
+    bool toFrameFD(CAN_FRAME_FD &frame) const;
+
+    static size_t packedSize(const CAN_FRAME &frame);
+    static size_t packedSize(const CAN_FRAME_FD &frame);
+    static size_t pack(const CAN_FRAME &frame, uint8_t *out, size_t space);
+    static size_t pack(const CAN_FRAME_FD &frame, uint8_t *out, size_t space);
+
+private:
+    static uint32_t read32(const uint8_t *p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    const uint8_t *rec;
+};
+
+/*
+Single producer / single consumer queue of packed records in a byte buffer. Same rules as CANRing:
+one side pushes (usually an ISR), the other pops, no interrupt masking. A record never wraps around
+the end of the buffer, when it won't fit the rest of the buffer is skipped with a marker byte.
+*/
+class CANPackedQueue
+{
+public:
+    CANPackedQueue();
+    CANPackedQueue(uint8_t *storage, uint32_t size);
+
+    bool attach(uint8_t *storage, uint32_t size);
+    void clear();
+
+    bool push(const CAN_FRAME &frame);
+    bool pushFD(const CAN_FRAME_FD &frame);
+    bool peek(CANFrameView &view);
+    void drop();
+    bool pop(CAN_FRAME &frame);
+    bool popFD(CAN_FRAME_FD &frame);
+
+    bool isEmpty() const;
+    uint32_t bytesUsed() const;
+    uint32_t capacity() const { return buffer ? mask + 1 : 0; }
+    uint32_t count() const;
+
+private:
+    uint8_t *reserve(size_t size);
+    void commit();
+    const uint8_t *front();
+
+    uint8_t *buffer;
+    uint32_t mask;
+    uint32_t head;       //bytes written, only changed by the producer
+    uint32_t tail;       //bytes consumed, only changed by the consumer
+    uint32_t pushed;     //record counts so count() is exact
+    uint32_t popped;
+    uint32_t pendingHead; //head after the reservation in progress
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "can_replay.h"
+
+CANReplay::CANReplay(CAN_COMMON &canBus, const CANCaptureReader &capture) : bus(canBus), reader(capture)
+{
+	haveRecord = false;
+	finished = true;
+	speed = 100;
+	firstTime = 0;
+	elapsed = 0;
+	lastMicros = 0;
+	played = 0;
+	maxLag = 0;
+}
+
+//Play the capture from the beginning
+void CANReplay::start(uint16_t speedPercent)
+{
+	speed = speedPercent;
+	reader.rewind();
+	played = 0;
+	maxLag = 0;
+	elapsed = 0;
+	lastMicros = micros();
+	finished = false;
+	haveRecord = load();
+	if (haveRecord) firstTime = record.timestamp;
+	else finished = true;
+}
+
+bool CANReplay::load()
+{
+	return reader.next(record);
+}
+
+/**
+ * \brief Feed the frames that are due
+ *
+ * \param maxFrames Most frames to feed in this call
+ *
+ * \ret  Number of frames fed to the interface
+ */
+int CANReplay::service(uint16_t maxFrames)
+{
+	if (finished) return 0;
+	uint32_t now = micros();
+	elapsed += (uint32_t)(now - lastMicros);
+	lastMicros = now;
+
+	int count = 0;
+	while (haveRecord && count < maxFrames)
+	{
+		if (speed)
+		{
+			//a frame stamped before the first one is due straight away
+			uint64_t due = (record.timestamp > firstTime) ? (record.timestamp - firstTime) * 100 / speed : 0;
+			if (due > elapsed) break;
+			if (elapsed - due > maxLag) maxLag = (elapsed - due > 0xFFFFFFFFull) ? 0xFFFFFFFF : (uint32_t)(elapsed - due);
+		}
+		if (record.fdMode() || record.dlcCode > 8)
+		{
+			CAN_FRAME_FD frame;
+			record.toFrameFD(frame);
+			bus.receiveFrameFD(frame, bus.findMailbox(frame.id, frame.extended));
+		}
+		else
+		{
+			CAN_FRAME frame;
+			record.toFrame(frame);
+			bus.receiveFrame(frame, bus.findMailbox(frame.id, frame.extended));
+		}
+		played++;
+		count++;
+		haveRecord = load();
+	}
+	if (!haveRecord) finished = true;
+	return count;
+}
@@ -0,0 +1,45 @@
+#ifndef _CAN_REPLAY_
+#define _CAN_REPLAY_
+
+#include <can_common.h>
+#include "can_capture.h"
+
+/*
+Plays a capture back into an interface through receiveFrame / receiveFrameFD, exactly as if the
+driver had received it. Everything downstream (filters in software, callbacks, listeners, the RX
+ring, deferred dispatch and statistics) sees the traffic, which makes it handy for load testing
+handlers with a real bus log. Each frame is handed over with the mailbox the interface's findMailbox()
+picks for its ID under the filters set now, so mailbox callbacks and listeners get their frames too.
+
+Timing follows the capture's timestamps (taken as microseconds) scaled by a speed in percent,
+200 plays twice as fast. Speed 0 feeds frames as fast as service() is called. Frames keep their
+captured timestamp.
+*/
+class CANReplay
+{
+public:
+    CANReplay(CAN_COMMON &bus, const CANCaptureReader &capture);
+
+    void start(uint16_t speedPercent = 100);
+    int service(uint16_t maxFrames = 32);
+    bool isFinished() const { return finished; }
+    uint32_t getFramesPlayed() const { return played; }
+    uint32_t getMaxLagMicros() const { return maxLag; }
+
+private:
+    bool load();
+
+    CAN_COMMON &bus;
+    CANCaptureReader reader;
+    CANCaptureRecord record;
+    bool haveRecord;
+    bool finished;
+    uint16_t speed;
+    uint64_t firstTime;   //capture time of the first record
+    uint64_t elapsed;     //wall time since start(), extended past the 32 bit micros() wrap
+    uint32_t lastMicros;
+    uint32_t played;
+    uint32_t maxLag;      //worst case of how late a frame was fed, tells you when the consumer can't keep up
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef _CAN_RING_
+#define _CAN_RING_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Single producer / single consumer ring buffer used to move frames between an interrupt handler
+and the main loop without having to disable interrupts. One side only ever writes head, the
+other side only ever writes tail. The GCC __atomic builtins give us the ordering we need on
+both the single core parts (Due) and the dual core ones (ESP32).
+
+The size must be a power of two so that wrapping is just a mask. Head and tail are free running
+16 bit counters, the difference between them is the number of queued entries. That limits a ring
+to 32768 entries which is far more than anyone should need on a microcontroller.
+*/
+template <typename T>
+class CANRing
+{
+public:
+    CANRing()
+    {
+        buffer = NULL;
+        mask = 0;
+        head = 0;
+        tail = 0;
+    }
+
+    CANRing(T *storage, uint16_t size)
+    {
+        head = 0;
+        tail = 0;
+        attach(storage, size);
+    }
+
+    /**
+     * \brief Point this ring at a block of storage
+     *
+     * \param storage Array of at least size entries
+     * \param size Number of entries. Must be a power of two no larger than 32768
+     *
+     * \ret  true if the storage was accepted, false if size was not a power of two
+     *
+     * \note Not safe to call while a producer or consumer is active. Any queued entries are discarded.
+     */
+    bool attach(T *storage, uint16_t size)
+    {
+        if (storage == NULL || size == 0 || (size & (size - 1)) != 0 || size > 32768)
+        {
+            buffer = NULL;
+            mask = 0;
+            return false;
+        }
+        buffer = storage;
+        mask = size - 1;
+        clear();
+        return true;
+    }
+
+    //Consumer side only. Drops everything queued.
+    void clear()
+    {
+        __atomic_store_n(&tail, __atomic_load_n(&head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+
+    bool isAttached() const { return buffer != NULL; }
+    uint16_t capacity() const { return buffer ? (uint16_t)(mask + 1) : 0; }
+
+    uint16_t count() const
+    {
+        return (uint16_t)(__atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+    }
+
+    uint16_t space() const { return capacity() - count(); }
+    bool isEmpty() const { return count() == 0; }
+    bool isFull() const { return buffer == NULL || count() > mask; }
+
+    //Producer side. Returns false if the ring is full (or not attached)
+    bool push(const T &item)
+    {
+        if (buffer == NULL) return false;
+        uint16_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if ((uint16_t)(h - t) > mask) return false;
+        buffer[h & mask] = item;
+        __atomic_store_n(&head, (uint16_t)(h + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //Producer side. Queues as many of the n items as will fit and returns how many that was.
+    //Only one release store is done for the whole batch.
+    uint16_t pushBulk(const T *items, uint16_t n)
+    {
+        if (buffer == NULL) return 0;
+        uint16_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        uint16_t freeSlots = (uint16_t)(mask + 1 - (uint16_t)(h - t));
+        if (n > freeSlots) n = freeSlots;
+        for (uint16_t i = 0; i < n; i++) buffer[(uint16_t)(h + i) & mask] = items[i];
+        __atomic_store_n(&head, (uint16_t)(h + n), __ATOMIC_RELEASE);
+        return n;
+    }
+
+    //Consumer side. Returns false if there was nothing to pop.
+    bool pop(T &item)
+    {
+        if (buffer == NULL) return false;
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        uint16_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if (h == t) return false;
+        item = buffer[t & mask];
+        __atomic_store_n(&tail, (uint16_t)(t + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //Consumer side. Pops up to n items into the caller's array and returns how many were copied.
+    uint16_t popBulk(T *items, uint16_t n)
+    {
+        if (buffer == NULL) return 0;
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        uint16_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint16_t queued = (uint16_t)(h - t);
+        if (n > queued) n = queued;
+        for (uint16_t i = 0; i < n; i++) items[i] = buffer[(uint16_t)(t + i) & mask];
+        __atomic_store_n(&tail, (uint16_t)(t + n), __ATOMIC_RELEASE);
+        return n;
+    }
+
+    //Consumer side. Look at the oldest entry without removing it. NULL if empty.
+    T *peek()
+    {
+        if (buffer == NULL) return NULL;
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) return NULL;
+        return &buffer[t & mask];
+    }
+
+    //Consumer side. Drop the entry returned by peek()
+    void drop()
+    {
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) return;
+        __atomic_store_n(&tail, (uint16_t)(t + 1), __ATOMIC_RELEASE);
+    }
+
+private:
+    T *buffer;
+    uint16_t mask;
+    uint16_t head; //only written by the producer
+    uint16_t tail; //only written by the consumer
+};
+
+//Same thing but with the storage built in. SIZE is checked at compile time.
+template <typename T, uint16_t SIZE>
+class CANRingBuffer : public CANRing<T>
+{
+public:
+    static_assert(SIZE != 0 && (SIZE & (SIZE - 1)) == 0, "CANRingBuffer size must be a power of two");
+
+    CANRingBuffer() : CANRing<T>(storage, SIZE) {}
+
+private:
+    T storage[SIZE];
+};
+
+#endif
@@ -0,0 +1,339 @@
+#include "can_router.h"
+
+#define ROUTE_EXT 0x80000000ul
+
+static_assert(CAN_ROUTER_MAX_BUSES <= 8, "destinations are a bitmask in a byte");
+static_assert((CAN_ROUTER_QUEUE_BYTES & (CAN_ROUTER_QUEUE_BYTES - 1)) == 0, "CAN_ROUTER_QUEUE_BYTES must be a power of two");
+static_assert(CAN_ROUTER_MAX_ROUTES < 256, "route indexes are stored in a byte");
+
+CANRouter::CANRouter()
+{
+	numPorts = 0;
+	numRoutes = 0;
+	dirty = true;
+	forwarded = 0;
+	dropped = 0;
+}
+
+/**
+ * \brief Hand an interface to the router
+ *
+ * \param bus Interface, already started
+ * \param fd true to read and send with the FD calls (the bus was started with beginFD / initFD)
+ *
+ * \ret  Bus number to use in routes or -1 if the router is full
+ */
+int CANRouter::addBus(CAN_COMMON &bus, bool fd)
+{
+	if (numPorts >= CAN_ROUTER_MAX_BUSES) return -1;
+	Port &port = ports[numPorts];
+	port.bus = &bus;
+	port.fd = fd;
+	port.lossless = false;
+	port.queue.attach(port.storage, CAN_ROUTER_QUEUE_BYTES);
+	dirty = true;
+	return numPorts++;
+}
+
+//Lossless destinations push back on their sources instead of dropping when their queue fills
+void CANRouter::setLossless(uint8_t bus, bool lossless)
+{
+	if (bus < numPorts) ports[bus].lossless = lossless;
+}
+
+/**
+ * \brief Forward frames from one bus to others
+ *
+ * \param source Bus number the frames arrive on
+ * \param id, mask Frame matches when (frame id & mask) == (id & mask)
+ * \param extended Which frame type the route is for
+ * \param destinations Bitmask of bus numbers to send to (CAN_ROUTER_ALL_BUSES for all but the source)
+ *
+ * \ret  Route number or -1 if the table is full or the source is invalid
+ */
+int CANRouter::addRoute(uint8_t source, uint32_t id, uint32_t mask, bool extended, uint8_t destinations)
+{
+	if (source >= numPorts) return -1;
+	int idx = -1;
+	for (int i = 0; i < numRoutes; i++)
+	{
+		if (!routes[i].active)
+		{
+			idx = i;
+			break;
+		}
+	}
+	if (idx == -1)
+	{
+		if (numRoutes >= CAN_ROUTER_MAX_ROUTES) return -1;
+		idx = numRoutes++;
+	}
+	Route &r = routes[idx];
+	mask &= extended ? 0x1FFFFFFF : 0x7FF;
+	r.mask = mask | ROUTE_EXT;
+	r.key = (id & mask) | (extended ? ROUTE_EXT : 0);
+	r.keepMask = 0xFFFFFFFF;
+	r.setBits = 0;
+	r.remap = false;
+	r.transform = NULL;
+	r.context = NULL;
+	r.source = source;
+	r.destinations = destinations & ~(1 << source);
+	r.active = true;
+	dirty = true;
+	return idx;
+}
+
+/**
+ * \brief Rewrite the ID of frames on this route
+ *
+ * \ret  false if the route doesn't exist or setBits has bits outside the route's ID width
+ *
+ * \note The new ID is (id & keepMask) | setBits. keepMask = 0 gives a fixed ID, keepMask = 0xFF with
+ * setBits = 0x700 moves a block of IDs to 0x7xx. The frame type doesn't change, use a transform for that.
+ */
+bool CANRouter::setRemap(int route, uint32_t keepMask, uint32_t setBits)
+{
+	if (route < 0 || route >= numRoutes || !routes[route].active) return false;
+	uint32_t width = (routes[route].key & ROUTE_EXT) ? 0x1FFFFFFF : 0x7FF;
+	if (setBits & ~width) return false;
+	routes[route].keepMask = keepMask & width;
+	routes[route].setBits = setBits;
+	routes[route].remap = true;
+	return true;
+}
+
+bool CANRouter::setTransform(int route, CANRouteTransform transform, void *context)
+{
+	if (route < 0 || route >= numRoutes || !routes[route].active) return false;
+	routes[route].transform = transform;
+	routes[route].context = context;
+	return true;
+}
+
+void CANRouter::removeRoute(int route)
+{
+	if (route < 0 || route >= numRoutes) return;
+	routes[route].active = false;
+	dirty = true;
+}
+
+void CANRouter::clearRoutes()
+{
+	numRoutes = 0;
+	dirty = true;
+}
+
+//Group active routes by source so each frame only looks at the routes for its own bus
+void CANRouter::compile()
+{
+	uint8_t n = 0;
+	for (int src = 0; src < CAN_ROUTER_MAX_BUSES; src++)
+	{
+		busStart[src] = n;
+		for (int dest = 0; dest < CAN_ROUTER_MAX_BUSES; dest++) fanout[src][dest] = 0;
+		for (int i = 0; i < numRoutes; i++)
+		{
+			if (!routes[i].active || routes[i].source != src) continue;
+			order[n++] = i;
+			for (int dest = 0; dest < numPorts; dest++)
+			{
+				if (routes[i].destinations & (1 << dest)) fanout[src][dest]++;
+			}
+		}
+	}
+	busStart[CAN_ROUTER_MAX_BUSES] = n;
+	dirty = false;
+}
+
+//How many frames can be read from this source without overflowing a lossless destination, assuming worst case FD records
+uint16_t CANRouter::batchLimit(uint8_t source)
+{
+	uint16_t limit = CAN_ROUTER_BATCH;
+	for (int dest = 0; dest < numPorts; dest++)
+	{
+		if (!ports[dest].lossless || !fanout[source][dest]) continue;
+		CANPackedQueue &queue = ports[dest].queue;
+		uint32_t room = queue.capacity() - queue.bytesUsed();
+		//keep one record spare, a record that won't fit before the end of the buffer wastes up to that much
+		uint32_t fits = room > CAN_PACKED_MAX_RECORD ? (room - CAN_PACKED_MAX_RECORD) / CAN_PACKED_MAX_RECORD : 0;
+		fits /= fanout[source][dest];
+		if (fits < limit) limit = fits;
+	}
+	return limit;
+}
+
+void CANRouter::drop(Port &port)
+{
+	port.bus->getStatistics().countTXDropped();
+	dropped++;
+}
+
+void CANRouter::deliver(uint8_t dest, CAN_FRAME &frame)
+{
+	Port &port = ports[dest];
+	if (port.fd)
+	{
+		CAN_FRAME_FD fd;
+		port.bus->canToFD(frame, fd);
+		deliverFD(dest, fd);
+		return;
+	}
+	//straight to the driver unless older frames are still waiting
+	if ((port.queue.isEmpty() && port.bus->sendFrame(frame)) || port.queue.push(frame)) forwarded++;
+	else drop(port);
+}
+
+void CANRouter::deliverFD(uint8_t dest, CAN_FRAME_FD &frame)
+{
+	Port &port = ports[dest];
+	if (!port.fd)
+	{
+		CAN_FRAME classic;
+		if (frame.length > 8)
+		{
+			drop(port);
+			return;
+		}
+		//short FD frames go out as classic ones. fdToCan refuses anything marked FD so clear it on the way through.
+		uint8_t mode = frame.fdMode;
+		frame.fdMode = 0;
+		port.bus->fdToCan(frame, classic);
+		frame.fdMode = mode;
+		deliver(dest, classic);
+		return;
+	}
+	if ((port.queue.isEmpty() && port.bus->sendFrameFD(frame)) || port.queue.pushFD(frame)) forwarded++;
+	else drop(port);
+}
+
+void CANRouter::route(uint8_t source, CAN_FRAME &frame)
+{
+	uint32_t key = frame.id | (frame.extended ? ROUTE_EXT : 0);
+	for (int i = busStart[source]; i < busStart[source + 1]; i++)
+	{
+		Route &r = routes[order[i]];
+		if ((key & r.mask) != r.key || !r.destinations) continue;
+		if (r.transform)
+		{
+			CAN_FRAME_FD work;
+			ports[source].bus->canToFD(frame, work);
+			if (r.remap) work.id = remapId(r, work.id);
+			if (!r.transform(work, r.context)) continue;
+			for (int dest = 0; dest < numPorts; dest++)
+			{
+				if (r.destinations & (1 << dest)) deliverFD(dest, work);
+			}
+			continue;
+		}
+		CAN_FRAME copy;
+		CAN_FRAME *out = &frame;
+		if (r.remap)
+		{
+			copy = frame;
+			copy.id = remapId(r, frame.id);
+			out = &copy;
+		}
+		for (int dest = 0; dest < numPorts; dest++)
+		{
+			if (r.destinations & (1 << dest)) deliver(dest, *out);
+		}
+	}
+}
+
+void CANRouter::routeFD(uint8_t source, CAN_FRAME_FD &frame)
+{
+	uint32_t key = frame.id | (frame.extended ? ROUTE_EXT : 0);
+	for (int i = busStart[source]; i < busStart[source + 1]; i++)
+	{
+		Route &r = routes[order[i]];
+		if ((key & r.mask) != r.key || !r.destinations) continue;
+		CAN_FRAME_FD work;
+		CAN_FRAME_FD *out = &frame;
+		if (r.remap || r.transform)
+		{
+			work = frame;
+			if (r.remap) work.id = remapId(r, work.id);
+			if (r.transform && !r.transform(work, r.context)) continue;
+			out = &work;
+		}
+		for (int dest = 0; dest < numPorts; dest++)
+		{
+			if (r.destinations & (1 << dest)) deliverFD(dest, *out);
+		}
+	}
+}
+
+//Send what's waiting for one destination, oldest first. Returns frames sent.
+int CANRouter::flush(uint8_t dest)
+{
+	Port &port = ports[dest];
+	int sent = 0;
+	CANFrameView view;
+	while (port.queue.peek(view))
+	{
+		bool ok;
+		if (port.fd)
+		{
+			CAN_FRAME_FD frame;
+			view.toFrameFD(frame);
+			ok = port.bus->sendFrameFD(frame);
+		}
+		else
+		{
+			CAN_FRAME frame;
+			view.toFrame(frame);
+			ok = port.bus->sendFrame(frame);
+		}
+		if (!ok) break;
+		port.queue.drop();
+		sent++;
+	}
+	return sent;
+}
+
+/**
+ * \brief Move frames between the buses
+ *
+ * \ret  Number of frames read from the sources this time around
+ *
+ * \note Each call retries the destination backlogs first, then reads one batch from every source.
+ * Call it often, latency through the router is mostly the time between calls.
+ */
+int CANRouter::service()
+{
+	if (dirty) compile();
+	int handled = 0;
+
+	for (int dest = 0; dest < numPorts; dest++)
+	{
+		if (!ports[dest].queue.isEmpty()) flush(dest);
+	}
+
+	for (int src = 0; src < numPorts; src++)
+	{
+		if (busStart[src] == busStart[src + 1]) continue; //nothing routed from here, leave its frames for the sketch
+		uint16_t limit = batchLimit(src);
+		if (!limit) continue;
+		Port &port = ports[src];
+		size_t n;
+		if (port.fd)
+		{
+			n = port.bus->readBatchFD(batchFD, limit);
+			for (size_t i = 0; i < n; i++) routeFD(src, batchFD[i]);
+			handled += n;
+			limit -= n;
+		}
+		n = port.bus->readBatch(batch, limit);
+		for (size_t i = 0; i < n; i++) route(src, batch[i]);
+		handled += n;
+	}
+	return handled;
+}
+
+//Frames waiting for a destination that was busy
+uint16_t CANRouter::pending(uint8_t bus)
+{
+	if (bus >= numPorts) return 0;
+	return ports[bus].queue.count();
+}
@@ -0,0 +1,123 @@
+#ifndef _CAN_ROUTER_
+#define _CAN_ROUTER_
+
+#include <can_common.h>
+#include "can_packed.h"
+
+//Interfaces a router can own. Destinations are a bitmask so this can't go past 8.
+#ifndef CAN_ROUTER_MAX_BUSES
+#define CAN_ROUTER_MAX_BUSES 4
+#endif
+
+#ifndef CAN_ROUTER_MAX_ROUTES
+#define CAN_ROUTER_MAX_ROUTES 32
+#endif
+
+//Frames read from each source per service() call
+#ifndef CAN_ROUTER_BATCH
+#define CAN_ROUTER_BATCH 8
+#endif
+
+//Backlog per destination, in bytes of packed records (power of two). 1024 is 14 worst case FD frames or 60 classic ones.
+#ifndef CAN_ROUTER_QUEUE_BYTES
+#define CAN_ROUTER_QUEUE_BYTES 1024
+#endif
+
+#define CAN_ROUTER_ALL_BUSES 0xFF
+
+//Called with a private copy of the frame for each route that has one. Return false to drop the frame.
+typedef bool (*CANRouteTransform)(CAN_FRAME_FD &frame, void *context);
+
+/*
+Gateway between several CAN_COMMON interfaces.
+
+Each route matches frames from one source bus by ID / mask and frame type and sends them to a set of
+destination buses, optionally with the ID rewritten (id = (id & keepMask) | setBits) and the frame
+passed through a transform function. Every route that matches a frame is applied, in the order the
+routes were added. A frame is never sent back out of the bus it came in on.
+
+service() reads each source with readBatch / readBatchFD, matches the batch against that bus's routes
+and hands the frames straight to the destination driver. Frames that don't need changing are sent
+from the batch buffer without another copy. When a destination refuses a frame it and everything
+after it for that destination wait in a small packed queue, so a slow or busy bus only holds up
+itself. A full queue drops the frame (counted in the destination's txDropped statistic) unless the
+destination is lossless, in which case the router stops reading sources that feed it and the
+backlog stays in their RX buffers instead.
+
+Classic and FD buses can be mixed. Classic frames go to FD buses as classic frames, FD frames of 8
+bytes or less go to classic buses as classic frames, longer ones can't and are dropped. On an FD bus
+the FD receive queue is read before the classic one, so order is only kept within each of them.
+
+Call service() from loop() or a task. Nothing here is interrupt safe.
+*/
+class CANRouter
+{
+public:
+    CANRouter();
+
+    int addBus(CAN_COMMON &bus, bool fd = false);
+    void setLossless(uint8_t bus, bool lossless);
+
+    int addRoute(uint8_t source, uint32_t id, uint32_t mask, bool extended, uint8_t destinations);
+    bool setRemap(int route, uint32_t keepMask, uint32_t setBits);
+    bool setTransform(int route, CANRouteTransform transform, void *context = NULL);
+    void removeRoute(int route);
+    void clearRoutes();
+
+    int service();
+    uint16_t pending(uint8_t bus);
+    uint32_t getForwarded() const { return forwarded; }
+    uint32_t getDropped() const { return dropped; }
+
+private:
+    struct Port
+    {
+        CAN_COMMON *bus;
+        bool fd;
+        bool lossless;
+        CANPackedQueue queue;
+        uint8_t storage[CAN_ROUTER_QUEUE_BYTES];
+    };
+    struct Route
+    {
+        uint32_t key;       //id | extended in bit 31, already masked
+        uint32_t mask;      //id mask with bit 31 set so the frame type always has to match
+        uint32_t keepMask;
+        uint32_t setBits;
+        CANRouteTransform transform;
+        void *context;
+        uint8_t source;
+        uint8_t destinations;
+        bool remap;
+        bool active;
+    };
+
+    void compile();
+    uint16_t batchLimit(uint8_t source);
+    void route(uint8_t source, CAN_FRAME &frame);
+    void routeFD(uint8_t source, CAN_FRAME_FD &frame);
+    void deliver(uint8_t dest, CAN_FRAME &frame);
+    void deliverFD(uint8_t dest, CAN_FRAME_FD &frame);
+    void drop(Port &port);
+    int flush(uint8_t dest);
+
+    static inline uint32_t remapId(const Route &r, uint32_t id) { return (id & r.keepMask) | r.setBits; }
+
+    Port ports[CAN_ROUTER_MAX_BUSES];
+    uint8_t numPorts;
+    Route routes[CAN_ROUTER_MAX_ROUTES];
+    uint8_t numRoutes;
+
+    //compiled form: routes grouped by source, order[busStart[n]] .. order[busStart[n + 1] - 1]
+    bool dirty;
+    uint8_t order[CAN_ROUTER_MAX_ROUTES];
+    uint8_t busStart[CAN_ROUTER_MAX_BUSES + 1];
+    uint8_t fanout[CAN_ROUTER_MAX_BUSES][CAN_ROUTER_MAX_BUSES]; //routes from source to destination
+
+    CAN_FRAME batch[CAN_ROUTER_BATCH];
+    CAN_FRAME_FD batchFD[CAN_ROUTER_BATCH];
+    uint32_t forwarded;
+    uint32_t dropped;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef _CAN_SIGNAL_
+#define _CAN_SIGNAL_
+
+#include <can_common.h>
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "can_signal.h assumes a little endian CPU (true for every board this library supports)"
+#endif
+
+enum CANByteOrder
+{
+    CAN_INTEL = 0,    //little endian, start bit is the LSB of the signal
+    CAN_MOTOROLA = 1  //big endian, start bit is the MSB of the signal (DBC numbering)
+};
+
+template <bool SIGNED> struct CANSignalValueType { typedef uint64_t type; };
+template <> struct CANSignalValueType<true> { typedef int64_t type; };
+
+//Arithmetic get() / set() scale in: float while every raw value is exact in it, double for wider fields
+template <bool WIDE> struct CANSignalMathType { typedef float type; };
+template <> struct CANSignalMathType<true> { typedef double type; };
+
+/*
+Compile time description of one signal inside a frame payload. Everything about where the signal
+lives is a template parameter so get / set boil down to one load of the bytes involved, a shift and
+a mask (plus a byte swap for Motorola signals). Works on BytesUnion (8 bytes), BytesUnion_FD (64 bytes)
+or a plain byte pointer.
+
+START and LEN follow DBC conventions. A signal may span at most 8 bytes, that is (START % 8) + LEN <= 64
+for Intel and (7 - START % 8) + LEN <= 64 for Motorola.
+
+Floating point template parameters don't exist in C++11 so scaling is given as a ratio:
+physical = raw * SCALE_NUM / SCALE_DEN + OFFSET
+Physical values are float for signals up to 24 bits and double for wider ones (math_type).
+
+Example - a 16 bit unsigned Intel signal at bit 8 with a scale of 0.25:
+    typedef CANSignal<8, 16, CAN_INTEL, false, 1, 4> EngineRPM;
+    float rpm = EngineRPM::get(frame.data);
+    EngineRPM::set(frame.data, 3000.0f);
+*/
+template <uint16_t START, uint8_t LEN, CANByteOrder ORDER = CAN_INTEL, bool SIGNED = false,
+          int32_t SCALE_NUM = 1, int32_t SCALE_DEN = 1, int32_t OFFSET = 0>
+class CANSignal
+{
+public:
+    static_assert(LEN >= 1 && LEN <= 64, "signal length must be 1 to 64 bits");
+    static_assert(SCALE_DEN != 0, "scale denominator can't be zero");
+
+    static const uint16_t FIRST_BYTE = START / 8;
+    //bits in the first byte that come before the signal
+    static const uint8_t LEAD = (ORDER == CAN_INTEL) ? (START % 8) : (7 - (START % 8));
+    static const uint8_t NUM_BYTES = (LEAD + LEN + 7) / 8;
+    static const uint16_t END_BYTE = FIRST_BYTE + NUM_BYTES; //one past the last byte touched
+    static const uint64_t MASK = (~0ull) >> (64 - LEN);
+
+    static_assert(LEAD + LEN <= 64, "signal spans more than 8 bytes");
+
+    typedef typename CANSignalValueType<SIGNED>::type value_type;
+    typedef typename CANSignalMathType<(LEN > 24)>::type math_type;
+
+    //Unscaled field contents, zero extended
+    static inline uint64_t raw(const uint8_t *bytes)
+    {
+        uint64_t window = 0;
+        memcpy(&window, bytes + FIRST_BYTE, NUM_BYTES);
+        if (ORDER == CAN_INTEL) return (window >> LEAD) & MASK;
+        return (__builtin_bswap64(window) >> (64 - LEAD - LEN)) & MASK;
+    }
+
+    static inline uint64_t raw(const BytesUnion &data)
+    {
+        static_assert(END_BYTE <= 8, "signal runs past the end of an 8 byte payload");
+        return raw(data.uint8);
+    }
+
+    static inline uint64_t raw(const BytesUnion_FD &data)
+    {
+        static_assert(END_BYTE <= 64, "signal runs past the end of a 64 byte payload");
+        return raw(data.uint8);
+    }
+
+    //Unscaled value, sign extended if the signal is signed
+    template <typename PAYLOAD>
+    static inline value_type value(const PAYLOAD &data)
+    {
+        uint64_t r = raw(data);
+        if (SIGNED) return (value_type)((int64_t)(r << (64 - LEN)) >> (64 - LEN));
+        return (value_type)r;
+    }
+
+    //Scaled physical value
+    template <typename PAYLOAD>
+    static inline math_type get(const PAYLOAD &data)
+    {
+        math_type v = (math_type)value(data);
+        if (SCALE_NUM != 1 || SCALE_DEN != 1) v = v * (math_type)SCALE_NUM / (math_type)SCALE_DEN;
+        return v + (math_type)OFFSET;
+    }
+
+    static inline void setRaw(uint8_t *bytes, uint64_t r)
+    {
+        uint64_t window = 0;
+        memcpy(&window, bytes + FIRST_BYTE, NUM_BYTES);
+        if (ORDER == CAN_INTEL)
+        {
+            window &= ~(MASK << LEAD);
+            window |= (r & MASK) << LEAD;
+        }
+        else
+        {
+            const int shift = 64 - LEAD - LEN;
+            uint64_t be = __builtin_bswap64(window);
+            be &= ~(MASK << shift);
+            be |= (r & MASK) << shift;
+            window = __builtin_bswap64(be);
+        }
+        memcpy(bytes + FIRST_BYTE, &window, NUM_BYTES);
+    }
+
+    static inline void setRaw(BytesUnion &data, uint64_t r)
+    {
+        static_assert(END_BYTE <= 8, "signal runs past the end of an 8 byte payload");
+        setRaw(data.uint8, r);
+    }
+
+    static inline void setRaw(BytesUnion_FD &data, uint64_t r)
+    {
+        static_assert(END_BYTE <= 64, "signal runs past the end of a 64 byte payload");
+        setRaw(data.uint8, r);
+    }
+
+    //Store a physical value. Rounds to the nearest raw step and clamps to what fits in the field.
+    template <typename PAYLOAD>
+    static inline void set(PAYLOAD &data, math_type physical)
+    {
+        math_type scaled = (math_type)physical - (math_type)OFFSET;
+        if (SCALE_NUM != 1 || SCALE_DEN != 1) scaled = scaled * (math_type)SCALE_DEN / (math_type)SCALE_NUM;
+        scaled += (scaled < 0) ? (math_type)-0.5 : (math_type)0.5;
+
+        //the limits may round up to the next power of two once converted, so compare first and only
+        //convert values that are strictly inside (NaN ends up at the lower limit)
+        if (SIGNED)
+        {
+            const int64_t maxRaw = (int64_t)(MASK >> 1);
+            const int64_t minRaw = -maxRaw - 1;
+            int64_t r;
+            if (scaled >= (math_type)maxRaw) r = maxRaw;
+            else if (!(scaled > (math_type)minRaw)) r = minRaw;
+            else r = (int64_t)scaled;
+            setRaw(data, (uint64_t)r);
+        }
+        else
+        {
+            uint64_t r;
+            if (scaled >= (math_type)MASK) r = MASK;
+            else if (!(scaled > 0)) r = 0;
+            else r = (uint64_t)scaled;
+            setRaw(data, r);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "can_soft_filter.h"
+
+#if defined(CAN_SOFT_FILTER_SCALAR)
+//forced to the plain C kernel, for comparisons
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define SOFT_FILTER_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SOFT_FILTER_NEON
+#endif
+
+//Padding and disabled filters. Bits 29 and 30 are never set in a frame key so this can't match.
+#define NEVER_KEY   0x60000000
+#define NEVER_MASK  0xFFFFFFFF
+#define EXT_BIT     0x80000000
+
+typedef void (*MatchKernel)(const uint32_t *keys, const uint32_t *masks, uint8_t count, const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out);
+
+static inline uint32_t frameKey(uint32_t id, uint8_t extended)
+{
+	return (id & 0x1FFFFFFF) | (extended ? EXT_BIT : 0);
+}
+
+#if !defined(SOFT_FILTER_X86) && !defined(SOFT_FILTER_NEON)
+static void matchScalar(const uint32_t *keys, const uint32_t *masks, uint8_t count, const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out)
+{
+	for (uint16_t f = 0; f < frames; f++)
+	{
+		uint32_t key = frameKey(ids[f], extended[f]);
+		uint64_t bits = 0;
+		for (uint8_t j = 0; j < count; j++) bits |= (uint64_t)(((key ^ keys[j]) & masks[j]) == 0) << j;
+		out[f] = bits;
+	}
+}
+#endif
+
+#if defined(SOFT_FILTER_X86)
+static void matchSSE2(const uint32_t *keys, const uint32_t *masks, uint8_t count, const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	for (uint16_t f = 0; f < frames; f++)
+	{
+		__m128i key = _mm_set1_epi32((int)frameKey(ids[f], extended[f]));
+		uint64_t bits = 0;
+		for (uint8_t j = 0; j < count; j += 4)
+		{
+			__m128i diff = _mm_xor_si128(key, _mm_loadu_si128((const __m128i *)(keys + j)));
+			diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *)(masks + j)));
+			bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(diff, zero))) << j;
+		}
+		out[f] = bits;
+	}
+}
+
+__attribute__((target("avx2")))
+static void matchAVX2(const uint32_t *keys, const uint32_t *masks, uint8_t count, const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	for (uint16_t f = 0; f < frames; f++)
+	{
+		__m256i key = _mm256_set1_epi32((int)frameKey(ids[f], extended[f]));
+		uint64_t bits = 0;
+		for (uint8_t j = 0; j < count; j += 8)
+		{
+			__m256i diff = _mm256_xor_si256(key, _mm256_loadu_si256((const __m256i *)(keys + j)));
+			diff = _mm256_and_si256(diff, _mm256_loadu_si256((const __m256i *)(masks + j)));
+			bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(diff, zero))) << j;
+		}
+		out[f] = bits;
+	}
+}
+
+static MatchKernel pickKernel(const char **name)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "avx2";
+		return matchAVX2;
+	}
+	*name = "sse2";
+	return matchSSE2;
+}
+
+static const char *kernelName;
+static MatchKernel kernel = pickKernel(&kernelName);
+
+#elif defined(SOFT_FILTER_NEON)
+static void matchNEON(const uint32_t *keys, const uint32_t *masks, uint8_t count, const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out)
+{
+	static const uint32_t laneBits[4] = {1, 2, 4, 8};
+	const uint32x4_t weights = vld1q_u32(laneBits);
+	const uint32x4_t zero = vdupq_n_u32(0);
+	for (uint16_t f = 0; f < frames; f++)
+	{
+		uint32x4_t key = vdupq_n_u32(frameKey(ids[f], extended[f]));
+		uint64_t bits = 0;
+		for (uint8_t j = 0; j < count; j += 4)
+		{
+			uint32x4_t diff = vandq_u32(veorq_u32(key, vld1q_u32(keys + j)), vld1q_u32(masks + j));
+			uint32x4_t hit = vandq_u32(vceqq_u32(diff, zero), weights);
+#if defined(__aarch64__)
+			uint32_t lanes = vaddvq_u32(hit);
+#else
+			uint32x2_t half = vpadd_u32(vget_low_u32(hit), vget_high_u32(hit));
+			uint32_t lanes = vget_lane_u32(vpadd_u32(half, half), 0);
+#endif
+			bits |= (uint64_t)lanes << j;
+		}
+		out[f] = bits;
+	}
+}
+
+static const char *kernelName = "neon";
+static const MatchKernel kernel = matchNEON;
+
+#else
+static const char *kernelName = "scalar";
+static const MatchKernel kernel = matchScalar;
+#endif
+
+CANSoftFilter::CANSoftFilter()
+{
+	clear();
+}
+
+//Remove every filter. A filter with none accepts nothing.
+void CANSoftFilter::clear()
+{
+	for (int i = 0; i < CAN_SOFT_FILTER_MAX; i++)
+	{
+		keys[i] = NEVER_KEY;
+		masks[i] = NEVER_MASK;
+	}
+	count = 0;
+}
+
+/**
+ * \brief Add a filter after the ones already there
+ *
+ * \param id Frame ID to match
+ * \param mask Bits of the ID that have to match, like the hardware filters
+ * \param extended Matches only extended frames if true, only standard ones if false
+ *
+ * \ret  Bit number of the filter in match() results or -1 if all CAN_SOFT_FILTER_MAX are used
+ */
+int CANSoftFilter::add(uint32_t id, uint32_t mask, bool extended)
+{
+	if (count >= CAN_SOFT_FILTER_MAX) return -1;
+	set(count, id, mask, extended);
+	return count - 1;
+}
+
+/**
+ * \brief Replace filter index (or append it when it is the next free one)
+ *
+ * \ret  false if index is beyond the filters in use
+ */
+bool CANSoftFilter::set(uint8_t index, uint32_t id, uint32_t mask, bool extended)
+{
+	if (index > count || index >= CAN_SOFT_FILTER_MAX) return false;
+	mask &= extended ? 0x1FFFFFFF : 0x7FF;
+	keys[index] = (id & mask) | (extended ? EXT_BIT : 0);
+	masks[index] = mask | EXT_BIT;
+	if (index == count) count++;
+	return true;
+}
+
+//Keep the slot (and so the bit numbers of the others) but never match it
+void CANSoftFilter::disable(uint8_t index)
+{
+	if (index >= count) return;
+	keys[index] = NEVER_KEY;
+	masks[index] = NEVER_MASK;
+}
+
+//Bitmap of the filters matching one frame
+uint64_t CANSoftFilter::match(uint32_t id, bool extended) const
+{
+	uint64_t bits;
+	uint8_t ext = extended;
+	kernel(keys, masks, (count + 7) & ~7, &id, &ext, 1, &bits);
+	return bits;
+}
+
+/**
+ * \brief Run a block of frames through every filter
+ *
+ * \param ids Frame IDs
+ * \param extended One byte per frame, non zero for extended
+ * \param frames Number of frames
+ * \param out frames bitmaps, bit n set when filter n matched
+ */
+void CANSoftFilter::matchBatch(const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out) const
+{
+	kernel(keys, masks, (count + 7) & ~7, ids, extended, frames, out);
+}
+
+//Which kernel this build and CPU ended up with: avx2, sse2, neon or scalar
+const char *CANSoftFilter::getKernelName()
+{
+	return kernelName;
+}
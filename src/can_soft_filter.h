@@ -0,0 +1,53 @@
+#ifndef _CAN_SOFT_FILTER_
+#define _CAN_SOFT_FILTER_
+
+#include <Arduino.h>
+
+//id / mask pairs a CANSoftFilter holds. Bitmaps are 64 bit so this can't go over 64.
+#ifndef CAN_SOFT_FILTER_MAX
+#define CAN_SOFT_FILTER_MAX 64
+#endif
+
+static_assert(CAN_SOFT_FILTER_MAX <= 64 && (CAN_SOFT_FILTER_MAX % 8) == 0, "CAN_SOFT_FILTER_MAX must be a multiple of 8 up to 64");
+
+/*
+Acceptance filtering in software, for when the controller has fewer filters than the application
+needs and has been left open (watchFor()). Each filter is an id / mask pair like the hardware ones
+and the result for a frame is a bitmap with bit n set when filter n matches.
+
+Filters are kept as two plain arrays with the extended flag folded into bit 31 of both id and
+mask, so checking one filter is xor, and, compare against zero. That runs 8 filters per
+instruction with AVX2, 4 with SSE2 or NEON, or one at a time in C. On x86 the AVX2 kernel is picked
+at run time if the CPU has it. Cortex-M3 (Due) and Xtensa (ESP32) get the plain C loop, which is
+still a single pass over the filters with no branches per filter.
+
+matchBatch() takes the IDs and extended flags of many frames as separate arrays (like a poll() or
+recvmmsg batch) and fills one bitmap per frame. match() / accepts() do a single frame.
+
+A CAN_COMMON given a filter with setSoftFilter() counts frames no filter matches as filter rejects
+and drops them before they reach the dispatch ring or any callback.
+*/
+class CANSoftFilter
+{
+public:
+    CANSoftFilter();
+
+    int add(uint32_t id, uint32_t mask, bool extended);
+    bool set(uint8_t index, uint32_t id, uint32_t mask, bool extended);
+    void disable(uint8_t index);
+    void clear();
+    uint8_t getCount() const { return count; }
+
+    uint64_t match(uint32_t id, bool extended) const;
+    bool accepts(uint32_t id, bool extended) const { return match(id, extended) != 0; }
+    void matchBatch(const uint32_t *ids, const uint8_t *extended, uint16_t frames, uint64_t *out) const;
+
+    static const char *getKernelName();
+
+private:
+    uint32_t keys[CAN_SOFT_FILTER_MAX];     //id, bit 31 = extended
+    uint32_t masks[CAN_SOFT_FILTER_MAX];    //mask, bit 31 always set so standard and extended never mix
+    uint8_t count;                          //filters in use, the rest up to a multiple of 8 never match
+};
+
+#endif
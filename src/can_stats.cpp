@@ -0,0 +1,261 @@
+#include "can_stats.h"
+#include "can_common.h"
+#include <string.h>
+
+CANStatistics::CANStatistics()
+{
+	reset();
+}
+
+//Not atomic as a whole. Counts racing with a reset may land on either side of it.
+void CANStatistics::reset()
+{
+	rxFrames = rxFramesFD = rxBytes = 0;
+	txFrames = txFramesFD = txBytes = 0;
+	rxOverruns = rxDropped = deferredDropped = txDropped = schedulerDropped = filterRejects = 0;
+	callbackCalls = callbackMicros = callbackMaxMicros = handlerOverruns = 0;
+	errorFrames = busOffCount = 0;
+	errorCounters = 0;
+	nominalBits = dataBits = 0;
+	resetMillis = millis();
+}
+
+//Bits on the wire without stuff bits: SOF, arbitration, control, data, CRC, ACK, EOF and interframe space.
+uint32_t CANStatistics::frameBits(const CAN_FRAME &frame)
+{
+	uint32_t len = frame.rtr ? 0 : frame.length;
+	if (len > 8) len = 8;
+	return (frame.extended ? 67 : 47) + 8 * len;
+}
+
+//FD frames are split between the nominal rate (arbitration, ACK, EOF) and the data rate (after BRS up to the CRC delimiter)
+void CANStatistics::frameBitsFD(const CAN_FRAME_FD &frame, uint32_t &nominal, uint32_t &data)
+{
+	uint32_t len = frame.length;
+	if (len > 64) len = 64;
+	if (!frame.fdMode)
+	{
+		if (len > 8) len = 8;
+		nominal = (frame.extended ? 67 : 47) + 8 * len;
+		data = 0;
+		return;
+	}
+	len = fdLengthDecoding[fdLengthEncoding[len]]; //round up to a length FD can actually send
+	//SOF, arbitration, IDE, FDF, res, BRS then CRC delimiter, ACK, ACK delimiter, EOF and interframe space
+	nominal = (frame.extended ? 36 : 17) + 13;
+	//ESI, DLC, data, stuff count, CRC and the fixed stuff bits inside the CRC field
+	data = 1 + 4 + 8 * len + 4 + (len > 16 ? 21 + 7 : 17 + 6);
+}
+
+/*
+Feeds a frame through bit by bit the way a controller sends it, counting dynamic stuff bits (one
+after every five equal bits, itself starting the next run) and optionally the classic CRC-15
+which has to be known because the CRC field is stuffed too.
+*/
+class CANBitStuffer
+{
+public:
+    CANBitStuffer() : run(0), last(2), stuffBits(0), crc(0) {}
+
+    void bit(uint8_t b)
+    {
+        if (run == 5)
+        {
+            stuffBits++;
+            last ^= 1;
+            run = 1;
+        }
+        if (b == last) run++;
+        else
+        {
+            last = b;
+            run = 1;
+        }
+        uint16_t top = ((crc >> 14) ^ b) & 1;
+        crc = (crc << 1) & 0x7FFF;
+        if (top) crc ^= 0x4599;
+    }
+
+    void bits(uint32_t value, uint8_t count)
+    {
+        while (count--) bit((value >> count) & 1);
+    }
+
+    //a stuff bit that would follow the last bit sent (classic CRC end)
+    void finish()
+    {
+        if (run == 5) stuffBits++;
+    }
+
+    uint8_t run;
+    uint8_t last;
+    uint32_t stuffBits;
+    uint16_t crc;
+};
+
+//Identifier, control field and data as sent. Leaves the stuffer just before the CRC field.
+static void stuffHeader(CANBitStuffer &s, uint32_t id, bool extended, uint8_t rtr)
+{
+	s.bit(0); //SOF
+	if (extended)
+	{
+		s.bits(id >> 18, 11);
+		s.bit(1); //SRR
+		s.bit(1); //IDE
+		s.bits(id & 0x3FFFF, 18);
+	}
+	else s.bits(id & 0x7FF, 11);
+	s.bit(rtr);
+}
+
+/**
+ * \brief Exact length of a classic frame on the wire
+ *
+ * \ret  Bits from SOF to the end of interframe space, stuff bits included
+ */
+uint32_t CANStatistics::stuffedFrameBits(const CAN_FRAME &frame)
+{
+	uint32_t len = frame.length;
+	if (len > 8) len = 8;
+	CANBitStuffer s;
+	stuffHeader(s, frame.id, frame.extended, frame.rtr ? 1 : 0);
+	if (frame.extended) s.bit(0); //r1
+	else s.bit(0); //IDE
+	s.bit(0); //r0
+	s.bits(len, 4);
+	if (!frame.rtr)
+	{
+		for (uint32_t i = 0; i < len; i++) s.bits(frame.data.bytes[i], 8);
+	}
+	uint16_t crc = s.crc;
+	s.bits(crc, 15);
+	s.finish();
+	return frameBits(frame) + s.stuffBits;
+}
+
+/**
+ * \brief Exact length of an FD frame, split by the rate each part is sent at
+ *
+ * \note Dynamic stuffing stops after the data field, the stuff count and CRC carry fixed stuff bits
+ * (already in frameBitsFD) so the CRC value doesn't change the length. The bitrate switches at
+ * BRS and back at the CRC delimiter, both counted whole on the nominal side like frameBitsFD.
+ */
+void CANStatistics::stuffedFrameBitsFD(const CAN_FRAME_FD &frame, uint32_t &nominal, uint32_t &data)
+{
+	if (!frame.fdMode)
+	{
+		CAN_FRAME classic;
+		classic.id = frame.id;
+		classic.extended = frame.extended;
+		classic.rtr = 0;
+		classic.length = (frame.length > 8) ? 8 : frame.length;
+		memcpy(classic.data.bytes, frame.data.uint8, 8);
+		nominal = stuffedFrameBits(classic);
+		data = 0;
+		return;
+	}
+	frameBitsFD(frame, nominal, data);
+	uint32_t len = frame.length;
+	if (len > 64) len = 64;
+	CANBitStuffer s;
+	stuffHeader(s, frame.id, frame.extended, 0); //RRS
+	if (!frame.extended) s.bit(0); //IDE
+	s.bit(1); //FDF
+	s.bit(0); //res
+	s.bit(1); //BRS
+	nominal += s.stuffBits;
+	uint32_t before = s.stuffBits;
+	s.bit(0); //ESI
+	s.bits(fdLengthEncoding[len], 4);
+	len = fdLengthDecoding[fdLengthEncoding[len]];
+	for (uint32_t i = 0; i < len; i++) s.bits(frame.data.uint8[i], 8);
+	data += s.stuffBits - before;
+}
+
+void CANStatistics::countRX(const CAN_FRAME &frame)
+{
+	add(rxFrames, 1);
+	add(rxBytes, frame.length);
+	add(nominalBits, frameBits(frame));
+}
+
+void CANStatistics::countRXFD(const CAN_FRAME_FD &frame)
+{
+	uint32_t nominal, data;
+	frameBitsFD(frame, nominal, data);
+	add(frame.fdMode ? rxFramesFD : rxFrames, 1);
+	add(rxBytes, frame.length);
+	add(nominalBits, nominal);
+	add(dataBits, data);
+}
+
+void CANStatistics::countTX(const CAN_FRAME &frame)
+{
+	add(txFrames, 1);
+	add(txBytes, frame.length);
+	add(nominalBits, frameBits(frame));
+}
+
+void CANStatistics::countTXFD(const CAN_FRAME_FD &frame)
+{
+	uint32_t nominal, data;
+	frameBitsFD(frame, nominal, data);
+	add(frame.fdMode ? txFramesFD : txFrames, 1);
+	add(txBytes, frame.length);
+	add(nominalBits, nominal);
+	add(dataBits, data);
+}
+
+void CANStatistics::countCallback(uint32_t micros)
+{
+	add(callbackCalls, 1);
+	add(callbackMicros, micros);
+	if (micros > get(callbackMaxMicros)) __atomic_store_n(&callbackMaxMicros, micros, __ATOMIC_RELAXED);
+}
+
+void CANStatistics::setErrorCounters(uint8_t tec, uint8_t rec)
+{
+	__atomic_store_n(&errorCounters, (uint32_t)tec | ((uint32_t)rec << 8), __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Copy the counters out and work out bus load
+ *
+ * \param out Where to put the copy
+ * \param nominalRate, dataRate Bus speeds used to turn bit counts into wire time
+ */
+void CANStatistics::snapshot(CANStats &out, uint32_t nominalRate, uint32_t dataRate) const
+{
+	out.rxFrames = get(rxFrames);
+	out.rxFramesFD = get(rxFramesFD);
+	out.rxBytes = get(rxBytes);
+	out.txFrames = get(txFrames);
+	out.txFramesFD = get(txFramesFD);
+	out.txBytes = get(txBytes);
+	out.rxOverruns = get(rxOverruns);
+	out.rxDropped = get(rxDropped);
+	out.deferredDropped = get(deferredDropped);
+	out.txDropped = get(txDropped);
+	out.schedulerDropped = get(schedulerDropped);
+	out.filterRejects = get(filterRejects);
+	out.callbackCalls = get(callbackCalls);
+	out.callbackMicros = get(callbackMicros);
+	out.callbackMaxMicros = get(callbackMaxMicros);
+	out.handlerOverruns = get(handlerOverruns);
+	out.errorFrames = get(errorFrames);
+	out.busOffCount = get(busOffCount);
+	uint32_t ec = get(errorCounters);
+	out.txErrorCounter = (uint8_t)ec;
+	out.rxErrorCounter = (uint8_t)(ec >> 8);
+	out.elapsedMillis = millis() - resetMillis;
+
+	out.busLoadPercent = 0;
+	if (nominalRate && out.elapsedMillis)
+	{
+		//wire time in microseconds
+		uint64_t busyMicros = (uint64_t)get(nominalBits) * 1000000ull / nominalRate;
+		if (dataRate) busyMicros += (uint64_t)get(dataBits) * 1000000ull / dataRate;
+		uint64_t load = busyMicros / 10 / out.elapsedMillis; //100 * busy / (elapsed * 1000)
+		out.busLoadPercent = (load > 100) ? 100 : (uint8_t)load;
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef _CAN_STATS_
+#define _CAN_STATS_
+
+#include <Arduino.h>
+
+class CAN_FRAME;
+class CAN_FRAME_FD;
+
+//Plain copy of the counters, filled in by CAN_COMMON::getStats()
+struct CANStats
+{
+    uint32_t rxFrames;         //classic frames received
+    uint32_t rxFramesFD;       //FD frames received (fdMode set)
+    uint32_t rxBytes;          //payload bytes received
+    uint32_t txFrames;         //classic frames accepted for transmission
+    uint32_t txFramesFD;
+    uint32_t txBytes;
+    uint32_t rxOverruns;       //frames lost in hardware (driver reported)
+    uint32_t rxDropped;        //frames lost because the RX ring was full
+    uint32_t deferredDropped;  //frames lost because the deferred dispatch ring was full
+    uint32_t txDropped;        //frames lost because a software TX queue was full (CANRouter backlogs)
+    uint32_t schedulerDropped; //frames refused because the CANTxScheduler was full
+    uint32_t filterRejects;    //frames seen by the controller but not accepted by any filter (if the driver can tell)
+    uint32_t callbackCalls;    //dispatches that were timed
+    uint32_t callbackMicros;   //total time spent in timed dispatches
+    uint32_t callbackMaxMicros;
+    uint32_t handlerOverruns;  //dispatches that ran past the handler budget (setHandlerBudget)
+    uint32_t errorFrames;
+    uint32_t busOffCount;
+    uint8_t txErrorCounter;    //TEC / REC as last reported by the driver
+    uint8_t rxErrorCounter;
+    uint8_t busLoadPercent;    //own traffic (RX + TX) on the wire since the last reset
+    uint32_t elapsedMillis;    //time since the last reset
+};
+
+/*
+Per interface counters. Everything is a 32 bit relaxed atomic add so it costs next to nothing in an
+ISR and readers never need a lock. Counters wrap at 2^32, take snapshots and diff them for rates.
+Bus load is worked out from the bits each frame puts on the wire (no stuff bits, so it reads a little low).
+*/
+class CANStatistics
+{
+public:
+    CANStatistics();
+
+    void countRX(const CAN_FRAME &frame);
+    void countRXFD(const CAN_FRAME_FD &frame);
+    void countTX(const CAN_FRAME &frame);
+    void countTXFD(const CAN_FRAME_FD &frame);
+    void countCallback(uint32_t micros);
+    void countHandlerOverrun() { add(handlerOverruns, 1); }
+    uint32_t handlerOverrunCount() const { return get(handlerOverruns); }
+    void countOverrun(uint32_t n = 1) { add(rxOverruns, n); }
+    void countRXDropped(uint32_t n = 1) { add(rxDropped, n); }
+    void countDeferredDropped(uint32_t n = 1) { add(deferredDropped, n); }
+    void countTXDropped(uint32_t n = 1) { add(txDropped, n); }
+    void countSchedulerDropped(uint32_t n = 1) { add(schedulerDropped, n); }
+    void countFilterReject(uint32_t n = 1) { add(filterRejects, n); }
+    void countErrorFrame(uint32_t n = 1) { add(errorFrames, n); }
+    void countBusOff() { add(busOffCount, 1); }
+    void setErrorCounters(uint8_t tec, uint8_t rec);
+
+    void snapshot(CANStats &out, uint32_t nominalRate, uint32_t dataRate) const;
+    void reset();
+
+    static uint32_t frameBits(const CAN_FRAME &frame);
+    static void frameBitsFD(const CAN_FRAME_FD &frame, uint32_t &nominalBits, uint32_t &dataBits);
+    //same but with the stuff bits this frame's contents really need, for exact wire time
+    static uint32_t stuffedFrameBits(const CAN_FRAME &frame);
+    static void stuffedFrameBitsFD(const CAN_FRAME_FD &frame, uint32_t &nominalBits, uint32_t &dataBits);
+
+private:
+    static inline void add(uint32_t &counter, uint32_t n) { __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED); }
+    static inline uint32_t get(const uint32_t &counter) { return __atomic_load_n(&counter, __ATOMIC_RELAXED); }
+
+    uint32_t rxFrames, rxFramesFD, rxBytes;
+    uint32_t txFrames, txFramesFD, txBytes;
+    uint32_t rxOverruns, rxDropped, deferredDropped, txDropped, schedulerDropped, filterRejects;
+    uint32_t callbackCalls, callbackMicros, callbackMaxMicros, handlerOverruns;
+    uint32_t errorFrames, busOffCount;
+    uint32_t errorCounters;   //TEC in the low byte, REC in the next
+    uint32_t nominalBits;     //bits on the wire at the nominal rate
+    uint32_t dataBits;        //bits at the FD data rate
+    uint32_t resetMillis;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "can_timer_wheel.h"
+
+//slot value for a timer that has been taken off the wheel and is waiting for its callback
+#define EXPIRING 0xFFFE
+
+static_assert((CAN_TIMER_WHEEL_SLOTS & (CAN_TIMER_WHEEL_SLOTS - 1)) == 0, "CAN_TIMER_WHEEL_SLOTS must be a power of two");
+static_assert(CAN_TIMER_WHEEL_SLOTS * 2 < EXPIRING, "slot numbers have to stay clear of the marker values");
+
+#define SLOT_MASK (CAN_TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT __builtin_ctz(CAN_TIMER_WHEEL_SLOTS)
+
+CANTimerWheel::CANTimerWheel()
+{
+	timers = NULL;
+	count = 0;
+	current = 0;
+	for (int i = 0; i < CAN_TIMER_WHEEL_SLOTS * 2; i++) slots[i] = CAN_TIMER_NONE;
+}
+
+/**
+ * \brief Give the wheel its timers
+ *
+ * \param storage Array of count timers, all stopped by this call
+ * \param count Number of timers, less than 0xFFFE
+ */
+bool CANTimerWheel::attach(CANTimer *storage, uint16_t num)
+{
+	if (storage == NULL || num >= EXPIRING) return false;
+	timers = storage;
+	count = num;
+	for (int i = 0; i < CAN_TIMER_WHEEL_SLOTS * 2; i++) slots[i] = CAN_TIMER_NONE;
+	for (uint16_t i = 0; i < count; i++) timers[i].slot = CAN_TIMER_NONE;
+	return true;
+}
+
+void CANTimerWheel::unlink(uint16_t timer)
+{
+	CANTimer &t = timers[timer];
+	if (t.prev != CAN_TIMER_NONE) timers[t.prev].next = t.next;
+	else slots[t.slot] = t.next;
+	if (t.next != CAN_TIMER_NONE) timers[t.next].prev = t.prev;
+}
+
+//Put a timer in the slot for its expiry: fine level if due before the fine level comes round again, else coarse
+void CANTimerWheel::link(uint16_t timer)
+{
+	CANTimer &t = timers[timer];
+	if ((uint32_t)(t.expires - current) < CAN_TIMER_WHEEL_SLOTS) t.slot = t.expires & SLOT_MASK;
+	else t.slot = CAN_TIMER_WHEEL_SLOTS + ((t.expires >> LEVEL_SHIFT) & SLOT_MASK);
+	t.prev = CAN_TIMER_NONE;
+	t.next = slots[t.slot];
+	if (t.next != CAN_TIMER_NONE) timers[t.next].prev = timer;
+	slots[t.slot] = timer;
+}
+
+/**
+ * \brief (Re)start a timer
+ *
+ * \param ticks Fire after this many calls' worth of advance(). 0 is taken as 1.
+ */
+void CANTimerWheel::start(uint16_t timer, uint32_t ticks)
+{
+	if (timer >= count) return;
+	stop(timer);
+	if (ticks == 0) ticks = 1;
+	timers[timer].expires = current + ticks;
+	link(timer);
+}
+
+void CANTimerWheel::stop(uint16_t timer)
+{
+	if (timer >= count) return;
+	CANTimer &t = timers[timer];
+	if (t.slot == CAN_TIMER_NONE) return;
+	if (t.slot != EXPIRING) unlink(timer);
+	t.slot = CAN_TIMER_NONE;
+}
+
+/**
+ * \brief Move time forward
+ *
+ * \param ticks How many ticks have passed
+ * \param callback Called for every timer that runs out
+ *
+ * \ret  Number of timers that fired
+ */
+uint32_t CANTimerWheel::advance(uint32_t ticks, CANTimerCallback callback, void *context)
+{
+	uint32_t fired = 0;
+	while (ticks--)
+	{
+		current++;
+		uint16_t slot = current & SLOT_MASK;
+		if (slot == 0)
+		{
+			//a new turn of the fine level: bring down the coarse slot for it. Timers a lap or more
+			//out land back in the same coarse slot.
+			uint16_t coarse = CAN_TIMER_WHEEL_SLOTS + ((current >> LEVEL_SHIFT) & SLOT_MASK);
+			uint16_t idx = slots[coarse];
+			slots[coarse] = CAN_TIMER_NONE;
+			while (idx != CAN_TIMER_NONE)
+			{
+				uint16_t following = timers[idx].next;
+				link(idx);
+				idx = following;
+			}
+		}
+		//take the expired timers off the wheel first so callbacks are free to restart them
+		uint16_t expired = CAN_TIMER_NONE;
+		uint16_t idx = slots[slot];
+		slots[slot] = CAN_TIMER_NONE;
+		while (idx != CAN_TIMER_NONE)
+		{
+			CANTimer &t = timers[idx];
+			uint16_t following = t.next;
+			t.slot = EXPIRING;
+			t.fireNext = expired;
+			expired = idx;
+			idx = following;
+		}
+		while (expired != CAN_TIMER_NONE)
+		{
+			CANTimer &t = timers[expired];
+			uint16_t following = t.fireNext;
+			if (t.slot == EXPIRING) //not stopped or restarted by an earlier callback
+			{
+				t.slot = CAN_TIMER_NONE;
+				fired++;
+				if (callback) callback(expired, context);
+			}
+			expired = following;
+		}
+	}
+	return fired;
+}
@@ -0,0 +1,61 @@
+#ifndef _CAN_TIMER_WHEEL_
+#define _CAN_TIMER_WHEEL_
+
+#include <Arduino.h>
+
+//Slots per level of the wheel (power of two). The fine level holds timers due within this many ticks,
+//the coarse one the next SLOTS * SLOTS ticks. Timers further out than that take extra laps of the coarse level.
+#ifndef CAN_TIMER_WHEEL_SLOTS
+#define CAN_TIMER_WHEEL_SLOTS 64
+#endif
+
+#define CAN_TIMER_NONE 0xFFFF
+
+//One timer. Storage belongs to the user of the wheel, only the wheel touches the fields.
+struct CANTimer
+{
+    uint16_t next;
+    uint16_t prev;
+    uint16_t slot;      //CAN_TIMER_NONE when stopped
+    uint16_t fireNext;  //chain of timers expiring in the current tick
+    uint32_t expires;   //tick it is due at
+};
+
+typedef void (*CANTimerCallback)(uint16_t timer, void *context);
+
+/*
+Hierarchical timing wheel. Starting, stopping and expiring a timer are all constant time no matter
+how many timers are running, which is what protocol stacks with a timeout per session and periodic
+transmit schedules need. Ticks are whatever unit the caller advances the wheel by.
+
+Timers due within CAN_TIMER_WHEEL_SLOTS ticks sit in the fine level, one slot per tick. Later ones
+go into the coarse level, one slot per CAN_TIMER_WHEEL_SLOTS ticks, and drop down to the fine level
+when their slot comes up. So a tick only ever looks at timers that are really due, plus one coarse
+slot every CAN_TIMER_WHEEL_SLOTS ticks.
+
+Timers are numbered 0 .. count - 1 over storage handed to attach(). The expiry callback may start
+or stop any timer, including the one that just fired.
+*/
+class CANTimerWheel
+{
+public:
+    CANTimerWheel();
+
+    bool attach(CANTimer *storage, uint16_t count);
+    void start(uint16_t timer, uint32_t ticks);
+    void stop(uint16_t timer);
+    bool isRunning(uint16_t timer) const { return timer < count && timers[timer].slot != CAN_TIMER_NONE; }
+    uint32_t advance(uint32_t ticks, CANTimerCallback callback, void *context);
+    uint32_t getTick() const { return current; }
+
+private:
+    void unlink(uint16_t timer);
+    void link(uint16_t timer);
+
+    uint16_t slots[CAN_TIMER_WHEEL_SLOTS * 2]; //fine level, then coarse
+    CANTimer *timers;
+    uint16_t count;
+    uint32_t current;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "can_timestamp.h"
+
+CANTimeBase::CANTimeBase()
+{
+	tickRate = 1000000;
+	counterMask = 0xFFFFFFFF;
+	reset();
+}
+
+/**
+ * \brief Tell the time base how the driver's timestamp counter behaves
+ *
+ * \param ticksPerSecond Counter frequency. 1000000 if the driver stores micros()
+ * \param counterBits Width of the hardware counter if it is less than 32 bits (16 bit timers are common)
+ */
+void CANTimeBase::setTickRate(uint32_t ticksPerSecond, uint8_t counterBits)
+{
+	tickRate = ticksPerSecond ? ticksPerSecond : 1000000;
+	counterMask = (counterBits >= 32 || counterBits == 0) ? 0xFFFFFFFF : ((1ul << counterBits) - 1);
+	reset();
+}
+
+void CANTimeBase::reset()
+{
+	lastRaw = 0;
+	epoch = 0;
+}
+
+uint64_t CANTimeBase::ticksToNs(uint64_t ticks) const
+{
+	//split so ticks * 1e9 can't overflow
+	return (ticks / tickRate) * 1000000000ull + ((ticks % tickRate) * 1000000000ull) / tickRate;
+}
+
+/**
+ * \brief Feed the newest raw timestamp and get it back as 64 bit nanoseconds
+ *
+ * \note Only one context (normally the receive path) should call this. Only a step back of more than
+ * half the counter range counts as a wrap, a smaller one is a frame stamped a little before the
+ * newest (another mailbox, out of order delivery) and is placed just before it.
+ */
+uint64_t CANTimeBase::update(uint32_t rawTicks)
+{
+	rawTicks &= counterMask;
+	if (rawTicks < lastRaw)
+	{
+		if ((lastRaw - rawTicks) <= (counterMask >> 1)) return ticksToNs(((uint64_t)epoch * ((uint64_t)counterMask + 1)) + rawTicks);
+		epoch++;
+	}
+	lastRaw = rawTicks;
+	return ticksToNs(((uint64_t)epoch * ((uint64_t)counterMask + 1)) + rawTicks);
+}
+
+/**
+ * \brief Convert a timestamp seen recently without advancing the rollover tracking
+ *
+ * \note A timestamp a little older than the last one passed to update() (from just before a wrap)
+ * is placed in the previous epoch.
+ */
+uint64_t CANTimeBase::toNs(uint32_t rawTicks) const
+{
+	rawTicks &= counterMask;
+	uint64_t e = epoch;
+	if (rawTicks > lastRaw && (rawTicks - lastRaw) > (counterMask >> 1) && e > 0) e--;
+	return ticksToNs((e * ((uint64_t)counterMask + 1)) + rawTicks);
+}
+
+CANLatencyHistogram::CANLatencyHistogram()
+{
+	reset();
+}
+
+void CANLatencyHistogram::reset()
+{
+	for (int i = 0; i < CAN_LATENCY_BUCKETS; i++) buckets[i] = 0;
+	count = 0;
+	minimum = 0xFFFFFFFF;
+	maximum = 0;
+	sum = 0;
+}
+
+void CANLatencyHistogram::record(uint32_t micros)
+{
+	int bucket = micros ? 32 - __builtin_clz(micros) : 0;
+	if (bucket >= CAN_LATENCY_BUCKETS) bucket = CAN_LATENCY_BUCKETS - 1;
+	__atomic_fetch_add(&buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+	//64 bit atomics aren't lock free on 32 bit parts, a torn sum only skews the average slightly
+	sum += micros;
+	if (micros < __atomic_load_n(&minimum, __ATOMIC_RELAXED)) __atomic_store_n(&minimum, micros, __ATOMIC_RELAXED);
+	if (micros > __atomic_load_n(&maximum, __ATOMIC_RELAXED)) __atomic_store_n(&maximum, micros, __ATOMIC_RELAXED);
+}
+
+uint32_t CANLatencyHistogram::getCount() const
+{
+	return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+uint32_t CANLatencyHistogram::getBucket(int bucket) const
+{
+	if (bucket < 0 || bucket >= CAN_LATENCY_BUCKETS) return 0;
+	return __atomic_load_n(&buckets[bucket], __ATOMIC_RELAXED);
+}
+
+uint32_t CANLatencyHistogram::getMin() const
+{
+	return getCount() ? minimum : 0;
+}
+
+uint32_t CANLatencyHistogram::getMax() const
+{
+	return maximum;
+}
+
+uint32_t CANLatencyHistogram::getAverage() const
+{
+	uint32_t c = getCount();
+	return c ? (uint32_t)(sum / c) : 0;
+}
+
+//Largest latency (exclusive, in microseconds) that lands in the given bucket
+uint32_t CANLatencyHistogram::bucketUpperBound(int bucket)
+{
+	if (bucket <= 0) return 1;
+	if (bucket >= CAN_LATENCY_BUCKETS - 1) return 0xFFFFFFFF;
+	return 1ul << bucket;
+}
+
+/**
+ * \brief Latency that percent of the samples were under
+ *
+ * \ret  Upper bound of the bucket the percentile falls in, clamped to the largest value seen
+ */
+uint32_t CANLatencyHistogram::getPercentile(uint8_t percent) const
+{
+	uint32_t total = getCount();
+	if (total == 0) return 0;
+	if (percent > 100) percent = 100;
+	uint64_t target = ((uint64_t)total * percent + 99) / 100;
+	uint64_t running = 0;
+	for (int i = 0; i < CAN_LATENCY_BUCKETS; i++)
+	{
+		running += getBucket(i);
+		if (running >= target && running > 0)
+		{
+			uint32_t bound = bucketUpperBound(i);
+			return (bound > maximum) ? maximum : bound;
+		}
+	}
+	return maximum;
+}
@@ -0,0 +1,73 @@
+#ifndef _CAN_TIMESTAMP_
+#define _CAN_TIMESTAMP_
+
+#include <Arduino.h>
+
+/*
+Turns the 32 bit driver specific CAN_FRAME::timestamp into 64 bit nanoseconds.
+
+The driver says how fast its timestamp counter runs (ticks per second, microseconds by default).
+update() is called with every received timestamp in arrival order and notices when the counter
+wraps. As long as at least one frame arrives per wrap period (71 minutes for a 1MHz counter,
+65ms for a 16 bit bit-time counter on some controllers - call update from a timer there) the
+extended time is monotonic and comparable between buses that share a tick rate and origin.
+*/
+class CANTimeBase
+{
+public:
+    CANTimeBase();
+
+    void setTickRate(uint32_t ticksPerSecond, uint8_t counterBits = 32);
+    uint32_t getTickRate() const { return tickRate; }
+    uint64_t update(uint32_t rawTicks);
+    uint64_t toNs(uint32_t rawTicks) const;
+    uint64_t ticksToNs(uint64_t ticks) const;
+    void reset();
+
+private:
+    uint32_t tickRate;
+    uint32_t counterMask;
+    uint32_t lastRaw;
+    uint32_t epoch;   //number of times the counter has wrapped
+};
+
+//Number of buckets in a latency histogram. Bucket 0 is under 1us, bucket n is [2^(n-1), 2^n) us,
+//the last bucket also holds everything longer.
+#define CAN_LATENCY_BUCKETS 24
+
+/*
+Fixed bucket, power of two latency histogram. record() is a few relaxed atomic adds so it is fine
+to call from an ISR. Reading while recording can give a count and sum that are off by one sample.
+*/
+class CANLatencyHistogram
+{
+public:
+    CANLatencyHistogram();
+
+    void record(uint32_t micros);
+    void reset();
+
+    uint32_t getCount() const;
+    uint32_t getBucket(int bucket) const;
+    uint32_t getMin() const;
+    uint32_t getMax() const;
+    uint32_t getAverage() const;
+    uint32_t getPercentile(uint8_t percent) const;
+    static uint32_t bucketUpperBound(int bucket);
+
+private:
+    uint32_t buckets[CAN_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t minimum;
+    uint32_t maximum;
+    uint64_t sum;
+};
+
+//The two latencies CAN_COMMON tracks. All values are in microseconds.
+struct CANLatencyStats
+{
+    CANLatencyHistogram rxToDispatch;  //from the driver handing the frame over to dispatch finishing
+    CANLatencyHistogram enqueueToTx;   //from a frame being queued for send to the driver accepting it
+};
+
+#endif
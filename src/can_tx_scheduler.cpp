@@ -0,0 +1,226 @@
+#include "can_tx_scheduler.h"
+
+#define NO_ENTRY 0xFF
+
+static_assert(CAN_TXSCHED_DEPTH < NO_ENTRY, "scheduler indexes are stored in a byte");
+
+CANTxScheduler::CANTxScheduler(CAN_COMMON &canBus) : bus(canBus)
+{
+	clear();
+	for (int i = 0; i < CAN_TXSCHED_RATE_LIMITS; i++) limits[i].active = false;
+}
+
+void CANTxScheduler::clear()
+{
+	for (int i = 0; i < 32; i++) levelHead[i] = NO_ENTRY;
+	levelMap = 0;
+	for (int i = 0; i < CAN_TXSCHED_DEPTH; i++) entries[i].next = i + 1;
+	entries[CAN_TXSCHED_DEPTH - 1].next = NO_ENTRY;
+	freeHead = 0;
+	count = 0;
+	servicing = false;
+}
+
+/**
+ * \brief Sort key that orders IDs the way bus arbitration does
+ *
+ * \note The first 11 ID bits go out first on the wire. With equal base IDs a standard frame beats an
+ * extended one because SRR / IDE are recessive in the extended frame.
+ */
+uint32_t CANTxScheduler::arbitrationKey(uint32_t id, bool extended)
+{
+	if (!extended) return (id & 0x7FF) << 19;
+	id &= 0x1FFFFFFF;
+	return ((id >> 18) << 19) | (1ul << 18) | (id & 0x3FFFF);
+}
+
+//Put an entry into its level in key order. A frame going back after the driver refused it goes ahead
+//of the ones with the same ID (ahead = true), new frames behind them. Call with interrupts off.
+void CANTxScheduler::link(uint8_t idx, bool ahead)
+{
+	Entry &entry = entries[idx];
+	uint8_t level = entry.frame.priority > 31 ? 31 : entry.frame.priority;
+	uint8_t *next = &levelHead[level];
+	while (*next != NO_ENTRY && (entries[*next].key < entry.key || (!ahead && entries[*next].key == entry.key))) next = &entries[*next].next;
+	entry.next = *next;
+	*next = idx;
+	levelMap |= (1ul << level);
+}
+
+bool CANTxScheduler::insert(const CAN_FRAME_FD &frame, bool isFD)
+{
+	noInterrupts();
+	uint8_t idx = freeHead;
+	if (idx != NO_ENTRY) freeHead = entries[idx].next;
+	interrupts();
+	if (idx == NO_ENTRY)
+	{
+		bus.getStatistics().countSchedulerDropped();
+		return false;
+	}
+
+	Entry &entry = entries[idx];
+	entry.frame = frame;
+	entry.key = arbitrationKey(frame.id, frame.extended);
+	entry.queuedAt = micros();
+	entry.isFD = isFD;
+
+	noInterrupts();
+	link(idx, false);
+	count++;
+	interrupts();
+	return true;
+}
+
+void CANTxScheduler::release(uint8_t idx)
+{
+	noInterrupts();
+	entries[idx].next = freeHead;
+	freeHead = idx;
+	count--;
+	interrupts();
+}
+
+/**
+ * \brief Queue a frame for transmission in priority / arbitration order
+ *
+ * \param frame Frame to send. frame.priority (0-31) picks the queue, 0 is sent first.
+ *
+ * \ret  false if the frame is longer than 8 bytes or the scheduler is full (counted in the interface's
+ * schedulerDropped statistic)
+ */
+bool CANTxScheduler::queue(const CAN_FRAME &frame)
+{
+	if (frame.length > 8) return false;
+	CAN_FRAME_FD fd;
+	CAN_FRAME copy = frame;
+	bus.canToFD(copy, fd);
+	return insert(fd, false);
+}
+
+//As queue(). Also false for frames the bus could never send: FD on a classic only interface or a bad length.
+bool CANTxScheduler::queueFD(const CAN_FRAME_FD &frame)
+{
+	if (!bus.supportsFDMode() || frame.length > 64 || (!frame.fdMode && frame.length > 8)) return false;
+	return insert(frame, true);
+}
+
+CANTxScheduler::RateLimit *CANTxScheduler::findLimit(uint32_t key)
+{
+	for (int i = 0; i < CAN_TXSCHED_RATE_LIMITS; i++)
+	{
+		if (limits[i].active && limits[i].key == key) return &limits[i];
+	}
+	return NULL;
+}
+
+/**
+ * \brief Hold frames with this ID back so they go out no more often than once per interval
+ *
+ * \ret  false if the rate limit table is full
+ */
+bool CANTxScheduler::setRateLimit(uint32_t id, bool extended, uint32_t minIntervalMicros)
+{
+	uint32_t key = arbitrationKey(id, extended);
+	RateLimit *limit = findLimit(key);
+	for (int i = 0; limit == NULL && i < CAN_TXSCHED_RATE_LIMITS; i++)
+	{
+		if (!limits[i].active) limit = &limits[i];
+	}
+	if (limit == NULL) return false;
+	limit->key = key;
+	limit->interval = minIntervalMicros;
+	limit->sentOnce = false;
+	limit->active = true;
+	return true;
+}
+
+void CANTxScheduler::removeRateLimit(uint32_t id, bool extended)
+{
+	RateLimit *limit = findLimit(arbitrationKey(id, extended));
+	if (limit) limit->active = false;
+}
+
+bool CANTxScheduler::send(Entry &entry)
+{
+	if (entry.isFD) return bus.sendFrameFD(entry.frame);
+	CAN_FRAME frame;
+	bus.fdToCan(entry.frame, frame); //can't fail, queue() only takes what fits
+	return bus.sendFrame(frame);
+}
+
+//Unlink the first frame that may go out now, NO_ENTRY if there is none
+uint8_t CANTxScheduler::takeNext(uint32_t now)
+{
+	noInterrupts();
+	uint32_t levels = levelMap;
+	while (levels)
+	{
+		int level = __builtin_ctz(levels);
+		uint8_t *next = &levelHead[level];
+		while (*next != NO_ENTRY)
+		{
+			uint8_t idx = *next;
+			RateLimit *limit = findLimit(entries[idx].key);
+			if (limit && limit->sentOnce && (uint32_t)(now - limit->lastSent) < limit->interval)
+			{
+				next = &entries[idx].next; //not due yet
+				continue;
+			}
+			*next = entries[idx].next;
+			if (levelHead[level] == NO_ENTRY) levelMap &= ~(1ul << level);
+			interrupts();
+			return idx;
+		}
+		levels &= ~(1ul << level);
+	}
+	interrupts();
+	return NO_ENTRY;
+}
+
+/**
+ * \brief Move queued frames into the driver
+ *
+ * \ret  Number of frames the driver accepted
+ *
+ * \note Stops at the first frame the driver refuses so nothing overtakes it. Rate limited frames that
+ * aren't due yet are stepped over, lower priority frames may go out ahead of them. A call that comes
+ * in while another one is running (the TX interrupt firing during the one from loop()) returns 0 and
+ * leaves the refill to the running call.
+ */
+int CANTxScheduler::service()
+{
+	noInterrupts();
+	bool busy = servicing;
+	servicing = true;
+	interrupts();
+	if (busy) return 0;
+
+	int sent = 0;
+	uint32_t now = micros();
+	uint8_t idx;
+	while ((idx = takeNext(now)) != NO_ENTRY)
+	{
+		Entry &entry = entries[idx];
+		if (!send(entry)) //mailboxes full, back to the front of its ID
+		{
+			noInterrupts();
+			link(idx, true);
+			interrupts();
+			break;
+		}
+		bus.recordTXLatency(entry.queuedAt);
+		RateLimit *limit = findLimit(entry.key);
+		if (limit)
+		{
+			limit->lastSent = now;
+			limit->sentOnce = true;
+		}
+		release(idx);
+		sent++;
+	}
+	noInterrupts();
+	servicing = false;
+	interrupts();
+	return sent;
+}
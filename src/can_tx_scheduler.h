@@ -0,0 +1,83 @@
+#ifndef _CAN_TX_SCHEDULER_
+#define _CAN_TX_SCHEDULER_
+
+#include <can_common.h>
+
+//Frames that can wait in the scheduler at once. Each slot holds a CAN_FRAME_FD (about 90 bytes).
+#ifndef CAN_TXSCHED_DEPTH
+#define CAN_TXSCHED_DEPTH 16
+#endif
+
+//How many IDs can have a rate limit
+#ifndef CAN_TXSCHED_RATE_LIMITS
+#define CAN_TXSCHED_RATE_LIMITS 8
+#endif
+
+/*
+Software transmit queue in front of sendFrame / sendFrameFD.
+
+Frames wait in one queue per CAN_FRAME::priority level (0 is most urgent, 31 least). Inside a level
+frames are kept in arbitration order (lower ID first, standard before extended with the same base ID)
+so the queue sends in the same order the bus would let them win. Frames with the same ID keep their
+queue order. A 32 bit map of non-empty levels makes finding the next frame a count trailing zeros.
+
+service() hands frames to the driver until it refuses one (mailboxes full). Call it from loop() and,
+if the driver has a transmit complete interrupt, from there too to refill the mailboxes as they drain.
+The queue itself is only changed with interrupts off so queue() and service() can interrupt each other.
+clear() and the rate limit calls are not protected, use them from loop() only.
+
+IDs can be rate limited: a frame is held back (not dropped) until minimum interval has passed since
+the last frame with that ID went out.
+*/
+class CANTxScheduler
+{
+public:
+    CANTxScheduler(CAN_COMMON &bus);
+
+    bool queue(const CAN_FRAME &frame);
+    bool queueFD(const CAN_FRAME_FD &frame);
+    int service();
+    void clear();
+    uint16_t pending() const { return count; }
+
+    bool setRateLimit(uint32_t id, bool extended, uint32_t minIntervalMicros);
+    void removeRateLimit(uint32_t id, bool extended);
+
+    static uint32_t arbitrationKey(uint32_t id, bool extended);
+
+private:
+    struct Entry
+    {
+        CAN_FRAME_FD frame;
+        uint32_t key;
+        uint32_t queuedAt;
+        uint8_t next;
+        bool isFD;
+    };
+    struct RateLimit
+    {
+        uint32_t key;
+        uint32_t interval;
+        uint32_t lastSent;
+        bool active;
+        bool sentOnce;
+    };
+
+    bool insert(const CAN_FRAME_FD &frame, bool isFD);
+    void link(uint8_t idx, bool ahead);
+    void release(uint8_t idx);
+    uint8_t takeNext(uint32_t now);
+    RateLimit *findLimit(uint32_t key);
+    bool send(Entry &entry);
+
+    CAN_COMMON &bus;
+    Entry entries[CAN_TXSCHED_DEPTH];
+    uint8_t levelHead[32];
+    uint32_t levelMap;
+    uint8_t freeHead;
+    uint16_t count;
+    bool servicing;     //a service() call is running, one from an interrupt backs off
+    RateLimit limits[CAN_TXSCHED_RATE_LIMITS];
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "can_value_cache.h"
+
+#define KEY_USED    0x80000000ul
+#define KEY_EXT     0x40000000ul
+#define WORDS       ((CAN_VALUE_CACHE_DATA + 3) / 4)
+
+static_assert((CAN_VALUE_CACHE_SLOTS & (CAN_VALUE_CACHE_SLOTS - 1)) == 0, "CAN_VALUE_CACHE_SLOTS must be a power of two");
+static_assert(CAN_VALUE_CACHE_DATA >= 1 && CAN_VALUE_CACHE_DATA <= 64, "CAN_VALUE_CACHE_DATA must be 1 - 64");
+
+static inline uint32_t makeKey(uint32_t id, bool extended)
+{
+	return extended ? ((id & 0x1FFFFFFF) | KEY_EXT | KEY_USED) : ((id & 0x7FF) | KEY_USED);
+}
+
+static inline uint32_t slotFor(uint32_t key)
+{
+	return (uint32_t)(key * 2654435761ul) >> (32 - __builtin_ctz(CAN_VALUE_CACHE_SLOTS));
+}
+
+CANValueCache::CANValueCache()
+{
+	trackAll = false;
+	clear();
+}
+
+//Forget every ID. Not safe while the bus is feeding the cache or anyone is reading it.
+void CANValueCache::clear()
+{
+	memset(entries, 0, sizeof(entries));
+	count = 0;
+}
+
+//Learn every ID the bus delivers (until the table is full) instead of only the track()ed ones
+void CANValueCache::setTrackAll(bool state)
+{
+	trackAll = state;
+}
+
+/**
+ * \brief Keep the newest frame of this ID
+ *
+ * \ret  false if the table is full
+ *
+ * \note The RX path is the only other writer, so track IDs before the cache is attached or from
+ * the receive context.
+ */
+bool CANValueCache::track(uint32_t id, bool extended)
+{
+	return find(makeKey(id, extended), true) != NULL;
+}
+
+//Writer side lookup, optionally taking a free slot for a new key
+CANValueCache::Entry *CANValueCache::find(uint32_t key, bool insert)
+{
+	uint32_t idx = slotFor(key);
+	for (int probe = 0; probe < CAN_VALUE_CACHE_SLOTS; probe++)
+	{
+		Entry &e = entries[idx];
+		if (e.key == key) return &e;
+		if (e.key == 0)
+		{
+			if (!insert || count >= CAN_VALUE_CACHE_SLOTS - 1) return NULL; //keep a hole so misses stop
+			e.seq = 0;
+			e.frames = 0;
+			e.changes = 0;
+			e.length = 0;
+			e.tail = 0;
+			__atomic_store_n(&e.key, key, __ATOMIC_RELEASE); //readers only look at entries once the key is there
+			count++;
+			return &e;
+		}
+		idx = (idx + 1) & (CAN_VALUE_CACHE_SLOTS - 1);
+	}
+	return NULL;
+}
+
+const CANValueCache::Entry *CANValueCache::lookup(uint32_t id, bool extended) const
+{
+	uint32_t key = makeKey(id, extended);
+	uint32_t idx = slotFor(key);
+	for (int probe = 0; probe < CAN_VALUE_CACHE_SLOTS; probe++)
+	{
+		uint32_t k = __atomic_load_n(&entries[idx].key, __ATOMIC_ACQUIRE);
+		if (k == key) return &entries[idx];
+		if (k == 0) return NULL;
+		idx = (idx + 1) & (CAN_VALUE_CACHE_SLOTS - 1);
+	}
+	return NULL;
+}
+
+bool CANValueCache::store(Entry &e, const uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+	uint32_t words[WORDS];
+	uint8_t keep = length < CAN_VALUE_CACHE_DATA ? length : CAN_VALUE_CACHE_DATA;
+	memset(words, 0, sizeof(words));
+	memcpy(words, data, keep);
+	//FD bytes that aren't kept still decide whether the frame changed (FNV-1a)
+	uint32_t tail = 0;
+	if (length > keep)
+	{
+		tail = 2166136261u;
+		for (int i = keep; i < length; i++) tail = (tail ^ data[i]) * 16777619u;
+	}
+
+	//only this context writes the entry so it can read it back without the lock
+	bool changed = (e.frames == 0 || e.length != length || e.tail != tail || memcmp(words, e.words, sizeof(words)) != 0);
+	e.tail = tail;
+
+	uint32_t seq = e.seq;
+	__atomic_store_n(&e.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (int i = 0; i < WORDS; i++) __atomic_store_n(&e.words[i], words[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&e.length, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.timestamp, timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.frames, e.frames + 1, __ATOMIC_RELAXED);
+	if (changed) __atomic_store_n(&e.changes, e.changes + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.seq, seq + 2, __ATOMIC_RELEASE);
+	return changed;
+}
+
+/**
+ * \brief Record a received frame. Called by CAN_COMMON::receiveFrame for an attached cache.
+ *
+ * \ret  false if the payload and length are the same as the last frame with this ID. true if they
+ * differ, it is the first one or the ID isn't tracked.
+ */
+bool CANValueCache::update(const CAN_FRAME &frame)
+{
+	if (frame.rtr) return true;
+	Entry *e = find(makeKey(frame.id, frame.extended), trackAll);
+	if (e == NULL) return true;
+	return store(*e, frame.data.bytes, frame.length > 8 ? 8 : frame.length, frame.timestamp);
+}
+
+//FD frames and classic ones with the same ID share an entry. Only the first CAN_VALUE_CACHE_DATA bytes are kept,
+//a hash of the rest catches changes there.
+bool CANValueCache::updateFD(const CAN_FRAME_FD &frame)
+{
+	Entry *e = find(makeKey(frame.id, frame.extended), trackAll);
+	if (e == NULL) return true;
+	return store(*e, frame.data.uint8, frame.length > 64 ? 64 : frame.length, frame.timestamp);
+}
+
+/**
+ * \brief Consistent copy of the newest frame for an ID
+ *
+ * \ret  false if the ID isn't tracked or nothing arrived for it yet
+ *
+ * \note Lock free. Retries while the receive path is writing the same entry.
+ */
+bool CANValueCache::read(uint32_t id, bool extended, CANCachedValue &out) const
+{
+	const Entry *e = lookup(id, extended);
+	if (e == NULL) return false;
+	uint32_t words[WORDS];
+	uint32_t before, after;
+	do
+	{
+		before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (before & 1) continue;
+		for (int i = 0; i < WORDS; i++) words[i] = __atomic_load_n(&e->words[i], __ATOMIC_RELAXED);
+		out.length = __atomic_load_n(&e->length, __ATOMIC_RELAXED);
+		out.timestamp = __atomic_load_n(&e->timestamp, __ATOMIC_RELAXED);
+		out.frames = __atomic_load_n(&e->frames, __ATOMIC_RELAXED);
+		out.changes = __atomic_load_n(&e->changes, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+
+	if (out.frames == 0) return false;
+	out.id = id & (extended ? 0x1FFFFFFF : 0x7FF);
+	out.extended = extended;
+	memcpy(out.data, words, CAN_VALUE_CACHE_DATA);
+	return true;
+}
+
+//read() into a CAN_FRAME (first 8 bytes)
+bool CANValueCache::readFrame(uint32_t id, bool extended, CAN_FRAME &out) const
+{
+	CANCachedValue value;
+	if (!read(id, extended, value)) return false;
+	out.id = value.id;
+	out.extended = extended;
+	out.rtr = 0;
+	out.length = value.length > 8 ? 8 : value.length;
+	out.timestamp = value.timestamp;
+	out.data.value = 0;
+	memcpy(out.data.bytes, value.data, out.length < CAN_VALUE_CACHE_DATA ? out.length : CAN_VALUE_CACHE_DATA);
+	return true;
+}
+
+//Payload changes seen for an ID, 0 if untracked. A single load, no retries.
+uint32_t CANValueCache::getChanges(uint32_t id, bool extended) const
+{
+	const Entry *e = lookup(id, extended);
+	return e ? __atomic_load_n(&e->changes, __ATOMIC_ACQUIRE) : 0;
+}
@@ -0,0 +1,88 @@
+#ifndef _CAN_VALUE_CACHE_
+#define _CAN_VALUE_CACHE_
+
+#include <can_common.h>
+
+//IDs the cache can hold (power of two). Keep it under 75% full for short probes.
+#ifndef CAN_VALUE_CACHE_SLOTS
+#define CAN_VALUE_CACHE_SLOTS 64
+#endif
+
+//Payload bytes kept per ID. 8 for classic CAN, up to 64 to keep whole FD frames.
+#ifndef CAN_VALUE_CACHE_DATA
+#define CAN_VALUE_CACHE_DATA 8
+#endif
+
+//A consistent copy of one cache entry
+struct CANCachedValue
+{
+    uint32_t id;
+    bool extended;
+    uint8_t length;         //of the last frame, data holds the first CAN_VALUE_CACHE_DATA bytes of it
+    uint8_t data[CAN_VALUE_CACHE_DATA];
+    uint32_t timestamp;     //of the last frame
+    uint32_t frames;        //frames seen with this ID
+    uint32_t changes;       //frames whose payload differed from the one before
+};
+
+/*
+The newest frame per CAN ID, for code that only cares about the current state of the bus (a
+dashboard, a control loop reading a sensor) and not about every frame that went past.
+
+One writer, the receive path: attach the cache to a bus with attachValueCache() and receiveFrame
+keeps it up to date, in the interrupt if that is where the driver calls it. Any number of readers
+get consistent snapshots through a sequence lock - the writer makes the entry's sequence number odd
+while it writes and even again after, and a reader copies the entry and tries again if the number
+was odd or moved. The writer never waits for a reader, readers never block the writer and
+never see half a frame.
+
+Each entry counts frames and payload changes. Comparing getChanges() with the value from last time
+is the cheapest way to see whether anything new arrived, and the bus uses the same comparison for
+listeners that asked for setOnlyOnChange().
+
+IDs are tracked either explicitly with track() or, with setTrackAll(true), as they are first seen
+until the table is full. Entries are never removed except by clear().
+
+Do not read from an interrupt that can preempt the one receiving frames: on a single core the
+reader would spin forever waiting for a write that can't finish.
+*/
+class CANValueCache
+{
+public:
+    CANValueCache();
+
+    bool track(uint32_t id, bool extended);
+    void setTrackAll(bool state);
+    void clear();
+    uint16_t getCount() const { return count; }
+
+    bool update(const CAN_FRAME &frame);
+    bool updateFD(const CAN_FRAME_FD &frame);
+
+    bool read(uint32_t id, bool extended, CANCachedValue &out) const;
+    bool readFrame(uint32_t id, bool extended, CAN_FRAME &out) const;
+    uint32_t getChanges(uint32_t id, bool extended) const;
+
+private:
+    struct Entry
+    {
+        uint32_t key;       //ID | 0x40000000 for extended | 0x80000000 when used, 0 when empty
+        uint32_t seq;       //odd while the writer is in the middle of an update
+        uint32_t timestamp;
+        uint32_t frames;
+        uint32_t changes;
+        uint32_t words[(CAN_VALUE_CACHE_DATA + 3) / 4];
+        uint32_t tail;      //hash of the payload past CAN_VALUE_CACHE_DATA, only the writer looks at it
+        uint8_t length;
+    };
+
+    Entry *find(uint32_t key, bool insert);
+    const Entry *lookup(uint32_t id, bool extended) const;
+    bool store(Entry &entry, const uint8_t *data, uint8_t length, uint32_t timestamp);
+
+    Entry entries[CAN_VALUE_CACHE_SLOTS];
+    uint16_t count;
+    bool trackAll;
+};
+
+#endif